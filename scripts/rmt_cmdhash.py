@@ -0,0 +1,95 @@
+#!/usr/bin/env python
+#
+# Generate src/rmt_redis_cmdhash.h, the perfect hash used by redis_parse_req
+# to classify a request by its command name.
+#
+# The command names are read from the REDIS_COMMAND() entries of the
+# redis_command_table in src/rmt_redis.c, so rerun this script whenever a
+# command is added there:
+#
+#   $ python scripts/rmt_cmdhash.py
+#
+# Lookup (see redis_command_lookup): h is the 32 bit FNV-1a hash of the
+# command name folded with '| 0x20', the bucket is h % BUCKETS and the
+# slot is ((h >> 16) ^ disp[bucket]) % SLOTS. Every slot holds at most one
+# command, so a lookup costs one hash and one string compare.
+
+import os
+import re
+import sys
+
+BUCKETS = 64
+SLOTS = 256
+
+top = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir)
+src = os.path.join(top, 'src', 'rmt_redis.c')
+dst = os.path.join(top, 'src', 'rmt_redis_cmdhash.h')
+
+
+def cmdhash(name):
+    h = 2166136261
+    for ch in name:
+        h ^= ord(ch) | 0x20
+        h = (h * 16777619) & 0xffffffff
+    return h
+
+
+def main():
+    entry = re.compile(r'REDIS_COMMAND\(\s*(\w+),\s*"([^"]+)"')
+    commands = entry.findall(open(src).read())
+    if not commands:
+        sys.exit('no REDIS_COMMAND entries found in %s' % src)
+
+    buckets = [[] for _ in range(BUCKETS)]
+    for ctype, name in commands:
+        buckets[cmdhash(name) % BUCKETS].append((ctype, name))
+
+    disp = [0] * BUCKETS
+    slots = [None] * SLOTS
+    order = sorted(range(BUCKETS), key=lambda b: -len(buckets[b]))
+    for b in order:
+        if not buckets[b]:
+            continue
+        for d in range(SLOTS):
+            want = [((cmdhash(n) >> 16) ^ d) % SLOTS for _, n in buckets[b]]
+            if len(set(want)) == len(want) and \
+               all(slots[s] is None for s in want):
+                break
+        else:
+            sys.exit('no displacement for bucket %d, grow SLOTS' % b)
+        disp[b] = d
+        for s, (ctype, _) in zip(want, buckets[b]):
+            slots[s] = ctype
+
+    out = []
+    out.append('/*')
+    out.append(' * Perfect hash over the redis command names, generated by')
+    out.append(' * scripts/rmt_cmdhash.py from redis_command_table in rmt_redis.c.')
+    out.append(' * Do not edit by hand, rerun the script after adding a command.')
+    out.append(' */')
+    out.append('')
+    out.append('#ifndef _RMT_REDIS_CMDHASH_H_')
+    out.append('#define _RMT_REDIS_CMDHASH_H_')
+    out.append('')
+    out.append('#define REDIS_CMDHASH_BUCKETS   %d' % BUCKETS)
+    out.append('#define REDIS_CMDHASH_SLOTS     %d' % SLOTS)
+    out.append('')
+    out.append('static const uint16_t redis_cmdhash_disp[REDIS_CMDHASH_BUCKETS] = {')
+    for i in range(0, BUCKETS, 8):
+        out.append('    ' + ', '.join('%3d' % d for d in disp[i:i + 8]) + ',')
+    out.append('};')
+    out.append('')
+    out.append('static const uint16_t redis_cmdhash_slot[REDIS_CMDHASH_SLOTS] = {')
+    for s in range(SLOTS):
+        ctype = slots[s]
+        name = 'MSG_REQ_REDIS_' + ctype if ctype else 'MSG_UNKNOWN'
+        out.append('    %s,' % name)
+    out.append('};')
+    out.append('')
+    out.append('#endif')
+
+    open(dst, 'w').write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
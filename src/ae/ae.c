@@ -58,17 +58,51 @@
     #endif
 #endif
 
+/* Monotonic time in microseconds, not moved by the system clock. */
+static long long aeMonotonicUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static unsigned int aeTimeEventIdHash(const void *key)
+{
+    return dictGenHashFunction(key, sizeof(long long));
+}
+
+static int aeTimeEventIdCompare(void *privdata, const void *key1, const void *key2)
+{
+    AE_NOTUSED(privdata);
+    return *(const long long *)key1 == *(const long long *)key2;
+}
+
+/* The keys are &te->id of the values. */
+static dictType aeTimeEventsDictType = {
+    aeTimeEventIdHash,          /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    aeTimeEventIdCompare,       /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
     int i;
 
     if ((eventLoop = rmt_alloc(sizeof(*eventLoop))) == NULL) goto err;
+    eventLoop->timeEventsById = NULL;
     eventLoop->events = rmt_alloc(sizeof(aeFileEvent)*setsize);
     eventLoop->fired = rmt_alloc(sizeof(aeFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    eventLoop->timeEvents = NULL;
+    eventLoop->timeEventsCount = 0;
+    eventLoop->timeEventsSize = 0;
+    eventLoop->timeEventsById = dictCreate(&aeTimeEventsDictType,NULL);
+    if (eventLoop->timeEventsById == NULL) goto err;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
@@ -82,6 +116,7 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
 
 err:
     if (eventLoop) {
+        if (eventLoop->timeEventsById) dictRelease(eventLoop->timeEventsById);
         rmt_free(eventLoop->events);
         rmt_free(eventLoop->fired);
         rmt_free(eventLoop);
@@ -120,6 +155,12 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int j;
+
+    for (j = 0; j < eventLoop->timeEventsCount; j++)
+        rmt_free(eventLoop->timeEvents[j]);
+    rmt_free(eventLoop->timeEvents);
+    dictRelease(eventLoop->timeEventsById);
     aeApiFree(eventLoop);
     rmt_free(eventLoop->events);
     rmt_free(eventLoop->fired);
@@ -175,27 +216,38 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
-{
-    struct timeval tv;
+static int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->when < b->when || (a->when == b->when && a->id < b->id);
+}
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+static void aeTimeEventSet(aeEventLoop *eventLoop, int i, aeTimeEvent *te) {
+    eventLoop->timeEvents[i] = te;
+    te->index = i;
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+/* Restore the heap order for the time event at index i. */
+static void aeTimeEventFix(aeEventLoop *eventLoop, int i) {
+    aeTimeEvent **heap = eventLoop->timeEvents;
+    aeTimeEvent *te = heap[i];
+    int parent, child;
+
+    while (i > 0) {
+        parent = (i-1)/2;
+        if (!aeTimeEventBefore(te,heap[parent])) break;
+        aeTimeEventSet(eventLoop,i,heap[parent]);
+        i = parent;
+    }
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+    while ((child = 2*i+1) < eventLoop->timeEventsCount) {
+        if (child+1 < eventLoop->timeEventsCount &&
+            aeTimeEventBefore(heap[child+1],heap[child]))
+            child++;
+        if (!aeTimeEventBefore(heap[child],te)) break;
+        aeTimeEventSet(eventLoop,i,heap[child]);
+        i = child;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+
+    aeTimeEventSet(eventLoop,i,te);
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
@@ -203,132 +255,83 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeEventFinalizerProc *finalizerProc)
 {
     long long id = eventLoop->timeEventNextId++;
-    aeTimeEvent *te;
+    aeTimeEvent *te, **heap;
+    int size;
+
+    if (eventLoop->timeEventsCount == eventLoop->timeEventsSize) {
+        size = eventLoop->timeEventsSize ? eventLoop->timeEventsSize*2 : 16;
+        heap = rmt_realloc(eventLoop->timeEvents,sizeof(aeTimeEvent *)*size);
+        if (heap == NULL) return AE_ERR;
+        eventLoop->timeEvents = heap;
+        eventLoop->timeEventsSize = size;
+    }
 
     te = rmt_alloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
     te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    te->when = aeMonotonicUs() + milliseconds*1000;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
+    if (dictAdd(eventLoop->timeEventsById,&te->id,te) != DICT_OK) {
+        rmt_free(te);
+        return AE_ERR;
+    }
+    aeTimeEventSet(eventLoop,eventLoop->timeEventsCount++,te);
+    aeTimeEventFix(eventLoop,te->index);
     return id;
 }
 
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te, *prev = NULL;
-
-    te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            rmt_free(te);
-            return AE_OK;
-        }
-        prev = te;
-        te = te->next;
-    }
-    return AE_ERR; /* NO event with the specified ID found */
-}
+    aeTimeEvent *te, *last;
 
-/* Search the first timer to fire.
- * This operation is useful to know how many time the select can be
- * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
-static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
-{
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
+    te = dictFetchValue(eventLoop->timeEventsById,&id);
+    if (te == NULL) return AE_ERR; /* NO event with the specified ID found */
+
+    dictDelete(eventLoop->timeEventsById,&id);
+    last = eventLoop->timeEvents[--eventLoop->timeEventsCount];
+    if (last != te) {
+        aeTimeEventSet(eventLoop,te->index,last);
+        aeTimeEventFix(eventLoop,last->index);
     }
-    return nearest;
+
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    rmt_free(te);
+    return AE_OK;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
+    int count = eventLoop->timeEventsCount;
     aeTimeEvent *te;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
-
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
+    long long maxId = eventLoop->timeEventNextId-1;
+    long long now = aeMonotonicUs();
+
+    /* The nearest time event is at the top of the heap. Don't process
+     * events registered by the handlers themselves, and every event at
+     * most once, in order to don't loop forever. */
+    while (count-- > 0 && eventLoop->timeEventsCount > 0) {
+        int retval;
         long long id;
 
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            /* After an event is processed our time event list may
-             * no longer be the same, so we restart from head.
-             * Still we make sure to don't process events registered
-             * by event handlers itself in order to don't loop forever.
-             * To do so we saved the max ID we want to handle.
-             *
-             * FUTURE OPTIMIZATIONS:
-             * Note that this is NOT great algorithmically. Redis uses
-             * a single time event so it's not a problem but the right
-             * way to do this is to add the new elements on head, and
-             * to flag deleted elements in a special way for later
-             * deletion (putting references to the nodes to delete into
-             * another linked list). */
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                aeDeleteTimeEvent(eventLoop, id);
-            }
-            te = eventLoop->timeEventHead;
+        te = eventLoop->timeEvents[0];
+        if (te->when > now || te->id > maxId) break;
+
+        id = te->id;
+        retval = te->timeProc(eventLoop, id, te->clientData);
+        processed++;
+
+        /* The handler may have created or deleted time events. */
+        te = dictFetchValue(eventLoop->timeEventsById,&id);
+        if (te == NULL) continue;
+        if (retval != AE_NOMORE) {
+            te->when = aeMonotonicUs() + (long long)retval*1000;
+            aeTimeEventFix(eventLoop,te->index);
         } else {
-            te = te->next;
+            aeDeleteTimeEvent(eventLoop, id);
         }
     }
     return processed;
@@ -364,24 +367,19 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         aeTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
-        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
-            shortest = aeSearchNearestTimer(eventLoop);
+        if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT) &&
+            eventLoop->timeEventsCount > 0)
+            shortest = eventLoop->timeEvents[0];
         if (shortest) {
-            long now_sec, now_ms;
+            long long us;
 
             /* Calculate the time missing for the nearest
              * timer to fire. */
-            aeGetTime(&now_sec, &now_ms);
+            us = shortest->when - aeMonotonicUs();
+            if (us < 0) us = 0;
             tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
-            if (shortest->when_ms < now_ms) {
-                tvp->tv_usec = ((shortest->when_ms+1000) - now_ms)*1000;
-                tvp->tv_sec --;
-            } else {
-                tvp->tv_usec = (shortest->when_ms - now_ms)*1000;
-            }
-            if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-            if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+            tvp->tv_sec = us/1000000;
+            tvp->tv_usec = us%1000000;
         } else {
             /* If we have to check for events but need to return
              * ASAP because of AE_DONT_WAIT we need to set the timeout
@@ -55,10 +55,22 @@ init_context(struct instance *rmti)
 
     rmt_ctx->step = 0;
     rmt_ctx->source_safe = 0;
+    rmt_ctx->source_headroom = 0;
+    rmt_ctx->zerocopy = 0;
+    rmt_ctx->checkpoint = 0;
+    rmt_ctx->key_profile = 0;
+    rmt_ctx->spill_threshold = 0;
+    rmt_ctx->spill_compress = 0;
+    rmt_ctx->apply_threads = 0;
+    rmt_ctx->cpu_placement = CPU_PLACEMENT_NONE;
+    rmt_ctx->cpu_list = NULL;
     rmt_ctx->dir = NULL;
 
     rmt_ctx->rdatas = NULL;
     rmt_ctx->wdatas = NULL;
+    rmt_ctx->adatas = NULL;
+    rmt_ctx->cluster_moved = 0;
+    rmt_ctx->targets_backlogged = 0;
 
     rmt_ctx->srgroup = NULL;
 
@@ -77,6 +89,27 @@ init_context(struct instance *rmti)
     pthread_rwlock_init(&rmt_ctx->rwl_notice, &attr);
     reset_notice_flag(rmt_ctx);
     reset_finish_count_after_notice(rmt_ctx);
+    rmt_ctx->tunables.epoch = 0;
+    rmt_ctx->tunables.step = 0;
+    rmt_ctx->tunables.send_batch = RMT_IOV_BATCH_MAX;
+    rmt_ctx->tunables.max_inflight = 0;
+    rmt_ctx->tunables.paused = 0;
+    rmt_ctx->tunables.rate_limit_bytes = 0;
+    rmt_ctx->tunables.rate_limit_cmds = 0;
+    rmt_ctx->tunables.target_rate_limit_bytes = 0;
+    rmt_ctx->tunables.target_rate_limit_cmds = 0;
+    rmt_ctx->tunables.rate_limit_burst = 1000;
+    rmt_ctx->tunables.slowlog_log_slower_than = 10000;
+    rmt_ctx->tunables.slowlog_max_len = 128;
+    if (ratelimits_init(&rmt_ctx->ratelimits) != RMT_OK) {
+        rmt_free(rmt_ctx);
+        return NULL;
+    }
+    if (slowlog_init(&rmt_ctx->slowlog) != RMT_OK) {
+        ratelimits_deinit(&rmt_ctx->ratelimits);
+        rmt_free(rmt_ctx);
+        return NULL;
+    }
 
     commands = dictCreate(&commandTableDictType,NULL);
     if(commands == NULL)
@@ -181,6 +214,114 @@ init_context(struct instance *rmti)
         rmt_ctx->source_safe = cf->source_safe;
     }
 
+    if (cf->source_headroom != CONF_UNSET_NUM) {
+        rmt_ctx->source_headroom = cf->source_headroom;
+    }
+
+    if (cf->zerocopy != CONF_UNSET_NUM) {
+        rmt_ctx->zerocopy = cf->zerocopy;
+    }
+
+    if (cf->checkpoint != CONF_UNSET_NUM) {
+        rmt_ctx->checkpoint = cf->checkpoint;
+    }
+
+    if (cf->key_profile != CONF_UNSET_NUM) {
+        rmt_ctx->key_profile = cf->key_profile;
+    }
+
+    if (cf->spill_threshold != CONF_UNSET_NUM) {
+        rmt_ctx->spill_threshold = cf->spill_threshold;
+    }
+
+    if (cf->spill_compress != CONF_UNSET_NUM) {
+        rmt_ctx->spill_compress = cf->spill_compress;
+    }
+
+    if (cf->apply_threads != CONF_UNSET_NUM) {
+        rmt_ctx->apply_threads = cf->apply_threads;
+    }
+
+    rmt_ctx->tunables.step = rmt_ctx->step;
+
+    if (cf->send_batch != CONF_UNSET_NUM) {
+        if (cf->send_batch < RMT_IOV_BATCH_MIN || 
+            cf->send_batch > RMT_IOV_BATCH_MAX) {
+            log_error("ERROR: send_batch in config file must be between %d and %d", 
+                RMT_IOV_BATCH_MIN, RMT_IOV_BATCH_MAX);
+            destroy_context(rmt_ctx);
+            return NULL;
+        }
+        rmt_ctx->tunables.send_batch = cf->send_batch;
+    }
+
+    if (cf->max_inflight != CONF_UNSET_NUM) {
+        if (cf->max_inflight < 0) {
+            log_error("ERROR: max_inflight in config file can not be negative");
+            destroy_context(rmt_ctx);
+            return NULL;
+        }
+        rmt_ctx->tunables.max_inflight = cf->max_inflight;
+    }
+
+    if (cf->rate_limit_bytes != CONF_UNSET_NUM) {
+        rmt_ctx->tunables.rate_limit_bytes = cf->rate_limit_bytes;
+    }
+
+    if (cf->rate_limit_cmds != CONF_UNSET_NUM) {
+        rmt_ctx->tunables.rate_limit_cmds = cf->rate_limit_cmds;
+    }
+
+    if (cf->target_rate_limit_bytes != CONF_UNSET_NUM) {
+        rmt_ctx->tunables.target_rate_limit_bytes = cf->target_rate_limit_bytes;
+    }
+
+    if (cf->target_rate_limit_cmds != CONF_UNSET_NUM) {
+        rmt_ctx->tunables.target_rate_limit_cmds = cf->target_rate_limit_cmds;
+    }
+
+    if (cf->rate_limit_burst != CONF_UNSET_NUM) {
+        if (cf->rate_limit_burst < RATELIMIT_BURST_MIN) {
+            log_error("ERROR: rate_limit_burst in config file can not be less than %d", 
+                RATELIMIT_BURST_MIN);
+            destroy_context(rmt_ctx);
+            return NULL;
+        }
+        rmt_ctx->tunables.rate_limit_burst = cf->rate_limit_burst;
+    }
+
+    if (cf->slowlog_log_slower_than != CONF_UNSET_NUM) {
+        rmt_ctx->tunables.slowlog_log_slower_than = cf->slowlog_log_slower_than;
+    }
+
+    if (cf->slowlog_max_len != CONF_UNSET_NUM) {
+        rmt_ctx->tunables.slowlog_max_len = cf->slowlog_max_len;
+    }
+
+    if (cf->cpu_placement != CONF_UNSET_PTR) {
+        if (!strcasecmp(cf->cpu_placement, "none")) {
+            rmt_ctx->cpu_placement = CPU_PLACEMENT_NONE;
+        } else if (!strcasecmp(cf->cpu_placement, "compact")) {
+            rmt_ctx->cpu_placement = CPU_PLACEMENT_COMPACT;
+        } else if (!strcasecmp(cf->cpu_placement, "scatter")) {
+            rmt_ctx->cpu_placement = CPU_PLACEMENT_SCATTER;
+        } else {
+#ifdef HAVE_SCHED_SETAFFINITY
+            cpu_set_t cpus;
+
+            if (rmt_cpu_list_parse(cf->cpu_placement, &cpus) != RMT_OK ||
+                CPU_COUNT(&cpus) == 0) {
+                log_error("ERROR: cpu_placement[%s] in config file is not "
+                    "compact, scatter, none or a cpu list", cf->cpu_placement);
+                destroy_context(rmt_ctx);
+                return NULL;
+            }
+#endif
+            rmt_ctx->cpu_placement = CPU_PLACEMENT_COMPACT;
+            rmt_ctx->cpu_list = sdsdup(cf->cpu_placement);
+        }
+    }
+
     if (cf->dir != CONF_UNSET_PTR) {
         if (access(cf->dir, F_OK) < 0) {
             log_error("ERROR: work directory[%s] in config file does not exist", 
@@ -271,6 +412,10 @@ void destroy_context(rmtContext *rmt_ctx)
         sdsfree(rmt_ctx->dir);
     }
 
+    if (rmt_ctx->cpu_list != NULL) {
+        sdsfree(rmt_ctx->cpu_list);
+    }
+
     while(listLength(&rmt_ctx->clients) > 0) {
         lnode = listFirst(&rmt_ctx->clients);
         c = listNodeValue(lnode);
@@ -297,6 +442,8 @@ void destroy_context(rmtContext *rmt_ctx)
     reset_finish_count_after_notice(rmt_ctx);
     reset_notice_flag(rmt_ctx);
     pthread_rwlockattr_destroy(&rmt_ctx->rwl_notice);
+    ratelimits_deinit(&rmt_ctx->ratelimits);
+    slowlog_deinit(&rmt_ctx->slowlog);
 
     rmt_free(rmt_ctx);
 }
@@ -483,6 +630,12 @@ int main(int argc,char *argv[])
             return status;
         }
     }
+
+    status = log_ring_start();
+    if (status != RMT_OK) {
+        log_error("ERROR: Start the logger thread failed.");
+        return status;
+    }
     
     rmti.pid = getpid();
     if (rmti.pid_filename) {
@@ -105,6 +105,57 @@ static conf_option conf_common_options[] = {
     { (char*)"source_safe",
       conf_set_bool,
       offsetof(rmt_conf, source_safe) },
+    { (char*)"source_headroom",
+      conf_common_set_maxmemory,
+      offsetof(rmt_conf, source_headroom) },
+    { (char*)"zerocopy",
+      conf_set_bool,
+      offsetof(rmt_conf, zerocopy) },
+    { (char*)"checkpoint",
+      conf_set_bool,
+      offsetof(rmt_conf, checkpoint) },
+    { (char*)"key_profile",
+      conf_set_bool,
+      offsetof(rmt_conf, key_profile) },
+    { (char*)"spill_threshold",
+      conf_common_set_maxmemory,
+      offsetof(rmt_conf, spill_threshold) },
+    { (char*)"spill_compress",
+      conf_set_bool,
+      offsetof(rmt_conf, spill_compress) },
+    { (char*)"apply_threads",
+      conf_set_num,
+      offsetof(rmt_conf, apply_threads) },
+    { (char*)"send_batch",
+      conf_set_num,
+      offsetof(rmt_conf, send_batch) },
+    { (char*)"max_inflight",
+      conf_set_num,
+      offsetof(rmt_conf, max_inflight) },
+    { (char*)"rate_limit_bytes",
+      conf_common_set_maxmemory,
+      offsetof(rmt_conf, rate_limit_bytes) },
+    { (char*)"rate_limit_cmds",
+      conf_set_num,
+      offsetof(rmt_conf, rate_limit_cmds) },
+    { (char*)"target_rate_limit_bytes",
+      conf_common_set_maxmemory,
+      offsetof(rmt_conf, target_rate_limit_bytes) },
+    { (char*)"target_rate_limit_cmds",
+      conf_set_num,
+      offsetof(rmt_conf, target_rate_limit_cmds) },
+    { (char*)"rate_limit_burst",
+      conf_set_num,
+      offsetof(rmt_conf, rate_limit_burst) },
+    { (char*)"slowlog_log_slower_than",
+      conf_set_num,
+      offsetof(rmt_conf, slowlog_log_slower_than) },
+    { (char*)"slowlog_max_len",
+      conf_set_num,
+      offsetof(rmt_conf, slowlog_max_len) },
+    { (char*)"cpu_placement",
+      conf_set_string,
+      offsetof(rmt_conf, cpu_placement) },
     { (char*)"dir",
       conf_set_string,
       offsetof(rmt_conf, dir) },
@@ -693,6 +744,23 @@ static int conf_init(rmt_conf *cf)
     cf->noreply = CONF_UNSET_NUM;
     cf->rdb_diskless = CONF_UNSET_NUM;
     cf->source_safe = CONF_UNSET_NUM;
+    cf->source_headroom = CONF_UNSET_NUM;
+    cf->zerocopy = CONF_UNSET_NUM;
+    cf->checkpoint = CONF_UNSET_NUM;
+    cf->key_profile = CONF_UNSET_NUM;
+    cf->spill_threshold = CONF_UNSET_NUM;
+    cf->spill_compress = CONF_UNSET_NUM;
+    cf->apply_threads = CONF_UNSET_NUM;
+    cf->send_batch = CONF_UNSET_NUM;
+    cf->max_inflight = CONF_UNSET_NUM;
+    cf->rate_limit_bytes = CONF_UNSET_NUM;
+    cf->rate_limit_cmds = CONF_UNSET_NUM;
+    cf->target_rate_limit_bytes = CONF_UNSET_NUM;
+    cf->target_rate_limit_cmds = CONF_UNSET_NUM;
+    cf->rate_limit_burst = CONF_UNSET_NUM;
+    cf->slowlog_log_slower_than = CONF_UNSET_NUM;
+    cf->slowlog_max_len = CONF_UNSET_NUM;
+    cf->cpu_placement = CONF_UNSET_PTR;
     cf->dir = CONF_UNSET_PTR;
 
     cf->max_clients = CONF_UNSET_NUM;
@@ -735,6 +803,11 @@ static void conf_deinit(rmt_conf *cf)
         sdsfree(cf->dir);
         cf->dir = CONF_UNSET_PTR;
     }
+
+    if(cf->cpu_placement != NULL){
+        sdsfree(cf->cpu_placement);
+        cf->cpu_placement = CONF_UNSET_PTR;
+    }
     
     cf->maxmemory = CONF_UNSET_NUM;
     cf->threads = CONF_UNSET_NUM;
@@ -743,6 +816,22 @@ static void conf_deinit(rmt_conf *cf)
     cf->noreply = CONF_UNSET_NUM;
     cf->rdb_diskless = CONF_UNSET_NUM;
     cf->source_safe = CONF_UNSET_NUM;
+    cf->source_headroom = CONF_UNSET_NUM;
+    cf->zerocopy = CONF_UNSET_NUM;
+    cf->checkpoint = CONF_UNSET_NUM;
+    cf->key_profile = CONF_UNSET_NUM;
+    cf->spill_threshold = CONF_UNSET_NUM;
+    cf->spill_compress = CONF_UNSET_NUM;
+    cf->apply_threads = CONF_UNSET_NUM;
+    cf->send_batch = CONF_UNSET_NUM;
+    cf->max_inflight = CONF_UNSET_NUM;
+    cf->rate_limit_bytes = CONF_UNSET_NUM;
+    cf->rate_limit_cmds = CONF_UNSET_NUM;
+    cf->target_rate_limit_bytes = CONF_UNSET_NUM;
+    cf->target_rate_limit_cmds = CONF_UNSET_NUM;
+    cf->rate_limit_burst = CONF_UNSET_NUM;
+    cf->slowlog_log_slower_than = CONF_UNSET_NUM;
+    cf->slowlog_max_len = CONF_UNSET_NUM;
 }
 
 static void
@@ -791,6 +880,23 @@ conf_dump(rmt_conf *cf)
     log_debug(log_level, "  noreply: %d", cf->noreply);
     log_debug(log_level, "  rdb_diskless: %d", cf->rdb_diskless);
     log_debug(log_level, "  source_safe: %d", cf->source_safe);
+    log_debug(log_level, "  source_headroom: %lld", cf->source_headroom);
+    log_debug(log_level, "  zerocopy: %d", cf->zerocopy);
+    log_debug(log_level, "  checkpoint: %d", cf->checkpoint);
+    log_debug(log_level, "  key_profile: %d", cf->key_profile);
+    log_debug(log_level, "  spill_threshold: %lld", cf->spill_threshold);
+    log_debug(log_level, "  spill_compress: %d", cf->spill_compress);
+    log_debug(log_level, "  apply_threads: %d", cf->apply_threads);
+    log_debug(log_level, "  send_batch: %d", cf->send_batch);
+    log_debug(log_level, "  max_inflight: %d", cf->max_inflight);
+    log_debug(log_level, "  rate_limit_bytes: %lld", cf->rate_limit_bytes);
+    log_debug(log_level, "  rate_limit_cmds: %d", cf->rate_limit_cmds);
+    log_debug(log_level, "  target_rate_limit_bytes: %lld", cf->target_rate_limit_bytes);
+    log_debug(log_level, "  target_rate_limit_cmds: %d", cf->target_rate_limit_cmds);
+    log_debug(log_level, "  rate_limit_burst: %d", cf->rate_limit_burst);
+    log_debug(log_level, "  slowlog_log_slower_than: %d", cf->slowlog_log_slower_than);
+    log_debug(log_level, "  slowlog_max_len: %d", cf->slowlog_max_len);
+    log_debug(log_level, "  cpu_placement: %s", cf->cpu_placement);
     log_debug(log_level, "  dir: %s", cf->dir);
     log_debug(log_level, "  max_clients: %d", cf->max_clients);
     log_debug(log_level, "  filter: %s", cf->filter);
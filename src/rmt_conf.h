@@ -60,6 +60,23 @@ typedef struct rmt_conf {
     int           noreply;
     int           rdb_diskless;
     int           source_safe;
+    long long     source_headroom;
+    int           zerocopy;
+    int           checkpoint;
+    int           key_profile;
+    long long     spill_threshold;
+    int           spill_compress;
+    int           apply_threads;
+    int           send_batch;
+    int           max_inflight;
+    long long     rate_limit_bytes;
+    int           rate_limit_cmds;
+    long long     target_rate_limit_bytes;
+    int           target_rate_limit_cmds;
+    int           rate_limit_burst;
+    int           slowlog_log_slower_than;
+    int           slowlog_max_len;
+    sds           cpu_placement;
     sds           dir;
 
     int           max_clients;
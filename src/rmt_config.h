@@ -69,6 +69,25 @@
 #endif
 #endif
 
+/* Test for splice() */
+#if defined(__linux__) && defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 5)
+#define HAVE_SPLICE 1
+#endif
+#endif
+
+/* Test for MSG_ZEROCOPY and its completion notifications */
+#ifdef __linux__
+#if (LINUX_VERSION_CODE >= 0x040e00)
+#define HAVE_MSG_ZEROCOPY 1
+#endif
+#endif
+
+/* Test for sched_setaffinity() and the NUMA memory policies */
+#if defined(__linux__) && defined(__GLIBC__)
+#define HAVE_SCHED_SETAFFINITY 1
+#endif
+
 /* Check if we can use setproctitle().
  * BSD systems have support for it, we provide an implementation for
  * Linux and osx. */
@@ -6,6 +6,14 @@
 #define ERROR_RESPONSE_SYNTAX       "-ERR syntax error\r\n"
 #define ERROR_RESPONSE_NOTSUPPORT   "-ERR command not support\r\n"
 
+#define HTTP_REQUEST_MAX_LEN        8192
+#define HTTP_METRICS_PATH           "/metrics"
+#define HTTP_METRICS_CONTENT_TYPE   \
+    "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+static struct msg *req_get(rmt_connect *conn);
+static void req_put(struct msg *msg);
+
 static uint32_t source_group_nodes_count(rmtContext *ctx)
 {
     return (uint32_t)dictSize(ctx->srgroup->nodes);
@@ -30,7 +38,7 @@ static int all_rdb_received_finished(rmtContext *ctx)
 
     for (i = 0; i < array_n(rdatas); i++) {
         rdata = array_get(rdatas, i);
-        if (rdata->stat_rdb_received_count < rdata->nodes_count) {
+        if (thread_stat(rdata, rdb_received_count) < rdata->nodes_count) {
             finished = 0;
             break;
         }
@@ -50,7 +58,7 @@ static int rdb_received_finished_count(rmtContext *ctx)
 
     for (i = 0; i < array_n(rdatas); i++) {
         rdata = array_get(rdatas, i);
-        count += rdata->stat_rdb_received_count;
+        count += thread_stat(rdata, rdb_received_count);
     }
 
     return count;
@@ -67,7 +75,7 @@ static int all_aof_loaded_finished(rmtContext *ctx)
 
     for (i = 0; i < array_n(rdatas); i++) {
         rdata = array_get(rdatas, i);
-        if (rdata->stat_aof_loaded_count < rdata->nodes_count) {
+        if (thread_stat(rdata, aof_loaded_count) < rdata->nodes_count) {
             finished = 0;
             break;
         }
@@ -87,7 +95,7 @@ static int aof_loaded_finished_count(rmtContext *ctx)
 
     for (i = 0; i < array_n(rdatas); i++) {
         rdata = array_get(rdatas, i);
-        count += rdata->stat_aof_loaded_count;
+        count += thread_stat(rdata, aof_loaded_count);
     }
 
     return count;
@@ -102,7 +110,7 @@ static int all_rdb_parse_finished(rmtContext *ctx)
 
     for (i = 0; i < array_n(wdatas); i++) {
         wdata = array_get(wdatas, i);
-        if (wdata->stat_rdb_parsed_count < wdata->nodes_count) {
+        if (thread_stat(wdata, rdb_parsed_count) < wdata->nodes_count) {
             finished = 0;
             break;
         }
@@ -120,7 +128,7 @@ static int rdb_parse_finished_count(rmtContext *ctx)
 
     for (i = 0; i < array_n(wdatas); i++) {
         wdata = array_get(wdatas, i);
-        count += wdata->stat_rdb_parsed_count;
+        count += thread_stat(wdata, rdb_parsed_count);
     }
 
     return count;
@@ -135,7 +143,13 @@ static uint64_t total_msgs_received(rmtContext *ctx)
 
     for (i = 0; i < array_n(wdatas); i++) {
         wdata = array_get(wdatas, i);
-        count += wdata->stat_total_msgs_recv;
+        count += thread_stat(wdata, total_msgs_recv);
+    }
+
+    /* the msgs are sent by the apply threads if any */
+    for (i = 0; ctx->adatas != NULL && i < array_n(ctx->adatas); i++) {
+        wdata = array_get(ctx->adatas, i);
+        count += thread_stat(wdata, total_msgs_recv);
     }
 
     return count;
@@ -150,7 +164,12 @@ static uint64_t total_msgs_sent(rmtContext *ctx)
 
     for (i = 0; i < array_n(wdatas); i++) {
         wdata = array_get(wdatas, i);
-        count += wdata->stat_total_msgs_sent;
+        count += thread_stat(wdata, total_msgs_sent);
+    }
+
+    for (i = 0; ctx->adatas != NULL && i < array_n(ctx->adatas); i++) {
+        wdata = array_get(ctx->adatas, i);
+        count += thread_stat(wdata, total_msgs_sent);
     }
 
     return count;
@@ -167,7 +186,7 @@ static uint64_t total_bytes_received(rmtContext *ctx)
 
     for (i = 0; i < array_n(rdatas); i++) {
         rdata = array_get(rdatas, i);
-        bytes += rdata->stat_total_net_input_bytes;
+        bytes += thread_stat(rdata, total_net_input_bytes);
     }
 
     return bytes;
@@ -182,7 +201,12 @@ static uint64_t total_bytes_sent(rmtContext *ctx)
 
     for (i = 0; i < array_n(wdatas); i++) {
         wdata = array_get(wdatas, i);
-        bytes += wdata->stat_total_net_output_bytes;
+        bytes += thread_stat(wdata, total_net_output_bytes);
+    }
+
+    for (i = 0; ctx->adatas != NULL && i < array_n(ctx->adatas); i++) {
+        wdata = array_get(ctx->adatas, i);
+        bytes += thread_stat(wdata, total_net_output_bytes);
     }
 
     return bytes;
@@ -215,12 +239,696 @@ static uint64_t total_msgs_outqueue(rmtContext *ctx)
 
     for (i = 0; i < array_n(wdatas); i++) {
         wdata = array_get(wdatas, i);
-        count += wdata->stat_msgs_outqueue;
+        count += thread_stat(wdata, msgs_outqueue);
+    }
+
+    for (i = 0; ctx->adatas != NULL && i < array_n(ctx->adatas); i++) {
+        wdata = array_get(ctx->adatas, i);
+        count += thread_stat(wdata, msgs_outqueue);
+    }
+
+    return count;
+}
+
+static uint64_t total_msgs_retried(rmtContext *ctx)
+{
+    uint32_t i;
+    uint64_t count = 0;
+    struct array *wdatas = ctx->wdatas;
+    thread_data *wdata;
+
+    for (i = 0; i < array_n(wdatas); i++) {
+        wdata = array_get(wdatas, i);
+        count += thread_stat(wdata, total_msgs_retried);
+    }
+
+    for (i = 0; ctx->adatas != NULL && i < array_n(ctx->adatas); i++) {
+        wdata = array_get(ctx->adatas, i);
+        count += thread_stat(wdata, total_msgs_retried);
+    }
+
+    return count;
+}
+
+static uint64_t total_msgs_retry_dropped(rmtContext *ctx)
+{
+    uint32_t i;
+    uint64_t count = 0;
+    struct array *wdatas = ctx->wdatas;
+    thread_data *wdata;
+
+    for (i = 0; i < array_n(wdatas); i++) {
+        wdata = array_get(wdatas, i);
+        count += thread_stat(wdata, total_msgs_retry_dropped);
+    }
+
+    for (i = 0; ctx->adatas != NULL && i < array_n(ctx->adatas); i++) {
+        wdata = array_get(ctx->adatas, i);
+        count += thread_stat(wdata, total_msgs_retry_dropped);
+    }
+
+    return count;
+}
+
+static uint64_t total_msgs_redirected(rmtContext *ctx)
+{
+    uint32_t i;
+    uint64_t count = 0;
+    struct array *wdatas = ctx->wdatas;
+    thread_data *wdata;
+
+    for (i = 0; i < array_n(wdatas); i++) {
+        wdata = array_get(wdatas, i);
+        count += thread_stat(wdata, total_msgs_redirected);
+    }
+
+    for (i = 0; ctx->adatas != NULL && i < array_n(ctx->adatas); i++) {
+        wdata = array_get(ctx->adatas, i);
+        count += thread_stat(wdata, total_msgs_redirected);
     }
 
     return count;
 }
 
+static uint64_t total_asking_sent(rmtContext *ctx)
+{
+    uint32_t i;
+    uint64_t count = 0;
+    struct array *wdatas = ctx->wdatas;
+    thread_data *wdata;
+
+    for (i = 0; i < array_n(wdatas); i++) {
+        wdata = array_get(wdatas, i);
+        count += thread_stat(wdata, total_asking_sent);
+    }
+
+    for (i = 0; ctx->adatas != NULL && i < array_n(ctx->adatas); i++) {
+        wdata = array_get(ctx->adatas, i);
+        count += thread_stat(wdata, total_asking_sent);
+    }
+
+    return count;
+}
+
+static const char *replication_state_string(redis_node *srnode)
+{
+    if (srnode->rr == NULL) {
+        return "none";
+    } else if (srnode->rr->repl_state == REDIS_REPL_NONE) {
+        return "waiting";
+    } else if (!__atomic_load_n(&srnode->rdb->received, __ATOMIC_ACQUIRE)) {
+        return "syncing";
+    }
+
+    return "online";
+}
+
+/* The replication plan of the source nodes given by the scheduler. */
+static sds schedule_info_string(rmtContext *ctx, sds info)
+{
+    uint32_t i;
+    int n = 0;
+    struct array *wdatas = ctx->wdatas;
+    thread_data *wdata;
+    redis_node *srnode;
+    listNode *lnode;
+
+    for (i = 0; i < array_n(wdatas); i++) {
+        wdata = array_get(wdatas, i);
+        for (lnode = listFirst(wdata->nodes); lnode != NULL; 
+            lnode = listNextNode(lnode)) {
+            srnode = listNodeValue(lnode);
+            if (srnode->lane < 0) {
+                continue;
+            }
+
+            info = sdscatprintf(info,
+                "node%d:addr=%s,lane=%d,order=%d,used_memory=%lld,"
+                "keys=%lld,state=%s\r\n",
+                n++, srnode->addr, srnode->lane, srnode->lane_order, 
+                srnode->used_memory, srnode->keys, 
+                replication_state_string(srnode));
+        }
+    }
+
+    return info;
+}
+
+/* 
+ * How far the target group is behind every source node, and the progress 
+ * of the rdb, updated every second. The master offset is the offset of the
+ * replication stream received, kept current by the PINGs of the master. 
+ * -1 if unknown.
+ */
+static sds replication_info_string(rmtContext *ctx, sds info)
+{
+    uint32_t i;
+    int n = 0;
+    struct array *wdatas = ctx->wdatas;
+    thread_data *wdata;
+    redis_node *srnode;
+    redis_repl_progress *progress;
+    listNode *lnode;
+
+    for (i = 0; i < array_n(wdatas); i++) {
+        wdata = array_get(wdatas, i);
+        for (lnode = listFirst(wdata->nodes); lnode != NULL; 
+            lnode = listNextNode(lnode)) {
+            srnode = listNodeValue(lnode);
+            if (srnode->rr == NULL) {
+                continue;
+            }
+            progress = &srnode->rr->progress;
+
+            info = sdscatprintf(info,
+                "node%d:addr=%s,state=%s,master_offset=%lld,"
+                "acked_offset=%lld,lag_bytes=%lld,lag_seconds=%.3f,"
+                "rdb_size=%lld,rdb_received=%lld,rdb_parsed=%lld,"
+                "rdb_keys=%lld,keys_per_sec=%.0f,rdb_eta_seconds=%.3f\r\n",
+                n++, srnode->addr, replication_state_string(srnode),
+                progress->reploff, progress->ack_off, 
+                progress->lag_bytes, progress->lag_msec < 0 ? 
+                -1.0 : (double)progress->lag_msec/1000,
+                (long long)srnode->rr->repl_transfer_size,
+                (long long)srnode->rr->repl_transfer_read,
+                progress->rdb_parsed, progress->rdb_keys,
+                progress->rdb_keys_per_sec, progress->rdb_eta_msec < 0 ? 
+                -1.0 : (double)progress->rdb_eta_msec/1000);
+        }
+    }
+
+    return info;
+}
+
+/*
+ * The keys profiled from the rdb of every source node, and of all of them
+ * by type. The sizes are the bytes encoded in the rdb.
+ */
+static sds keyprofile_info_string(rmtContext *ctx, sds info)
+{
+    uint32_t i;
+    int n = 0, type;
+    struct array *wdatas = ctx->wdatas;
+    thread_data *wdata;
+    redis_node *srnode;
+    keyprofile *kp;
+    keyprofile_type *kt, types[KEYPROFILE_TYPES];
+    uint64_t keys, bytes, expires, max_bytes;
+    listNode *lnode;
+
+    rmt_memset(types, 0, sizeof(types));
+
+    info = sdscatprintf(info, "key_profile:%d\r\n", ctx->key_profile);
+
+    for (i = 0; i < array_n(wdatas); i++) {
+        wdata = array_get(wdatas, i);
+        for (lnode = listFirst(wdata->nodes); lnode != NULL; 
+            lnode = listNextNode(lnode)) {
+            srnode = listNodeValue(lnode);
+            if (srnode->rdb == NULL || srnode->rdb->profile == NULL) {
+                continue;
+            }
+            kp = srnode->rdb->profile;
+
+            keys = bytes = expires = max_bytes = 0;
+            for (type = 0; type < KEYPROFILE_TYPES; type++) {
+                kt = &kp->types[type];
+                keys += kt->keys;
+                bytes += kt->bytes;
+                expires += kt->expires;
+                max_bytes = MAX(max_bytes, kt->max_bytes);
+                types[type].keys += kt->keys;
+                types[type].bytes += kt->bytes;
+                types[type].elements += kt->elements;
+                types[type].expires += kt->expires;
+                types[type].max_bytes = MAX(types[type].max_bytes, 
+                    kt->max_bytes);
+            }
+
+            info = sdscatprintf(info,
+                "node%d:addr=%s,keys=%"PRIu64",bytes=%"PRIu64
+                ",expires=%"PRIu64",max_bytes=%"PRIu64",report=%s\r\n",
+                n++, srnode->addr, keys, bytes, expires, max_bytes,
+                kp->reported ? kp->fname : "");
+        }
+    }
+
+    for (type = 0; n > 0 && type < KEYPROFILE_TYPES; type++) {
+        kt = &types[type];
+        info = sdscatprintf(info,
+            "type_%s:keys=%"PRIu64",bytes=%"PRIu64",elements=%"PRIu64
+            ",expires=%"PRIu64",max_bytes=%"PRIu64",avg_bytes=%.2f\r\n",
+            get_redis_type_string(type), kt->keys, kt->bytes, kt->elements,
+            kt->expires, kt->max_bytes, 
+            kt->keys == 0 ? 0.0 : (double)kt->bytes/(double)kt->keys);
+    }
+
+    return info;
+}
+
+static sds ratelimit_info_string(rmtContext *ctx, sds info)
+{
+    rmt_tunables *tunables = &ctx->tunables;
+    ratelimits *rls = &ctx->ratelimits;
+    dictIterator *di;
+    dictEntry *de;
+    ratelimit *rl;
+    int i = 0;
+
+    info = sdscatprintf(info,
+        "rate_limit_bytes:%lld\r\n"
+        "rate_limit_cmds:%lld\r\n"
+        "target_rate_limit_bytes:%lld\r\n"
+        "target_rate_limit_cmds:%lld\r\n"
+        "rate_limit_burst:%lld\r\n"
+        "throttled:%"PRIu64"\r\n",
+        tunables->rate_limit_bytes,
+        tunables->rate_limit_cmds,
+        tunables->target_rate_limit_bytes,
+        tunables->target_rate_limit_cmds,
+        tunables->rate_limit_burst,
+        rls->global->throttled);
+
+    pthread_mutex_lock(&rls->lock);
+    di = dictGetIterator(rls->targets);
+    while ((de = dictNext(di)) != NULL) {
+        rl = dictGetVal(de);
+        info = sdscatprintf(info, "target%d:addr=%s,throttled=%"PRIu64"\r\n",
+            i++, (char *)dictGetKey(de), rl->throttled);
+    }
+    dictReleaseIterator(di);
+    pthread_mutex_unlock(&rls->lock);
+
+    return info;
+}
+
+static void dictHistogramDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    hist_destroy(val);
+}
+
+/* Target node address to the latency merged from all the threads */
+static dictType latencyDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictHistogramDestructor     /* val destructor */
+};
+
+static int merge_target_latency(dict *latency, thread_data *wdata)
+{
+    redis_group *trgroup = wdata->trgroup;
+    dictIterator *di;
+    dictEntry *de;
+    redis_node *trnode;
+    histogram *h;
+    sds addr;
+    int ret = RMT_OK;
+
+    pthread_mutex_lock(&trgroup->nodes_mutex);
+    di = dictGetIterator(trgroup->nodes);
+    while ((de = dictNext(di)) != NULL) {
+        trnode = dictGetVal(de);
+        if (trnode->latency == NULL) {
+            continue;
+        }
+
+        addr = sdsnew(trnode->addr);
+        h = dictFetchValue(latency, addr);
+        if (h == NULL) {
+            h = hist_create();
+            if (h == NULL || dictAdd(latency, addr, h) != DICT_OK) {
+                sdsfree(addr);
+                hist_destroy(h);
+                ret = RMT_ERROR;
+                break;
+            }
+        } else {
+            sdsfree(addr);
+        }
+        hist_merge(h, trnode->latency);
+    }
+    dictReleaseIterator(di);
+    pthread_mutex_unlock(&trgroup->nodes_mutex);
+
+    return ret;
+}
+
+static sds latency_info_string(sds info, histogram *h)
+{
+    return sdscatprintf(info,
+        "calls=%"PRIu64",p50=%.3f,p99=%.3f,p999=%.3f,max=%.3f\r\n",
+        h->count,
+        (double)hist_percentile(h, 50.0)/1000,
+        (double)hist_percentile(h, 99.0)/1000,
+        (double)hist_percentile(h, 99.9)/1000,
+        (double)h->max/1000);
+}
+
+static int addr_compare(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*
+ * The latency percentiles in microseconds of the target nodes (from the 
+ * msg sent to its reply), the wait of the msgs in send_data, and the 
+ * parse of a mbuf of commands, merged from the write and apply threads.
+ */
+static sds target_latency_info_string(rmtContext *ctx, sds info)
+{
+    uint32_t i, n;
+    dict *latency;
+    dictIterator *di;
+    dictEntry *de;
+    sds *addrs;
+    histogram *queue, *parse;
+    thread_data *wdata;
+    struct array *tdatas[2] = {ctx->wdatas, ctx->adatas};
+    int k;
+
+    latency = dictCreate(&latencyDictType, NULL);
+    queue = hist_create();
+    parse = hist_create();
+    if (latency == NULL || queue == NULL || parse == NULL) {
+        goto done;
+    }
+
+    for (k = 0; k < 2; k++) {
+        for (i = 0; tdatas[k] != NULL && i < array_n(tdatas[k]); i++) {
+            wdata = array_get(tdatas[k], i);
+            if (wdata->stat_queue_latency != NULL) {
+                hist_merge(queue, wdata->stat_queue_latency);
+            }
+            if (wdata->stat_parse_latency != NULL) {
+                hist_merge(parse, wdata->stat_parse_latency);
+            }
+            if (merge_target_latency(latency, wdata) != RMT_OK) {
+                goto done;
+            }
+        }
+    }
+
+    n = (uint32_t)dictSize(latency);
+    addrs = rmt_alloc(sizeof(sds)*(n + 1));
+    if (addrs == NULL) {
+        goto done;
+    }
+
+    i = 0;
+    di = dictGetIterator(latency);
+    while ((de = dictNext(di)) != NULL) {
+        addrs[i++] = dictGetKey(de);
+    }
+    dictReleaseIterator(di);
+    qsort(addrs, n, sizeof(sds), addr_compare);
+
+    for (i = 0; i < n; i++) {
+        info = sdscatprintf(info, "target_node%u:addr=%s,", i, addrs[i]);
+        info = latency_info_string(info, dictFetchValue(latency, addrs[i]));
+    }
+    rmt_free(addrs);
+
+    info = sdscat(info, "stage_queue:");
+    info = latency_info_string(info, queue);
+    info = sdscat(info, "stage_parse:");
+    info = latency_info_string(info, parse);
+
+done:
+
+    if (latency != NULL) {
+        dictRelease(latency);
+    }
+    hist_destroy(queue);
+    hist_destroy(parse);
+
+    return info;
+}
+
+/*
+ * The commands sent to the target group by type, merged from the write 
+ * and apply threads: the replies, the bytes of the requests, the error 
+ * replies and the time from the send to the reply.
+ */
+static sds commandstats_info_string(rmtContext *ctx, sds info)
+{
+    uint64_t calls, bytes, errors, retries, nsec;
+    thread_data *wdata;
+    command_stats *cs;
+    struct array *tdatas[2] = {ctx->wdatas, ctx->adatas};
+    uint32_t i;
+    int k, type;
+
+    for (type = MSG_UNKNOWN + 1; type < MSG_SENTINEL; type++) {
+        calls = bytes = errors = retries = nsec = 0;
+        for (k = 0; k < 2; k++) {
+            for (i = 0; tdatas[k] != NULL && i < array_n(tdatas[k]); i++) {
+                wdata = array_get(tdatas[k], i);
+                if (wdata->stat_commands == NULL) {
+                    continue;
+                }
+                cs = &wdata->stat_commands[type];
+                calls += __atomic_load_n(&cs->calls, __ATOMIC_RELAXED);
+                bytes += __atomic_load_n(&cs->bytes, __ATOMIC_RELAXED);
+                errors += __atomic_load_n(&cs->errors, __ATOMIC_RELAXED);
+                retries += __atomic_load_n(&cs->retries, __ATOMIC_RELAXED);
+                nsec += __atomic_load_n(&cs->nsec, __ATOMIC_RELAXED);
+            }
+        }
+
+        if (calls == 0 && retries == 0) {
+            continue;
+        }
+
+        info = sdscatprintf(info,
+            "cmdstat_%s:calls=%"PRIu64",bytes=%"PRIu64",errors=%"PRIu64
+            ",retries=%"PRIu64",usec=%"PRIu64",usec_per_call=%.2f\r\n",
+            redis_command_name((msg_type_t)type), calls, bytes, errors,
+            retries, nsec/1000, 
+            calls > 0 ? (double)nsec/1000/(double)calls : 0);
+    }
+
+    return info;
+}
+
+static void mbuf_pool_usage(mbuf_base *mb, uint64_t *total, uint64_t *nfree)
+{
+    long long len;
+
+    if (mb == NULL) {
+        return;
+    }
+
+    *total += mb->ntotal_mbuf;
+    len = mb->free_mbufs != NULL ? mttlist_length(mb->free_mbufs) : 0;
+    *nfree += len > 0 ? (uint64_t)len : 0;
+}
+
+static sds metric_family(sds m, const char *name, const char *type, 
+    const char *help)
+{
+    return sdscatprintf(m, "# TYPE %s %s\n# HELP %s %s\n", 
+        name, type, name, help);
+}
+
+static sds metric_counter(sds m, const char *name, const char *help, 
+    uint64_t value)
+{
+    m = metric_family(m, name, "counter", help);
+    return sdscatprintf(m, "%s_total %"PRIu64"\n", name, value);
+}
+
+static sds metric_gauge(sds m, const char *name, const char *help, 
+    long long value)
+{
+    m = metric_family(m, name, "gauge", help);
+    return sdscatprintf(m, "%s %lld\n", name, value);
+}
+
+/* The samples of the source nodes, one metric family after another. */
+static sds source_nodes_metrics(rmtContext *ctx, sds m)
+{
+    uint32_t i;
+    struct array *wdatas = ctx->wdatas;
+    thread_data *wdata;
+    redis_node *srnode;
+    listNode *lnode;
+    long long now = rmt_msec_now();
+    redis_repl_progress *progress;
+    sds offset, acked, lag, lagsec, eta, lastio, inqueue;
+
+    offset = metric_family(sdsempty(), "rmt_source_repl_offset", "gauge",
+        "Replication offset received from the source node.");
+    acked = metric_family(sdsempty(), "rmt_source_repl_acked_offset", "gauge",
+        "Replication offset of the source node acknowledged by the target group.");
+    lag = metric_family(sdsempty(), "rmt_source_repl_lag_bytes", "gauge",
+        "Replication bytes received from the source node and not acknowledged by the target group yet.");
+    lagsec = metric_family(sdsempty(), "rmt_source_repl_lag_seconds", "gauge",
+        "Age of the oldest replication data of the source node not acknowledged by the target group.");
+    eta = metric_family(sdsempty(), "rmt_source_rdb_eta_seconds", "gauge",
+        "Estimated time to parse the rest of the rdb of the source node.");
+    lastio = metric_family(sdsempty(), "rmt_source_last_io_seconds", "gauge",
+        "Seconds since the last data read from the source node.");
+    inqueue = metric_family(sdsempty(), "rmt_source_mbufs_inqueue", "gauge",
+        "Mbufs of commands received from the source node and not parsed yet.");
+
+    for (i = 0; i < array_n(wdatas); i++) {
+        wdata = array_get(wdatas, i);
+        for (lnode = listFirst(wdata->nodes); lnode != NULL; 
+            lnode = listNextNode(lnode)) {
+            srnode = listNodeValue(lnode);
+
+            inqueue = sdscatprintf(inqueue, 
+                "rmt_source_mbufs_inqueue{node=\"%s\"} %lld\n", 
+                srnode->addr, mttlist_length(srnode->cmd_data));
+
+            if (srnode->rr == NULL) {
+                continue;
+            }
+            progress = &srnode->rr->progress;
+
+            offset = sdscatprintf(offset, 
+                "rmt_source_repl_offset{node=\"%s\"} %lld\n", 
+                srnode->addr, progress->reploff);
+            if (srnode->rr->repl_lastio > 0) {
+                lastio = sdscatprintf(lastio, 
+                    "rmt_source_last_io_seconds{node=\"%s\"} %.3f\n", 
+                    srnode->addr, (double)(now - srnode->rr->repl_lastio)/1000);
+            }
+            if (progress->ack_off >= 0) {
+                acked = sdscatprintf(acked, 
+                    "rmt_source_repl_acked_offset{node=\"%s\"} %lld\n", 
+                    srnode->addr, progress->ack_off);
+            }
+            if (progress->lag_bytes >= 0) {
+                lag = sdscatprintf(lag, 
+                    "rmt_source_repl_lag_bytes{node=\"%s\"} %lld\n", 
+                    srnode->addr, progress->lag_bytes);
+                lagsec = sdscatprintf(lagsec, 
+                    "rmt_source_repl_lag_seconds{node=\"%s\"} %.3f\n", 
+                    srnode->addr, (double)progress->lag_msec/1000);
+            }
+            if (progress->rdb_eta_msec >= 0) {
+                eta = sdscatprintf(eta, 
+                    "rmt_source_rdb_eta_seconds{node=\"%s\"} %.3f\n", 
+                    srnode->addr, (double)progress->rdb_eta_msec/1000);
+            }
+        }
+    }
+
+    m = sdscatsds(m, offset);
+    m = sdscatsds(m, acked);
+    m = sdscatsds(m, lag);
+    m = sdscatsds(m, lagsec);
+    m = sdscatsds(m, eta);
+    m = sdscatsds(m, lastio);
+    m = sdscatsds(m, inqueue);
+
+    sdsfree(offset);
+    sdsfree(acked);
+    sdsfree(lag);
+    sdsfree(lagsec);
+    sdsfree(eta);
+    sdsfree(lastio);
+    sdsfree(inqueue);
+
+    return m;
+}
+
+/* The INFO stats as OpenMetrics text for the http scrapes. */
+static sds gen_migrate_metrics_string(rmtContext *ctx)
+{
+    uint32_t i;
+    uint64_t source_total = 0, source_free = 0;
+    uint64_t target_total = 0, target_free = 0;
+    thread_data *wdata;
+    sds m = sdsempty();
+
+    mbuf_pool_usage(ctx->srgroup->mb, &source_total, &source_free);
+    for (i = 0; i < array_n(ctx->wdatas); i++) {
+        wdata = array_get(ctx->wdatas, i);
+        mbuf_pool_usage(wdata->trgroup->mb, &target_total, &target_free);
+    }
+    for (i = 0; ctx->adatas != NULL && i < array_n(ctx->adatas); i++) {
+        wdata = array_get(ctx->adatas, i);
+        mbuf_pool_usage(wdata->trgroup->mb, &target_total, &target_free);
+    }
+
+    m = metric_gauge(m, "rmt_uptime_seconds", 
+        "Seconds since the start.", 
+        (rmt_msec_now() - ctx->starttime)/1000);
+    m = metric_gauge(m, "rmt_connected_clients", 
+        "Clients connected to the listen port.", 
+        conn_ncurr_cconn(ctx));
+    m = metric_counter(m, "rmt_connections_received", 
+        "Connections accepted on the listen port.", 
+        conn_ntotal_cconn(ctx));
+    m = metric_gauge(m, "rmt_source_nodes", 
+        "Nodes of the source group.", 
+        source_group_nodes_count(ctx));
+    m = metric_gauge(m, "rmt_target_nodes", 
+        "Nodes of the target group.", 
+        target_group_nodes_count(ctx));
+    m = metric_gauge(m, "rmt_rdb_received_nodes", 
+        "Source nodes whose rdb is received.", 
+        rdb_received_finished_count(ctx));
+    m = metric_gauge(m, "rmt_rdb_parsed_nodes", 
+        "Source nodes whose rdb is parsed.", 
+        rdb_parse_finished_count(ctx));
+    m = metric_gauge(m, "rmt_aof_loaded_nodes", 
+        "Source nodes whose aof file is loaded.", 
+        aof_loaded_finished_count(ctx));
+    m = metric_counter(m, "rmt_msgs_received", 
+        "Msgs received from the source group.", 
+        total_msgs_received(ctx));
+    m = metric_counter(m, "rmt_msgs_sent", 
+        "Msgs sent to the target group and replied.", 
+        total_msgs_sent(ctx));
+    m = metric_counter(m, "rmt_net_input_bytes", 
+        "Bytes received from the source group.", 
+        total_bytes_received(ctx));
+    m = metric_counter(m, "rmt_net_output_bytes", 
+        "Bytes sent to the target group.", 
+        total_bytes_sent(ctx));
+    m = metric_counter(m, "rmt_msgs_retried", 
+        "Msgs sent to the target group again after transient errors.", 
+        total_msgs_retried(ctx));
+    m = metric_counter(m, "rmt_msgs_retry_dropped", 
+        "Msgs dropped after too many retries.", 
+        total_msgs_retry_dropped(ctx));
+    m = metric_counter(m, "rmt_msgs_redirected", 
+        "Msgs sent again for the -MOVED or -ASK of the target cluster.", 
+        total_msgs_redirected(ctx));
+    m = metric_counter(m, "rmt_asking_sent", 
+        "ASKING sent before the msgs redirected by -ASK.", 
+        total_asking_sent(ctx));
+    m = metric_gauge(m, "rmt_mbufs_inqueue", 
+        "Mbufs of commands received from the source group and not parsed yet.", 
+        (long long)total_mbufs_inqueue(ctx));
+    m = metric_gauge(m, "rmt_msgs_outqueue", 
+        "Msgs to send to the target group or waiting for the replies.", 
+        (long long)total_msgs_outqueue(ctx));
+
+    m = metric_family(m, "rmt_mbufs", "gauge", 
+        "Mbufs allocated by the pools.");
+    m = sdscatprintf(m, "rmt_mbufs{pool=\"source\"} %"PRIu64"\n"
+        "rmt_mbufs{pool=\"target\"} %"PRIu64"\n", 
+        source_total, target_total);
+    m = metric_family(m, "rmt_mbufs_free", "gauge", 
+        "Mbufs free in the pools.");
+    m = sdscatprintf(m, "rmt_mbufs_free{pool=\"source\"} %"PRIu64"\n"
+        "rmt_mbufs_free{pool=\"target\"} %"PRIu64"\n", 
+        source_free, target_free);
+
+    m = source_nodes_metrics(ctx, m);
+
+    return sdscat(m, "# EOF\n");
+}
+
 static sds gen_migrate_info_string(rmtContext *ctx, sds part)
 {
     sds info = sdsempty();
@@ -333,7 +1041,11 @@ static sds gen_migrate_info_string(rmtContext *ctx, sds part)
             "total_net_input_bytes_human:%s\r\n"
             "total_net_output_bytes_human:%s\r\n"
             "total_mbufs_inqueue:%"PRIu64"\r\n"
-            "total_msgs_outqueue:%"PRIu64"\r\n",
+            "total_msgs_outqueue:%"PRIu64"\r\n"
+            "total_msgs_retried:%"PRIu64"\r\n"
+            "total_msgs_retry_dropped:%"PRIu64"\r\n"
+            "total_msgs_redirected:%"PRIu64"\r\n"
+            "total_asking_sent:%"PRIu64"\r\n",
             all_rdb_received_finished(ctx),
             all_rdb_parse_finished(ctx),
             all_aof_loaded_finished(ctx),
@@ -347,12 +1059,286 @@ static sds gen_migrate_info_string(rmtContext *ctx, sds part)
             total_input_bytes_human,
             total_output_bytes_human,
             total_mbufs_inqueue(ctx),
-            total_msgs_outqueue(ctx));
+            total_msgs_outqueue(ctx),
+            total_msgs_retried(ctx),
+            total_msgs_retry_dropped(ctx),
+            total_msgs_redirected(ctx),
+            total_asking_sent(ctx));
+    }
+
+    /* Replication */
+    if (allsections || defsections || !strcasecmp(section,"replication")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info, "# Replication\r\n");
+        info = sdscatprintf(info, "migrate_paused:%d\r\n", 
+            ctx->tunables.paused);
+        info = replication_info_string(ctx, info);
+    }
+
+    /* Ratelimit */
+    if (allsections || defsections || !strcasecmp(section,"ratelimit")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info, "# Ratelimit\r\n");
+        info = ratelimit_info_string(ctx, info);
+    }
+
+    /* Latency */
+    if (allsections || !strcasecmp(section,"latency")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info, "# Latency\r\n");
+        info = target_latency_info_string(ctx, info);
+    }
+
+    /* Commandstats */
+    if (allsections || !strcasecmp(section,"commandstats")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info, "# Commandstats\r\n");
+        info = commandstats_info_string(ctx, info);
+    }
+
+    /* Keyprofile */
+    if (allsections || !strcasecmp(section,"keyprofile")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info, "# Keyprofile\r\n");
+        info = keyprofile_info_string(ctx, info);
+    }
+
+    /* Schedule */
+    if (allsections || !strcasecmp(section,"schedule")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Schedule\r\n"
+            "source_safe:%d\r\n"
+            "source_headroom:%lld\r\n",
+            ctx->source_safe,
+            ctx->source_headroom);
+        info = schedule_info_string(ctx, info);
     }
 
     return info;
 }
 
+/* The parameters of CONFIG GET|SET, the int or long long in rmt_tunables */
+typedef struct config_tunable {
+    const char *name;
+    size_t offset;
+    size_t size;
+    long long min;
+    long long max;
+} config_tunable;
+
+#define CONFIG_TUNABLE(_field, _min, _max)                      \
+    { #_field, offsetof(rmt_tunables, _field),                  \
+      sizeof(((rmt_tunables *)0)->_field), _min, _max }
+
+static config_tunable config_tunables[] = {
+    CONFIG_TUNABLE( step, 0, INT_MAX ),
+    CONFIG_TUNABLE( send_batch, RMT_IOV_BATCH_MIN, RMT_IOV_BATCH_MAX ),
+    CONFIG_TUNABLE( max_inflight, 0, INT_MAX ),
+    CONFIG_TUNABLE( rate_limit_bytes, 0, LLONG_MAX ),
+    CONFIG_TUNABLE( rate_limit_cmds, 0, LLONG_MAX ),
+    CONFIG_TUNABLE( target_rate_limit_bytes, 0, LLONG_MAX ),
+    CONFIG_TUNABLE( target_rate_limit_cmds, 0, LLONG_MAX ),
+    CONFIG_TUNABLE( rate_limit_burst, RATELIMIT_BURST_MIN, LLONG_MAX ),
+    CONFIG_TUNABLE( slowlog_log_slower_than, 0, LLONG_MAX ),
+    CONFIG_TUNABLE( slowlog_max_len, 0, LLONG_MAX ),
+    { NULL, 0, 0, 0, 0 }
+};
+
+static sds req_arg(struct msg *req, uint32_t idx)
+{
+    struct keypos *kp = array_get(req->keys, idx);
+    return sdsnewlen(kp->start, (size_t)(kp->end - kp->start));
+}
+
+static long long config_tunable_get(rmt_tunables *tunables, config_tunable *ct)
+{
+    char *p = (char *)tunables + ct->offset;
+
+    if (ct->size == sizeof(long long)) {
+        return *(long long *)p;
+    }
+    return *(int *)p;
+}
+
+static void config_tunable_set(rmt_tunables *tunables, config_tunable *ct, 
+    long long value)
+{
+    char *p = (char *)tunables + ct->offset;
+
+    if (ct->size == sizeof(long long)) {
+        *(long long *)p = value;
+    } else {
+        *(int *)p = (int)value;
+    }
+}
+
+/* CONFIG GET pattern | CONFIG SET parameter value */
+static sds config_command(rmtContext *ctx, struct msg *req)
+{
+    config_tunable *ct;
+    rmt_tunables tunables;
+    sds subcmd, name, arg, reply;
+    long long value;
+    int matches;
+    char buf[32];
+    int len;
+
+    if (array_n(req->keys) < 2) {
+        return sdsnew("-ERR wrong number of arguments for 'config' command\r\n");
+    }
+
+    subcmd = req_arg(req, 0);
+    name = req_arg(req, 1);
+    reply = NULL;
+
+    if (!strcasecmp(subcmd, "get") && array_n(req->keys) == 2) {
+        arg = sdsempty();
+        matches = 0;
+        for (ct = config_tunables; ct->name != NULL; ct++) {
+            if (!stringmatch(name, ct->name, 1)) {
+                continue;
+            }
+            len = rmt_scnprintf(buf, sizeof(buf), "%lld", 
+                config_tunable_get(&ctx->tunables, ct));
+            arg = sdscatprintf(arg, "$%zu\r\n%s\r\n$%d\r\n%s\r\n", 
+                strlen(ct->name), ct->name, len, buf);
+            matches++;
+        }
+        reply = sdscatprintf(sdsempty(), "*%d\r\n", matches*2);
+        reply = sdscatsds(reply, arg);
+        sdsfree(arg);
+    } else if (!strcasecmp(subcmd, "set") && array_n(req->keys) == 3) {
+        arg = req_arg(req, 2);
+        for (ct = config_tunables; ct->name != NULL; ct++) {
+            if (!strcasecmp(name, ct->name)) {
+                break;
+            }
+        }
+
+        if (ct->name == NULL) {
+            reply = sdscatprintf(sdsempty(), 
+                "-ERR Unsupported CONFIG parameter: %s\r\n", name);
+        } else if (!sdsIsNum(arg) || 
+            (value = rmt_atoll(arg, sdslen(arg))) < ct->min || 
+            value > ct->max) {
+            reply = sdscatprintf(sdsempty(), 
+                "-ERR Invalid argument '%s' for CONFIG SET '%s', "
+                "it must be between %lld and %lld\r\n", 
+                arg, ct->name, ct->min, ct->max);
+        } else {
+            tunables = ctx->tunables;
+            config_tunable_set(&tunables, ct, value);
+            set_tunables(ctx, &tunables);
+            log_notice("CONFIG SET %s %lld", ct->name, value);
+            reply = sdsnew("+OK\r\n");
+        }
+        sdsfree(arg);
+    } else {
+        reply = sdsnew(ERROR_RESPONSE_SYNTAX);
+    }
+
+    sdsfree(subcmd);
+    sdsfree(name);
+
+    return reply;
+}
+
+/* MIGRATE PAUSE|RESUME */
+static sds migrate_command(rmtContext *ctx, struct msg *req)
+{
+    rmt_tunables tunables;
+    sds subcmd;
+    int pause;
+
+    if (array_n(req->keys) != 1) {
+        return sdsnew("-ERR wrong number of arguments for 'migrate' command\r\n");
+    }
+
+    subcmd = req_arg(req, 0);
+    if (!strcasecmp(subcmd, "pause")) {
+        pause = 1;
+    } else if (!strcasecmp(subcmd, "resume")) {
+        pause = 0;
+    } else {
+        sdsfree(subcmd);
+        return sdsnew(ERROR_RESPONSE_SYNTAX);
+    }
+    sdsfree(subcmd);
+
+    if (ctx->tunables.paused != pause) {
+        tunables = ctx->tunables;
+        tunables.paused = pause;
+        set_tunables(ctx, &tunables);
+        log_notice("Migrate %s", pause ? "paused" : "resumed");
+    }
+
+    return sdsnew("+OK\r\n");
+}
+
+/* SLOWLOG GET [count] | SLOWLOG LEN | SLOWLOG RESET */
+static sds slowlog_command(rmtContext *ctx, struct msg *req)
+{
+    slowlog *sl = &ctx->slowlog;
+    slowlog_entry *se;
+    listNode *lnode;
+    sds subcmd, arg, reply;
+    long long count = 10, n;
+
+    if (array_n(req->keys) < 1) {
+        return sdsnew("-ERR wrong number of arguments for 'slowlog' command\r\n");
+    }
+
+    subcmd = req_arg(req, 0);
+
+    if (!strcasecmp(subcmd, "get") && array_n(req->keys) <= 2) {
+        if (array_n(req->keys) == 2) {
+            arg = req_arg(req, 1);
+            if (!sdsIsNum(arg)) {
+                sdsfree(arg);
+                sdsfree(subcmd);
+                return sdsnew("-ERR value is not an integer or out of range\r\n");
+            }
+            count = rmt_atoll(arg, sdslen(arg));
+            sdsfree(arg);
+        }
+
+        arg = sdsempty();
+        n = 0;
+        pthread_mutex_lock(&sl->lock);
+        for (lnode = listFirst(sl->entries); lnode != NULL && n < count; 
+            lnode = listNextNode(lnode), n++) {
+            se = listNodeValue(lnode);
+            arg = sdscatprintf(arg, 
+                "*5\r\n:%lld\r\n:%lld\r\n:%lld\r\n"
+                "*2\r\n$%zu\r\n%s\r\n$%zu\r\n",
+                se->id, se->time, se->duration, 
+                sdslen(se->command), se->command, sdslen(se->key));
+            arg = sdscatlen(arg, se->key, sdslen(se->key));
+            arg = sdscatprintf(arg, "\r\n$%zu\r\n%s\r\n", 
+                sdslen(se->node), se->node);
+        }
+        pthread_mutex_unlock(&sl->lock);
+        reply = sdscatprintf(sdsempty(), "*%lld\r\n", n);
+        reply = sdscatsds(reply, arg);
+        sdsfree(arg);
+    } else if (!strcasecmp(subcmd, "len") && array_n(req->keys) == 1) {
+        pthread_mutex_lock(&sl->lock);
+        n = (long long)listLength(sl->entries);
+        pthread_mutex_unlock(&sl->lock);
+        reply = sdscatprintf(sdsempty(), ":%lld\r\n", n);
+    } else if (!strcasecmp(subcmd, "reset") && array_n(req->keys) == 1) {
+        slowlog_reset(sl);
+        reply = sdsnew("+OK\r\n");
+    } else {
+        reply = sdsnew(ERROR_RESPONSE_SYNTAX);
+    }
+
+    sdsfree(subcmd);
+
+    return reply;
+}
+
 static int
 req_make_reply(rmtContext *ctx, rmt_connect *conn, struct msg *req)
 {
@@ -460,6 +1446,27 @@ req_make_reply(rmtContext *ctx, rmt_connect *conn, struct msg *req)
         return RMT_OK;
         break;
     }
+    case MSG_REQ_REDIS_CONFIG:
+    {
+        str = config_command(ctx, req);
+        ret = msg_append(msg, (uint8_t *)str, sdslen(str));
+        sdsfree(str);
+        break;
+    }
+    case MSG_REQ_REDIS_MIGRATE:
+    {
+        str = migrate_command(ctx, req);
+        ret = msg_append(msg, (uint8_t *)str, sdslen(str));
+        sdsfree(str);
+        break;
+    }
+    case MSG_REQ_REDIS_SLOWLOG:
+    {
+        str = slowlog_command(ctx, req);
+        ret = msg_append(msg, (uint8_t *)str, sdslen(str));
+        sdsfree(str);
+        break;
+    }
     case MSG_REQ_REDIS_COMMAND:
     {
         str = sdsnew("-ERR this is redis-migrate-tool, not support 'COMMAND'.\r\n");
@@ -591,6 +1598,7 @@ _conn_get(void)
     listInit(&conn->omsg_q);
     conn->rmsg = NULL;
     conn->smsg_node = NULL;
+    conn->http_req = NULL;
 
     conn->send_bytes = 0;
     conn->recv_bytes = 0;
@@ -606,6 +1614,7 @@ _conn_get(void)
     conn->connected = 0;
     conn->eof = 0;
     conn->done = 0;
+    conn->http = 0;
 
     return conn;
 }
@@ -1214,6 +2223,123 @@ conn_recv_chain(rmtContext *ctx, rmt_connect *conn, struct msg *msg)
     return RMT_OK;
 }
 
+/* A client sends "GET /" first to scrape the metrics with http. */
+static int
+http_detect(rmt_connect *conn)
+{
+    char buf[5];
+    ssize_t n;
+
+    n = recv(conn->sd, buf, sizeof(buf), MSG_PEEK);
+
+    return n == (ssize_t)sizeof(buf) && memcmp(buf, "GET /", sizeof(buf)) == 0;
+}
+
+static int
+http_reply(rmtContext *ctx, rmt_connect *conn)
+{
+    int ret;
+    struct msg *req, *rsp;
+    sds body, str;
+    char *path;
+    size_t len;
+
+    path = conn->http_req + 4;
+    len = strcspn(path, "? \r\n");
+    if (len == rmt_strlen(HTTP_METRICS_PATH) && 
+        !memcmp(path, HTTP_METRICS_PATH, len)) {
+        body = gen_migrate_metrics_string(ctx);
+        str = sdscatprintf(sdsempty(), "HTTP/1.1 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n",
+            HTTP_METRICS_CONTENT_TYPE, sdslen(body));
+        str = sdscatsds(str, body);
+        sdsfree(body);
+    } else {
+        str = sdsnew("HTTP/1.1 404 Not Found\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n");
+    }
+
+    req = req_get(conn);
+    if (req == NULL) {
+        sdsfree(str);
+        return RMT_ENOMEM;
+    }
+
+    rsp = msg_get(ctx->mb, 0, REDIS_DATA_TYPE_CMD);
+    if (rsp == NULL) {
+        sdsfree(str);
+        req_put(req);
+        return RMT_ENOMEM;
+    }
+
+    req->peer = rsp;
+    rsp->peer = req;
+
+    ret = msg_append_full(rsp, (uint8_t *)str, (uint32_t)sdslen(str));
+    sdsfree(str);
+    if (ret != RMT_OK) {
+        req_put(req);
+        return ret;
+    }
+
+    listAddNodeTail(&conn->omsg_q, req);
+
+    ret = aeCreateFileEvent(ctx->loop, conn->sd, AE_WRITABLE, conn->send, conn);
+    if (ret != AE_OK) {
+        return RMT_ERROR;
+    }
+    conn->send_active = 1;
+
+    return RMT_OK;
+}
+
+/*
+ * Read the http request header and reply it. The data after the header is 
+ * dropped, the connection is closed after the reply sent.
+ */
+static void
+http_recv(rmtContext *ctx, rmt_connect *conn)
+{
+    char buf[1024];
+    ssize_t n;
+
+    while (conn->recv_ready) {
+        n = conn_recv(conn, buf, sizeof(buf));
+        if (n <= 0) {
+            return;
+        }
+
+        if (conn->http_req == NULL) {
+            continue;
+        }
+
+        conn->http_req = sdscatlen(conn->http_req, buf, (size_t)n);
+        if (sdslen(conn->http_req) > HTTP_REQUEST_MAX_LEN) {
+            log_warn("http request from %s is too long", 
+                rmt_unresolve_peer_desc(conn->sd));
+            conn->err = EINVAL;
+            return;
+        }
+
+        if (strstr(conn->http_req, "\r\n\r\n") == NULL) {
+            continue;
+        }
+
+        if (http_reply(ctx, conn) != RMT_OK) {
+            log_error("ERROR: generate http response to client %s failed.", 
+                rmt_unresolve_peer_desc(conn->sd));
+            conn->err = errno ? errno : ENOMEM;
+            return;
+        }
+
+        sdsfree(conn->http_req);
+        conn->http_req = NULL;
+    }
+}
+
 void
 client_recv(aeEventLoop *el, int fd, void *privdata, int mask)
 {
@@ -1230,6 +2356,18 @@ client_recv(aeEventLoop *el, int fd, void *privdata, int mask)
     ASSERT(conn->recv_active);
 
     conn->recv_ready = 1;
+
+    if (!conn->http && conn->recv_bytes == 0 && conn->rmsg == NULL && 
+        http_detect(conn)) {
+        conn->http = 1;
+        conn->http_req = sdsempty();
+    }
+
+    if (conn->http) {
+        http_recv(ctx, conn);
+        goto done;
+    }
+
     do {
         msg = conn->recv_next(ctx, conn, 1);
         if (msg == NULL) {
@@ -1601,6 +2739,11 @@ rsp_send_done(rmtContext *ctx, rmt_connect *conn, struct msg *msg)
     listDelNode(&conn->omsg_q, lnode);
 
     req_put(pmsg);
+
+    if (conn->http && listLength(&conn->omsg_q) == 0) {
+        /* close the http client after the reply */
+        conn->eof = 1;
+    }
 }
 
 void
@@ -1654,6 +2797,11 @@ client_close(rmtContext *ctx, rmt_connect *conn)
     }
     conn->sd = -1;
 
+    if (conn->http_req != NULL) {
+        sdsfree(conn->http_req);
+        conn->http_req = NULL;
+    }
+
     conn_put(conn);
 
     ASSERT(ctx->ncurr_cconn > 0);
@@ -58,6 +58,7 @@ typedef struct rmt_connect {
     list               omsg_q;        /* outstanding request Q */
     struct msg         *rmsg;         /* current message being rcvd */
     struct listNode    *smsg_node;    /* current message listNode being sent in the connect-> omsg_q list */
+    sds                http_req;      /* http request header received so far */
 
     unsigned           client:1;       /* proxy or client? */
 
@@ -70,6 +71,7 @@ typedef struct rmt_connect {
     unsigned           connected:1;   /* connected? */
     unsigned           eof:1;         /* eof? aka passive close? */
     unsigned           done:1;        /* done? aka close? */
+    unsigned           http:1;        /* http client scraping the metrics? */
 } rmt_connect;
 
 rmt_connect *conn_get(void *owner, int client);
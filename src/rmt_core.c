@@ -4,10 +4,18 @@
 #include <time.h>
 #include <signal.h>
 
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
 static void recv_data_from_target(aeEventLoop *el, int fd, void *privdata, int mask);
 static void send_data_to_target(aeEventLoop *el, int fd, void *privdata, int mask);
 static int readThreadCron(struct aeEventLoop *eventLoop, long long id, void *clientData);
 static int writeThreadCron(struct aeEventLoop *eventLoop, long long id, void *clientData);
+static void apply_request(aeEventLoop *el, int fd, void *privdata, int mask);
+static void target_node_cron(redis_node *trnode, long long now);
+static void target_node_retry_cron(redis_node *trnode, long long now);
 
 int thread_data_init(thread_data *tdata)
 {
@@ -34,17 +42,22 @@ int thread_data_init(thread_data *tdata)
 
     tdata->cronloops = 0;
 
+    tdata->cpu = -1;
+    tdata->numa_node = -1;
+
     tdata->data = NULL;
+
+    tdata->notice_fds[0] = -1;
+    tdata->notice_fds[1] = -1;
+    tdata->noticed = 0;
+
+    rmt_memset(&tdata->tunables, 0, sizeof(tdata->tunables));
+    tdata->tunables.epoch = -1;
     
-    tdata->stat_total_msgs_recv = 0;
-    tdata->stat_total_msgs_sent = 0;
-    tdata->stat_total_net_input_bytes = 0;
-    tdata->stat_total_net_output_bytes = 0;
-    tdata->stat_rdb_received_count = 0;
-    tdata->stat_rdb_parsed_count = 0;
-    tdata->stat_aof_loaded_count = 0;
-    tdata->stat_mbufs_inqueue = 0;    
-    tdata->stat_msgs_outqueue = 0;
+    rmt_memset(&tdata->stat, 0, sizeof(tdata->stat));
+    tdata->stat_queue_latency = NULL;
+    tdata->stat_parse_latency = NULL;
+    tdata->stat_commands = NULL;
 
     return RMT_OK;
 }
@@ -81,14 +94,23 @@ void thread_data_deinit(thread_data *tdata)
 
     tdata->keys_count = 0;
     tdata->finished_keys_count = 0;
+
+    tdata->cpu = -1;
+    tdata->numa_node = -1;
     
-    tdata->stat_total_msgs_recv = 0;
-    tdata->stat_total_msgs_sent = 0;
-    tdata->stat_total_net_input_bytes = 0;
-    tdata->stat_total_net_output_bytes = 0;
-    tdata->stat_rdb_parsed_count = 0;
-    tdata->stat_mbufs_inqueue = 0;    
-    tdata->stat_msgs_outqueue = 0;
+    rmt_memset(&tdata->stat, 0, sizeof(tdata->stat));
+    if (tdata->stat_queue_latency != NULL) {
+        hist_destroy(tdata->stat_queue_latency);
+        tdata->stat_queue_latency = NULL;
+    }
+    if (tdata->stat_parse_latency != NULL) {
+        hist_destroy(tdata->stat_parse_latency);
+        tdata->stat_parse_latency = NULL;
+    }
+    if (tdata->stat_commands != NULL) {
+        rmt_free(tdata->stat_commands);
+        tdata->stat_commands = NULL;
+    }
 
     return;
 }
@@ -134,6 +156,9 @@ static void read_thread_data_deinit(thread_data *rdata)
 }
 
 static void write_thread_data_deinit(thread_data *wdata);
+static void write_thread_notice(aeEventLoop *el, int fd, void *privdata, int mask);
+
+static int thread_tunables_update(thread_data *tdata);
 
 static int write_thread_data_init(rmtContext *ctx, thread_data *wdata)
 {
@@ -149,6 +174,7 @@ static int write_thread_data_init(rmtContext *ctx, thread_data *wdata)
     thread_data_init(wdata);
 
     wdata->ctx = ctx;
+    thread_tunables_update(wdata);
 
 	wdata->loop = aeCreateEventLoop(1000);
     if (wdata->loop == NULL) {
@@ -168,6 +194,34 @@ static int write_thread_data_init(rmtContext *ctx, thread_data *wdata)
         goto error;
     }
 
+    wdata->stat_queue_latency = hist_create();
+    wdata->stat_parse_latency = hist_create();
+    if (wdata->stat_queue_latency == NULL || wdata->stat_parse_latency == NULL) {
+        log_error("ERROR: Create latency histograms failed: out of memory");
+        goto error;
+    }
+
+    wdata->stat_commands = rmt_zalloc(MSG_SENTINEL*sizeof(command_stats));
+    if (wdata->stat_commands == NULL) {
+        log_error("ERROR: Create command stats failed: out of memory");
+        goto error;
+    }
+
+    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, wdata->notice_fds) < 0 || 
+        rmt_set_nonblocking(wdata->notice_fds[0]) < 0 || 
+        rmt_set_nonblocking(wdata->notice_fds[1]) < 0) {
+        log_error("ERROR: notice_fds init for the write thread failed: %s", 
+            strerror(errno));
+        goto error;
+    }
+
+    if (aeCreateFileEvent(wdata->loop, wdata->notice_fds[1], 
+        AE_READABLE, write_thread_notice, wdata) != AE_OK) {
+        log_error("ERROR: create readable notice event for the write "
+            "thread failed: %s", strerror(errno));
+        goto error;
+    }
+
     di = dictGetSafeIterator(wdata->trgroup->nodes);
     while ((de = dictNext(di)) != NULL) {
         trnode = dictGetVal(de);
@@ -190,6 +244,15 @@ error:
 
 static void write_thread_data_deinit(thread_data *wdata)
 {
+    if (wdata->notice_fds[0] > 0) {
+        close(wdata->notice_fds[0]);
+        wdata->notice_fds[0] = -1;
+    }
+    if (wdata->notice_fds[1] > 0) {
+        close(wdata->notice_fds[1]);
+        wdata->notice_fds[1] = -1;
+    }
+
 	thread_data_deinit(wdata);
 }
 
@@ -241,6 +304,9 @@ static int write_thread_stop(thread_data *wdata)
         if (mttlist_length(srnode->cmd_data) > 0) {
             return RMT_AGAIN;
         }
+        if (srnode->msgs_inflight > 0) {
+            return RMT_AGAIN;
+        }
         ln = ln->next;
     }
 
@@ -258,6 +324,11 @@ static int write_thread_stop(thread_data *wdata)
             return RMT_AGAIN;
         }
 
+        if (listLength(srnode->retry_data) > 0) {
+            dictReleaseIterator(di);
+            return RMT_AGAIN;
+        }
+
         if (srnode->msg_rcv != NULL) {
             dictReleaseIterator(di);
             return RMT_AGAIN;
@@ -265,6 +336,13 @@ static int write_thread_stop(thread_data *wdata)
     }
     dictReleaseIterator(di);
 
+    /* all the msgs were acknowledged, save the last checkpoints */
+    ln = listFirst(wdata->nodes);
+    while (ln != NULL) {
+        redis_repl_checkpoint_save(listNodeValue(ln));
+        ln = ln->next;
+    }
+
     aeStop(wdata->loop);
 
     return RMT_OK;
@@ -320,6 +398,40 @@ void reset_finish_count_after_notice(rmtContext *ctx)
     pthread_rwlock_unlock(&ctx->rwl_notice);
 }
 
+/* Change the tunables, the threads copy them when they see a new epoch. */
+void set_tunables(rmtContext *ctx, rmt_tunables *tunables)
+{
+    pthread_rwlock_wrlock(&ctx->rwl_notice);
+    /* the threads read the epoch unlocked, so it is bumped last */
+    tunables->epoch = ctx->tunables.epoch;
+    ctx->tunables = *tunables;
+    __atomic_store_n(&ctx->tunables.epoch, tunables->epoch + 1, 
+        __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&ctx->rwl_notice);
+}
+
+/* Copy the tunables to the thread, return 1 if they were changed. The
+ * epoch is read without the lock, so a cron only takes it after a change. */
+static int thread_tunables_update(thread_data *tdata)
+{
+    rmtContext *ctx = tdata->ctx;
+    int changed = 0;
+
+    if (__atomic_load_n(&ctx->tunables.epoch, __ATOMIC_ACQUIRE) == 
+        tdata->tunables.epoch) {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&ctx->rwl_notice);
+    if (tdata->tunables.epoch != ctx->tunables.epoch) {
+        tdata->tunables = ctx->tunables;
+        changed = 1;
+    }
+    pthread_rwlock_unlock(&ctx->rwl_notice);
+
+    return changed;
+}
+
 static int readThreadCron(struct aeEventLoop *eventLoop, long long id, void *clientData)
 {
     thread_data *rdata = clientData;
@@ -328,6 +440,7 @@ static int readThreadCron(struct aeEventLoop *eventLoop, long long id, void *cli
     listNode *ln;
     redis_node *srnode;
     int flags_notice;
+    int changed;
 
     RMT_NOTUSED(eventLoop);
     RMT_NOTUSED(id);
@@ -348,6 +461,17 @@ static int readThreadCron(struct aeEventLoop *eventLoop, long long id, void *cli
     /* Update the time */
     rdata->unixtime = rmt_msec_now();
 
+    /* Stop or start reading from the source nodes for MIGRATE PAUSE|RESUME,
+     * the nodes connected while paused are stopped at the next cron. */
+    changed = thread_tunables_update(rdata);
+    if (changed || rdata->tunables.paused) {
+        ln = listFirst(rdata->nodes);
+        while (ln != NULL) {
+            redis_repl_pause(listNodeValue(ln), rdata->tunables.paused);
+            ln = ln->next;
+        }
+    }
+
     /* Check error connection */
     run_with_period(1000, rdata->cronloops, ctx->hz) {
         li = listGetIterator(rdata->nodes, AL_START_HEAD);
@@ -370,8 +494,8 @@ static int writeThreadCron(struct aeEventLoop *eventLoop, long long id, void *cl
     rmtContext *ctx = trgroup->ctx;
     dictIterator *di;
     dictEntry *de;
-    redis_node *trnode;
-    tcp_context *tc;
+    listNode *ln;
+    apply_queue *aq;
     int flags_notice;
 
     RMT_NOTUSED(eventLoop);
@@ -380,77 +504,65 @@ static int writeThreadCron(struct aeEventLoop *eventLoop, long long id, void *cl
 
     log_debug(LOG_VERB, "writeThreadCron() %lld", id);
 
-    /* handle the main thread flags */
     flags_notice = get_notice_flag(ctx);
-    if (flags_notice != RMT_NOTICE_FLAG_NULL) {
-        if (flags_notice & RMT_NOTICE_FLAG_SHUTDOWN) {
+
+    if (wdata->data != NULL) {
+        /* the apply threads stop after the write threads */
+        aq = wdata->data;
+        if (aq->stop && mttlist_empty(aq->msgs)) {
             ret = write_thread_stop(wdata);
             if (ret == RMT_OK) {
-                add_finish_count_after_notice(ctx);
                 return 1000/ctx->hz;
             }
         }
+    } else {
+        /* handle the main thread flags */
+        if (flags_notice != RMT_NOTICE_FLAG_NULL) {
+            if (flags_notice & RMT_NOTICE_FLAG_SHUTDOWN) {
+                ret = write_thread_stop(wdata);
+                if (ret == RMT_OK) {
+                    add_finish_count_after_notice(ctx);
+                    return 1000/ctx->hz;
+                }
+            }
+        }
     }
 
     /* Update the time */
     wdata->unixtime = rmt_msec_now();
 
-    run_with_period(1000, wdata->cronloops, ctx->hz) {
-        /* Check error connection */
-        di = dictGetSafeIterator(trgroup->nodes);
-        while ((de = dictNext(di)) != NULL) {
-            trnode = dictGetVal(de);
-            tc = trnode->tc;
-            if (tc->sd <= 0) {
-                if (tc->flags & RMT_RECONNECT) {
-                    ret = rmt_tcp_context_reconnect(tc);
-                } else {
-                    ret = rmt_tcp_context_connect_addr(tc, trnode->addr, 
-                        (int)rmt_strlen(trnode->addr), NULL, NULL);
-                }
-                if (ret != RMT_OK) {
-                    log_error("ERROR: connect to %s failed", trnode->addr);
-                    continue;
-                }
-
-                if (trgroup->password) {
-                    sds reply;
-                    reply = rmt_send_sync_cmd_read_line(tc->sd, "auth", trgroup->password, NULL);
-                    if (sdslen(reply) == 0 || reply[0] == '-') {
-                        log_error("ERROR: password to %s is wrong", trnode->addr);
-                        sdsfree(reply);
-                        continue;
-                    }
-                    sdsfree(reply);
-                }
-
-                if (ctx->noreply == 0) {
-                    ret = aeCreateFileEvent(wdata->loop, tc->sd, 
-                        AE_READABLE, recv_data_from_target, trnode);
-                    if (ret != AE_OK) {
-                        log_error("ERROR: send_data event create %ld failed: %s",
-                            wdata->thread_id, strerror(errno));
-                        continue;
-                    }
+    /* Parse the rdb paused by MIGRATE PAUSE again after MIGRATE RESUME */
+    if (thread_tunables_update(wdata) && !wdata->tunables.paused) {
+        ln = listFirst(wdata->nodes);
+        while (ln != NULL) {
+            source_node_resume(listNodeValue(ln));
+            ln = ln->next;
+        }
+    }
 
-                    log_debug(LOG_NOTICE, "node[%s] create read event for thread %ld", 
-                        trnode->addr, wdata->thread_id);
-                }
+    /* Follow the topology changes of the target cluster */
+    if (trgroup->kind == GROUP_TYPE_RCLUSTER) {
+        redis_cluster_refresh_cron(trgroup, wdata);
+    }
 
-                if (listLength(trnode->send_data) > 0) {
-                    ret = aeCreateFileEvent(wdata->loop, tc->sd, 
-                        AE_WRITABLE, send_data_to_target, trnode);
-                    if (ret != AE_OK) {
-                        log_error("ERROR: send_data event create %ld failed: %s",
-                            wdata->thread_id, strerror(errno));
-                        continue;
-                    }
-                }
-            }
+    run_with_period(1000, wdata->cronloops, ctx->hz) {
+        /* Save the replication checkpoints and sample the progress */
+        ln = listFirst(wdata->nodes);
+        while (ln != NULL) {
+            redis_repl_checkpoint_save(listNodeValue(ln));
+            redis_repl_progress_update(listNodeValue(ln), wdata->unixtime);
+            ln = ln->next;
         }
-        dictReleaseIterator(di);
     }
 
+    /* Connect the target nodes */
+    di = dictGetSafeIterator(trgroup->nodes);
+    while ((de = dictNext(di)) != NULL) {
+        target_node_cron(dictGetVal(de), wdata->unixtime);
+        target_node_retry_cron(dictGetVal(de), wdata->unixtime);
+    }
+    dictReleaseIterator(di);
+
     wdata->cronloops ++;
     return 1000/ctx->hz;
 }
@@ -547,6 +659,120 @@ instances_by_address_count_cmp(const void *t1, const void *t2)
     }
 }
 
+/* Estimated cost of the replication for the source node, the rdb
+ * generation, transfer and parse are all about its used memory. */
+static long long replication_cost(redis_node *rnode)
+{
+    return rnode->used_memory > 0 ? rnode->used_memory : 0;
+}
+
+static int
+replication_cost_cmp(const void *t1, const void *t2)
+{
+    redis_node * const *n1 = t1, * const *n2 = t2;
+    long long c1 = replication_cost(*n1), c2 = replication_cost(*n2);
+
+    if (c1 == c2) {
+        c1 = (*n1)->keys;
+        c2 = (*n2)->keys;
+        if (c1 == c2) {
+            return 0;
+        }
+    }
+
+    return c1 > c2 ? -1 : 1;
+}
+
+/* Plan the replication of the source nodes on the same host. The nodes
+ * are ordered longest-first and each one is put on the least loaded
+ * lane. Lanes begin replication at the same time, the nodes in a lane
+ * one after another through the redis_node->next chain. There are as
+ * many lanes as the biggest nodes that can generate rdb at one time
+ * within source_headroom, or just one lane if it is not set. */
+static int replication_schedule_host(rmtContext *ctx, list *instances)
+{
+    int i, j, k, n, lanes;
+    long long used;
+    redis_node **nodes, **tails, *rnode;
+    long long *costs;
+
+    n = (int)listLength(instances);
+    if (n == 0) {
+        return RMT_OK;
+    }
+
+    nodes = rmt_alloc((size_t)n*sizeof(*nodes));
+    tails = rmt_zalloc((size_t)n*sizeof(*tails));
+    costs = rmt_zalloc((size_t)n*sizeof(*costs));
+    if (nodes == NULL || tails == NULL || costs == NULL) {
+        log_error("ERROR: Out of memory");
+        if (nodes != NULL) rmt_free(nodes);
+        if (tails != NULL) rmt_free(tails);
+        if (costs != NULL) rmt_free(costs);
+        return RMT_ENOMEM;
+    }
+
+    i = 0;
+    while ((rnode = listPop(instances)) != NULL) {
+        nodes[i++] = rnode;
+    }
+    qsort(nodes, (size_t)n, sizeof(*nodes), replication_cost_cmp);
+
+    lanes = 1;
+    if (ctx->source_headroom > 0) {
+        used = 0;
+        for (i = 0; i < n; i ++) {
+            if (nodes[i]->used_memory < 0) {
+                /* The memory of this node is unknown, be safe. */
+                lanes = 1;
+                break;
+            }
+
+            used += nodes[i]->used_memory;
+            if (used <= ctx->source_headroom) {
+                lanes = i + 1;
+            }
+        }
+    }
+
+    for (i = 0; i < n; i ++) {
+        rnode = nodes[i];
+
+        if (i < lanes) {
+            j = i;
+        } else {
+            for (j = 0, k = 1; k < lanes; k ++) {
+                if (costs[k] < costs[j]) {
+                    j = k;
+                }
+            }
+        }
+
+        rnode->lane = j;
+        if (tails[j] == NULL) {
+            rnode->lane_order = 0;
+        } else {
+            ASSERT(tails[j]->next == NULL);
+            tails[j]->next = rnode;
+            rnode->lane_order = tails[j]->lane_order + 1;
+        }
+        tails[j] = rnode;
+        costs[j] += replication_cost(rnode);
+
+        listAddNodeTail(instances, rnode);
+
+        log_notice("Schedule node[%s] (used_memory: %lld, keys: %lld) "
+            "on lane %d order %d", rnode->addr, rnode->used_memory, 
+            rnode->keys, rnode->lane, rnode->lane_order);
+    }
+
+    rmt_free(nodes);
+    rmt_free(tails);
+    rmt_free(costs);
+
+    return RMT_OK;
+}
+
 static int read_write_threads_create(rmtContext *ctx, 
     dict *nodes, 
     int read_thread_count, 
@@ -562,7 +788,7 @@ static int read_write_threads_create(rmtContext *ctx,
     list *instances;
     thread_data *rdata, *rdata_min_rnodes;
     thread_data *wdata, *wdata_min_rnodes;
-    redis_node *srnode, *rnode, *pre_node;
+    redis_node *srnode, *rnode;
     dictIterator *di = NULL;
     dictEntry *de;
     listNode *lnode;
@@ -589,6 +815,11 @@ static int read_write_threads_create(rmtContext *ctx,
     while ((de = dictNext(di)) != NULL) {
         found = 0;
         srnode = dictGetVal(de);
+        if (redis_node_info_cost(srnode) != RMT_OK) {
+            log_warn("WARNING: Get the cost of node[%s] failed, "
+                "it is scheduled as the smallest one", srnode->addr);
+        }
+
         for (i = 0; i < array_n(&instances_by_host); i ++) {
             instances = array_get(&instances_by_host, i);
             rnode = listFirstValue(instances);
@@ -612,6 +843,14 @@ static int read_write_threads_create(rmtContext *ctx,
 
     array_sort(&instances_by_host, instances_by_address_count_cmp);
 
+    for (i = 0; i < array_n(&instances_by_host); i ++) {
+        instances = array_get(&instances_by_host, i);
+        ret = replication_schedule_host(ctx, instances);
+        if (ret != RMT_OK) {
+            goto error;
+        }
+    }
+
     if (array_n(&instances_by_host) <= read_thread_count) {
         ret = array_init(read_threads,array_n(&instances_by_host),sizeof(thread_data));
         if (ret != RMT_OK) {
@@ -663,20 +902,12 @@ static int read_write_threads_create(rmtContext *ctx,
             wdata->id = i;
 
             wdata->nodes_count = listLength(instances);
-            pre_node = NULL;
             lnode = instances->head;
             while (lnode) {
                 rnode = lnode->value;
                 lnode = lnode->next;
                 listAddNodeTail(wdata->nodes, rnode);
                 rnode->write_data = wdata;
-                
-                if (pre_node) {
-                    ASSERT(pre_node->next == NULL);
-                    pre_node->next = rnode;
-                }
-
-                pre_node = rnode;
 
                 ret = aeCreateFileEvent(wdata->loop, rnode->sockpairfds[1], 
                     AE_READABLE, parse_prepare, rnode);
@@ -761,20 +992,12 @@ static int read_write_threads_create(rmtContext *ctx,
                 wdata->id = i;
 
                 wdata->nodes_count = listLength(instances);
-                pre_node = NULL;
                 lnode = instances->head;
                 while (lnode) {
                     rnode = lnode->value;
                     lnode = lnode->next;
                     listAddNodeTail(wdata->nodes, rnode);
                     rnode->write_data = wdata;
-                    
-                    if (pre_node) {
-                        ASSERT(pre_node->next == NULL);
-                        pre_node->next = rnode;
-                    }
-
-                    pre_node = rnode;
                     ret = aeCreateFileEvent(wdata->loop, rnode->sockpairfds[1], 
                         AE_READABLE, parse_prepare, rnode);
                     if (ret != AE_OK) {
@@ -801,20 +1024,12 @@ static int read_write_threads_create(rmtContext *ctx,
                 }
 
                 wdata_min_rnodes->nodes_count += listLength(instances);
-                pre_node = listLastValue(wdata_min_rnodes->nodes);
                 lnode = instances->head;
                 while (lnode) {
                     rnode = lnode->value;
                     lnode = lnode->next;
                     listAddNodeTail(wdata_min_rnodes->nodes, rnode);
                     rnode->write_data = wdata_min_rnodes;
-
-                    if (pre_node) {
-                        ASSERT(pre_node->next == NULL);
-                        pre_node->next = rnode;
-                    }
-
-                    pre_node = rnode;
                     ret = aeCreateFileEvent(wdata_min_rnodes->loop, 
                         rnode->sockpairfds[1], 
                         AE_READABLE, parse_prepare, rnode);
@@ -1107,103 +1322,495 @@ static void write_threads_destroy(struct array *write_datas)
     array_destroy(write_datas);
 }
 
-static void *read_thread_run_old(void *args)
+static redis_node *group_node_by_addr(redis_group *rgroup, const char *addr)
 {
-    thread_data *rdata = args;
-    list *nodes = rdata->nodes;  //type : source redis_node
-    redis_node *srnode;
-    listNode *lnode;
-    listIter *it;
+    dictIterator *di;
+    dictEntry *de;
+    redis_node *rnode;
 
-    it = listGetIterator(nodes, AL_START_HEAD);
-    while((lnode = listNext(it)) != NULL)
-    {
-    	srnode = listNodeValue(lnode);
-        rmtConnectRedisMaster(srnode);
+    di = dictGetIterator(rgroup->nodes);
+    while ((de = dictNext(di)) != NULL) {
+        rnode = dictGetVal(de);
+        if (!strcmp(rnode->addr, addr)) {
+            dictReleaseIterator(di);
+            return rnode;
+        }
     }
-    
-    listReleaseIterator(it);
-
-    aeMain(rdata->loop);
+    dictReleaseIterator(di);
 
-    return 0;
+    return NULL;
 }
 
-static void begin_load_aof_file(aeEventLoop *el, int fd, void *privdata, int mask)
+static void apply_threads_destroy(struct array *apply_datas)
 {
-    char c[1];
-    redis_node *srnode = privdata;
-    thread_data *rdata = srnode->read_data;
-    
-    RMT_NOTUSED(el);
-    RMT_NOTUSED(fd);
-    RMT_NOTUSED(privdata);
-    RMT_NOTUSED(mask);
-
-    ASSERT(rdata->loop == el);
-    ASSERT(srnode->sockpairfds[0] == fd);
+    thread_data *adata;
+    apply_queue *aq;
+    struct msg *msg;
 
-    rmt_read(srnode->sockpairfds[0], c , 1);
-    ASSERT(c[0] == ' ');
+    if (apply_datas == NULL) {
+        return;
+    }
 
-    aeDeleteFileEvent(el, fd, mask);
-    
-    redis_load_aof_file(srnode, srnode->addr);
-}
+    while (array_n(apply_datas) > 0) {
+        adata = array_pop(apply_datas);
+        aq = adata->data;
+        if (aq != NULL) {
+            if (aq->msgs != NULL) {
+                while ((msg = mttlist_pop(aq->msgs)) != NULL) {
+                    msg->ack_lost = 1;
+                    msg_put(msg);
+                    msg_free(msg);
+                }
+                mttlist_destroy(aq->msgs);
+            }
 
-static void begin_replication(aeEventLoop *el, int fd, void *privdata, int mask)
-{
-    char c[1];
-    redis_node *srnode = privdata;
-    thread_data *rdata = srnode->read_data;
-    
-    RMT_NOTUSED(el);
-    RMT_NOTUSED(fd);
-    RMT_NOTUSED(privdata);
-    RMT_NOTUSED(mask);
+            if (aq->sockpairfds[0] > 0) {
+                close(aq->sockpairfds[0]);
+            }
+            if (aq->sockpairfds[1] > 0) {
+                close(aq->sockpairfds[1]);
+            }
 
-    ASSERT(rdata->loop == el);
-    ASSERT(srnode->sockpairfds[0] == fd);
+            rmt_free(aq);
+            adata->data = NULL;
+        }
 
-    rmt_read(srnode->sockpairfds[0], c , 1);
-    ASSERT(c[0] == ' ');
+        write_thread_data_deinit(adata);
+    }
 
-    aeDeleteFileEvent(el, fd, mask);
-    
-    rmtConnectRedisMaster(srnode);
+    array_destroy(apply_datas);
 }
 
-static void *read_thread_run(void *args)
+/*
+ * Create the apply threads that send the msgs parsed by the write threads, 
+ * partitioned by key. Every apply thread has its own connections to the 
+ * target group, so the msgs of a key are always sent in order on the 
+ * same connection.
+ */
+static struct array *apply_threads_create(rmtContext *ctx, 
+    struct array *write_datas)
 {
     int ret;
-    thread_data *rdata = args;
-    rmtContext *ctx = rdata->ctx;
-    list *nodes = rdata->nodes;  //type : source redis_node
-    redis_node *srnode;
-    listNode *lnode;
-    listIter *it;
+    uint32_t i, j;
+    struct array *apply_datas; //type : thread_data
+    thread_data *adata, *wdata;
+    apply_queue *aq;
+    dictIterator *di;
+    dictEntry *de;
+    redis_node *trnode;
 
-    it = listGetIterator(nodes, AL_START_HEAD);
-    while((lnode = listNext(it)) != NULL){
-    	srnode = listNodeValue(lnode);
+    apply_datas = array_create((uint32_t)ctx->apply_threads, 
+        sizeof(thread_data));
+    if (apply_datas == NULL) {
+        log_error("ERROR: Out of memory");
+        return NULL;
+    }
 
-        if (ctx->source_type == GROUP_TYPE_AOFFILE) {
-            ret = aeCreateFileEvent(rdata->loop, srnode->sockpairfds[0], 
-                    AE_READABLE, begin_load_aof_file, srnode);
-            if(ret != AE_OK)
-            {
-                log_error("ERROR: Create readable notice event for node[%s] fd %d "
-                    "to begin load aof file on the read thread %ld failed: %s",
-                    srnode->addr, srnode->sockpairfds[0],
-                    rdata->thread_id, strerror(errno));
-                listReleaseIterator(it);
-                exit(0);
-            }
-        } else {
-            ret = aeCreateFileEvent(rdata->loop, srnode->sockpairfds[0], 
-                    AE_READABLE, begin_replication, srnode);
-            if(ret != AE_OK)
-            {
+    for (i = 0; i < (uint32_t)ctx->apply_threads; i ++) {
+        adata = array_push(apply_datas);
+        ret = write_thread_data_init(ctx, adata);
+        if (ret != RMT_OK) {
+            goto error;
+        }
+
+        adata->id = (int)i;
+
+        aq = rmt_alloc(sizeof(*aq));
+        if (aq == NULL) {
+            log_error("ERROR: Out of memory");
+            goto error;
+        }
+
+        aq->msgs = NULL;
+        aq->sockpairfds[0] = -1;
+        aq->sockpairfds[1] = -1;
+        aq->noticed = 0;
+        aq->stop = 0;
+        adata->data = aq;
+
+        aq->msgs = mttlist_create();
+        if (aq->msgs == NULL || mttlist_init_with_locklist(aq->msgs) != RMT_OK) {
+            log_error("ERROR: Create msgs list for the apply thread failed");
+            goto error;
+        }
+
+        if (socketpair(AF_LOCAL, SOCK_STREAM, 0, aq->sockpairfds) < 0 || 
+            rmt_set_nonblocking(aq->sockpairfds[0]) < 0 || 
+            rmt_set_nonblocking(aq->sockpairfds[1]) < 0) {
+            log_error("ERROR: sockpairfds init for the apply thread failed: %s", 
+                strerror(errno));
+            goto error;
+        }
+
+        ret = aeCreateFileEvent(adata->loop, aq->sockpairfds[1], 
+            AE_READABLE, apply_request, adata);
+        if (ret != AE_OK) {
+            log_error("ERROR: create readable notice event for the apply "
+                "thread %d failed: %s", adata->id, strerror(errno));
+            goto error;
+        }
+    }
+
+    /* Map the target nodes of every write thread to the same ones of 
+     * the apply threads. */
+    for (i = 0; i < array_n(write_datas); i ++) {
+        wdata = array_get(write_datas, i);
+        di = dictGetIterator(wdata->trgroup->nodes);
+        while ((de = dictNext(di)) != NULL) {
+            trnode = dictGetVal(de);
+            trnode->apply_nodes = rmt_alloc(array_n(apply_datas)*sizeof(redis_node *));
+            if (trnode->apply_nodes == NULL) {
+                log_error("ERROR: Out of memory");
+                dictReleaseIterator(di);
+                goto error;
+            }
+
+            for (j = 0; j < array_n(apply_datas); j ++) {
+                adata = array_get(apply_datas, j);
+                trnode->apply_nodes[j] = group_node_by_addr(adata->trgroup, 
+                    trnode->addr);
+                if (trnode->apply_nodes[j] == NULL) {
+                    log_error("ERROR: Target node[%s] is not in the apply thread %d", 
+                        trnode->addr, adata->id);
+                    dictReleaseIterator(di);
+                    goto error;
+                }
+            }
+        }
+        dictReleaseIterator(di);
+    }
+
+    return apply_datas;
+
+error:
+
+    apply_threads_destroy(apply_datas);
+    return NULL;
+}
+
+#ifdef HAVE_SCHED_SETAFFINITY
+#define CPU_TOPOLOGY_MAX_NODES  64
+
+/* The cpus the threads can be pinned on, grouped by NUMA node. */
+typedef struct cpu_topology {
+    int nnodes;
+    int node[CPU_TOPOLOGY_MAX_NODES];   /* NUMA node id, -1 if unknown */
+    int first[CPU_TOPOLOGY_MAX_NODES];  /* index of the first cpu of the node in cpus */
+    int ncpus[CPU_TOPOLOGY_MAX_NODES];
+    int used[CPU_TOPOLOGY_MAX_NODES];   /* cpus of the node given to the threads */
+    int cpus[CPU_SETSIZE];
+}cpu_topology;
+
+static void cpu_topology_add(cpu_topology *topo, int node, cpu_set_t *cpus, 
+    int *ncpus)
+{
+    int cpu, n = topo->nnodes;
+
+    topo->node[n] = node;
+    topo->first[n] = *ncpus;
+    topo->ncpus[n] = 0;
+    topo->used[n] = 0;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu ++) {
+        if (CPU_ISSET((size_t)cpu, cpus)) {
+            topo->cpus[(*ncpus) ++] = cpu;
+            topo->ncpus[n] ++;
+        }
+    }
+    topo->nnodes ++;
+}
+
+/* Load the allowed cpus of the process (of ctx->cpu_list if set) and 
+ * their NUMA nodes from sysfs. */
+static int cpu_topology_load(rmtContext *ctx, cpu_topology *topo)
+{
+    cpu_set_t allowed, cpus;
+    char path[64], buf[4096];
+    FILE *fp;
+    int node, ncpus = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        log_error("ERROR: get the cpu affinity failed: %s", strerror(errno));
+        return RMT_ERROR;
+    }
+
+    if (ctx->cpu_list != NULL) {
+        rmt_cpu_list_parse(ctx->cpu_list, &cpus);
+        CPU_AND(&allowed, &allowed, &cpus);
+        if (CPU_COUNT(&allowed) == 0) {
+            log_error("ERROR: none of the cpus %s is allowed for the process", 
+                ctx->cpu_list);
+            return RMT_ERROR;
+        }
+    }
+
+    topo->nnodes = 0;
+    for (node = 0; node < CPU_TOPOLOGY_MAX_NODES - 1; node ++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        if (fgets(buf, sizeof(buf), fp) == NULL || 
+            rmt_cpu_list_parse(buf, &cpus) != RMT_OK) {
+            fclose(fp);
+            continue;
+        }
+        fclose(fp);
+
+        CPU_AND(&cpus, &cpus, &allowed);
+        if (CPU_COUNT(&cpus) == 0) {
+            continue;
+        }
+        cpu_topology_add(topo, node, &cpus, &ncpus);
+        CPU_XOR(&allowed, &allowed, &cpus);
+    }
+
+    /* The cpus not found in sysfs */
+    if (CPU_COUNT(&allowed) > 0) {
+        cpu_topology_add(topo, -1, &allowed, &ncpus);
+    }
+
+    return RMT_OK;
+}
+
+/* The node to put need threads on, seq is the order of the threads. */
+static int cpu_topology_pick(cpu_topology *topo, int policy, int seq, int need)
+{
+    int n;
+
+    if (policy == CPU_PLACEMENT_SCATTER) {
+        return seq%topo->nnodes;
+    }
+
+    for (n = 0; n < topo->nnodes; n ++) {
+        if (topo->ncpus[n] - topo->used[n] >= need) {
+            return n;
+        }
+    }
+
+    /* All the cpus are given, share them again from the first node */
+    for (n = 0; n < topo->nnodes; n ++) {
+        topo->used[n] = 0;
+    }
+    for (n = 0; n < topo->nnodes; n ++) {
+        if (topo->ncpus[n] >= need) {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+static void cpu_topology_assign(cpu_topology *topo, int n, thread_data *tdata)
+{
+    tdata->cpu = topo->cpus[topo->first[n] + topo->used[n]%topo->ncpus[n]];
+    tdata->numa_node = topo->node[n];
+    topo->used[n] ++;
+}
+#endif
+
+/*
+ * Give every thread a cpu as ctx->cpu_placement says. The threads pin 
+ * themselves when they start. The write thread and the read thread of 
+ * the same source nodes are put on one NUMA node, so the mbufs passed 
+ * between them stay in the memory of that node.
+ */
+static void threads_place(rmtContext *ctx, struct array *read_datas, 
+    struct array *write_datas, struct array *apply_datas)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_topology topo;
+    uint32_t i;
+    int n, seq = 0;
+    thread_data *rdata, *wdata, *adata;
+    redis_node *srnode;
+
+    if (ctx->cpu_placement == CPU_PLACEMENT_NONE) {
+        return;
+    }
+
+    if (cpu_topology_load(ctx, &topo) != RMT_OK) {
+        log_warn("The threads are not pinned to the cpus");
+        return;
+    }
+
+    for (i = 0; write_datas != NULL && i < array_n(write_datas); i ++) {
+        wdata = array_get(write_datas, i);
+        srnode = listFirstValue(wdata->nodes);
+        rdata = srnode != NULL ? srnode->read_data : NULL;
+        if (rdata != NULL && rdata->cpu >= 0) {
+            rdata = NULL;
+        }
+
+        n = cpu_topology_pick(&topo, ctx->cpu_placement, seq ++, 
+            rdata != NULL ? 2 : 1);
+        cpu_topology_assign(&topo, n, wdata);
+        if (rdata != NULL) {
+            cpu_topology_assign(&topo, n, rdata);
+        }
+    }
+
+    for (i = 0; read_datas != NULL && i < array_n(read_datas); i ++) {
+        rdata = array_get(read_datas, i);
+        if (rdata->cpu < 0) {
+            n = cpu_topology_pick(&topo, ctx->cpu_placement, seq ++, 1);
+            cpu_topology_assign(&topo, n, rdata);
+        }
+    }
+
+    for (i = 0; apply_datas != NULL && i < array_n(apply_datas); i ++) {
+        adata = array_get(apply_datas, i);
+        n = cpu_topology_pick(&topo, ctx->cpu_placement, seq ++, 1);
+        cpu_topology_assign(&topo, n, adata);
+    }
+#else
+    if (ctx->cpu_placement != CPU_PLACEMENT_NONE) {
+        log_warn("cpu_placement is not supported on this platform, "
+            "the threads are not pinned to the cpus");
+    }
+#endif
+}
+
+/* Pin the calling thread to the cpu given by threads_place(), and 
+ * prefer its NUMA node for the memory it allocates from now on. */
+static void thread_data_bind(thread_data *tdata, const char *role)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+    cpu_set_t cpus;
+    unsigned long nodemask;
+    int ret;
+
+    if (tdata->cpu < 0) {
+        return;
+    }
+
+    CPU_ZERO(&cpus);
+    CPU_SET((size_t)tdata->cpu, &cpus);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret != 0) {
+        log_warn("Pin the %s thread %d to cpu %d failed: %s", 
+            role, tdata->id, tdata->cpu, strerror(ret));
+        return;
+    }
+
+    if (tdata->numa_node >= 0 && 
+        tdata->numa_node < (int)(sizeof(nodemask)*8)) {
+        nodemask = 1UL << tdata->numa_node;
+        if (syscall(__NR_set_mempolicy, MPOL_PREFERRED, &nodemask, 
+                sizeof(nodemask)*8) < 0) {
+            log_warn("Set the memory policy of the %s thread %d to NUMA "
+                "node %d failed: %s", role, tdata->id, tdata->numa_node, 
+                strerror(errno));
+        }
+    }
+
+    log_notice("The %s thread %d is pinned to cpu %d (NUMA node %d)", 
+        role, tdata->id, tdata->cpu, tdata->numa_node);
+#else
+    RMT_NOTUSED(tdata);
+    RMT_NOTUSED(role);
+#endif
+}
+
+static void *read_thread_run_old(void *args)
+{
+    thread_data *rdata = args;
+    list *nodes = rdata->nodes;  //type : source redis_node
+    redis_node *srnode;
+    listNode *lnode;
+    listIter *it;
+
+    it = listGetIterator(nodes, AL_START_HEAD);
+    while((lnode = listNext(it)) != NULL)
+    {
+    	srnode = listNodeValue(lnode);
+        rmtConnectRedisMaster(srnode);
+    }
+    
+    listReleaseIterator(it);
+
+    aeMain(rdata->loop);
+
+    return 0;
+}
+
+static void begin_load_aof_file(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    char c[1];
+    redis_node *srnode = privdata;
+    thread_data *rdata = srnode->read_data;
+    
+    RMT_NOTUSED(el);
+    RMT_NOTUSED(fd);
+    RMT_NOTUSED(privdata);
+    RMT_NOTUSED(mask);
+
+    ASSERT(rdata->loop == el);
+    ASSERT(srnode->sockpairfds[0] == fd);
+
+    rmt_read(srnode->sockpairfds[0], c , 1);
+    ASSERT(c[0] == ' ');
+
+    aeDeleteFileEvent(el, fd, mask);
+    
+    redis_load_aof_file(srnode, srnode->addr);
+}
+
+static void begin_replication(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    char c[1];
+    redis_node *srnode = privdata;
+    thread_data *rdata = srnode->read_data;
+    
+    RMT_NOTUSED(el);
+    RMT_NOTUSED(fd);
+    RMT_NOTUSED(privdata);
+    RMT_NOTUSED(mask);
+
+    ASSERT(rdata->loop == el);
+    ASSERT(srnode->sockpairfds[0] == fd);
+
+    rmt_read(srnode->sockpairfds[0], c , 1);
+    ASSERT(c[0] == ' ');
+
+    aeDeleteFileEvent(el, fd, mask);
+    
+    rmtConnectRedisMaster(srnode);
+}
+
+static void *read_thread_run(void *args)
+{
+    int ret;
+    thread_data *rdata = args;
+    rmtContext *ctx = rdata->ctx;
+    list *nodes = rdata->nodes;  //type : source redis_node
+    redis_node *srnode;
+    listNode *lnode;
+    listIter *it;
+
+    thread_data_bind(rdata, "read");
+
+    it = listGetIterator(nodes, AL_START_HEAD);
+    while((lnode = listNext(it)) != NULL){
+    	srnode = listNodeValue(lnode);
+
+        if (ctx->source_type == GROUP_TYPE_AOFFILE) {
+            ret = aeCreateFileEvent(rdata->loop, srnode->sockpairfds[0], 
+                    AE_READABLE, begin_load_aof_file, srnode);
+            if(ret != AE_OK)
+            {
+                log_error("ERROR: Create readable notice event for node[%s] fd %d "
+                    "to begin load aof file on the read thread %ld failed: %s",
+                    srnode->addr, srnode->sockpairfds[0],
+                    rdata->thread_id, strerror(errno));
+                listReleaseIterator(it);
+                exit(0);
+            }
+        } else {
+            ret = aeCreateFileEvent(rdata->loop, srnode->sockpairfds[0], 
+                    AE_READABLE, begin_replication, srnode);
+            if(ret != AE_OK)
+            {
                 log_error("ERROR: Create readable notice event for node[%s] fd %d "
                     "to begin replication on the read thread %ld failed: %s",
                     srnode->addr, srnode->sockpairfds[0],
@@ -1213,91 +1820,573 @@ static void *read_thread_run(void *args)
             }
         }
     }
-    
-    listReleaseIterator(it);
+    
+    listReleaseIterator(it);
+
+    aeMain(rdata->loop);
+
+    return 0;
+}
+
+static void *write_thread_run(void *args)
+{
+    int ret;
+    thread_data *wdata = args;
+    list *nodes = wdata->nodes;  //type : source redis_node
+    redis_node *srnode;
+    redis_group *srgroup;
+
+    thread_data_bind(wdata, "write");
+
+    srnode = listFirstValue(nodes);
+    if(srnode == NULL){
+        log_error("ERROR: No redis nodes for this write thread %ld", 
+            wdata->thread_id);
+        return 0;
+    }
+
+    srgroup = srnode->owner;
+    if(srgroup->kind == GROUP_TYPE_RDBFILE){
+        listNode *lnode;
+        listIter *it;
+        it = listGetIterator(nodes, AL_START_HEAD);
+        while((lnode = listNext(it)) != NULL)
+        {
+        	srnode = listNodeValue(lnode);
+            
+            if(srnode->sk_event < 0){
+                srnode->sk_event = socket(AF_INET, SOCK_STREAM, 0);
+                if(srnode->sk_event < 0){
+                    log_error("ERROR: Create sk_event for node[%s] failed: %s", 
+                        srnode->addr, strerror(errno));
+                    return 0;
+                }
+            }
+            
+            srnode->timestamp = rmt_msec_now();
+            ret = aeCreateFileEvent(wdata->loop, srnode->sk_event, 
+                AE_WRITABLE, redis_parse_rdb, srnode);
+            if(ret == AE_ERR)
+            {
+                log_error("ERROR: Create ae write event for node %s parse rdb file failed", 
+                    srnode->addr);
+                listReleaseIterator(it);
+                return 0;
+            }
+        }
+        
+        listReleaseIterator(it);
+        
+        aeMain(wdata->loop);
+        return 0;
+    }
+
+    if (srnode->lane < 0) {
+        rmt_write(srnode->sockpairfds[1], " ", 1);
+    } else {
+        listNode *lnode;
+        listIter *it;
+
+        /* Begin replication for the first node of every lane. */
+        it = listGetIterator(nodes, AL_START_HEAD);
+        while ((lnode = listNext(it)) != NULL) {
+            srnode = listNodeValue(lnode);
+            if (srnode->lane_order == 0) {
+                rmt_write(srnode->sockpairfds[1], " ", 1);
+            }
+        }
+        listReleaseIterator(it);
+    }
+
+    aeMain(wdata->loop);
+
+    return 0;
+}
+
+static void *apply_thread_run(void *args)
+{
+    thread_data *adata = args;
+
+    thread_data_bind(adata, "apply");
+
+    aeMain(adata->loop);
+
+    return 0;
+}
+
+/*
+ * Count the target node in ctx->targets_backlogged while it stops sending
+ * for the rate limits or max_inflight with RMT_TARGET_BACKLOG msgs or 
+ * more to send, so the source nodes stop parsing (see source_node_held). 
+ * Called whenever the flags or the send_data of the node change.
+ */
+static void target_node_backlog(redis_node *trnode)
+{
+    rmtContext *ctx = trnode->ctx;
+    thread_data *wdata;
+    uint32_t i;
+    int backlogged;
+
+    backlogged = trnode->state == REDIS_TARGET_READY && 
+        (trnode->throttled || trnode->window_full) &&
+        listLength(trnode->send_data) >= RMT_TARGET_BACKLOG;
+    if (backlogged == trnode->backlogged) {
+        return;
+    }
+
+    trnode->backlogged = backlogged;
+    if (backlogged) {
+        __atomic_add_fetch(&ctx->targets_backlogged, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    if (__atomic_sub_fetch(&ctx->targets_backlogged, 1, __ATOMIC_SEQ_CST) == 0) {
+        for (i = 0; i < array_n(ctx->wdatas); i ++) {
+            wdata = array_get(ctx->wdatas, i);
+            notice_write_thread_resume(wdata);
+        }
+    }
+}
+
+static void target_node_close(redis_node *trnode)
+{
+    tcp_context *tc = trnode->tc;
+    thread_data *wdata = trnode->write_data;
+    listNode *ln;
+    struct msg *msg;
+
+    ASSERT(trnode->sent_data != NULL);
+
+    rmt_tcp_context_close_sd(tc);
+
+    /* the msgs waiting for the responses are sent again */
+    while ((msg = listPop(trnode->sent_data)) != NULL) {
+        ASSERT(msg->request && msg->sent);
+        if (msg->extra) {
+            msg_put(msg);
+            msg_free(msg);
+        } else if (target_node_retry(trnode, msg) != RMT_OK) {
+            msg->ack_lost = 1;
+            thread_stat_decr(wdata, msgs_outqueue, 1);
+            msg_put(msg);
+            msg_free(msg);
+        }
+    }
+
+    ln = listFirst(trnode->send_data);
+    if (ln != NULL && msg_sent_partially(listNodeValue(ln))) {
+        msg = listNodeValue(ln);
+        if (msg->extra) {
+            /* the rest of a msg moved to another node, or an ASKING */
+            listDelNode(trnode->send_data, ln);
+            msg_put(msg);
+            msg_free(msg);
+        } else if (msg_rewind(msg) != RMT_OK) {
+            log_warn("Msg %s partially sent to node[%s] is dropped", 
+                msg_type_string(msg->type), trnode->addr);
+            listDelNode(trnode->send_data, ln);
+            msg->ack_lost = 1;
+            thread_stat_decr(wdata, msgs_outqueue, 1);
+            msg_put(msg);
+            msg_free(msg);
+        }
+    }
+    
+    if (trnode->msg_rcv != NULL) {
+        msg_put(trnode->msg_rcv);
+        msg_free(trnode->msg_rcv);
+        trnode->msg_rcv = NULL;
+    }
+
+    if (trnode->mbuf_rcv != NULL) {
+        mbuf_rewind(trnode->mbuf_rcv);
+    }
+
+    if (trnode->mbuf_spare != NULL) {
+        mbuf_rewind(trnode->mbuf_spare);
+    }
+
+    if (trnode->zc != NULL) {
+        rmt_zerocopy_reset(trnode->zc);
+    }
+
+    trnode->state = REDIS_TARGET_NONE;
+    target_node_backlog(trnode);
+}
+
+/* Exponential backoff with jitter in ms after n failures in a row. */
+static long long target_backoff(int n)
+{
+    long long delay;
+
+    delay = (long long)REDIS_TARGET_RETRY_MIN << MIN(n, 16);
+    delay = MIN(delay, REDIS_TARGET_RETRY_MAX);
+
+    return delay/2 + random()%(delay/2 + 1);
+}
+
+/*
+ * Queue the msg to be sent to the target node again after a backoff, 
+ * for a transient error or a lost connection. The queued msgs go before 
+ * send_data, so the order of the msgs to the node is kept: the node 
+ * sends nothing until they are back in send_data. The msgs sent after 
+ * the msg are not sent again, they may have taken effect already: their 
+ * own replies tell whether they are retried too. Returns RMT_ERROR if 
+ * the msg can not be sent again, and it is left untouched.
+ */
+int target_node_retry(redis_node *trnode, struct msg *msg)
+{
+    thread_data *wdata = trnode->write_data;
+
+    if (msg->retries >= REDIS_TARGET_RETRY_TIMES || msg_rewind(msg) != RMT_OK) {
+        thread_stat_incr(wdata, total_msgs_retry_dropped, 1);
+        return RMT_ERROR;
+    }
+
+    msg->sent = 0;
+    msg->peer = NULL;
+    msg->stime = 0;
+    msg->retries ++;
+
+    if (listLength(trnode->retry_data) == 0) {
+        trnode->retry_time = rmt_msec_now() + target_backoff(msg->retries - 1);
+    }
+    listAddNodeTail(trnode->retry_data, msg);
+    thread_stat_incr(wdata, total_msgs_retried, 1);
+
+    return RMT_OK;
+}
+
+/* Whether the last msg sent to the target node is to be replied alone. */
+static int target_node_retrying(redis_node *trnode)
+{
+    listNode *ln = listLast(trnode->sent_data);
+    struct msg *msg;
+
+    if (ln == NULL) {
+        return 0;
+    }
+
+    msg = listNodeValue(ln);
+    return msg->retry_alone;
+}
+
+/*
+ * Move the msgs to retry back to the head of send_data when it is time,
+ * and all the msgs sent before are replied, so all the msgs to retry 
+ * are known and go in their order.
+ */
+static void target_node_retry_cron(redis_node *trnode, long long now)
+{
+    thread_data *wdata = trnode->write_data;
+    listNode *ln, *head;
+    struct msg *msg;
+
+    if (listLength(trnode->retry_data) == 0 || now < trnode->retry_time ||
+        listLength(trnode->sent_data) > 0) {
+        return;
+    }
+
+    /* after the msg partially sent */
+    head = listFirst(trnode->send_data);
+    if (head != NULL && !msg_sent_partially(listNodeValue(head))) {
+        head = NULL;
+    }
+
+    while ((ln = listLast(trnode->retry_data)) != NULL) {
+        msg = listNodeValue(ln);
+        listDelNode(trnode->retry_data, ln);
+        if (head != NULL) {
+            listInsertNode(trnode->send_data, head, msg, 1);
+        } else {
+            listAddNodeHead(trnode->send_data, msg);
+        }
+    }
+
+    if (trnode->state == REDIS_TARGET_READY && 
+        aeCreateFileEvent(wdata->loop, trnode->tc->sd, 
+        AE_WRITABLE, send_data_to_target, trnode) != AE_OK) {
+        log_error("ERROR: send_data event create %ld failed: %s",
+            wdata->thread_id, strerror(errno));
+    }
+}
+
+/* Connect the target node again later, with exponential backoff and jitter. */
+static void target_node_connect_failed(redis_node *trnode)
+{
+    thread_data *wdata = trnode->write_data;
+    tcp_context *tc = trnode->tc;
+    long long delay;
+
+    if (tc->sd > 0) {
+        aeDeleteFileEvent(wdata->loop, tc->sd, AE_READABLE|AE_WRITABLE);
+    }
+    target_node_close(trnode);
+
+    delay = target_backoff(trnode->conn_retries);
+
+    trnode->conn_retries ++;
+    trnode->conn_time = rmt_msec_now() + delay;
+
+    log_warn("Connect to target node[%s] failed %d times, retry in %lld ms",
+        trnode->addr, trnode->conn_retries, delay);
+}
+
+static void target_node_ready(redis_node *trnode)
+{
+    int ret;
+    rmtContext *ctx = trnode->ctx;
+    thread_data *wdata = trnode->write_data;
+    tcp_context *tc = trnode->tc;
+
+    aeDeleteFileEvent(wdata->loop, tc->sd, AE_READABLE|AE_WRITABLE);
+
+    trnode->state = REDIS_TARGET_READY;
+    trnode->conn_retries = 0;
+    trnode->window_full = 0;
+
+    if (ctx->noreply == 0) {
+        ret = aeCreateFileEvent(wdata->loop, tc->sd, 
+            AE_READABLE, recv_data_from_target, trnode);
+        if (ret != AE_OK) {
+            log_error("ERROR: create read event for node[%s] failed: %s",
+                trnode->addr, strerror(errno));
+            target_node_connect_failed(trnode);
+            return;
+        }
+    }
+
+    if (listLength(trnode->send_data) > 0) {
+        ret = aeCreateFileEvent(wdata->loop, tc->sd, 
+            AE_WRITABLE, send_data_to_target, trnode);
+        if (ret != AE_OK) {
+            log_error("ERROR: send_data event create %ld failed: %s",
+                wdata->thread_id, strerror(errno));
+            target_node_connect_failed(trnode);
+            return;
+        }
+    }
+
+    log_debug(LOG_NOTICE, "node[%s] is connected for thread %ld", 
+        trnode->addr, wdata->thread_id);
+}
+
+static void target_node_handshake_read(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    redis_node *trnode = privdata;
+    sds reply = trnode->conn_reply;
+    ssize_t n;
+
+    RMT_NOTUSED(el);
+    RMT_NOTUSED(mask);
+
+    reply = sdsMakeRoomFor(reply, 128);
+    trnode->conn_reply = reply;
+
+    n = rmt_read(fd, reply + sdslen(reply), sdsavail(reply));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    } else if (n <= 0) {
+        log_error("ERROR: read AUTH reply from node[%s] failed: %s", trnode->addr,
+            n == 0 ? "lost connect" : strerror(errno));
+        target_node_connect_failed(trnode);
+        return;
+    }
+    sdsIncrLen(reply, (int)n);
 
-    aeMain(rdata->loop);
+    if (strstr(reply, "\r\n") == NULL) {
+        return;
+    }
 
-    return 0;
+    if (reply[0] == '-') {
+        log_error("ERROR: password to %s is wrong", trnode->addr);
+        target_node_connect_failed(trnode);
+        return;
+    }
+
+    target_node_ready(trnode);
 }
 
-static void *write_thread_run(void *args)
+/* The nonblocking connect is done, send AUTH if the group has a password. */
+static void target_node_handshake(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    redis_node *trnode = privdata;
+    redis_group *trgroup = trnode->owner;
+    sds cmd;
+    ssize_t n;
+
+    RMT_NOTUSED(mask);
+
+    if (rmt_tcp_context_check_socket_error(trnode->tc) != RMT_OK) {
+        log_error("ERROR: connect to %s failed", trnode->addr);
+        target_node_connect_failed(trnode);
+        return;
+    }
+
+    if (trgroup->password == NULL) {
+        target_node_ready(trnode);
+        return;
+    }
+
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+
+    cmd = sdscatprintf(sdsempty(), "*2\r\n$4\r\nAUTH\r\n$%zu\r\n%s\r\n", 
+        strlen(trgroup->password), trgroup->password);
+    n = rmt_write(fd, cmd, sdslen(cmd));
+    if (n != (ssize_t)sdslen(cmd)) {
+        log_error("ERROR: send AUTH to node[%s] failed: %s", trnode->addr,
+            n < 0 ? strerror(errno) : "partial write");
+        sdsfree(cmd);
+        target_node_connect_failed(trnode);
+        return;
+    }
+    sdsfree(cmd);
+
+    if (trnode->conn_reply == NULL) {
+        trnode->conn_reply = sdsempty();
+    } else {
+        sdsclear(trnode->conn_reply);
+    }
+
+    trnode->state = REDIS_TARGET_HANDSHAKE;
+    if (aeCreateFileEvent(el, fd, AE_READABLE, 
+        target_node_handshake_read, trnode) != AE_OK) {
+        log_error("ERROR: create read event for node[%s] failed: %s",
+            trnode->addr, strerror(errno));
+        target_node_connect_failed(trnode);
+    }
+}
+
+/*
+ * Connect the target node without blocking the thread. The msgs queued 
+ * for it meanwhile are sent when the connection is ready.
+ */
+static int target_node_connect(redis_node *trnode)
 {
     int ret;
-    thread_data *wdata = args;
-    list *nodes = wdata->nodes;  //type : source redis_node
-    redis_node *srnode;
-    redis_group *srgroup;
+    thread_data *wdata = trnode->write_data;
+    tcp_context *tc = trnode->tc;
 
-    srnode = listFirstValue(nodes);
-    if(srnode == NULL){
-        log_error("ERROR: No redis nodes for this write thread %ld", 
-            wdata->thread_id);
-        return 0;
+    ASSERT(trnode->state == REDIS_TARGET_NONE);
+
+    tc->flags &= ~RMT_BLOCK;
+    if (tc->flags & RMT_RECONNECT) {
+        ret = rmt_tcp_context_reconnect(tc);
+    } else {
+        ret = rmt_tcp_context_connect_addr(tc, trnode->addr, 
+            (int)rmt_strlen(trnode->addr), NULL, NULL);
+    }
+    if (ret != RMT_OK) {
+        log_error("ERROR: connect to %s failed", trnode->addr);
+        target_node_connect_failed(trnode);
+        return RMT_ERROR;
     }
 
-    srgroup = srnode->owner;
-    if(srgroup->kind == GROUP_TYPE_RDBFILE){
-        listNode *lnode;
-        listIter *it;
-        it = listGetIterator(nodes, AL_START_HEAD);
-        while((lnode = listNext(it)) != NULL)
-        {
-        	srnode = listNodeValue(lnode);
-            
-            if(srnode->sk_event < 0){
-                srnode->sk_event = socket(AF_INET, SOCK_STREAM, 0);
-                if(srnode->sk_event < 0){
-                    log_error("ERROR: Create sk_event for node[%s] failed: %s", 
-                        srnode->addr, strerror(errno));
-                    return 0;
-                }
-            }
-            
-            srnode->timestamp = rmt_msec_now();
-            ret = aeCreateFileEvent(wdata->loop, srnode->sk_event, 
-                AE_WRITABLE, redis_parse_rdb, srnode);
-            if(ret == AE_ERR)
-            {
-                log_error("ERROR: Create ae write event for node %s parse rdb file failed", 
-                    srnode->addr);
-                listReleaseIterator(it);
-                return 0;
-            }
+    trnode->state = REDIS_TARGET_CONNECTING;
+    trnode->conn_time = rmt_msec_now() + REDIS_TARGET_CONNECT_TIMEOUT;
+
+    ret = aeCreateFileEvent(wdata->loop, tc->sd, 
+        AE_WRITABLE, target_node_handshake, trnode);
+    if (ret != AE_OK) {
+        log_error("ERROR: create write event for node[%s] failed: %s",
+            trnode->addr, strerror(errno));
+        target_node_connect_failed(trnode);
+        return RMT_ERROR;
+    }
+
+    return RMT_OK;
+}
+
+/* Connect the target node when it is time, or give up a slow connect. */
+static void target_node_cron(redis_node *trnode, long long now)
+{
+    thread_data *wdata = trnode->write_data;
+
+    if (trnode->throttled && trnode->state == REDIS_TARGET_READY) {
+        /* the tokens were refilled since the last send */
+        trnode->throttled = 0;
+        target_node_backlog(trnode);
+        if (aeCreateFileEvent(wdata->loop, trnode->tc->sd, 
+            AE_WRITABLE, send_data_to_target, trnode) != AE_OK) {
+            log_error("ERROR: send_data event create %ld failed: %s",
+                wdata->thread_id, strerror(errno));
         }
-        
-        listReleaseIterator(it);
-        
-        aeMain(wdata->loop);
-        return 0;
     }
 
-    rmt_write(srnode->sockpairfds[1], " ", 1);
+    if (trnode->state == REDIS_TARGET_NONE) {
+        if (now >= trnode->conn_time) {
+            target_node_connect(trnode);
+        }
+    } else if (trnode->state != REDIS_TARGET_READY && now > trnode->conn_time) {
+        log_error("ERROR: connect to %s timed out", trnode->addr);
+        target_node_connect_failed(trnode);
+    }
+}
+
+/* Count a msg sent by the write thread in the stats of its command. */
+static void command_stat(thread_data *wdata, struct msg *req,
+    long long nsec, int error)
+{
+    command_stats *cs;
 
-    aeMain(wdata->loop);
+    if (wdata->stat_commands == NULL ||
+        req->type <= MSG_UNKNOWN || req->type >= MSG_SENTINEL) {
+        return;
+    }
 
-    return 0;
+    cs = &wdata->stat_commands[req->type];
+    __atomic_store_n(&cs->calls, cs->calls + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cs->bytes, cs->bytes + req->mlen, __ATOMIC_RELAXED);
+    if (error) {
+        __atomic_store_n(&cs->errors, cs->errors + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&cs->nsec, cs->nsec + (uint64_t)nsec, __ATOMIC_RELAXED);
 }
 
-static void target_node_close(redis_node *trnode)
+/* 
+ * Move the error reply counted for req to the retries of its command, as
+ * req is sent again and its final reply is counted then.
+ */
+void command_stat_retried(thread_data *wdata, struct msg *req)
 {
-    tcp_context *tc = trnode->tc;
-    struct msg *msg;
+    command_stats *cs;
 
-    ASSERT(trnode->sent_data != NULL);
+    if (wdata->stat_commands == NULL ||
+        req->type <= MSG_UNKNOWN || req->type >= MSG_SENTINEL) {
+        return;
+    }
 
-    rmt_tcp_context_close_sd(tc);
+    cs = &wdata->stat_commands[req->type];
+    __atomic_store_n(&cs->calls, cs->calls - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cs->bytes, cs->bytes - req->mlen, __ATOMIC_RELAXED);
+    __atomic_store_n(&cs->errors, cs->errors - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&cs->retries, cs->retries + 1, __ATOMIC_RELAXED);
+}
 
-    while ((msg = listPop(trnode->sent_data)) != NULL) {
-        ASSERT(msg->request && msg->sent);
-        msg_put(msg);
-        msg_free(msg);
+/*
+ * Account the reply of req from the target node at monotonic time now:
+ * the latency of the node, the command stats and the slowlog.
+ */
+static void response_account(redis_node *trnode, struct msg *req,
+    long long now, int error)
+{
+    thread_data *wdata = trnode->write_data;
+    long long nsec = now - req->stime;
+    uint8_t key[SLOWLOG_ENTRY_MAX_STRING];
+    size_t keylen;
+
+    if (trnode->latency != NULL) {
+        hist_record(trnode->latency, (uint64_t)nsec);
     }
-    
-    if (trnode->msg_rcv != NULL) {
-        msg_put(trnode->msg_rcv);
-        msg_free(trnode->msg_rcv);
-        trnode->msg_rcv = NULL;
+
+    command_stat(wdata, req, nsec, error);
+
+    if (wdata->tunables.slowlog_max_len > 0 &&
+        nsec/1000 >= wdata->tunables.slowlog_log_slower_than) {
+        keylen = redis_msg_first_key(req, key, sizeof(key));
+        slowlog_push(&trnode->ctx->slowlog, wdata->tunables.slowlog_max_len,
+            redis_command_name(req->type), key, keylen, trnode->addr, 
+            nsec/1000);
     }
 }
 
@@ -1309,16 +2398,23 @@ static void send_data_to_target(aeEventLoop *el, int fd, void *privdata, int mas
     thread_data *wdata = trnode->write_data;
     listNode *lnode_node, *lnode_msg, *lnode_mbuf;
     list send_msgl;                      /* send msg list */
-    struct iovec *ciov, iov[RMT_IOV_MAX];
+    struct iovec *ciov, iov[RMT_IOV_BATCH_MAX];
     struct msg *msg;
     struct mbuf *mbuf;                   /* current mbuf */
     size_t mlen;                         /* current mbuf data length */
     struct array sendv;                  /* send iovec */
     size_t limit;                        /* bytes to send limit */
     size_t nsend, nsent;                 /* bytes to send; bytes sent */
+    long long now = 0;                   /* time the msgs were sent, in ns */
     ssize_t n;                           /* bytes sent by sendv */
     int stop;
     int send_again;
+    int zerocopy;                        /* sent with MSG_ZEROCOPY */
+    int batch;                           /* max iovecs to gather */
+    long window;                         /* msgs can be sent before the replies, -1 for no limit */
+    long nmsgs;                          /* msgs sent completely */
+    rmt_tunables *tunables = &wdata->tunables;
+    int ratelimited;                     /* limited by the global or the target node rates */
 
     RMT_NOTUSED(el);
     RMT_NOTUSED(fd);
@@ -1327,15 +2423,82 @@ static void send_data_to_target(aeEventLoop *el, int fd, void *privdata, int mas
 
     ASSERT(fd == tc->sd);
 
+    if (trnode->zc != NULL) {
+        rmt_zerocopy_reap(trnode->zc);
+    }
+
+    /* target_node_retry_cron sends again after the msgs to retry */
+    if (listLength(trnode->retry_data) > 0) {
+        aeDeleteFileEvent(el, fd, AE_WRITABLE);
+        return;
+    }
+
 again:
 
+    /* 
+     * A msg sent again for an error reply goes alone: the next msgs wait 
+     * for its reply, so they do not take effect before it if it fails 
+     * again.
+     */
+    if (target_node_retrying(trnode)) {
+        trnode->window_full = 1;
+        target_node_backlog(trnode);
+        aeDeleteFileEvent(el, fd, AE_WRITABLE);
+        return;
+    }
+
     send_again = 1;
     nsend = 0;
+    nmsgs = 0;
     stop = 0;
     limit = SSIZE_MAX;
+    batch = MIN(trnode->iov_batch, wdata->tunables.send_batch);
+
+    window = -1;
+    if (wdata->tunables.max_inflight > 0 && !trnode->ctx->noreply) {
+        window = wdata->tunables.max_inflight - 
+            (long)listLength(trnode->sent_data);
+        if (window <= 0) {
+            /* recv_data_from_target sends again after the replies */
+            trnode->window_full = 1;
+            target_node_backlog(trnode);
+            aeDeleteFileEvent(el, fd, AE_WRITABLE);
+            return;
+        }
+    }
+
+    ratelimited = 0;
+    if (tunables->rate_limit_bytes > 0 || tunables->rate_limit_cmds > 0 ||
+        tunables->target_rate_limit_bytes > 0 || 
+        tunables->target_rate_limit_cmds > 0) {
+        if (trnode->ratelimit == NULL) {
+            trnode->ratelimit = ratelimits_target(&trnode->ctx->ratelimits, 
+                trnode->addr);
+            if (trnode->ratelimit == NULL) {
+                log_error("ERROR: out of memory");
+                return;
+            }
+        }
+
+        ratelimited = 1;
+        now = rmt_nsec_monotonic();
+        if (ratelimit_allow(trnode->ctx->ratelimits.global, 
+                tunables->rate_limit_bytes, tunables->rate_limit_cmds, 
+                tunables->rate_limit_burst, now, &limit, &window) ||
+            ratelimit_allow(trnode->ratelimit, 
+                tunables->target_rate_limit_bytes, 
+                tunables->target_rate_limit_cmds, 
+                tunables->rate_limit_burst, now, &limit, &window)) {
+            /* target_node_cron sends again after the tokens are refilled */
+            trnode->throttled = 1;
+            target_node_backlog(trnode);
+            aeDeleteFileEvent(el, fd, AE_WRITABLE);
+            return;
+        }
+    }
     
     listInit(&send_msgl);
-    array_set(&sendv, iov, sizeof(iov[0]), RMT_IOV_MAX);
+    array_set(&sendv, iov, sizeof(iov[0]), RMT_IOV_BATCH_MAX);
 
     log_debug(LOG_DEBUG, "send_data_to_target node[%s] msgs %lld",
         trnode->addr, listLength(trnode->send_data));
@@ -1346,14 +2509,29 @@ again:
         
         msg = listNodeValue(lnode_msg);
         ASSERT(msg != NULL);
+
+        /* the msgs to retry go first, only finish the one partially sent */
+        if (listLength(trnode->retry_data) > 0 && !msg_sent_partially(msg)) {
+            break;
+        }
+
+        if (window >= 0 && (long)listLength(&send_msgl) >= window) {
+            stop = 1;
+            break;
+        }
+
+        if (msg->retry_alone && !msg_sent_partially(msg) &&
+            (listLength(&send_msgl) > 0 || listLength(trnode->sent_data) > 0)) {
+            stop = 1;
+            break;
+        }
         
         listAddNodeTail(&send_msgl, lnode_msg);
 
         lnode_mbuf = listFirst(msg->data);
         while (lnode_mbuf != NULL) {
 
-            if (array_n(&sendv) >= RMT_IOV_MAX || 
-                nsend >= limit) {
+            if (array_n(&sendv) >= (uint32_t)batch || nsend >= limit) {
                 stop = 1;
                 break;
             }
@@ -1376,14 +2554,35 @@ again:
             lnode_mbuf = listNextNode(lnode_mbuf);
         }
 
+        if (msg->retry_alone) {
+            stop = 1;
+            break;
+        }
+
         lnode_msg = listNextNode(lnode_msg);
     }
 
+    if (listLength(&send_msgl) == 0) {
+        aeDeleteFileEvent(el, fd, AE_WRITABLE);
+        return;
+    }
+
     log_debug(LOG_DEBUG, "%u mbufs %u bytes will be sent", 
         array_n(&sendv), nsend);
 
+    zerocopy = 0;
     if (listLength(&send_msgl) > 0 && nsend != 0) {
-        n = rmt_sendv(fd, &sendv, nsend);
+        n = RMT_ENOMEM;
+        if (trnode->zc != NULL && nsend >= RMT_ZEROCOPY_MIN_BYTES &&
+            rmt_zerocopy_enable(trnode->zc, fd) == RMT_OK) {
+            n = rmt_sendv_zerocopy(trnode->zc, &sendv, nsend);
+            zerocopy = n > 0 ? 1 : 0;
+        }
+        
+        if (n == RMT_ENOMEM) {
+            n = rmt_sendv(fd, &sendv, nsend);
+        }
+        
         if (n == RMT_ERROR) {
             log_error("ERROR: errors on connection with node[%s]", trnode->addr);
 
@@ -1394,6 +2593,16 @@ again:
 
         if (n < (ssize_t)nsend) {
             send_again = 0;
+
+            /* the socket buffer is full, gather less next time */
+            if (trnode->iov_batch > RMT_IOV_BATCH_MIN) {
+                trnode->iov_batch /= 2;
+            }
+        } else if (stop && trnode->iov_batch < RMT_IOV_BATCH_MAX &&
+            array_n(&sendv) >= (uint32_t)batch && 
+            batch == trnode->iov_batch) {
+            /* the whole batch was sent, gather more next time */
+            trnode->iov_batch = MIN(trnode->iov_batch * 2, RMT_IOV_BATCH_MAX);
         }
     } else {
         n = 0;
@@ -1401,7 +2610,7 @@ again:
 
     nsent = n > 0 ? (size_t)n : 0;
 
-    wdata->stat_total_net_output_bytes += nsent;
+    thread_stat_incr(wdata, total_net_output_bytes, nsent);
 
     log_debug(LOG_DEBUG, "%u bytes has be sent", nsent);
 
@@ -1421,6 +2630,12 @@ again:
             continue;
         }
 
+        if (zerocopy) {
+            /* msg_put holds its mbufs until the kernel is done */
+            msg->zc = trnode->zc;
+            msg->zc_id = trnode->zc->next - 1;
+        }
+
         /* adjust mbufs of the sent message */
         lnode_mbuf = listFirst(msg->data);
         while(lnode_mbuf != NULL){
@@ -1453,12 +2668,23 @@ again:
             //msg send done
             ASSERT(listFirst(trnode->send_data) == lnode_msg);
             listDelNode(trnode->send_data, lnode_msg);
+
+            nmsgs ++;
+            if (now == 0) {
+                now = rmt_nsec_monotonic();
+            }
+            if (msg->stime > 0 && wdata->stat_queue_latency != NULL) {
+                hist_record(wdata->stat_queue_latency, 
+                    (uint64_t)(now - msg->stime));
+            }
+            msg->stime = now;
             if(msg->noreply){
                 ASSERT(listLength(trnode->sent_data) == 0);
-                wdata->stat_msgs_outqueue --;
+                command_stat(wdata, msg, 0, 0);
+                thread_stat_decr(wdata, msgs_outqueue, 1);
                 msg_put(msg);
                 msg_free(msg);
-                wdata->stat_total_msgs_sent ++;
+                thread_stat_incr(wdata, total_msgs_sent, 1);
             }else{
                 msg->sent = 1;
                 listAddNodeTail(trnode->sent_data,msg);
@@ -1466,12 +2692,202 @@ again:
         }
     }
 
-    ASSERT(listLength(&send_msgl) == 0);
+    ASSERT(listLength(&send_msgl) == 0);
+
+    if (ratelimited) {
+        ratelimit_consume(trnode->ctx->ratelimits.global, 
+            n > 0 ? (size_t)n : 0, nmsgs);
+        ratelimit_consume(trnode->ratelimit, n > 0 ? (size_t)n : 0, nmsgs);
+    }
+
+    if(listLength(trnode->send_data) == 0){
+        aeDeleteFileEvent(el, fd, AE_WRITABLE);
+    }else if(send_again == 1){
+        goto again;
+    }
+}
+
+/*
+ * Consume the status and integer responses at the head of mbuf without
+ * building msgs for them, matching them against sent_data in order.
+ * Return RMT_AGAIN if scanning stopped at a response that needs a full
+ * parse (errors, bulks, or responses that the request's resp_check
+ * inspects), RMT_OK if all the data was consumed or only an incomplete
+ * line is left.
+ */
+static int response_scan(redis_node *trnode, struct mbuf *mbuf)
+{
+    thread_data *wdata = trnode->write_data;
+    listNode *lnode;
+    struct msg *req;
+    uint8_t *p, *q;
+    long long now = 0;
+
+    p = mbuf->pos;
+    while (p < mbuf->last) {
+        if (*p != '+' && *p != ':') {
+            break;
+        }
+
+        q = memchr(p, LF, (size_t)(mbuf->last - p));
+        if (q == NULL) {
+            mbuf->pos = p;
+            return RMT_OK;
+        }
+
+        lnode = listFirst(trnode->sent_data);
+        if (lnode == NULL || q - p < 2 || *(q - 1) != CR) {
+            break;
+        }
+
+        req = listNodeValue(lnode);
+        if (req->extra) {
+            break;
+        }
+        listDelNode(trnode->sent_data, lnode);
+        if (redis_response_check_line(trnode, req, p, 
+            (uint32_t)(q - 1 - p)) != RMT_OK) {
+            listAddNodeHead(trnode->sent_data, req);
+            break;
+        }
+
+        thread_stat_incr(wdata, total_msgs_sent, 1);
+        thread_stat_decr(wdata, msgs_outqueue, 1);
+        if (now == 0) {
+            now = rmt_nsec_monotonic();
+        }
+        /* req is freed by redis_response_line_done, account for it first */
+        response_account(trnode, req, now, 0);
+        redis_response_line_done(trnode, req);
+
+        p = q + 1;
+    }
+
+    mbuf->pos = p;
+
+    return mbuf_empty(mbuf) ? RMT_OK : RMT_AGAIN;
+}
+
+/*
+ * Return the mbuf to read the next responses from the target node in,
+ * after moving an incomplete line left by response_scan to its start.
+ */
+static struct mbuf *response_scan_mbuf(redis_node *trnode)
+{
+    struct mbuf *mbuf = trnode->mbuf_rcv;
+    uint32_t len;
+
+    if (mbuf == NULL) {
+        mbuf = mbuf_get(trnode->owner->mb);
+        trnode->mbuf_rcv = mbuf;
+    } else if (mbuf_empty(mbuf)) {
+        mbuf_rewind(mbuf);
+    } else if (mbuf_full(mbuf) && mbuf->pos > mbuf->start) {
+        len = mbuf_length(mbuf);
+        memmove(mbuf->start, mbuf->pos, len);
+        mbuf->pos = mbuf->start;
+        mbuf->last = mbuf->start + len;
+    }
+
+    return mbuf;
+}
+
+/*
+ * Hand trnode->mbuf_rcv over to a response msg for the responses that
+ * response_scan can not consume, and parse them with parse_response.
+ */
+static int response_scan_done(redis_node *trnode)
+{
+    struct mbuf *mbuf = trnode->mbuf_rcv;
+    struct msg *msg;
+
+    ASSERT(trnode->msg_rcv == NULL);
+    ASSERT(mbuf != NULL && !mbuf_empty(mbuf));
+
+    msg = msg_get(trnode->owner->mb, 0, 0);
+    if (msg == NULL) {
+        log_error("ERROR: out of memory");
+        return RMT_ENOMEM;
+    }
+
+    listAddNodeTail(msg->data, mbuf);
+    msg->pos = mbuf->pos;
+    msg->mlen = mbuf_length(mbuf);
+    trnode->mbuf_rcv = NULL;
+    trnode->msg_rcv = msg;
+
+    return parse_response(trnode);
+}
+
+/*
+ * Read the responses of trnode into buf. The spare mbuf is filled by
+ * the same readv, and the data it got is returned by the next calls
+ * before reading the socket again, so a burst of responses costs one
+ * syscall per two mbufs.
+ */
+static ssize_t response_read(redis_node *trnode, int fd, uint8_t *buf, size_t size)
+{
+    struct mbuf *spare = trnode->mbuf_spare;
+    struct iovec iov[2];
+    ssize_t n;
+    size_t len;
+
+    if (spare == NULL) {
+        spare = mbuf_get(trnode->owner->mb);
+        if (spare == NULL) {
+            return rmt_read(fd, buf, size);
+        }
+        trnode->mbuf_spare = spare;
+    }
+
+    if (!mbuf_empty(spare)) {
+        len = MIN(size, mbuf_length(spare));
+        memcpy(buf, spare->pos, len);
+        spare->pos += len;
+        return (ssize_t)len;
+    }
+
+    mbuf_rewind(spare);
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = size;
+    iov[1].iov_base = spare->last;
+    iov[1].iov_len = mbuf_size(spare);
+
+    n = rmt_readv(fd, iov, 2);
+    if (n > (ssize_t)size) {
+        spare->last += n - (ssize_t)size;
+        n = (ssize_t)size;
+    }
+
+    return n;
+}
+
+/* Send again after the replies made room in the max_inflight window. */
+static void target_node_window_open(redis_node *trnode)
+{
+    thread_data *wdata = trnode->write_data;
+    int max_inflight = wdata->tunables.max_inflight;
+
+    if (!trnode->window_full || trnode->state != REDIS_TARGET_READY) {
+        return;
+    }
+
+    if (max_inflight > 0 && 
+        listLength(trnode->sent_data) >= (unsigned long)max_inflight) {
+        return;
+    }
 
-    if(listLength(trnode->send_data) == 0){
-        aeDeleteFileEvent(el, fd, AE_WRITABLE);
-    }else if(send_again == 1){
-        goto again;
+    if (target_node_retrying(trnode)) {
+        return;
+    }
+
+    trnode->window_full = 0;
+    target_node_backlog(trnode);
+    if (aeCreateFileEvent(wdata->loop, trnode->tc->sd, 
+        AE_WRITABLE, send_data_to_target, trnode) != AE_OK) {
+        log_error("ERROR: send_data event create %ld failed: %s",
+            wdata->thread_id, strerror(errno));
     }
 }
 
@@ -1479,7 +2895,6 @@ static void recv_data_from_target(aeEventLoop *el, int fd, void *privdata, int m
 {
     int ret;
     redis_node *trnode = privdata;
-    tcp_context *tc = trnode->tc;
     redis_group *trgroup = trnode->owner;
     mbuf_base *mb = trgroup->mb;
     struct msg *msg;
@@ -1492,36 +2907,81 @@ static void recv_data_from_target(aeEventLoop *el, int fd, void *privdata, int m
     RMT_NOTUSED(privdata);
     RMT_NOTUSED(mask);
 
-    ASSERT(fd == tc->sd);
+    ASSERT(fd == trnode->tc->sd);
 
-again:
-    
-    if(trnode->msg_rcv == NULL){
-        trnode->msg_rcv = msg_get(mb, 0, 0);
+    if (trnode->zc != NULL) {
+        rmt_zerocopy_reap(trnode->zc);
     }
 
-    msg = trnode->msg_rcv;
-    if(msg == NULL){
-        log_error("ERROR: out of memory");
-        return;
-    }
+again:
 
-    mbuf = listLastValue(msg->data);
-    if(mbuf == NULL || mbuf_full(mbuf)){
-        mbuf = mbuf_get(mb);
+    if(trnode->msg_rcv == NULL){
+        /* Most responses are status or integer, scan them in place */
+        mbuf = response_scan_mbuf(trnode);
         if(mbuf == NULL){
             log_error("ERROR: mbuf_get NULL");
             return;
         }
-        
-        listAddNodeTail(msg->data, mbuf);
-        msg->pos = mbuf->pos;
-    }
 
-    msize = mbuf_size(mbuf);
-    ASSERT(msize > 0);
+        msize = mbuf_size(mbuf);
+        if(msize == 0){
+            /* one response is larger than the mbuf */
+            ret = response_scan_done(trnode);
+            if(ret != RMT_OK){
+                log_error("ERROR: response msg parsed error");
+                return;
+            }
+
+            goto again;
+        }
+
+        nread = response_read(trnode, fd, mbuf->last, msize);
+        if(nread > 0){
+            mbuf->last += nread;
+
+            ret = response_scan(trnode, mbuf);
+            if(ret != RMT_OK){
+                ret = response_scan_done(trnode);
+                if(ret != RMT_OK){
+                    log_error("ERROR: response msg parsed error");
+                    return;
+                }
+            }
+        }
+    }else{
+        msg = trnode->msg_rcv;
+
+        mbuf = listLastValue(msg->data);
+        if(mbuf == NULL || mbuf_full(mbuf)){
+            mbuf = mbuf_get(mb);
+            if(mbuf == NULL){
+                log_error("ERROR: mbuf_get NULL");
+                return;
+            }
+            
+            listAddNodeTail(msg->data, mbuf);
+            msg->pos = mbuf->pos;
+        }
+
+        msize = mbuf_size(mbuf);
+        ASSERT(msize > 0);
+
+        nread = response_read(trnode, fd, mbuf->last, msize);
+        if(nread > 0){
+            ASSERT((mbuf->last + nread) <= mbuf->end);
+
+            mbuf->last += nread;
+            msg->mlen += (uint32_t)nread;
+
+            ret = parse_response(trnode);
+            if(ret != RMT_OK)
+            {
+                log_error("ERROR: response msg parsed error");
+                return;
+            }
+        }
+    }
 
-    nread = rmt_read(fd, mbuf->last, msize);
     if (nread < 0) {
         if (errno == EINTR) {
             log_debug(LOG_VERB, "I/O no ready-eintr to read from target server[%s]: %s", 
@@ -1531,110 +2991,296 @@ again:
             log_debug(LOG_VERB, "I/O no ready-eagain to read from target server[%s]: %s",
                 trnode->addr, strerror(errno));
             nread = 0;
+            target_node_window_open(trnode);
         }else{
             log_warn("I/O error read from target server[%s]: %s",
                 trnode->addr, strerror(errno));
-            aeDeleteFileEvent(el, fd, AE_READABLE);
+            aeDeleteFileEvent(el, fd, AE_READABLE|AE_WRITABLE);
+            target_node_close(trnode);
         }
 
         return;
     }else if(nread == 0){
         log_warn("I/O error read from target server[%s]: lost connect",
             trnode->addr);
-        aeDeleteFileEvent(el, fd, AE_READABLE);
-        rmt_tcp_context_close_sd(tc);
-        return;
-    }
-    
-    ASSERT((mbuf->last + nread) <= mbuf->end);
-
-    if(nread == 0){
-        return;
-    }
-
-    mbuf->last += nread;
-    msg->mlen += (uint32_t)nread;
-
-    ret = parse_response(trnode);
-    if(ret != RMT_OK)
-    {
-        log_error("ERROR: response msg parsed error");
+        aeDeleteFileEvent(el, fd, AE_READABLE|AE_WRITABLE);
+        target_node_close(trnode);
         return;
     }
 
     if(nread < (ssize_t)msize){
+        target_node_window_open(trnode);
         return;
     }
 
     goto again;
 }
 
-int prepare_send_msg(redis_node *srnode, struct msg *msg, redis_node *trnode)
+/*
+ * Queue the msg to be sent to the target node, without counting it in the
+ * stats: the msgs sent again by the target cluster come here, they were 
+ * counted when they were queued at first.
+ */
+int target_node_queue(redis_node *trnode, struct msg *msg)
 {
     int ret;
-    rmtContext *ctx = srnode->ctx;
-    thread_data *wdata = srnode->write_data;
-    tcp_context *tc = trnode->tc;
-    redis_group *trgroup = trnode->owner;
+    rmtContext *ctx = trnode->ctx;
+    thread_data *wdata = trnode->write_data;
 
     log_debug(LOG_DEBUG, "prepare_send_msg holds %u mbufs to node[%s]", 
         listLength(msg->data), trnode->addr);
 
+    RMT_NOTUSED(ctx);
     MSG_CHECK(ctx, msg);
     
-    if (tc->sd < 0) {
-        tc->flags &= ~RMT_BLOCK;
-        if (tc->flags & RMT_RECONNECT) {
-            ret = rmt_tcp_context_reconnect(tc);
-        } else {
-            ret = rmt_tcp_context_connect_addr(tc, trnode->addr, 
-                (int)rmt_strlen(trnode->addr), NULL, NULL);
-        }
-        if (ret != RMT_OK) {
-            log_error("ERROR: connect to %s failed", trnode->addr);
+    if (trnode->state == REDIS_TARGET_NONE && 
+        rmt_msec_now() >= trnode->conn_time) {
+        target_node_connect(trnode);
+    }
+
+    /* Otherwise the msg is sent once the connection is ready, or once
+     * the replies, the tokens or the msgs to retry let the msgs go */
+    if (trnode->state == REDIS_TARGET_READY && !trnode->window_full && 
+        !trnode->throttled && listLength(trnode->retry_data) == 0) {
+        ret = aeCreateFileEvent(wdata->loop, trnode->tc->sd, 
+            AE_WRITABLE, send_data_to_target, trnode);
+        if (ret != AE_OK) {
+            log_error("ERROR: send_data event create %ld failed: %s",
+                wdata->thread_id, strerror(errno));
             return RMT_ERROR;
         }
+    }
+
+    if (msg->spos == NULL && listLength(msg->data) > 0) {
+        msg->spos = ((struct mbuf *)listFirstValue(msg->data))->pos;
+    }
+
+    msg->stime = rmt_nsec_monotonic();
+    listAddNodeTail(trnode->send_data, msg);
+    if (trnode->throttled || trnode->window_full) {
+        target_node_backlog(trnode);
+    }
+
+    return RMT_OK;
+}
+
+int prepare_send_msg(redis_node *srnode, struct msg *msg, redis_node *trnode)
+{
+    thread_data *wdata = trnode->write_data;
+
+    if (target_node_queue(trnode, msg) != RMT_OK) {
+        return RMT_ERROR;
+    }
+
+    if (srnode != NULL) {
+        redis_repl_ack_msg(srnode, msg);
+    }
+    thread_stat_incr(wdata, total_msgs_recv, 1);
+    thread_stat_incr(wdata, msgs_outqueue, 1);
+    
+    return RMT_OK;
+}
 
-        if (trgroup->password) {
-            sds reply;
-            reply = rmt_send_sync_cmd_read_line(tc->sd, "auth", trgroup->password, NULL);
-            if (sdslen(reply) == 0 || reply[0] == '-') {
-                log_error("ERROR: password to %s is wrong", trnode->addr);
-                sdsfree(reply);
-                return RMT_ERROR;
+static uint32_t apply_thread_index(rmtContext *ctx, uint8_t *key, uint32_t keylen)
+{
+    return dictGenHashFunction(key, (int)keylen) % array_n(ctx->adatas);
+}
+
+/* Hand the msg of the source node to its apply thread. */
+static int apply_hand_msg(redis_node *srnode, struct msg *msg)
+{
+    rmtContext *ctx = srnode->ctx;
+    thread_data *adata;
+    apply_queue *aq;
+
+    adata = array_get(ctx->adatas, msg->apply_idx);
+    aq = adata->data;
+
+    msg->srnode = srnode;
+    __atomic_add_fetch(&srnode->msgs_inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (mttlist_push(aq->msgs, msg) != RMT_OK) {
+        log_error("ERROR: Hand msg to the apply thread %d failed", adata->id);
+        msg->ack_lost = 1;
+        return RMT_ERROR;
+    }
+
+    /* The apply thread clears noticed before it pops the msgs. */
+    if (__sync_bool_compare_and_swap(&aq->noticed, 0, 1)) {
+        rmt_write(aq->sockpairfds[0], " ", 1);
+    }
+
+    return RMT_OK;
+}
+
+/*
+ * Hand the msgs parked by the source node that can go now: a barrier 
+ * msg goes when all the msgs handed before it are freed, and the msgs
+ * after it go when it is freed. If some msgs still wait, apply_msg_done()
+ * notices the write thread to call it again.
+ */
+static void apply_drain(redis_node *srnode)
+{
+    struct msg *msg;
+
+    while (1) {
+        if (srnode->apply_barrier) {
+            if (__atomic_load_n(&srnode->msgs_inflight, __ATOMIC_SEQ_CST) > 0) {
+                return;
             }
-            sdsfree(reply);
+            srnode->apply_barrier = 0;
         }
 
-        if (ctx->noreply == 0) {
-            ret = aeCreateFileEvent(wdata->loop, tc->sd, 
-                AE_READABLE, recv_data_from_target, trnode);
-            if(ret != AE_OK){
-                log_error("ERROR: create read event for node[%s] failed: %s",
-                    trnode->addr, strerror(errno));
-                return RMT_ERROR;
+        while ((msg = listFirstValue(srnode->apply_parked)) != NULL) {
+            if (msg->apply_barrier && 
+                __atomic_load_n(&srnode->msgs_inflight, __ATOMIC_SEQ_CST) > 0) {
+                break;
+            }
+
+            listPop(srnode->apply_parked);
+            if (apply_hand_msg(srnode, msg) != RMT_OK) {
+                msg_put(msg);
+                msg_free(msg);
+                continue;
+            }
+
+            if (msg->apply_barrier) {
+                srnode->apply_barrier = 1;
+                break;
             }
+        }
+
+        if (!srnode->apply_barrier && listLength(srnode->apply_parked) == 0) {
+            __atomic_store_n(&srnode->apply_blocked, 0, __ATOMIC_SEQ_CST);
+            return;
+        }
 
-            log_debug(LOG_DEBUG, "node[%s] create read event for thread %ld", 
-                trnode->addr, wdata->thread_id);
+        /* the msgs may be freed before the apply threads see it */
+        __atomic_store_n(&srnode->apply_blocked, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&srnode->msgs_inflight, __ATOMIC_SEQ_CST) > 0) {
+            return;
         }
     }
-    
-    ret = aeCreateFileEvent(wdata->loop, tc->sd, 
-        AE_WRITABLE, send_data_to_target, trnode);
-    if (ret != AE_OK) {
-        log_error("ERROR: send_data event create %ld failed: %s",
-            wdata->thread_id, strerror(errno));
+}
+
+/*
+ * Send the msg parsed from the source node to the target node. With the 
+ * apply threads, the msg is handed to the apply thread that the key (or 
+ * the keys of the msg if key is NULL) hashes to, so the msgs of a key 
+ * keep their order. A msg with keys on different apply threads is a 
+ * barrier: it is parked until the msgs handed before it are freed, and 
+ * the msgs after it are parked until it is freed. The source node stops
+ * parsing while it has parked msgs, see source_node_held().
+ */
+int apply_send_msg(redis_node *srnode, struct msg *msg, redis_node *trnode, 
+    uint8_t *key, uint32_t keylen)
+{
+    rmtContext *ctx = srnode->ctx;
+    struct keypos *kp;
+    uint32_t i, idx;
+    int barrier = 0;
+
+    if (ctx->adatas == NULL) {
+        return prepare_send_msg(srnode, msg, trnode);
+    }
+
+    if (key != NULL) {
+        idx = apply_thread_index(ctx, key, keylen);
+    } else if (array_n(msg->keys) == 0) {
+        idx = 0;
+        barrier = 1;
+    } else {
+        kp = array_get(msg->keys, 0);
+        idx = apply_thread_index(ctx, kp->start, (uint32_t)(kp->end-kp->start));
+        for (i = 1; i < array_n(msg->keys); i ++) {
+            kp = array_get(msg->keys, i);
+            if (apply_thread_index(ctx, kp->start, 
+                (uint32_t)(kp->end-kp->start)) != idx) {
+                barrier = 1;
+                break;
+            }
+        }
+    }
+
+    msg->ptr = trnode;
+    msg->apply_idx = idx;
+    msg->apply_barrier = barrier ? 1 : 0;
+    redis_repl_ack_msg(srnode, msg);
+
+    if (!barrier && !srnode->apply_barrier && 
+        listLength(srnode->apply_parked) == 0) {
+        return apply_hand_msg(srnode, msg);
+    }
+
+    if (listAddNodeTail(srnode->apply_parked, msg) == NULL) {
+        log_error("ERROR: Park msg of node[%s] failed: out of memory", 
+            srnode->addr);
+        msg->ack_lost = 1;
         return RMT_ERROR;
     }
+    apply_drain(srnode);
 
-    listAddNodeTail(trnode->send_data, msg);
-    wdata->stat_total_msgs_recv ++;
-    wdata->stat_msgs_outqueue ++;
-    
     return RMT_OK;
 }
 
+/* Called when a msg handed to the apply threads is freed. */
+void apply_msg_done(struct msg *msg)
+{
+    redis_node *srnode = msg->srnode;
+
+    msg->srnode = NULL;
+    if (__atomic_sub_fetch(&srnode->msgs_inflight, 1, __ATOMIC_SEQ_CST) == 0 && 
+        __atomic_load_n(&srnode->apply_blocked, __ATOMIC_SEQ_CST)) {
+        notice_write_thread_resume(srnode->write_data);
+    }
+}
+
+/* Send the msgs handed to this apply thread to the target group. */
+static void apply_request(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    thread_data *adata = privdata;
+    apply_queue *aq = adata->data;
+    redis_node *trnode, *wtrnode;
+    struct msg *msg;
+    char buf[64];
+
+    RMT_NOTUSED(el);
+    RMT_NOTUSED(mask);
+
+    ASSERT(fd == aq->sockpairfds[1]);
+
+    rmt_read(fd, buf, sizeof(buf));
+
+    aq->noticed = 0;
+    __sync_synchronize();
+
+    while ((msg = mttlist_pop(aq->msgs)) != NULL) {
+        wtrnode = msg->ptr;
+        msg->ptr = NULL;
+
+        /* the route of the apply thread follows the -MOVED it got */
+        trnode = NULL;
+        if (adata->trgroup->kind == GROUP_TYPE_RCLUSTER) {
+            trnode = redis_cluster_msg_node(adata->trgroup, msg);
+        }
+
+        /* the node may have joined the target cluster after the start */
+        if (trnode == NULL) {
+            trnode = wtrnode->apply_nodes[adata->id];
+        }
+        if (trnode == NULL) {
+            trnode = redis_cluster_node_get(adata->trgroup, wtrnode->addr, adata);
+            wtrnode->apply_nodes[adata->id] = trnode;
+        }
+
+        if (trnode == NULL || prepare_send_msg(NULL, msg, trnode) != RMT_OK) {
+            msg->ack_lost = 1;
+            msg_put(msg);
+            msg_free(msg);
+        }
+    }
+}
+
 static int prepare_send_data(redis_node *srnode)
 {
     int ret;
@@ -1688,7 +3334,7 @@ static int prepare_send_data(redis_node *srnode)
         }
         
         trnode = trgroup->get_backend_node(trgroup, kp->start, (uint32_t)(kp->end-kp->start));
-        if(prepare_send_msg(srnode, msg, trnode) != RMT_OK){
+        if(apply_send_msg(srnode, msg, trnode, NULL, 0) != RMT_OK){
             goto error;
         }
         return RMT_OK;
@@ -1718,7 +3364,7 @@ static int prepare_send_data(redis_node *srnode)
     while ((sub_msg = listPop(&frag_msgl)) != NULL) {
         kp = array_get(sub_msg->keys, 0);
         trnode = trgroup->get_backend_node(trgroup, kp->start, (uint32_t)(kp->end-kp->start));
-        if(prepare_send_msg(srnode, sub_msg, trnode) != RMT_OK){
+        if(apply_send_msg(srnode, sub_msg, trnode, NULL, 0) != RMT_OK){
             msg_put(sub_msg);
             msg_free(sub_msg);
             goto error;
@@ -1758,12 +3404,24 @@ static int response_done(redis_node *trnode, struct msg *resp)
     ASSERT(trnode->msg_rcv == resp);
     
     req = listPop(trnode->sent_data);    
-    wdata->stat_total_msgs_sent ++;
-    wdata->stat_msgs_outqueue --;
     ASSERT(req != NULL);
+    if (req->extra) {
+        /* the reply of an ASKING, or of a msg moved to another node */
+        trnode->msg_rcv = NULL;
+        msg_put(req);
+        msg_free(req);
+        msg_put(resp);
+        msg_free(resp);
+        return RMT_OK;
+    }
+
+    thread_stat_incr(wdata, total_msgs_sent, 1);
+    thread_stat_decr(wdata, msgs_outqueue, 1);
     ASSERT(req->sent == 1);
     ASSERT(req->peer == NULL);
     req->peer = resp;
+    response_account(trnode, req, rmt_nsec_monotonic(), 
+        resp->type == MSG_RSP_REDIS_ERROR);
 
     log_debug(LOG_DEBUG, "%d msgs wait for response from target group", listLength(trnode->sent_data));
     
@@ -1795,7 +3453,8 @@ void parse_prepare(aeEventLoop *el, int fd, void *privdata, int mask)
     ASSERT(srnode->sockpairfds[1] == fd);
 
     if (rdb->type == REDIS_RDB_TYPE_FILE && 
-        ctx->source_type != GROUP_TYPE_AOFFILE) {
+        ctx->source_type != GROUP_TYPE_AOFFILE && 
+        !__atomic_load_n(&rdb->resumed, __ATOMIC_ACQUIRE)) {
         aeDeleteFileEvent(wdata->loop, srnode->sockpairfds[1], AE_READABLE);
 
         if (ctx->target_type == GROUP_TYPE_RDBFILE) {
@@ -1827,6 +3486,16 @@ void parse_prepare(aeEventLoop *el, int fd, void *privdata, int mask)
     }
 
     aeDeleteFileEvent(wdata->loop, srnode->sockpairfds[1], AE_READABLE);
+
+    if (__atomic_load_n(&rdb->resumed, __ATOMIC_ACQUIRE)) {
+        /* Resumed from the checkpoint, there is no rdb to parse. */
+        log_notice("Replication for node[%s] resumed from the checkpoint.", 
+            srnode->addr);
+        thread_stat_incr(wdata, rdb_parsed_count, 1);
+        if (srnode->next != NULL) {
+            rmt_write(srnode->next->sockpairfds[1], " ", 1);
+        }
+    }
     
     ret = aeCreateFileEvent(wdata->loop, srnode->sockpairfds[1], 
         AE_READABLE, parse_request, srnode);
@@ -1883,8 +3552,16 @@ void parse_request(aeEventLoop *el, int fd, void *privdata, int mask)
         log_error("ERROR: recieve data node state is error: %d", rr->repl_state);
         return;
     }
+
+    redis_repl_ack_batch(srnode);
     
     while(1){
+        if (source_node_held(srnode)) {
+            /* source_node_resume() notices it again */
+            srnode->parse_held = 1;
+            break;
+        }
+
         if(listLength(srnode->piece_data) > 0){
             log_debug(LOG_VVERB,"trgroup->piece_data:");
             mbuf_list_dump(srnode->piece_data, LOG_VVERB);
@@ -1973,7 +3650,14 @@ void parse_request(aeEventLoop *el, int fd, void *privdata, int mask)
         }
 
         MSG_DUMP(msg, LOG_VVERB, 0);
-        msg->parser(msg);
+        if (wdata->stat_parse_latency != NULL) {
+            long long start = rmt_nsec_monotonic();
+            msg->parser(msg);
+            hist_record(wdata->stat_parse_latency, 
+                (uint64_t)(rmt_nsec_monotonic() - start));
+        } else {
+            msg->parser(msg);
+        }
 
         if(msg->result == MSG_PARSE_OK){
             log_debug(LOG_DEBUG, "msg %s parse ok", 
@@ -1982,6 +3666,9 @@ void parse_request(aeEventLoop *el, int fd, void *privdata, int mask)
             mbuf = listLastValue(msg->data);
             if (msg->pos == mbuf->last){
                 //send msg                
+                if (data_type == REDIS_DATA_TYPE_CMD) {
+                    redis_repl_ack_parsed(srnode, msg->mlen, 1);
+                }
                 prepare_send_data(srnode);
                 continue;
             }
@@ -1997,6 +3684,9 @@ void parse_request(aeEventLoop *el, int fd, void *privdata, int mask)
             ASSERT(msg->mlen > 0);
 
             //send msg
+            if (data_type == REDIS_DATA_TYPE_CMD) {
+                redis_repl_ack_parsed(srnode, msg->mlen, 1);
+            }
             prepare_send_data(srnode);
         }else if(msg->result == MSG_PARSE_REPAIR){
             log_debug(LOG_DEBUG, "msg %s parse repair", 
@@ -2019,6 +3709,10 @@ void parse_request(aeEventLoop *el, int fd, void *privdata, int mask)
                 MSG_DUMP_ALL(msg, LOG_NOTICE, 0);
                 mbuf_list_dump_all(srnode->piece_data, LOG_NOTICE);
             }
+
+            if (data_type == REDIS_DATA_TYPE_CMD) {
+                redis_repl_ack_parsed(srnode, 0, 0);
+            }
             
             msg_put(srnode->msg);
             msg_free(srnode->msg);
@@ -2136,6 +3830,73 @@ int notice_write_thread(redis_node *srnode)
     return RMT_OK;
 }
 
+/* Notice the write thread to resume its held source nodes, from any thread. */
+void notice_write_thread_resume(thread_data *wdata)
+{
+    /* The write thread clears noticed before it checks the nodes. */
+    if (__sync_bool_compare_and_swap(&wdata->noticed, 0, 1)) {
+        rmt_write(wdata->notice_fds[0], " ", 1);
+    }
+}
+
+static void write_thread_notice(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    thread_data *wdata = privdata;
+    redis_node *srnode;
+    listNode *ln;
+    char buf[64];
+
+    RMT_NOTUSED(el);
+    RMT_NOTUSED(mask);
+
+    ASSERT(fd == wdata->notice_fds[1]);
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    wdata->noticed = 0;
+    __sync_synchronize();
+
+    ln = listFirst(wdata->nodes);
+    while (ln != NULL) {
+        srnode = listNodeValue(ln);
+        if (srnode->apply_blocked) {
+            apply_drain(srnode);
+        }
+        source_node_resume(srnode);
+        ln = ln->next;
+    }
+}
+
+/*
+ * If the source node must stop parsing, so the msgs parsed do not pile 
+ * up in memory: some msgs are parked behind a barrier msg, or a target 
+ * node has a backlog it can not send now (see target_node_backlog).
+ */
+int source_node_held(redis_node *srnode)
+{
+    return listLength(srnode->apply_parked) > 0 ||
+        __atomic_load_n(&srnode->ctx->targets_backlogged, __ATOMIC_SEQ_CST) > 0;
+}
+
+/* Parse the source node stopped by MIGRATE PAUSE or source_node_held() again. */
+void source_node_resume(redis_node *srnode)
+{
+    thread_data *wdata = srnode->write_data;
+
+    if (source_node_held(srnode)) {
+        return;
+    }
+
+    if (!wdata->tunables.paused) {
+        redis_parse_rdb_resume(srnode);
+    }
+
+    if (srnode->parse_held) {
+        srnode->parse_held = 0;
+        notice_write_thread(srnode);
+    }
+}
+
 static redis_group *
 group_create_from_option(rmtContext *ctx, char *addrs, int type, int source)
 {
@@ -2340,6 +4101,9 @@ void redis_migrate(rmtContext *ctx, int type)
     thread_data *rdata;
     struct array *write_datas = NULL; //type : thread_data
     thread_data *wdata;
+    struct array *apply_datas = NULL; //type : thread_data
+    thread_data *adata;
+    apply_queue *aq;
     redis_node *rnode;
     listNode *lnode;
 
@@ -2506,10 +4270,19 @@ void redis_migrate(rmtContext *ctx, int type)
         }
 
         node_next_nodes_count = 0;
-        rnode = listFirstValue(wdata->nodes);
-        while (rnode) {
-            node_next_nodes_count ++;
-            rnode = rnode->next;
+        lnode = wdata->nodes->head;
+        while (lnode) {
+            rnode = lnode->value;
+            lnode = lnode->next;
+            if (rnode->lane < 0 ? rnode != listFirstValue(wdata->nodes) : 
+                rnode->lane_order != 0) {
+                continue;
+            }
+
+            while (rnode) {
+                node_next_nodes_count ++;
+                rnode = rnode->next;
+            }
         }
         if (node_next_nodes_count != wdata->nodes_count && 
             srgroup->kind != GROUP_TYPE_RDBFILE) {
@@ -2524,8 +4297,20 @@ void redis_migrate(rmtContext *ctx, int type)
         goto done;
     }
 
+    if (ctx->apply_threads > 0 && ctx->target_type != GROUP_TYPE_RDBFILE) {
+        apply_datas = apply_threads_create(ctx, write_datas);
+        if (apply_datas == NULL) {
+            log_error("Error: Apply threads create failed");
+            goto done;
+        }
+        log_notice("Apply threads count: %d", ctx->apply_threads);
+    }
+
     ctx->rdatas = read_datas;
     ctx->wdatas = write_datas;
+    ctx->adatas = apply_datas;
+
+    threads_place(ctx, read_datas, write_datas, apply_datas);
 
     ret = proxy_begin(ctx);
     if (ret != RMT_OK) {
@@ -2540,6 +4325,14 @@ void redis_migrate(rmtContext *ctx, int type)
         	NULL, read_thread_run, rdata);
     }
     
+    //Run the apply job
+    for(i = 0; apply_datas != NULL && i < (int)array_n(apply_datas); i ++){
+        adata = array_get(apply_datas, (uint32_t)i);
+
+        pthread_create(&adata->thread_id, 
+            NULL, apply_thread_run, adata);
+    }
+
     //Run the write job
     for(i = 0; i < write_threads_count; i ++){
         wdata = array_get(write_datas, (uint32_t)i);
@@ -2564,8 +4357,21 @@ void redis_migrate(rmtContext *ctx, int type)
 		pthread_join(wdata->thread_id, NULL);
 	}
 
+    //wait for the apply job finish, after the write job
+    for(i = 0; apply_datas != NULL && i < (int)array_n(apply_datas); i ++){
+        adata = array_get(apply_datas, (uint32_t)i);
+        aq = adata->data;
+        aq->stop = 1;
+        pthread_join(adata->thread_id, NULL);
+    }
+
 done:
 
+    ctx->adatas = NULL;
+    if (apply_datas != NULL) {
+        apply_threads_destroy(apply_datas);
+    }
+
     if (read_datas != NULL) {
         read_threads_destroy(read_datas);
     }
@@ -84,6 +84,7 @@ typedef int err_t;     /* error type */
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
 #include <ctype.h>
 #include <errno.h>
 #include <stddef.h>
@@ -114,6 +115,11 @@ typedef int err_t;     /* error type */
 #include <rmt_locklist.h>
 #include <rmt_unlocklist.h>
 #include <rmt_mbuf.h>
+#include <rmt_spilllist.h>
+#include <rmt_histogram.h>
+#include <rmt_ratelimit.h>
+#include <rmt_slowlog.h>
+#include <rmt_keyprofile.h>
 #include <rmt_message.h>
 
 #include <ae/ae.h>
@@ -133,9 +139,32 @@ struct redis_group;
 #define RMT_IOV_MAX IOV_MAX
 #endif
 
+/* The iovecs gathered for one send to a target node start from
+ * RMT_IOV_BATCH, grow up to the kernel IOV_MAX while the whole batches
+ * are sent, and shrink when the socket buffer is full. */
+#define RMT_IOV_BATCH       RMT_IOV_MAX
+#define RMT_IOV_BATCH_MIN   16
+#define RMT_IOV_BATCH_MAX   IOV_MAX
+
+/* The msgs queued to a target node stopped by the rate limits or the
+ * max_inflight window, from which the source nodes stop parsing. */
+#define RMT_TARGET_BACKLOG      10000
+
+/* The smallest batch that is sent with MSG_ZEROCOPY, below it the
+ * page pinning and completion costs more than the copy. */
+#define RMT_ZEROCOPY_MIN_BYTES  (64 * 1024)
+
+/* How the threads are pinned to the cpus. A read thread and the write
+ * thread of the same source nodes are always put on one NUMA node. */
+#define CPU_PLACEMENT_NONE      0   /* not pinned */
+#define CPU_PLACEMENT_COMPACT   1   /* fill the cpus of a NUMA node before the next */
+#define CPU_PLACEMENT_SCATTER   2   /* round robin over the NUMA nodes */
+
 /* Anti-warning macro... */
 #define RMT_NOTUSED(V) ((void) V)
 
+#define RMT_CACHELINE_SIZE  64
+
 #define RMT_NOTICE_FLAG_NULL        0
 #define RMT_NOTICE_FLAG_SHUTDOWN    (1<<0)
 
@@ -174,6 +203,27 @@ struct instance {
     int             max_clients;
 };
 
+/*
+ * The parameters changed by CONFIG SET and MIGRATE PAUSE|RESUME while 
+ * migrating. The main thread changes ctx->tunables under rwl_notice and 
+ * bumps the epoch, every thread copies them in its cron when it sees an
+ * epoch other than its own.
+ */
+typedef struct rmt_tunables {
+    long long epoch;    /* bumped by every change */
+    int step;           /* mbufs of the rdb parsed at one time, 0 for no limit */
+    int send_batch;     /* max iovecs gathered for one send to a target node */
+    int max_inflight;   /* max msgs sent to a target node and waiting for the replies, 0 for no limit */
+    int paused;         /* stop reading from the source nodes */
+    long long rate_limit_bytes;         /* bytes per second sent to the target group, 0 for no limit */
+    long long rate_limit_cmds;          /* commands per second sent to the target group, 0 for no limit */
+    long long target_rate_limit_bytes;  /* bytes per second sent to every target node, 0 for no limit */
+    long long target_rate_limit_cmds;   /* commands per second sent to every target node, 0 for no limit */
+    long long rate_limit_burst;         /* milliseconds of the rates that can be sent at once */
+    long long slowlog_log_slower_than;  /* microseconds of the replies put into the slowlog */
+    long long slowlog_max_len;          /* max entries in the slowlog, 0 for no slowlog */
+} rmt_tunables;
+
 typedef struct rmtContext {
     dict *commands;                     /* Command table */
     rmt_conf *cf;
@@ -197,6 +247,15 @@ typedef struct rmtContext {
 
     int step;
     int source_safe;
+    long long source_headroom;  /* memory of a source machine for the rdb generations at one time */
+    int zerocopy;       /* send large batches to targets with MSG_ZEROCOPY */
+    int checkpoint;     /* persist the acknowledged replication offsets to resume with PSYNC */
+    int key_profile;    /* profile the keys of the rdb into a json report in dir */
+    long long spill_threshold;  /* cmd data of a source node in memory before spilling to dir */
+    int spill_compress;         /* compress the spilled cmd data with lzf */
+    int apply_threads;          /* threads sending the msgs partitioned by key, 0 to send in the write threads */
+    int cpu_placement;          /* CPU_PLACEMENT_*, how the threads are pinned to the cpus */
+    sds cpu_list;               /* the cpus to pin the threads on, NULL for all the allowed cpus */
 
     sds dir;
 
@@ -204,6 +263,10 @@ typedef struct rmtContext {
 
     struct array *rdatas;   /* read thread_data */
     struct array *wdatas;   /* write thread_data */
+    struct array *adatas;   /* apply thread_data, NULL if no apply threads */
+
+    volatile long long cluster_moved;   /* -MOVED replies from the target cluster, the routes are refreshed when it grows */
+    volatile int targets_backlogged;    /* target nodes with a backlog they can not send now, see source_node_held() */
 
     /* The fllow region used for client connect to migrate tool */
     aeEventLoop *loop;
@@ -221,8 +284,54 @@ typedef struct rmtContext {
     pthread_rwlock_t rwl_notice;        /* read write lock */
     int              flags_notice;      /* used to notice the threads */
     int              finish_count_after_notice; /* finished thread count after the main thread noticed */
+    rmt_tunables     tunables;          /* changed at runtime, under rwl_notice */
+    ratelimits       ratelimits;        /* token buckets of the sends to the target group */
+    slowlog          slowlog;           /* slowest replies of the target group */
 }rmtContext;
 
+/*
+ * Counters of a thread. They are only changed by the thread itself with 
+ * thread_stat_incr/thread_stat_decr and read by the other threads with 
+ * thread_stat, so no lock is needed.
+ */
+typedef struct thread_stats{
+    uint64_t total_msgs_recv;           /* total msg received for this thread */
+    uint64_t total_msgs_sent;           /* total msg sent to target group and replied for this thread */
+    uint64_t total_net_input_bytes;     /* total bytes received from source group for this read thread */
+    uint64_t total_net_output_bytes;    /* total bytes sent to target group for this write thread */
+    uint64_t msgs_outqueue;             /* the count of msgs that will be sent to target group and msgs had been sent to target but waiting for the response */
+    uint64_t total_msgs_retried;        /* total msgs sent again for the transient errors of the target group */
+    uint64_t total_msgs_retry_dropped;  /* total msgs dropped after REDIS_TARGET_RETRY_TIMES retries */
+    uint64_t total_msgs_redirected;     /* total msgs sent again for the -MOVED or -ASK of the target cluster */
+    uint64_t total_asking_sent;         /* total ASKING sent before the msgs redirected by -ASK */
+    int rdb_received_count;             /* the rdb received count for this read thread */
+    int rdb_parsed_count;               /* the rdb parse finished count for this write thread */
+    int aof_loaded_count;               /* the aof file load finished count for this read thread */
+}thread_stats;
+
+#define thread_stat(_tdata, _field)                                 \
+    __atomic_load_n(&(_tdata)->stat._field, __ATOMIC_RELAXED)
+
+#define thread_stat_incr(_tdata, _field, _n)                        \
+    __atomic_store_n(&(_tdata)->stat._field,                        \
+        (_tdata)->stat._field + (_n), __ATOMIC_RELAXED)
+
+#define thread_stat_decr(_tdata, _field, _n)                        \
+    __atomic_store_n(&(_tdata)->stat._field,                        \
+        (_tdata)->stat._field - (_n), __ATOMIC_RELAXED)
+
+/*
+ * Counters of one command type sent to the target group by a write or
+ * apply thread, changed and read like thread_stats.
+ */
+typedef struct command_stats{
+    uint64_t calls;     /* replies received, or msgs sent with noreply */
+    uint64_t bytes;     /* bytes of the requests */
+    uint64_t errors;    /* error replies */
+    uint64_t retries;   /* error replies the msg was retried or redirected for, not in calls */
+    uint64_t nsec;      /* time from the send to the reply, also of the retried ones */
+}command_stats;
+
 typedef struct thread_data{
     int id;
     pthread_t thread_id;
@@ -243,20 +352,36 @@ typedef struct thread_data{
     long long correct_keys_count;
 
     int cronloops;          /* Number of times the cron function run */
+
+    int cpu;                /* cpu this thread is pinned to, -1 if not pinned */
+    int numa_node;          /* NUMA node of the cpu, -1 if unknown */
     
     void *data;             /* data for this thread */
 
-    volatile uint64_t stat_total_msgs_recv;         /* total msg received for this thread */
-    volatile uint64_t stat_total_msgs_sent;         /* total msg received for this thread */
-    volatile uint64_t stat_total_net_input_bytes;   /* total bytes received from source group for this read thread */
-    volatile uint64_t stat_total_net_output_bytes;  /* total bytes sent to target group for this write thread */
-    volatile int      stat_rdb_received_count;      /* the rdb received count for this read thread */
-    volatile int      stat_rdb_parsed_count;        /* the rdb parse finished count for this write thread */
-    volatile int      stat_aof_loaded_count;        /* the aof file load finished count for this read thread */
-    volatile uint64_t stat_mbufs_inqueue;           /* the count of mbufs that recived from source group */
-    volatile uint64_t stat_msgs_outqueue;           /* the count of msgs that will be sent to target group and msgs had been sent to target but waiting for the response */
+    int notice_fds[2];      /* notice_fds[0]: other threads, notice_fds[1]: this write thread, to resume the held source nodes */
+    volatile int noticed;   /* this write thread was noticed and did not read notice_fds[1] yet */
+
+    rmt_tunables tunables;  /* the copy of ctx->tunables for this thread */
+
+    /* Padded to cache lines of its own, so the writes of the threads to the
+     * thread_data around it in the array don't bounce the counters. */
+    char stat_pad0[RMT_CACHELINE_SIZE];
+    thread_stats stat;
+    char stat_pad1[RMT_CACHELINE_SIZE];
+
+    histogram *stat_queue_latency;  /* time the msgs waited in send_data of the target nodes for this write thread */
+    histogram *stat_parse_latency;  /* time to parse a mbuf of commands for this write thread */
+    command_stats *stat_commands;   /* indexed by msg_type_t, the commands sent by this write thread */
 }thread_data;
 
+/* Msgs handed to an apply thread by the write threads, in thread_data.data */
+typedef struct apply_queue{
+    mttlist *msgs;              /* type: msg, msg->ptr is the target node of the apply thread */
+    int sockpairfds[2];         /* sockpairfds[0]: write threads, sockpairfds[1]: apply thread */
+    volatile int noticed;       /* the apply thread was noticed and did not pop the msgs yet */
+    volatile int stop;          /* the write threads were stopped */
+}apply_queue;
+
 rmtContext *init_context(struct instance *nci);
 void destroy_context(rmtContext *rmt_ctx);
 
@@ -269,6 +394,7 @@ void reset_notice_flag(rmtContext *ctx);
 int get_finish_count_after_notice(rmtContext *ctx);
 void add_finish_count_after_notice(rmtContext *ctx);
 void reset_finish_count_after_notice(rmtContext *ctx);
+void set_tunables(rmtContext *ctx, rmt_tunables *tunables);
 
 
 unsigned int dictSdsHash(const void *key);
@@ -279,12 +405,21 @@ void dictGroupNodeDestructor(void *privdata, void *val);
 int core_core(rmtContext *ctx);
 
 int prepare_send_msg(redis_node *srnode, struct msg *msg, redis_node *trnode);
+int target_node_queue(redis_node *trnode, struct msg *msg);
+int target_node_retry(redis_node *trnode, struct msg *msg);
+void command_stat_retried(thread_data *wdata, struct msg *req);
+int apply_send_msg(redis_node *srnode, struct msg *msg, redis_node *trnode, 
+    uint8_t *key, uint32_t keylen);
+void apply_msg_done(struct msg *msg);
 
 void parse_prepare(aeEventLoop *el, int fd, void *privdata, int mask);
 void parse_request(aeEventLoop *el, int fd, void *privdata, int mask);
 int parse_response(redis_node *trnode);
 
 int notice_write_thread(redis_node *srnode);
+void notice_write_thread_resume(thread_data *wdata);
+int source_node_held(redis_node *srnode);
+void source_node_resume(redis_node *srnode);
 
 redis_group *source_group_create(rmtContext *ctx);
 void source_group_destroy(redis_group *srgroup);
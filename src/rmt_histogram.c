@@ -0,0 +1,92 @@
+
+#include <rmt_core.h>
+
+histogram *
+hist_create(void)
+{
+    histogram *h;
+
+    h = rmt_alloc(sizeof(*h));
+    if (h == NULL) {
+        return NULL;
+    }
+
+    hist_reset(h);
+
+    return h;
+}
+
+void
+hist_destroy(histogram *h)
+{
+    rmt_free(h);
+}
+
+void
+hist_reset(histogram *h)
+{
+    memset((void *)h, 0, sizeof(*h));
+}
+
+/* Add the counts of src, that may be recorded at the same time, to dst. */
+void
+hist_merge(histogram *dst, histogram *src)
+{
+    uint32_t i;
+    uint64_t count = 0, max, n;
+
+    for (i = 0; i < HIST_BUCKETS; i ++) {
+        n = src->counts[i];
+        dst->counts[i] += n;
+        count += n;
+    }
+
+    dst->count += count;
+    max = src->max;
+    if (max > dst->max) {
+        dst->max = max;
+    }
+}
+
+/* The highest value equivalent to the value at bucket i. */
+static uint64_t
+hist_bucket_value(uint32_t i)
+{
+    uint32_t shift;
+
+    if (i < HIST_SUB_COUNT) {
+        return i;
+    }
+
+    shift = i / HIST_SUB_COUNT - 1;
+    return ((uint64_t)(HIST_SUB_COUNT + i % HIST_SUB_COUNT + 1) << shift) - 1;
+}
+
+/* The value below which p percent of the values are, 0 if empty. */
+uint64_t
+hist_percentile(histogram *h, double p)
+{
+    uint32_t i;
+    uint64_t count = 0, total = 0, rank;
+
+    for (i = 0; i < HIST_BUCKETS; i ++) {
+        total += h->counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t)(p / 100.0 * (double)total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < HIST_BUCKETS; i ++) {
+        count += h->counts[i];
+        if (count >= rank) {
+            return MIN(hist_bucket_value(i), h->max);
+        }
+    }
+
+    return h->max;
+}
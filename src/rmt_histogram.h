@@ -0,0 +1,54 @@
+#ifndef _RMT_HISTOGRAM_H_
+#define _RMT_HISTOGRAM_H_
+
+#define HIST_SUB_BITS   3                       /* 8 sub-buckets for every power of 2, ~12% error */
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS   48                      /* values up to 2^48 ns, ~78 hours */
+#define HIST_BUCKETS    ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/*
+ * Log-bucketed latency histogram in nanoseconds, in the style of
+ * HdrHistogram. It is recorded by one thread only, other threads read 
+ * it without locks and merge it into their own with hist_merge().
+ */
+typedef struct histogram{
+    volatile uint64_t counts[HIST_BUCKETS];
+    volatile uint64_t count;
+    volatile uint64_t max;
+}histogram;
+
+static inline uint32_t
+hist_index(uint64_t v)
+{
+    uint32_t shift;
+
+    if (v < HIST_SUB_COUNT) {
+        return (uint32_t)v;
+    }
+
+    if (v >= (1ULL << HIST_MAX_BITS)) {
+        return HIST_BUCKETS - 1;
+    }
+
+    shift = (uint32_t)(63 - __builtin_clzll(v)) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_COUNT + 
+        (uint32_t)((v >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+static inline void
+hist_record(histogram *h, uint64_t v)
+{
+    h->counts[hist_index(v)] ++;
+    h->count ++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+histogram *hist_create(void);
+void hist_destroy(histogram *h);
+void hist_reset(histogram *h);
+void hist_merge(histogram *dst, histogram *src);
+uint64_t hist_percentile(histogram *h, double p);
+
+#endif
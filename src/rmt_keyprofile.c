@@ -0,0 +1,475 @@
+
+#include <rmt_core.h>
+
+/* The counters own the prefixes, the index only points to them. */
+static dictType prefixDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
+keyprofile *
+keyprofile_create(const char *fname)
+{
+    keyprofile *kp;
+
+    kp = rmt_zalloc(sizeof(*kp));
+    if (kp == NULL) {
+        return NULL;
+    }
+
+    kp->top = rmt_zalloc(KEYPROFILE_TOP_KEYS*sizeof(*kp->top));
+    kp->prefixes = rmt_zalloc(KEYPROFILE_PREFIXES*sizeof(*kp->prefixes));
+    kp->heap = rmt_zalloc(KEYPROFILE_PREFIXES*sizeof(*kp->heap));
+    kp->index = dictCreate(&prefixDictType, NULL);
+    kp->scratch = sdsempty();
+    kp->fname = sdsnew(fname);
+    if (kp->top == NULL || kp->prefixes == NULL || kp->heap == NULL ||
+        kp->index == NULL || kp->scratch == NULL || kp->fname == NULL) {
+        keyprofile_destroy(kp);
+        return NULL;
+    }
+
+    return kp;
+}
+
+void
+keyprofile_destroy(keyprofile *kp)
+{
+    if (kp->top != NULL && kp->prefixes != NULL && kp->index != NULL) {
+        keyprofile_reset(kp);
+    }
+
+    if (kp->top != NULL) {
+        rmt_free(kp->top);
+    }
+    if (kp->prefixes != NULL) {
+        rmt_free(kp->prefixes);
+    }
+    if (kp->heap != NULL) {
+        rmt_free(kp->heap);
+    }
+    if (kp->index != NULL) {
+        dictRelease(kp->index);
+    }
+    if (kp->scratch != NULL) {
+        sdsfree(kp->scratch);
+    }
+    if (kp->fname != NULL) {
+        sdsfree(kp->fname);
+    }
+
+    rmt_free(kp);
+}
+
+/* Drop the keys profiled, for the rdb parsed again. */
+void
+keyprofile_reset(keyprofile *kp)
+{
+    uint32_t i;
+
+    rmt_memset(kp->types, 0, sizeof(kp->types));
+
+    for (i = 0; i < kp->ntop; i++) {
+        sdsfree(kp->top[i].key);
+    }
+    kp->ntop = 0;
+
+    dictEmpty(kp->index, NULL);
+    for (i = 0; i < kp->nprefixes; i++) {
+        sdsfree(kp->prefixes[i].prefix);
+    }
+    kp->nprefixes = 0;
+
+    kp->reported = 0;
+}
+
+static void
+keyprofile_top_sift_down(keyprofile *kp, uint32_t i)
+{
+    keyprofile_key tmp;
+    uint32_t child;
+
+    while ((child = 2*i + 1) < kp->ntop) {
+        if (child + 1 < kp->ntop &&
+            kp->top[child + 1].bytes < kp->top[child].bytes) {
+            child++;
+        }
+        if (kp->top[i].bytes <= kp->top[child].bytes) {
+            break;
+        }
+        tmp = kp->top[i];
+        kp->top[i] = kp->top[child];
+        kp->top[child] = tmp;
+        i = child;
+    }
+}
+
+static void
+keyprofile_top_sift_up(keyprofile *kp, uint32_t i)
+{
+    keyprofile_key tmp;
+    uint32_t parent;
+
+    while (i > 0) {
+        parent = (i - 1)/2;
+        if (kp->top[parent].bytes <= kp->top[i].bytes) {
+            break;
+        }
+        tmp = kp->top[i];
+        kp->top[i] = kp->top[parent];
+        kp->top[parent] = tmp;
+        i = parent;
+    }
+}
+
+/* Keep the key if it is one of the KEYPROFILE_TOP_KEYS biggest so far. */
+static void
+keyprofile_top_add(keyprofile *kp, sds key, int type, uint64_t bytes,
+    uint64_t elements, long long expire)
+{
+    keyprofile_key *k;
+    uint32_t i;
+
+    if (kp->ntop < KEYPROFILE_TOP_KEYS) {
+        i = kp->ntop;
+        k = &kp->top[i];
+        k->key = sdsdup(key);
+        if (k->key == NULL) {
+            return;
+        }
+        kp->ntop++;
+    } else if (bytes > kp->top[0].bytes) {
+        i = 0;
+        k = &kp->top[i];
+        k->key = sdscpylen(k->key, key, sdslen(key));
+    } else {
+        return;
+    }
+
+    k->type = type;
+    k->bytes = bytes;
+    k->elements = elements;
+    k->expire = expire;
+
+    if (i == 0) {
+        keyprofile_top_sift_down(kp, i);
+    } else {
+        keyprofile_top_sift_up(kp, i);
+    }
+}
+
+static void
+keyprofile_heap_swap(keyprofile *kp, uint32_t i, uint32_t j)
+{
+    keyprofile_prefix *tmp = kp->heap[i];
+
+    kp->heap[i] = kp->heap[j];
+    kp->heap[j] = tmp;
+    kp->heap[i]->pos = i;
+    kp->heap[j]->pos = j;
+}
+
+/* The counter at i was incremented, move it down the min heap. */
+static void
+keyprofile_heap_sift_down(keyprofile *kp, uint32_t i)
+{
+    uint32_t child;
+
+    while ((child = 2*i + 1) < kp->nprefixes) {
+        if (child + 1 < kp->nprefixes &&
+            kp->heap[child + 1]->keys < kp->heap[child]->keys) {
+            child++;
+        }
+        if (kp->heap[i]->keys <= kp->heap[child]->keys) {
+            break;
+        }
+        keyprofile_heap_swap(kp, i, child);
+        i = child;
+    }
+}
+
+static void
+keyprofile_heap_sift_up(keyprofile *kp, uint32_t i)
+{
+    uint32_t parent;
+
+    while (i > 0) {
+        parent = (i - 1)/2;
+        if (kp->heap[parent]->keys <= kp->heap[i]->keys) {
+            break;
+        }
+        keyprofile_heap_swap(kp, i, parent);
+        i = parent;
+    }
+}
+
+/*
+ * Count the key in the counter of its prefix. When all the counters are
+ * taken, the prefix takes over the counter with the least keys, so a
+ * prefix with more than 1/KEYPROFILE_PREFIXES of the keys is never lost.
+ */
+static void
+keyprofile_prefix_add(keyprofile *kp, sds key, uint64_t bytes)
+{
+    keyprofile_prefix *pp;
+    char *sep;
+    size_t len;
+
+    sep = memchr(key, KEYPROFILE_PREFIX_SEP, sdslen(key));
+    len = sep == NULL ? 0 : (size_t)(sep - key);
+    kp->scratch = sdscpylen(kp->scratch, key, MIN(len, KEYPROFILE_PREFIX_MAX));
+
+    pp = dictFetchValue(kp->index, kp->scratch);
+    if (pp != NULL) {
+        pp->keys++;
+        pp->bytes += bytes;
+        keyprofile_heap_sift_down(kp, pp->pos);
+        return;
+    }
+
+    if (kp->nprefixes < KEYPROFILE_PREFIXES) {
+        pp = &kp->prefixes[kp->nprefixes];
+        pp->prefix = sdsdup(kp->scratch);
+        if (pp->prefix == NULL) {
+            return;
+        }
+        pp->keys = 1;
+        pp->error = 0;
+        pp->bytes = bytes;
+        pp->pos = kp->nprefixes;
+        kp->heap[kp->nprefixes++] = pp;
+        dictAdd(kp->index, pp->prefix, pp);
+        keyprofile_heap_sift_up(kp, pp->pos);
+        return;
+    }
+
+    pp = kp->heap[0];
+    dictDelete(kp->index, pp->prefix);
+    pp->prefix = sdscpylen(pp->prefix, kp->scratch, sdslen(kp->scratch));
+    pp->error = pp->keys;
+    pp->keys++;
+    pp->bytes = bytes;
+    dictAdd(kp->index, pp->prefix, pp);
+    keyprofile_heap_sift_down(kp, 0);
+}
+
+/* Profile a key of the rdb of bytes encoded and elements in the value. */
+void
+keyprofile_add(keyprofile *kp, sds key, int type, uint64_t bytes,
+    uint64_t elements, long long expire)
+{
+    keyprofile_type *kt;
+    uint32_t bucket = 0;
+
+    if (type < 0 || type >= KEYPROFILE_TYPES) {
+        return;
+    }
+
+    kt = &kp->types[type];
+    kt->keys++;
+    kt->bytes += bytes;
+    kt->elements += elements;
+    if (expire >= 0) {
+        kt->expires++;
+    }
+    if (bytes > kt->max_bytes) {
+        kt->max_bytes = bytes;
+    }
+
+    while (bucket < KEYPROFILE_BUCKETS - 1 && (bytes >> (bucket + 1)) > 0) {
+        bucket++;
+    }
+    kt->hist[bucket]++;
+
+    keyprofile_top_add(kp, key, type, bytes, elements, expire);
+    keyprofile_prefix_add(kp, key, bytes);
+}
+
+/* Append str as a json string, the bytes that are not printable ascii
+ * are escaped one by one. */
+static sds
+json_string(sds s, const char *str, size_t len)
+{
+    size_t i;
+    unsigned char c;
+
+    s = sdscatlen(s, "\"", 1);
+    for (i = 0; i < len; i++) {
+        c = (unsigned char)str[i];
+        if (c == '"' || c == '\\') {
+            s = sdscatprintf(s, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7f) {
+            s = sdscatprintf(s, "\\u%04x", c);
+        } else {
+            s = sdscatlen(s, &str[i], 1);
+        }
+    }
+
+    return sdscatlen(s, "\"", 1);
+}
+
+static int
+keyprofile_key_compare(const void *a, const void *b)
+{
+    const keyprofile_key *ka = a, *kb = b;
+
+    return ka->bytes < kb->bytes ? 1 : (ka->bytes > kb->bytes ? -1 : 0);
+}
+
+static int
+keyprofile_prefix_compare(const void *a, const void *b)
+{
+    const keyprofile_prefix *pa = *(keyprofile_prefix * const *)a;
+    const keyprofile_prefix *pb = *(keyprofile_prefix * const *)b;
+
+    return pa->keys < pb->keys ? 1 : (pa->keys > pb->keys ? -1 : 0);
+}
+
+static sds
+keyprofile_json(keyprofile *kp, const char *node, int rdbver)
+{
+    keyprofile_type *kt;
+    keyprofile_key *top;
+    keyprofile_prefix **prefixes;
+    uint64_t keys = 0, bytes = 0, expires = 0;
+    uint32_t i, j, last;
+    int type;
+    sds s;
+
+    for (type = 0; type < KEYPROFILE_TYPES; type++) {
+        keys += kp->types[type].keys;
+        bytes += kp->types[type].bytes;
+        expires += kp->types[type].expires;
+    }
+
+    s = sdsempty();
+    s = sdscat(s, "{\n  \"node\": ");
+    s = json_string(s, node, strlen(node));
+    s = sdscatprintf(s, ",\n  \"rdb_version\": %d,\n"
+        "  \"time\": %lld,\n"
+        "  \"keys\": %"PRIu64",\n"
+        "  \"bytes\": %"PRIu64",\n"
+        "  \"expires\": %"PRIu64",\n"
+        "  \"types\": {",
+        rdbver, rmt_msec_now()/1000, keys, bytes, expires);
+
+    for (type = 0; type < KEYPROFILE_TYPES; type++) {
+        kt = &kp->types[type];
+        s = sdscatprintf(s, "%s\n    \"%s\": {\"keys\": %"PRIu64
+            ", \"bytes\": %"PRIu64", \"elements\": %"PRIu64
+            ", \"expires\": %"PRIu64", \"max_bytes\": %"PRIu64
+            ", \"histogram\": [",
+            type == 0 ? "" : ",", get_redis_type_string(type), kt->keys,
+            kt->bytes, kt->elements, kt->expires, kt->max_bytes);
+
+        /* buckets up to the last one with keys, by their upper bound */
+        for (last = KEYPROFILE_BUCKETS; last > 0 && kt->hist[last - 1] == 0; last--);
+        for (j = 0; j < last; j++) {
+            if (j == KEYPROFILE_BUCKETS - 1) {
+                s = sdscatprintf(s, "%s{\"le\": null, \"keys\": %"PRIu64"}",
+                    j == 0 ? "" : ", ", kt->hist[j]);
+            } else {
+                s = sdscatprintf(s, "%s{\"le\": %llu, \"keys\": %"PRIu64"}",
+                    j == 0 ? "" : ", ", (1ULL << (j + 1)) - 1, kt->hist[j]);
+            }
+        }
+        s = sdscat(s, "]}");
+    }
+    s = sdscat(s, "\n  },\n  \"big_keys\": [");
+
+    top = rmt_alloc(MAX(kp->ntop, 1)*sizeof(*top));
+    if (top != NULL) {
+        rmt_memcpy(top, kp->top, kp->ntop*sizeof(*top));
+        qsort(top, kp->ntop, sizeof(*top), keyprofile_key_compare);
+        for (i = 0; i < kp->ntop; i++) {
+            s = sdscatprintf(s, "%s\n    {\"key\": ", i == 0 ? "" : ",");
+            s = json_string(s, top[i].key, sdslen(top[i].key));
+            s = sdscatprintf(s, ", \"type\": \"%s\", \"bytes\": %"PRIu64
+                ", \"elements\": %"PRIu64", \"expire\": %lld}",
+                get_redis_type_string(top[i].type), top[i].bytes,
+                top[i].elements, top[i].expire);
+        }
+        rmt_free(top);
+    }
+    s = sdscat(s, "\n  ],\n  \"prefixes\": [");
+
+    prefixes = rmt_alloc(MAX(kp->nprefixes, 1)*sizeof(*prefixes));
+    if (prefixes != NULL) {
+        rmt_memcpy(prefixes, kp->heap, kp->nprefixes*sizeof(*prefixes));
+        qsort(prefixes, kp->nprefixes, sizeof(*prefixes),
+            keyprofile_prefix_compare);
+        for (i = 0; i < kp->nprefixes; i++) {
+            s = sdscatprintf(s, "%s\n    {\"prefix\": ", i == 0 ? "" : ",");
+            s = json_string(s, prefixes[i]->prefix, sdslen(prefixes[i]->prefix));
+            s = sdscatprintf(s, ", \"keys\": %"PRIu64", \"error\": %"PRIu64
+                ", \"bytes\": %"PRIu64"}",
+                prefixes[i]->keys, prefixes[i]->error, prefixes[i]->bytes);
+        }
+        rmt_free(prefixes);
+    }
+    s = sdscat(s, "\n  ]\n}\n");
+
+    return s;
+}
+
+/* Write the json report of the keys profiled, with a rename so the file
+ * is always complete. */
+int
+keyprofile_report(keyprofile *kp, const char *node, int rdbver)
+{
+    sds json, tmpname;
+    FILE *fp;
+
+    json = keyprofile_json(kp, node, rdbver);
+    tmpname = sdscatfmt(sdsempty(), "%s.tmp", kp->fname);
+    if (json == NULL || tmpname == NULL) {
+        log_error("ERROR: Out of memory");
+        goto error;
+    }
+
+    fp = fopen(tmpname, "w");
+    if (fp == NULL) {
+        log_error("ERROR: Open key profile file %s failed: %s",
+            tmpname, strerror(errno));
+        goto error;
+    }
+
+    if (fwrite(json, 1, sdslen(json), fp) != sdslen(json) ||
+        fflush(fp) != 0) {
+        log_error("ERROR: Write key profile file %s failed: %s",
+            tmpname, strerror(errno));
+        fclose(fp);
+        unlink(tmpname);
+        goto error;
+    }
+    fclose(fp);
+
+    if (rename(tmpname, kp->fname) == -1) {
+        log_error("ERROR: Rename key profile file %s to %s failed: %s",
+            tmpname, kp->fname, strerror(errno));
+        unlink(tmpname);
+        goto error;
+    }
+
+    sdsfree(json);
+    sdsfree(tmpname);
+
+    kp->reported = 1;
+
+    return RMT_OK;
+
+error:
+
+    if (json != NULL) {
+        sdsfree(json);
+    }
+    if (tmpname != NULL) {
+        sdsfree(tmpname);
+    }
+
+    return RMT_ERROR;
+}
@@ -0,0 +1,67 @@
+#ifndef _RMT_KEYPROFILE_H_
+#define _RMT_KEYPROFILE_H_
+
+#define KEYPROFILE_TYPES        5       /* REDIS_STRING to REDIS_HASH */
+#define KEYPROFILE_BUCKETS      32      /* bucket n for the sizes in [2^n, 2^(n+1)), the last for bigger */
+#define KEYPROFILE_TOP_KEYS     100     /* biggest keys kept */
+#define KEYPROFILE_PREFIXES     1024    /* counters of the key prefixes sketch */
+#define KEYPROFILE_PREFIX_MAX   64      /* bytes of a key prefix kept */
+#define KEYPROFILE_PREFIX_SEP   ':'
+
+/* The keys of one type, the sizes are the bytes encoded in the rdb. */
+typedef struct keyprofile_type{
+    volatile uint64_t keys;
+    volatile uint64_t bytes;
+    volatile uint64_t elements;
+    volatile uint64_t expires;          /* keys with a ttl */
+    volatile uint64_t max_bytes;
+    uint64_t hist[KEYPROFILE_BUCKETS];  /* keys by their size */
+}keyprofile_type;
+
+typedef struct keyprofile_key{
+    sds key;
+    int type;
+    uint64_t bytes;
+    uint64_t elements;
+    long long expire;   /* unix time in milliseconds, -1 for none */
+}keyprofile_key;
+
+/* A counter of the Space-Saving sketch of the key prefixes. */
+typedef struct keyprofile_prefix{
+    sds prefix;
+    uint64_t keys;      /* over counted by error at most */
+    uint64_t error;     /* keys of the prefixes this counter took over */
+    uint64_t bytes;     /* since this prefix took over the counter */
+    uint32_t pos;       /* in the heap */
+}keyprofile_prefix;
+
+/*
+ * Profile of the keys of a rdb with bounded memory, built by the thread
+ * parsing the rdb: the keys and sizes by type, the biggest keys in a min
+ * heap, and the most frequent key prefixes (before the first ':') in a
+ * Space-Saving sketch. INFO reads the counters of the types without lock.
+ */
+typedef struct keyprofile{
+    keyprofile_type types[KEYPROFILE_TYPES];
+
+    keyprofile_key *top;            /* min heap by bytes */
+    uint32_t ntop;
+
+    keyprofile_prefix *prefixes;
+    keyprofile_prefix **heap;       /* min heap by keys */
+    uint32_t nprefixes;
+    dict *index;                    /* prefix to its counter */
+    sds scratch;                    /* prefix of the key being added */
+
+    sds fname;                      /* the json report */
+    volatile int reported;          /* the report of the last rdb is written */
+}keyprofile;
+
+keyprofile *keyprofile_create(const char *fname);
+void keyprofile_destroy(keyprofile *kp);
+void keyprofile_reset(keyprofile *kp);
+void keyprofile_add(keyprofile *kp, sds key, int type, uint64_t bytes,
+    uint64_t elements, long long expire);
+int keyprofile_report(keyprofile *kp, const char *node, int rdbver);
+
+#endif
@@ -12,14 +12,56 @@ int         LOG_RORATE                      = 0;
 ssize_t     LOG_FIEL_MAX_SIZE_FOR_ROTATING  = 1048576;  /* 1MB */
 int         LOG_FILE_COUNT_TO_STAY          = 2;
 
+int         rmt_log_level                   = RMT_LOG_DEFAULT;
+
 static struct logger logger;
 
+/* A line formatted by a thread and waiting for the logger thread */
+struct log_line {
+    volatile uint64_t seq;  /* the ring position it can be pushed (== pos) or popped (== pos+1) at */
+    struct timeval tv;
+    int len;
+    char buf[LOG_MAX_LEN];
+};
+
+/* Lines of a call site in the current second, to suppress error storms */
+struct log_site {
+    const char *volatile file;  /* NULL if the slot is free */
+    volatile int line;
+    volatile long sec;
+    volatile int count;
+    volatile int suppressed;
+};
+
+/*
+ * A bounded multi-producer single-consumer ring of log lines. The threads
+ * claim a line with a CAS on head and publish it with its seq, the logger
+ * thread writes the published lines in order in big batches. When the
+ * ring is full the lines are dropped and counted, the threads never wait.
+ */
+static struct log_ring {
+    struct log_line *lines;
+    volatile uint64_t head;     /* next position to push at */
+    uint64_t tail;              /* next position to pop at, logger thread only */
+    volatile uint64_t dropped;  /* lines dropped when the ring was full */
+    uint64_t dropped_reported;
+
+    volatile int running;
+    volatile int stop;
+    volatile int waiting;       /* the logger thread waits for lines */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    struct log_site sites[LOG_SITE_SIZE];
+} ring;
+
 int
 log_init(int level, char *name)
 {
     struct logger *l = &logger;
 
-    l->level = MAX(LOG_EMERG, MIN(level, LOG_PVERB));
+    rmt_log_level = MAX(LOG_EMERG, MIN(level, LOG_PVERB));
     l->name = name;
     if (name == NULL || !strlen(name)) {
         l->fd = STDERR_FILENO;
@@ -88,32 +130,26 @@ log_reopen(void)
 void
 log_level_up(void)
 {
-    struct logger *l = &logger;
-
-    if (l->level < LOG_PVERB) {
-        l->level++;
-        log_safe("up log level to %d", l->level);
+    if (rmt_log_level < LOG_PVERB) {
+        rmt_log_level++;
+        log_safe("up log level to %d", rmt_log_level);
     }
 }
 
 void
 log_level_down(void)
 {
-    struct logger *l = &logger;
-
-    if (l->level > LOG_EMERG) {
-        l->level--;
-        log_safe("down log level to %d", l->level);
+    if (rmt_log_level > LOG_EMERG) {
+        rmt_log_level--;
+        log_safe("down log level to %d", rmt_log_level);
     }
 }
 
 void
 log_level_set(int level)
 {
-    struct logger *l = &logger;
-
-    l->level = MAX(LOG_EMERG, MIN(level, LOG_PVERB));
-    loga("set log level to %d", l->level);
+    rmt_log_level = MAX(LOG_EMERG, MIN(level, LOG_PVERB));
+    loga("set log level to %d", rmt_log_level);
 }
 
 void
@@ -127,41 +163,334 @@ log_stacktrace(void)
     rmt_stacktrace_fd(l->fd);
 }
 
+/* Format the time prefix of a line, the length is returned. */
+static int
+log_time(char *buf, int size, struct timeval *tv)
+{
+    struct tm tm;
+    int len = 0;
+
+    buf[len++] = '[';
+    len += rmt_strftime(buf + len, size - len, "%Y-%m-%d %H:%M:%S.", 
+        localtime_r(&tv->tv_sec, &tm));
+    len += rmt_scnprintf(buf + len, size - len, "%03ld] ", tv->tv_usec/1000);
+
+    return len;
+}
+
+/* Claim a line of the ring, NULL if it is full. */
+static struct log_line *
+log_ring_claim(void)
+{
+    struct log_line *ll;
+    uint64_t pos;
+    int64_t diff;
+
+    pos = ring.head;
+    for (;;) {
+        ll = &ring.lines[pos & (LOG_RING_SIZE - 1)];
+        diff = (int64_t)(__atomic_load_n(&ll->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring.head, &pos, pos + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                return ll;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = ring.head;
+        }
+    }
+}
+
+static void
+log_ring_publish(struct log_line *ll)
+{
+    __atomic_store_n(&ll->seq, ll->seq + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ring.waiting) {
+        pthread_mutex_lock(&ring.mutex);
+        pthread_cond_signal(&ring.cond);
+        pthread_mutex_unlock(&ring.mutex);
+    }
+}
+
+/*
+ * Count a line of the call site file:line, 1 is returned if it is beyond 
+ * LOG_SITE_BURST lines in this second and must not be logged. The count 
+ * of the suppressed lines of the last second is put in *suppressed.
+ */
+static int
+log_site_suppress(const char *file, int line, long sec, int *suppressed)
+{
+    struct log_site *site;
+    const char *expected = NULL;
+    long old;
+    uint32_t h;
+
+    *suppressed = 0;
+
+    h = (uint32_t)(((uintptr_t)file >> 3) ^ ((uint32_t)line * 2654435761U));
+    site = &ring.sites[h & (LOG_SITE_SIZE - 1)];
+    if (site->file != file) {
+        if (!__atomic_compare_exchange_n(&site->file, &expected, file, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return 0;   /* taken by another call site */
+        }
+        site->line = line;
+    }
+    if (site->line != line) {
+        return 0;
+    }
+
+    old = site->sec;
+    if (old != sec && __atomic_compare_exchange_n(&site->sec, &old, sec, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > LOG_SITE_BURST) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Report the lines suppressed in the seconds before sec by the call 
+ * sites that were not logged again. */
+static void
+log_site_report(long sec)
+{
+    struct log_site *site;
+    int i, suppressed;
+
+    for (i = 0; i < LOG_SITE_SIZE; i++) {
+        site = &ring.sites[i];
+        if (site->file == NULL || site->sec >= sec || site->suppressed == 0) {
+            continue;
+        }
+
+        suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+        if (suppressed > 0) {
+            _log(site->file, site->line, 0, "%d similar lines were suppressed", 
+                suppressed);
+        }
+    }
+}
+
+/* Write the published lines, the count of the lines is returned. */
+static int
+log_ring_drain(struct logger *l)
+{
+    struct log_line *ll;
+    char buf[64 * LOG_MAX_LEN];
+    int len = 0, count = 0;
+    uint64_t dropped;
+    ssize_t n;
+
+    for (;;) {
+        ll = &ring.lines[ring.tail & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&ll->seq, __ATOMIC_ACQUIRE) != ring.tail + 1 ||
+            len + 64 + ll->len >= (int)sizeof(buf)) {
+            if (len == 0) {
+                break;
+            }
+
+            n = rmt_write(l->fd, buf, len);
+            if (n < 0) {
+                l->nerror++;
+            } else {
+                _log_rotating(n, l);
+            }
+            len = 0;
+            continue;
+        }
+
+        len += log_time(buf + len, (int)sizeof(buf) - len, &ll->tv);
+        memcpy(buf + len, ll->buf, (size_t)ll->len);
+        len += ll->len;
+        buf[len++] = '\n';
+
+        __atomic_store_n(&ll->seq, ring.tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        ring.tail++;
+        count++;
+    }
+
+    dropped = ring.dropped;
+    if (dropped != ring.dropped_reported) {
+        _log(__FILE__, __LINE__, 0, "%"PRIu64" log lines are dropped, "
+            "the log ring is full", dropped - ring.dropped_reported);
+        ring.dropped_reported = dropped;
+    }
+
+    return count;
+}
+
+static void *
+log_ring_run(void *arg)
+{
+    struct logger *l = arg;
+    struct timespec ts;
+    long reported = 0;
+
+    for (;;) {
+        if (log_ring_drain(l) > 0) {
+            continue;
+        }
+        if (ring.stop) {
+            break;
+        }
+
+        if ((long)time(NULL) != reported) {
+            reported = (long)time(NULL);
+            log_site_report(reported);
+        }
+
+        pthread_mutex_lock(&ring.mutex);
+        ring.waiting = 1;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring.lines[ring.tail & (LOG_RING_SIZE - 1)].seq,
+                __ATOMIC_ACQUIRE) != ring.tail + 1 && !ring.stop) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&ring.cond, &ring.mutex, &ts);
+        }
+        ring.waiting = 0;
+        pthread_mutex_unlock(&ring.mutex);
+    }
+
+    return NULL;
+}
+
+/*
+ * Start the logger thread, the lines of _log() are written by it from 
+ * now on. It must be called after the daemonization, the thread does 
+ * not survive fork(). The lines left are written at exit().
+ */
 int
-log_loggable(int level)
+log_ring_start(void)
 {
     struct logger *l = &logger;
+    uint64_t i;
 
-    if (level > l->level) {
+    if (l->fd < 0 || ring.running) {
         return 0;
     }
 
-    return 1;
+    ring.lines = rmt_alloc(LOG_RING_SIZE * sizeof(struct log_line));
+    if (ring.lines == NULL) {
+        return -1;
+    }
+    for (i = 0; i < LOG_RING_SIZE; i++) {
+        ring.lines[i].seq = i;
+    }
+    ring.head = 0;
+    ring.tail = 0;
+    ring.stop = 0;
+    ring.waiting = 0;
+    pthread_mutex_init(&ring.mutex, NULL);
+    pthread_cond_init(&ring.cond, NULL);
+
+    if (pthread_create(&ring.thread, NULL, log_ring_run, l) != 0) {
+        log_error("ERROR: create the logger thread failed");
+        rmt_free(ring.lines);
+        ring.lines = NULL;
+        return -1;
+    }
+    ring.running = 1;
+
+    atexit(log_ring_stop);
+
+    return 0;
+}
+
+/* Stop the logger thread after the lines in the ring are written. */
+void
+log_ring_stop(void)
+{
+    if (!ring.running || pthread_equal(pthread_self(), ring.thread)) {
+        return;
+    }
+
+    pthread_mutex_lock(&ring.mutex);
+    ring.stop = 1;
+    pthread_cond_signal(&ring.cond);
+    pthread_mutex_unlock(&ring.mutex);
+
+    pthread_join(ring.thread, NULL);
+    ring.running = 0;
+
+    /* the lines pushed while the thread was stopping */
+    log_ring_drain(&logger);
+    log_site_report(LONG_MAX);
 }
 
 void
-_log(const char *file, int line, int panic, const char *fmt, ...)
+_log(const char *file, int line, int flags, const char *fmt, ...)
 {
     struct logger *l = &logger;
-    int len, size, errno_save;
+    int len, size, errno_save, suppressed;
     char buf[LOG_MAX_LEN];
     va_list args;
     ssize_t n;
     struct timeval tv;
+    struct log_line *ll = NULL;
 
     if (l->fd < 0) {
         return;
     }
 
     errno_save = errno;
-    len = 0;            /* length of output buffer */
-    size = LOG_MAX_LEN; /* size of output buffer */
-
     gettimeofday(&tv, NULL);
-    buf[len++] = '[';
-    len += rmt_strftime(buf + len, size - len, "%Y-%m-%d %H:%M:%S.", localtime(&tv.tv_sec));
-    len += rmt_scnprintf(buf + len, size - len, "%03ld", tv.tv_usec/1000);
-    len += rmt_scnprintf(buf + len, size - len, "] %s:%d ", file, line);
+
+    if (flags & LOG_F_PANIC) {
+        log_ring_stop();
+    } else if (ring.running) {
+        if ((flags & LOG_F_DEDUP) && 
+            log_site_suppress(file, line, (long)tv.tv_sec, &suppressed)) {
+            errno = errno_save;
+            return;
+        }
+
+        if ((flags & LOG_F_DEDUP) && suppressed > 0 && 
+            (ll = log_ring_claim()) != NULL) {
+            ll->tv = tv;
+            ll->len = rmt_scnprintf(ll->buf, LOG_MAX_LEN, "%s:%d %d similar "
+                "lines were suppressed", file, line, suppressed);
+            log_ring_publish(ll);
+        }
+
+        ll = log_ring_claim();
+        if (ll == NULL) {
+            errno = errno_save;
+            return;
+        }
+    }
+
+    if (ll != NULL) {
+        ll->tv = tv;
+        len = rmt_scnprintf(ll->buf, LOG_MAX_LEN - 1, "%s:%d ", file, line);
+        va_start(args, fmt);
+        len += rmt_vscnprintf(ll->buf + len, LOG_MAX_LEN - 1 - len, fmt, args);
+        va_end(args);
+        ll->len = len;
+        log_ring_publish(ll);
+
+        errno = errno_save;
+        return;
+    }
+
+    size = LOG_MAX_LEN; /* size of output buffer */
+    len = log_time(buf, size, &tv);
+    len += rmt_scnprintf(buf + len, size - len, "%s:%d ", file, line);
 
     va_start(args, fmt);
     len += rmt_vscnprintf(buf + len, size - len, fmt, args);
@@ -180,7 +509,7 @@ _log(const char *file, int line, int panic, const char *fmt, ...)
 
     errno = errno_save;
 
-    if (panic) {
+    if (flags & LOG_F_PANIC) {
         abort();
     }
 }
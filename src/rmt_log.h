@@ -29,7 +29,6 @@ extern int      LOG_FILE_COUNT_TO_STAY;
 
 struct logger {
     char *name;  /* log file name */
-    int  level;  /* log level */
     int  fd;     /* log file descriptor */
     int  nerror; /* # log error */
 
@@ -58,6 +57,18 @@ struct logger {
 
 #define LOG_MAX_LEN 512 /* max length of log message */
 
+#define LOG_RING_SIZE   4096    /* lines waiting for the logger thread, a power of 2 */
+#define LOG_SITE_SIZE   1024    /* call sites tracked to suppress the repeated lines, a power of 2 */
+#define LOG_SITE_BURST  20      /* lines of one call site logged in a second */
+
+extern int rmt_log_level;   /* the lines above it are not logged */
+
+/* flags of _log() */
+#define LOG_F_PANIC     1   /* abort after the line is written */
+#define LOG_F_DEDUP     2   /* suppress the lines of the call site beyond LOG_SITE_BURST in a second */
+
+#define log_loggable(_level) ((_level) <= rmt_log_level)
+
 /*
  * log_stderr   - log to stderr
  * loga         - log always
@@ -72,13 +83,13 @@ struct logger {
 #ifdef RMT_DEBUG_LOG
 
 #define log_debug(_level, ...) do {                                         \
-    if (log_loggable(_level) != 0) {                                        \
+    if (rmt_unlikely(log_loggable(_level))) {                               \
         _log(__FILE__, __LINE__, 0, __VA_ARGS__);                           \
     }                                                                       \
 } while (0)
 
 #define log_hexdump(_level, _data, _datalen, ...) do {                      \
-    if (log_loggable(_level) != 0) {                                        \
+    if (rmt_unlikely(log_loggable(_level))) {                               \
         _log(__FILE__, __LINE__, 0, __VA_ARGS__);                           \
         _log_hexdump(__FILE__, __LINE__, (char *)(_data), (int)(_datalen),  \
                      __VA_ARGS__);                                          \
@@ -120,13 +131,13 @@ struct logger {
 
 #define log_error(...) do {                                                 \
     if (log_loggable(LOG_ALERT) != 0) {                                     \
-        _log(__FILE__, __LINE__, 0, __VA_ARGS__);                           \
+        _log(__FILE__, __LINE__, LOG_F_DEDUP, __VA_ARGS__);                 \
     }                                                                       \
 } while (0)
 
 #define log_warn(...) do {                                                  \
     if (log_loggable(LOG_WARN) != 0) {                                      \
-        _log(__FILE__, __LINE__, 0, __VA_ARGS__);                           \
+        _log(__FILE__, __LINE__, LOG_F_DEDUP, __VA_ARGS__);                 \
     }                                                                       \
 } while (0)
 
@@ -144,19 +155,20 @@ struct logger {
 
 #define log_panic(...) do {                                                 \
     if (log_loggable(LOG_EMERG) != 0) {                                     \
-        _log(__FILE__, __LINE__, 1, __VA_ARGS__);                           \
+        _log(__FILE__, __LINE__, LOG_F_PANIC, __VA_ARGS__);                 \
     }                                                                       \
 } while (0)
 
 int log_init(int level, char *filename);
 void log_deinit(void);
+int log_ring_start(void);
+void log_ring_stop(void);
 void log_level_up(void);
 void log_level_down(void);
 void log_level_set(int level);
 void log_stacktrace(void);
 void log_reopen(void);
-int log_loggable(int level);
-void _log(const char *file, int line, int panic, const char *fmt, ...);
+void _log(const char *file, int line, int flags, const char *fmt, ...);
 void _log_stderr(const char *fmt, ...);
 void _log_stdout(const char *fmt, ...);
 void _log_safe(const char *fmt, ...);
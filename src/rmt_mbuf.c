@@ -77,12 +77,78 @@ mbuf_get(mbuf_base *mb)
 
     mbuf->pos = mbuf->start;
     mbuf->last = mbuf->start;
+    mbuf->seg = NULL;
 
     log_debug(LOG_VVERB, "get mbuf %p", mbuf);
 
     return mbuf;
 }
 
+/*
+ * Create a segment for the external buffer data. The caller holds the
+ * first reference, and must drop it with mbuf_seg_put() after attaching
+ * the segment to mbufs.
+ */
+struct mbuf_seg *
+mbuf_seg_create(void *data, void (*free)(void *))
+{
+    struct mbuf_seg *seg;
+
+    seg = rmt_alloc(sizeof(*seg));
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    seg->refcount = 1;
+    seg->data = data;
+    seg->free = free;
+
+    return seg;
+}
+
+void
+mbuf_seg_put(struct mbuf_seg *seg)
+{
+    if (__sync_sub_and_fetch(&seg->refcount, 1) > 0) {
+        return;
+    }
+
+    if (seg->free != NULL) {
+        seg->free(seg->data);
+    }
+    rmt_free(seg);
+}
+
+/*
+ * Get a mbuf referencing n bytes at pos inside the segment seg, without
+ * copying them. The mbuf is full from the start, so nothing can be
+ * appended to it, and it is released back to the segment by mbuf_put().
+ */
+struct mbuf *
+mbuf_get_seg(mbuf_base *mb, struct mbuf_seg *seg, uint8_t *pos, size_t n)
+{
+    struct mbuf *mbuf;
+
+    mbuf = rmt_alloc(sizeof(*mbuf));
+    if (mbuf == NULL) {
+        return NULL;
+    }
+
+    __sync_add_and_fetch(&seg->refcount, 1);
+
+    mbuf->mb = mb;
+    mbuf->magic = MBUF_MAGIC;
+    mbuf->start = pos;
+    mbuf->pos = pos;
+    mbuf->last = pos + n;
+    mbuf->end = mbuf->last;
+    mbuf->seg = seg;
+
+    log_debug(LOG_VVERB, "get mbuf %p of segment %p len %zu", mbuf, seg, n);
+
+    return mbuf;
+}
+
 static void
 mbuf_free(struct mbuf *mbuf)
 {
@@ -116,6 +182,13 @@ mbuf_put(struct mbuf *mbuf)
         return RMT_ERROR;
     }
 
+    if(mbuf->seg != NULL)
+    {
+        mbuf_seg_put(mbuf->seg);
+        rmt_free(mbuf);
+        return RMT_OK;
+    }
+
     if(mb->free_mbufs == NULL || mttlist_length(mb->free_mbufs) > 10000)
     {
         mbuf_free(mbuf);
@@ -227,13 +300,26 @@ mbuf_split(struct mbuf *mbuf, uint8_t *pos)
 
     ASSERT(pos >= mbuf->pos && pos <= mbuf->last);
 
+    size = (size_t)(mbuf->last - pos);
+
+    if (mbuf->seg != NULL) {
+        /* reference the tail of the segment instead of copying it */
+        nbuf = mbuf_get_seg(mb, mbuf->seg, pos, size);
+        if (nbuf == NULL) {
+            return NULL;
+        }
+
+        mbuf->last = pos;
+        mbuf->end = pos;
+        return nbuf;
+    }
+
     nbuf = mbuf_get(mb);
     if (nbuf == NULL) {
         return NULL;
     }
 
 	/* copy data from mbuf to nbuf */
-    size = (size_t)(mbuf->last - pos);
     mbuf_copy(nbuf, pos, size);
 
     /* adjust mbuf */
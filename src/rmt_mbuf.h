@@ -10,6 +10,17 @@ typedef struct mbuf_base{
     mttlist  *free_mbufs;   /* free mbuf list */
 }mbuf_base;
 
+/*
+ * External buffer that mbufs can reference instead of copying its data
+ * into the chunk, such as a large value decoded from the rdb. The buffer
+ * is released with free() when the last mbuf referencing it is put.
+ */
+struct mbuf_seg {
+    volatile int       refcount;
+    void               *data;   /* external buffer */
+    void               (*free)(void *);
+};
+
 struct mbuf {
     mbuf_base          *mb;
     uint32_t           magic;   /* mbuf magic (const) */
@@ -17,12 +28,13 @@ struct mbuf {
     uint8_t            *last;   /* write marker */
     uint8_t            *start;  /* start of buffer (const) */
     uint8_t            *end;    /* end of buffer (const) */
+    struct mbuf_seg    *seg;    /* referenced external segment, or NULL */
 };
 
 typedef void (*mbuf_copy_t)(struct mbuf *, void *);
 
 #define MBUF_MAGIC      0xdeadbeef
-#define MBUF_HSIZE      sizeof(struct mbuf) //48
+#define MBUF_HSIZE      sizeof(struct mbuf) //56
 #define MBUF_MIN_SIZE   128
 #define MBUF_MAX_SIZE   16777216
 #define MBUF_SIZE       16384
@@ -44,6 +56,11 @@ void mbuf_base_destroy(mbuf_base *mb);
 
 struct mbuf *mbuf_get(mbuf_base *mb);
 int mbuf_put(struct mbuf *mbuf);
+
+struct mbuf_seg *mbuf_seg_create(void *data, void (*free)(void *));
+void mbuf_seg_put(struct mbuf_seg *seg);
+struct mbuf *mbuf_get_seg(mbuf_base *mb, struct mbuf_seg *seg, uint8_t *pos, size_t n);
+
 void mbuf_rewind(struct mbuf *mbuf);
 uint32_t mbuf_storage_length(struct mbuf *mbuf);
 uint32_t mbuf_length(struct mbuf *mbuf);
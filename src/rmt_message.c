@@ -88,6 +88,20 @@ _msg_get(void)
 
     msg->sent = 0;
 
+    msg->zc = NULL;
+    msg->zc_id = 0;
+    msg->ack = NULL;
+    msg->ack_lost = 0;
+    msg->srnode = NULL;
+    msg->apply_idx = 0;
+    msg->apply_barrier = 0;
+    msg->spos = NULL;
+    msg->redirects = 0;
+    msg->extra = 0;
+    msg->retry_alone = 0;
+    msg->retries = 0;
+    msg->stime = 0;
+
     msg->ptr = NULL;
     
     return msg;
@@ -161,6 +175,15 @@ msg_free(struct msg *msg)
 #endif
 
     log_debug(LOG_VVERB, "free msg %p id %"PRIu64"", msg, msg->id);
+
+    if (msg->ack != NULL) {
+        redis_repl_ack_put(msg);
+    }
+
+    if (msg->srnode != NULL) {
+        apply_msg_done(msg);
+    }
+
     rmt_free(msg);
 }
 
@@ -172,7 +195,14 @@ msg_put(struct msg *msg)
 
     log_debug(LOG_VVERB, "put msg %p id %"PRIu64"", msg, msg->id);
 
-    while (listLength(msg->data) > 0) {
+    if (msg->zc != NULL && rmt_zerocopy_pending(msg->zc, msg->zc_id)) {
+        /* the kernel may still read the mbufs */
+        rmt_zerocopy_hold(msg->zc, msg->zc_id, msg->data);
+        msg->data = NULL;
+        msg->zc = NULL;
+    }
+
+    while (msg->data != NULL && listLength(msg->data) > 0) {
 
         node = listFirst(msg->data);
         mbuf = listNodeValue(node);
@@ -182,8 +212,10 @@ msg_put(struct msg *msg)
         mbuf_put(mbuf);
     }
 
-    listRelease(msg->data);
-    msg->data = NULL;
+    if (msg->data != NULL) {
+        listRelease(msg->data);
+        msg->data = NULL;
+    }
 
     if (msg->frag_seq) {
         rmt_free(msg->frag_seq);
@@ -208,23 +240,20 @@ msg_type_string(msg_type_t type)
 sds
 msg_cmd_string(msg_type_t type)
 {
-    char *msg_string;
-    sds *parts = NULL; 
-    int parts_count = 0;
-    sds command = NULL;
+    const char *name;
+    sds command;
 
-    msg_string = msg_type_string(type);
-    parts = sdssplitlen(msg_string,strlen(msg_string),"_",1,&parts_count);
-    if (parts == NULL) return command;
+    name = redis_command_name(type);
+    if (name == NULL) {
+        return NULL;
+    }
 
-    if (parts_count != 3) {
-        sdsfreesplitres(parts, parts_count);
-        return command;
+    command = sdsnew(name);
+    if (command == NULL) {
+        return NULL;
     }
 
-    command = parts[2];
-    parts[2] = NULL;
-    sdsfreesplitres(parts, parts_count);
+    sdstoupper(command);
 
     return command;
 }
@@ -235,6 +264,97 @@ msg_empty(struct msg *msg)
     return msg->mlen == 0 ? 1 : 0;
 }
 
+/*
+ * Move the pos of the mbufs of the sent msg back, so it can be sent
+ * again. Returns RMT_ERROR if the mbufs do not hold the whole msg.
+ */
+int
+msg_rewind(struct msg *msg)
+{
+    listNode *node;
+    struct mbuf *mbuf;
+    uint32_t len = 0;
+
+    if (msg->spos == NULL) {
+        return RMT_ERROR;
+    }
+
+    for (node = listFirst(msg->data); node != NULL; node = listNextNode(node)) {
+        mbuf = listNodeValue(node);
+        if (node == listFirst(msg->data)) {
+            mbuf->pos = msg->spos;
+        } else {
+            mbuf->pos = mbuf->start;
+        }
+        len += mbuf_length(mbuf);
+    }
+
+    if (len != msg->mlen) {
+        return RMT_ERROR;
+    }
+
+    return RMT_OK;
+}
+
+/* Whether some but not all of the msg was sent. */
+int
+msg_sent_partially(struct msg *msg)
+{
+    listNode *node;
+    uint32_t len = 0;
+
+    for (node = listFirst(msg->data); node != NULL; node = listNextNode(node)) {
+        len += mbuf_length(listNodeValue(node));
+    }
+
+    return len != msg->mlen && len != 0;
+}
+
+/*
+ * Get an extra msg to take the place of the request msg in the queue of
+ * its target node: it drops the reply of msg, or sends the rest of msg 
+ * if msg was sent partially. msg is rewound to be sent again from the 
+ * start. Returns NULL if msg can not be sent again.
+ */
+struct msg *
+msg_stand_in(struct msg *msg)
+{
+    struct msg *sub;
+    struct mbuf *mbuf;
+    listNode *node;
+
+    sub = msg_get(msg->mb, 1, REDIS_DATA_TYPE_CMD);
+    if (sub == NULL) {
+        return NULL;
+    }
+
+    sub->type = msg->type;
+    sub->extra = 1;
+    sub->sent = msg->sent;
+    sub->stime = msg->stime;
+
+    for (node = listFirst(msg->data); !msg->sent && node != NULL; 
+        node = listNextNode(node)) {
+        mbuf = listNodeValue(node);
+        if (!mbuf_empty(mbuf) && msg_append_full(sub, mbuf->pos, 
+            mbuf_length(mbuf)) != RMT_OK) {
+            goto error;
+        }
+    }
+
+    if (msg_rewind(msg) != RMT_OK) {
+        goto error;
+    }
+
+    return sub;
+
+error:
+
+    msg_put(sub);
+    msg_free(sub);
+    return NULL;
+}
+
 uint32_t
 msg_backend_idx(struct msg *msg, uint8_t *key, uint32_t keylen)
 {
@@ -303,6 +423,30 @@ int msg_append_full(struct msg *msg, const uint8_t *pos, uint32_t n)
     return RMT_OK;
 }
 
+/*
+ * append n bytes at pos, that lie in the external segment seg, into msg
+ * by reference instead of copying them into mbufs
+ */
+int msg_append_seg(struct msg *msg, struct mbuf_seg *seg, uint8_t *pos, uint32_t n)
+{
+    struct mbuf *mbuf;
+
+    if (n == 0) {
+        return RMT_OK;
+    }
+
+    mbuf = mbuf_get_seg(msg->mb, seg, pos, n);
+    if (mbuf == NULL) {
+        log_error("ERROR: Mbuf get failed: out of memory");
+        return RMT_ENOMEM;
+    }
+
+    listAddNodeTail(msg->data, mbuf);
+    msg->mlen += n;
+
+    return RMT_OK;
+}
+
 /*
  * append small(small than a mbuf) content into msg
  */
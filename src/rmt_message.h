@@ -133,6 +133,7 @@ typedef enum msg_parse_result {
     ACTION( REQ_REDIS_INFO )                                                                        \
     ACTION( REQ_REDIS_QUIT )                                                                        \
     ACTION( REQ_REDIS_AUTH )                                                                        \
+    ACTION( REQ_REDIS_ASKING )                                                                      \
     ACTION( REQ_REDIS_SHUTDOWN )                                                                    \
     ACTION( REQ_REDIS_COMMAND )                                                                     \
     ACTION( REQ_REDIS_RENAME )                                                                      \
@@ -150,6 +151,9 @@ typedef enum msg_parse_result {
     ACTION( REQ_REDIS_GEORADIUSBYMEMBER )                                                           \
     ACTION( REQ_REDIS_MULTI )                                                                       \
     ACTION( REQ_REDIS_EXEC )                                                                        \
+    ACTION( REQ_REDIS_CONFIG )                 /* redis-migrate-tool requests */                    \
+    ACTION( REQ_REDIS_MIGRATE )                                                                     \
+    ACTION( REQ_REDIS_SLOWLOG )                                                                     \
     ACTION( RSP_REDIS_STATUS )                 /* redis response */                                 \
     ACTION( RSP_REDIS_ERROR )                                                                       \
     ACTION( RSP_REDIS_INTEGER )                                                                     \
@@ -225,6 +229,21 @@ struct msg {
 
     unsigned             sent:1;          /* have send to target */
 
+    struct rmt_zerocopy  *zc;             /* zerocopy state if sent with MSG_ZEROCOPY */
+    uint32_t             zc_id;           /* the last zerocopy send of this msg */
+
+    struct redis_repl_ack *ack;           /* replication batch acknowledged with this msg */
+    unsigned             ack_lost:1;      /* dropped without the acknowledgement? */
+    struct redis_node    *srnode;         /* source node waiting for the msg sent by an apply thread */
+    uint32_t             apply_idx;       /* apply thread of the msg parked by its source node */
+    unsigned             apply_barrier:1; /* has keys on different apply threads, or none? */
+    uint8_t              *spos;           /* start of the msg in the first mbuf, to send it again */
+    int                  redirects;       /* times redirected by the target cluster */
+    unsigned             extra:1;         /* ASKING, or a stand-in for a msg moved to another node: not counted, the reply is dropped */
+    int                  retries;         /* times sent again for the transient errors */
+    unsigned             retry_alone:1;   /* sent again for an error reply: the next msgs wait for its reply */
+    long long            stime;           /* monotonic ns it was queued to the target, then sent */
+
     int                  kind;
 
     void                 *ptr;
@@ -236,10 +255,14 @@ struct msg *msg_get(mbuf_base *mb, int request, int type);
 void msg_free(struct msg *msg);
 void msg_put(struct msg *msg);
 int msg_empty(struct msg *msg);
+int msg_rewind(struct msg *msg);
+int msg_sent_partially(struct msg *msg);
+struct msg *msg_stand_in(struct msg *msg);
 uint64_t msg_gen_frag_id(void);
 uint32_t msg_backend_idx(struct msg *msg, uint8_t *key, uint32_t keylen);
 struct mbuf *msg_ensure_mbuf(struct msg *msg, size_t len);
 int msg_append_full(struct msg *msg, const uint8_t *pos, uint32_t n);
+int msg_append_seg(struct msg *msg, struct mbuf_seg *seg, uint8_t *pos, uint32_t n);
 int msg_append(struct msg *msg, uint8_t *pos, size_t n);
 int msg_prepend(struct msg *msg, uint8_t *pos, size_t n);
 int msg_prepend_format(struct msg *msg, const char *fmt, ...);
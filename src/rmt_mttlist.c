@@ -137,3 +137,29 @@ int mttlist_init_with_unlocklist(mttlist *l)
     return RMT_OK;
 }
 
+/**
+* This is multi-thread safe list for one pushing thread and one popping thread.
+* Beyond the limit of mbufs in memory, it spills the mbufs to segment files.
+*/
+int mttlist_init_with_spilllist(mttlist *l, struct mbuf_base *mb, 
+    const char *prefix, long long limit, int compress)
+{
+    if(l == NULL)
+    {
+        return RMT_ERROR;
+    }
+
+    l->l = spilllist_create(mb, prefix, limit, compress);
+    if(l->l == NULL)
+    {
+        return RMT_ERROR;
+    }
+    
+    l->lock_push = spilllist_push;
+    l->lock_pop = spilllist_pop;
+    l->free = spilllist_free;
+    l->length = spilllist_length;
+
+    return RMT_OK;
+}
+
@@ -12,6 +12,8 @@ typedef struct mttlist{
 
 typedef int (*mttlist_init)(mttlist *);
 
+struct mbuf_base;
+
 /******** multi-thread safe list interface ********/
 
 mttlist *mttlist_create(void);
@@ -27,4 +29,7 @@ int mttlist_init_with_locklist(mttlist *l);
 
 int mttlist_init_with_unlocklist(mttlist *l);
 
+int mttlist_init_with_spilllist(mttlist *l, struct mbuf_base *mb, 
+    const char *prefix, long long limit, int compress);
+
 #endif
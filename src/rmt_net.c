@@ -17,6 +17,18 @@
 
 #include <rmt_core.h>
 
+#ifdef HAVE_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY     60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY    0x4000000
+#endif
+#endif
+
 /* number of times we retry to connect in the case of EADDRNOTAVAIL and
  * SO_REUSEADDR is being used. */
 #define RMT_CONNECT_RETRIES  10
@@ -1064,4 +1076,343 @@ rmt_sendv(int sd, struct array *sendv, size_t nsend)
     return RMT_ERROR;
 }
 
+typedef struct rmt_zerocopy_range {
+    uint32_t lo;
+    uint32_t hi;
+}rmt_zerocopy_range;
+
+typedef struct rmt_zerocopy_held {
+    uint32_t id;            /* the last zerocopy send of these mbufs */
+    list     *mbufs;        /* type: mbuf */
+}rmt_zerocopy_held;
+
+rmt_zerocopy *
+rmt_zerocopy_create(void)
+{
+    rmt_zerocopy *zc;
+
+    zc = rmt_alloc(sizeof(*zc));
+    if (zc == NULL) {
+        return NULL;
+    }
+
+    zc->sd = -1;
+    zc->disabled = 0;
+    zc->base = 0;
+    zc->next = 0;
+    zc->done = 0;
+    zc->nsend = 0;
+    zc->ncopied = 0;
+
+    zc->ranges = array_create(4, sizeof(rmt_zerocopy_range));
+    if (zc->ranges == NULL) {
+        rmt_free(zc);
+        return NULL;
+    }
+
+    zc->hold = listCreate();
+    if (zc->hold == NULL) {
+        array_destroy(zc->ranges);
+        rmt_free(zc);
+        return NULL;
+    }
+
+    return zc;
+}
+
+void
+rmt_zerocopy_destroy(rmt_zerocopy *zc)
+{
+    if (zc == NULL) {
+        return;
+    }
+
+    rmt_zerocopy_reset(zc);
+
+    array_destroy(zc->ranges);
+    listRelease(zc->hold);
+    rmt_free(zc);
+}
+
+static void
+zerocopy_hold_free(rmt_zerocopy_held *zh)
+{
+    struct mbuf *mbuf;
+
+    while ((mbuf = listPop(zh->mbufs)) != NULL) {
+        mbuf_put(mbuf);
+    }
+
+    listRelease(zh->mbufs);
+    rmt_free(zh);
+}
+
+/* Return the held mbufs whose sends are all completed to the pool. */
+static void
+zerocopy_release(rmt_zerocopy *zc)
+{
+    rmt_zerocopy_held *zh;
+
+    while (listLength(zc->hold) > 0) {
+        zh = listFirstValue(zc->hold);
+        if (rmt_zerocopy_pending(zc, zh->id)) {
+            break;
+        }
+
+        listPop(zc->hold);
+        zerocopy_hold_free(zh);
+    }
+}
+
+/* Called when the socket is closed: the kernel will not report the
+ * remaining completions, so release everything it held. */
+void
+rmt_zerocopy_reset(rmt_zerocopy *zc)
+{
+    rmt_zerocopy_held *zh;
+
+    while ((zh = listPop(zc->hold)) != NULL) {
+        zerocopy_hold_free(zh);
+    }
+
+    zc->ranges->nelem = 0;
+    zc->done = zc->next;
+    zc->sd = -1;
+}
+
+int
+rmt_zerocopy_enable(rmt_zerocopy *zc, int sd)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    int one = 1;
+
+    if (zc->disabled) {
+        return RMT_ERROR;
+    }
+
+    if (zc->sd == sd) {
+        return RMT_OK;
+    }
+
+    if (zc->sd >= 0) {
+        rmt_zerocopy_reset(zc);
+    }
+
+    if (rmt_setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        log_warn("set SO_ZEROCOPY on sd %d failed: %s, use the copying send",
+            sd, strerror(errno));
+        zc->disabled = 1;
+        return RMT_ERROR;
+    }
+
+    zc->sd = sd;
+    zc->base = zc->next;
+
+    return RMT_OK;
+#else
+    RMT_NOTUSED(sd);
+    zc->disabled = 1;
+    return RMT_ERROR;
+#endif
+}
+
+int
+rmt_zerocopy_pending(rmt_zerocopy *zc, uint32_t id)
+{
+    return (int32_t)(id - zc->done) >= 0 ? 1 : 0;
+}
+
+/* Take the mbufs list over until the send id is completed. */
+void
+rmt_zerocopy_hold(rmt_zerocopy *zc, uint32_t id, list *mbufs)
+{
+    rmt_zerocopy_held *zh;
+    struct mbuf *mbuf;
+
+    zh = rmt_alloc(sizeof(*zh));
+    if (zh == NULL) {
+        log_error("ERROR: hold zerocopy mbufs failed: out of memory");
+        goto release;
+    }
+
+    zh->id = id;
+    zh->mbufs = mbufs;
+
+    if (listAddNodeTail(zc->hold, zh) == NULL) {
+        log_error("ERROR: hold zerocopy mbufs failed: out of memory");
+        rmt_free(zh);
+        goto release;
+    }
+
+    return;
+
+release:
 
+    /* better to risk the sent data than to leak the mbufs */
+    while ((mbuf = listPop(mbufs)) != NULL) {
+        mbuf_put(mbuf);
+    }
+    listRelease(mbufs);
+}
+
+#ifdef HAVE_MSG_ZEROCOPY
+static void
+zerocopy_complete(rmt_zerocopy *zc, uint32_t lo, uint32_t hi)
+{
+    rmt_zerocopy_range *range;
+    uint32_t i;
+
+    if (lo != zc->done) {
+        range = array_push(zc->ranges);
+        if (range == NULL) {
+            log_error("ERROR: record zerocopy completion failed: out of memory");
+            return;
+        }
+        range->lo = lo;
+        range->hi = hi;
+        return;
+    }
+
+    zc->done = hi + 1;
+
+    /* merge the ranges that completed before this one */
+    i = 0;
+    while (i < array_n(zc->ranges)) {
+        range = array_get(zc->ranges, i);
+        if (range->lo != zc->done) {
+            i ++;
+            continue;
+        }
+
+        zc->done = range->hi + 1;
+        *range = *(rmt_zerocopy_range *)array_top(zc->ranges);
+        array_pop(zc->ranges);
+        i = 0;
+    }
+}
+#endif
+
+/* Read the completions from the socket error queue. */
+void
+rmt_zerocopy_reap(rmt_zerocopy *zc)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    char control[128];
+    ssize_t n;
+
+    if (zc->sd < 0 || zc->next == zc->done) {
+        return;
+    }
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        n = recvmsg(zc->sd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_debug(LOG_DEBUG, "recvmsg errqueue on sd %d failed: %s",
+                    zc->sd, strerror(errno));
+            }
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->ncopied += serr->ee_data - serr->ee_info + 1;
+                if (!zc->disabled) {
+                    /* loopback and some devices copy anyway */
+                    log_notice("zerocopy sends on sd %d are copied by the kernel, "
+                        "use the copying send", zc->sd);
+                    zc->disabled = 1;
+                }
+            }
+
+            zerocopy_complete(zc, zc->base + serr->ee_info,
+                zc->base + serr->ee_data);
+        }
+    }
+
+    zerocopy_release(zc);
+#else
+    RMT_NOTUSED(zc);
+#endif
+}
+
+/* Like rmt_sendv, but the kernel sends the mbufs without copying them.
+ * Return RMT_ENOMEM if the kernel can not pin more pages, and the
+ * caller should use the copying send. */
+ssize_t
+rmt_sendv_zerocopy(rmt_zerocopy *zc, struct array *sendv, size_t nsend)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    struct msghdr msg;
+    ssize_t n;
+
+    ASSERT(array_n(sendv) > 0);
+    ASSERT(nsend != 0);
+    ASSERT(zc->sd >= 0);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = sendv->elem;
+    msg.msg_iovlen = sendv->nelem;
+
+    for (;;) {
+        n = sendmsg(zc->sd, &msg, MSG_ZEROCOPY);
+
+        log_debug(LOG_VERB, "sendv zerocopy on sd %d %zd of %zu in %"PRIu32" buffers",
+                  zc->sd, n, nsend, sendv->nelem);
+
+        if (n > 0) {
+            zc->next ++;
+            zc->nsend ++;
+            return n;
+        }
+
+        if (n == 0) {
+            log_warn("sendv zerocopy on sd %d returned zero", zc->sd);
+            return 0;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return RMT_EAGAIN;
+        } else if (errno == ENOBUFS) {
+            log_debug(LOG_VERB, "sendv zerocopy on sd %d not ready - enobufs", zc->sd);
+            return RMT_ENOMEM;
+        } else {
+            log_error("ERROR: sendv zerocopy on sd %d failed: %s",
+                zc->sd, strerror(errno));
+            return RMT_ERROR;
+        }
+    }
+
+    NOT_REACHED();
+
+    return RMT_ERROR;
+#else
+    RMT_NOTUSED(zc);
+    RMT_NOTUSED(sendv);
+    RMT_NOTUSED(nsend);
+    return RMT_ENOMEM;
+#endif
+}
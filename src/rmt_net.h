@@ -133,5 +133,35 @@ int rmt_tcp_context_reconnect(tcp_context *tc);
 
 ssize_t rmt_sendv(int sd, struct array *sendv, size_t nsend);
 
+/*
+ * MSG_ZEROCOPY state of a connection. The kernel keeps reading the
+ * buffers of a zerocopy send until it reports the completion on the
+ * socket error queue, so the mbufs of such sends are held here and
+ * only returned to the pool after their completions were reaped.
+ * Ids keep growing across reconnects, the kernel ids of the current
+ * socket start from base.
+ */
+typedef struct rmt_zerocopy {
+    int         sd;         /* socket with SO_ZEROCOPY set, -1 if none */
+    int         disabled;   /* the kernel copied the data, stop using it */
+    uint32_t    base;       /* id of the first send on sd */
+    uint32_t    next;       /* id of the next send */
+    uint32_t    done;       /* sends before this id are completed */
+    struct array *ranges;   /* completed out of order, type: rmt_zerocopy_range */
+    list        *hold;      /* held mbufs, type: rmt_zerocopy_held */
+
+    uint64_t    nsend;      /* # zerocopy sends */
+    uint64_t    ncopied;    /* # sends the kernel copied anyway */
+}rmt_zerocopy;
+
+rmt_zerocopy *rmt_zerocopy_create(void);
+void rmt_zerocopy_destroy(rmt_zerocopy *zc);
+void rmt_zerocopy_reset(rmt_zerocopy *zc);
+int rmt_zerocopy_enable(rmt_zerocopy *zc, int sd);
+int rmt_zerocopy_pending(rmt_zerocopy *zc, uint32_t id);
+void rmt_zerocopy_hold(rmt_zerocopy *zc, uint32_t id, list *mbufs);
+void rmt_zerocopy_reap(rmt_zerocopy *zc);
+ssize_t rmt_sendv_zerocopy(rmt_zerocopy *zc, struct array *sendv, size_t nsend);
+
 #endif
 
@@ -0,0 +1,191 @@
+
+#include <rmt_core.h>
+
+ratelimit *
+ratelimit_create(void)
+{
+    ratelimit *rl;
+
+    rl = rmt_alloc(sizeof(*rl));
+    if (rl == NULL) {
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&rl->lock, NULL) != 0) {
+        rmt_free(rl);
+        return NULL;
+    }
+
+    rl->bytes = 0;
+    rl->cmds = 0;
+    rl->last = 0;
+    rl->throttled = 0;
+
+    return rl;
+}
+
+void
+ratelimit_destroy(ratelimit *rl)
+{
+    pthread_mutex_destroy(&rl->lock);
+    rmt_free(rl);
+}
+
+/* Refill the tokens for the time since the last refill, up to burst. */
+static double
+ratelimit_refill(double tokens, long long rate, long long burst,
+    long long elapsed)
+{
+    double max = (double)rate * (double)burst / 1000;
+
+    if (tokens >= max) {
+        return max;
+    }
+
+    tokens += (double)rate * (double)elapsed / 1000000000;
+
+    return tokens > max ? max : tokens;
+}
+
+/*
+ * Lower *bytes and *cmds to the tokens left, the rates of 0 are no limit
+ * and drop the tokens of their kind. Return 1 and count the throttle if 
+ * there are no tokens to send now.
+ */
+int
+ratelimit_allow(ratelimit *rl, long long bytes_rate, long long cmds_rate,
+    long long burst, long long now, size_t *bytes, long *cmds)
+{
+    long long elapsed;
+    int throttled = 0;
+
+    if (burst < RATELIMIT_BURST_MIN) {
+        burst = RATELIMIT_BURST_MIN;
+    }
+
+    pthread_mutex_lock(&rl->lock);
+
+    elapsed = rl->last == 0 ? now : now - rl->last;
+    rl->last = now;
+
+    if (bytes_rate > 0) {
+        rl->bytes = ratelimit_refill(rl->bytes, bytes_rate, burst, elapsed);
+        if (rl->bytes < 1) {
+            throttled = 1;
+        } else if ((double)*bytes > rl->bytes) {
+            *bytes = (size_t)rl->bytes;
+        }
+    } else {
+        rl->bytes = 0;
+    }
+
+    if (cmds_rate > 0) {
+        rl->cmds = ratelimit_refill(rl->cmds, cmds_rate, burst, elapsed);
+        if (rl->cmds < 1) {
+            throttled = 1;
+        } else if (*cmds < 0 || (double)*cmds > rl->cmds) {
+            *cmds = (long)rl->cmds;
+        }
+    } else {
+        rl->cmds = 0;
+    }
+
+    if (throttled) {
+        rl->throttled ++;
+    }
+
+    pthread_mutex_unlock(&rl->lock);
+
+    return throttled;
+}
+
+/* Take the tokens of a send, they may go into debt. */
+void
+ratelimit_consume(ratelimit *rl, size_t bytes, long cmds)
+{
+    pthread_mutex_lock(&rl->lock);
+    rl->bytes -= (double)bytes;
+    rl->cmds -= (double)cmds;
+    pthread_mutex_unlock(&rl->lock);
+}
+
+static void dictRatelimitDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    ratelimit_destroy(val);
+}
+
+static dictType ratelimitDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictRatelimitDestructor     /* val destructor */
+};
+
+int
+ratelimits_init(ratelimits *rls)
+{
+    rls->targets = NULL;
+
+    rls->global = ratelimit_create();
+    if (rls->global == NULL) {
+        return RMT_ENOMEM;
+    }
+
+    rls->targets = dictCreate(&ratelimitDictType, NULL);
+    if (rls->targets == NULL) {
+        ratelimit_destroy(rls->global);
+        rls->global = NULL;
+        return RMT_ENOMEM;
+    }
+
+    pthread_mutex_init(&rls->lock, NULL);
+
+    return RMT_OK;
+}
+
+void
+ratelimits_deinit(ratelimits *rls)
+{
+    if (rls->global == NULL) {
+        return;
+    }
+
+    ratelimit_destroy(rls->global);
+    rls->global = NULL;
+    dictRelease(rls->targets);
+    rls->targets = NULL;
+    pthread_mutex_destroy(&rls->lock);
+}
+
+/* The ratelimit of the target node, created at the first use. */
+ratelimit *
+ratelimits_target(ratelimits *rls, const char *addr)
+{
+    ratelimit *rl;
+    sds key;
+
+    pthread_mutex_lock(&rls->lock);
+
+    key = sdsnew(addr);
+    rl = dictFetchValue(rls->targets, key);
+    if (rl == NULL) {
+        rl = ratelimit_create();
+        if (rl == NULL || dictAdd(rls->targets, key, rl) != DICT_OK) {
+            if (rl != NULL) {
+                ratelimit_destroy(rl);
+                rl = NULL;
+            }
+            sdsfree(key);
+        }
+    } else {
+        sdsfree(key);
+    }
+
+    pthread_mutex_unlock(&rls->lock);
+
+    return rl;
+}
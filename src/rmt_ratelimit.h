@@ -0,0 +1,38 @@
+#ifndef _RMT_RATELIMIT_H_
+#define _RMT_RATELIMIT_H_
+
+#define RATELIMIT_BURST_MIN     100     /* milliseconds, the senders wait for the tokens in the cron */
+
+/*
+ * Token buckets of the bytes and the commands sent to the target group.
+ * They are refilled with the rates given by the caller, so the rates can
+ * be changed at any time. A send may take more tokens than left, the
+ * debt delays the next sends.
+ */
+typedef struct ratelimit{
+    pthread_mutex_t lock;
+    double bytes;                   /* bytes tokens, negative for the debt */
+    double cmds;                    /* commands tokens, negative for the debt */
+    long long last;                 /* time of the last refill, in nanoseconds */
+    volatile uint64_t throttled;    /* times the senders waited for the tokens */
+}ratelimit;
+
+/* The buckets of the whole target group and of every target node, shared
+ * by all the threads sending to the target group. */
+typedef struct ratelimits{
+    ratelimit *global;
+    dict *targets;                  /* target node address to its ratelimit */
+    pthread_mutex_t lock;           /* for targets */
+}ratelimits;
+
+ratelimit *ratelimit_create(void);
+void ratelimit_destroy(ratelimit *rl);
+int ratelimit_allow(ratelimit *rl, long long bytes_rate, long long cmds_rate,
+    long long burst, long long now, size_t *bytes, long *cmds);
+void ratelimit_consume(ratelimit *rl, size_t bytes, long cmds);
+
+int ratelimits_init(ratelimits *rls);
+void ratelimits_deinit(ratelimits *rls);
+ratelimit *ratelimits_target(ratelimits *rls, const char *addr);
+
+#endif
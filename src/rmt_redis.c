@@ -26,6 +26,11 @@
 
 #define REDIS_RDB_USED_USEMARK (1<<19); /* RDB file recieved from master is usemark. */
 
+static redis_repl_ckpt *redis_repl_checkpoint_create(redis_node *srnode);
+static void redis_repl_checkpoint_destroy(redis_repl_ckpt *ckpt);
+static int redis_repl_checkpoint_load(redis_node *srnode);
+static void redis_cluster_refresh_free(redis_group *rgroup, int events);
+
 /* ========================== Redis RDB ============================ */
 
 /* The current RDB version. When the format changes in a way that is no longer
@@ -127,17 +132,20 @@ struct node_twem{
 #define REDIS_SET_CMD_EXPIRE_SECOND_PREFIX      "EX"
 #define REDIS_SET_CMD_EXPIRE_MILLISECOND_PREFIX "PX"
 
-/* Redis data type for replication. 
- */
-#define RMT_REDIS_REPL_DATA_TYPE_UNKNOW 0
-#define RMT_REDIS_REPL_DATA_TYPE_RDB 1
-#define RMT_REDIS_REPL_DATA_TYPE_CMD 2
-
 #define REDIS_CLUSTER_SLOTS 16384
 
 //#define REDIS_COMMAND_CLUSTER_NODES "*1\r\n$13\r\nCLUSTER NODES\r\n"
 #define REDIS_COMMAND_CLUSTER_NODES "CLUSTER NODES\r\n"
-#define REDIS_COMMAND_CLUSTER_SLOTS "*1\r\n$13\r\nCLUSTER SLOTS\r\n"
+#define REDIS_COMMAND_CLUSTER_SLOTS "*2\r\n$7\r\nCLUSTER\r\n$5\r\nSLOTS\r\n"
+#define REDIS_COMMAND_ASKING        "*1\r\n$6\r\nASKING\r\n"
+
+#define REDIS_CLUSTER_MAX_REDIRECTS     5       /* times a request may be redirected */
+#define REDIS_CLUSTER_REDIRECT_LEN      256     /* max length of a -MOVED/-ASK reply */
+#define REDIS_CLUSTER_REFRESH_TIMEOUT   3000    /* ms to wait for CLUSTER SLOTS */
+#define REDIS_COMMAND_INFO_MEMORY   "INFO memory\r\n"
+#define REDIS_COMMAND_INFO_KEYSPACE "INFO keyspace\r\n"
+
+#define REDIS_INFO_BUF_SIZE 16384
 
 #define REDIS_MAX_ELEMS_PER_COMMAND 1024*1024
 
@@ -164,8 +172,19 @@ static dictType groupNodesDictType = {
 
 static int rmtRedisSlaveAgainOnline(redis_node *srnode);
 
+static void redis_repl_progress_reset(redis_repl_progress *progress)
+{
+    rmt_memset(progress, 0, sizeof(*progress));
+    progress->ack_off = -1;
+    progress->lag_bytes = -1;
+    progress->lag_msec = -1;
+    progress->rdb_eta_msec = -1;
+}
+
 int redis_replication_init(redis_repl *rr)
 {
+    int i;
+
     if (rr == NULL) {
         return RMT_ERROR;
     }
@@ -187,12 +206,21 @@ int redis_replication_init(redis_repl *rr)
     rr->repl_transfer_read = 0;
     rr->repl_transfer_last_fsync_off = 0;
     rr->repl_lastio = 0;
+    rr->paused = 0;
+
+    for (i = 0; i < REDIS_REPL_READV_MBUFS - 1; i ++) {
+        rr->mbuf_spare[i] = NULL;
+    }
+
+    redis_repl_progress_reset(&rr->progress);
 
     return RMT_OK;
 }
 
 void redis_replication_deinit(redis_repl *rr)
 {
+    int i;
+
     if (rr == NULL) {
         return;
     }
@@ -214,6 +242,16 @@ void redis_replication_deinit(redis_repl *rr)
     rr->repl_transfer_read = 0;
     rr->repl_transfer_last_fsync_off = 0;
     rr->repl_lastio = 0;
+    rr->paused = 0;
+
+    for (i = 0; i < REDIS_REPL_READV_MBUFS - 1; i ++) {
+        if (rr->mbuf_spare[i] != NULL) {
+            mbuf_put(rr->mbuf_spare[i]);
+            rr->mbuf_spare[i] = NULL;
+        }
+    }
+
+    redis_repl_progress_reset(&rr->progress);
 }
 
 int redis_node_init(redis_node *rnode, const char *addr, redis_group *rgroup)
@@ -248,7 +286,18 @@ int redis_node_init(redis_node *rnode, const char *addr, redis_group *rgroup)
 
     rnode->send_data = NULL;
     rnode->sent_data = NULL;
+    rnode->retry_data = NULL;
+    rnode->retry_time = 0;
     rnode->msg_rcv = NULL;
+    rnode->mbuf_rcv = NULL;
+    rnode->mbuf_spare = NULL;
+    rnode->iov_batch = RMT_IOV_BATCH;
+    rnode->window_full = 0;
+    rnode->ratelimit = NULL;
+    rnode->throttled = 0;
+    rnode->backlogged = 0;
+    rnode->zc = NULL;
+    rnode->ckpt = NULL;
 
     rnode->sockpairfds[0] = -1;
     rnode->sockpairfds[1] = -1;
@@ -258,6 +307,23 @@ int redis_node_init(redis_node *rnode, const char *addr, redis_group *rgroup)
     rnode->sk_event = -1;
     
     rnode->next = NULL;
+    rnode->used_memory = -1;
+    rnode->keys = -1;
+    rnode->lane = -1;
+    rnode->lane_order = -1;
+
+    rnode->msgs_inflight = 0;
+    rnode->apply_parked = NULL;
+    rnode->apply_barrier = 0;
+    rnode->apply_blocked = 0;
+    rnode->parse_held = 0;
+    rnode->apply_nodes = NULL;
+
+    rnode->conn_retries = 0;
+    rnode->conn_time = 0;
+    rnode->conn_reply = NULL;
+
+    rnode->latency = NULL;
 
     rnode->owner = rgroup;
 
@@ -286,15 +352,38 @@ int redis_node_init(redis_node *rnode, const char *addr, redis_group *rgroup)
             log_error("ERROR: Init srnode->rdb failed");
             goto error;
         }
+        rnode->rdb->rnode = rnode;
         if (!strcasecmp(ctx->cmd, RMT_CMD_REDIS_MIGRATE)) {
             rnode->rdb->handler = redis_key_value_send;
         }
 
+        if (ctx->key_profile && rgroup->kind != GROUP_TYPE_AOFFILE) {
+            sds fname = sdsempty();
+            const char *name = strrchr(addr, '/');
+            if (ctx->dir != NULL) {
+                fname = sdscatsds(fname, ctx->dir);
+                fname = sdscat(fname, "/");
+            }
+            if (rgroup->kind == GROUP_TYPE_RDBFILE) {
+                fname = sdscatfmt(fname, "%s-keyprofile.json", 
+                    name != NULL ? name + 1 : addr);
+            } else {
+                fname = sdscatfmt(fname, "node%s-keyprofile.json", addr);
+            }
+            rnode->rdb->profile = keyprofile_create(fname);
+            sdsfree(fname);
+            if (rnode->rdb->profile == NULL) {
+                log_error("ERROR: Create key profile failed: out of memory");
+                goto error;
+            }
+        }
+
         if (rgroup->kind == GROUP_TYPE_RDBFILE) {
             sdsrange(rnode->rdb->fname,0,0);
             rnode->rdb->fname = sdscat(rnode->rdb->fname, addr);
             log_debug(LOG_DEBUG, "rdb->fname: %s", rnode->rdb->fname);
             rnode->rdb->deleted = 0;
+            rnode->rdb->received = 1;
         }
 
         rnode->rr = rmt_alloc(sizeof(*rnode->rr));
@@ -308,6 +397,22 @@ int redis_node_init(redis_node *rnode, const char *addr, redis_group *rgroup)
             log_error("ERROR: Init redis replication failed");
             goto error;
         }        
+
+        if (!strcasecmp(ctx->cmd, RMT_CMD_REDIS_MIGRATE) && 
+            rgroup->kind != GROUP_TYPE_RDBFILE && 
+            rgroup->kind != GROUP_TYPE_AOFFILE && 
+            ctx->target_type != GROUP_TYPE_RDBFILE) {
+            rnode->ckpt = redis_repl_checkpoint_create(rnode);
+            if (rnode->ckpt == NULL) {
+                log_error("ERROR: Create replication checkpoint failed: out of memory");
+                goto error;
+            }
+
+            if (ctx->checkpoint) {
+                rnode->ckpt->save = 1;
+                redis_repl_checkpoint_load(rnode);
+            }
+        }
         
         rnode->cmd_data = mttlist_create();
         if (rnode->cmd_data == NULL) {
@@ -321,7 +426,26 @@ int redis_node_init(redis_node *rnode, const char *addr, redis_group *rgroup)
             goto error;
         }
 
-        ret = mttlist_init_with_locklist(rnode->cmd_data);
+        rnode->apply_parked = listCreate();
+        if (rnode->apply_parked == NULL) {
+            log_error("ERROR: Create parked msgs for source node failed: out of memory");
+            goto error;
+        }
+
+        if (ctx->spill_threshold > 0 && rgroup->kind != GROUP_TYPE_RDBFILE) {
+            sds prefix = sdsempty();
+            if (ctx->dir != NULL) {
+                prefix = sdscatsds(prefix, ctx->dir);
+                prefix = sdscat(prefix, "/");
+            }
+            prefix = sdscatfmt(prefix, "node%s", addr);
+            ret = mttlist_init_with_spilllist(rnode->cmd_data, rgroup->mb, prefix, 
+                MAX(ctx->spill_threshold/(long long)rgroup->mb->mbuf_chunk_size, 1), 
+                ctx->spill_compress);
+            sdsfree(prefix);
+        } else {
+            ret = mttlist_init_with_locklist(rnode->cmd_data);
+        }
         if (ret != RMT_OK) {
             log_error("ERROR: Init cmd_data list failed: out of memory");
             goto error;
@@ -358,6 +482,27 @@ int redis_node_init(redis_node *rnode, const char *addr, redis_group *rgroup)
             log_error("ERROR: Create msg list failed: out of memory");
             goto error;
         }
+
+        rnode->retry_data = listCreate();
+        if (rnode->retry_data == NULL) {
+            log_error("ERROR: Create msg list failed: out of memory");
+            goto error;
+        }
+
+        rnode->latency = hist_create();
+        if (rnode->latency == NULL) {
+            log_error("ERROR: Create latency histogram failed: out of memory");
+            goto error;
+        }
+
+        /* without replies there is no read event to reap the completions */
+        if (ctx->zerocopy && !ctx->noreply) {
+            rnode->zc = rmt_zerocopy_create();
+            if (rnode->zc == NULL) {
+                log_error("ERROR: Create zerocopy state failed: out of memory");
+                goto error;
+            }
+        }
     }
 
     rnode->id = rgroup->node_id;
@@ -429,6 +574,11 @@ void redis_node_deinit(redis_node *rnode)
         rnode->mbuf_in = NULL;
     }
 
+    if (rnode->ckpt != NULL) {
+        redis_repl_checkpoint_destroy(rnode->ckpt);
+        rnode->ckpt = NULL;
+    }
+
     if (rnode->rr != NULL) {
         redis_replication_deinit(rnode->rr);
         rmt_free(rnode->rr);
@@ -459,12 +609,39 @@ void redis_node_deinit(redis_node *rnode)
         rnode->sent_data = NULL;
     }
 
+    if (rnode->retry_data != NULL) {
+        while ((msg = listPop(rnode->retry_data)) != NULL) {
+            ASSERT(msg->request);
+            msg_put(msg);
+            msg_free(msg);
+        }
+    
+        listRelease(rnode->retry_data);
+        rnode->retry_data = NULL;
+    }
+
     if (rnode->msg_rcv != NULL) {
         msg_put(rnode->msg_rcv);
         msg_free(rnode->msg_rcv);
         rnode->msg_rcv = NULL;
     }
 
+    if (rnode->mbuf_rcv != NULL) {
+        mbuf_put(rnode->mbuf_rcv);
+        rnode->mbuf_rcv = NULL;
+    }
+
+    if (rnode->mbuf_spare != NULL) {
+        mbuf_put(rnode->mbuf_spare);
+        rnode->mbuf_spare = NULL;
+    }
+
+    /* after the sent msgs were put, they may hold mbufs in it */
+    if (rnode->zc != NULL) {
+        rmt_zerocopy_destroy(rnode->zc);
+        rnode->zc = NULL;
+    }
+
     if (rnode->piece_data != NULL) {
         while ((mbuf = listPop(rnode->piece_data)) != NULL) {
             mbuf_put(mbuf);
@@ -480,6 +657,17 @@ void redis_node_deinit(redis_node *rnode)
         rnode->msg = NULL;
     }
 
+    if (rnode->apply_parked != NULL) {
+        while ((msg = listPop(rnode->apply_parked)) != NULL) {
+            msg->ack_lost = 1;
+            msg_put(msg);
+            msg_free(msg);
+        }
+
+        listRelease(rnode->apply_parked);
+        rnode->apply_parked = NULL;
+    }
+
     rnode->read_data = NULL;
     rnode->write_data = NULL;
     rnode->state = 0;
@@ -493,6 +681,20 @@ void redis_node_deinit(redis_node *rnode)
 
     rnode->next = NULL;
 
+    if (rnode->apply_nodes != NULL) {
+        rmt_free(rnode->apply_nodes);
+        rnode->apply_nodes = NULL;
+    }
+
+    if (rnode->conn_reply != NULL) {
+        sdsfree(rnode->conn_reply);
+        rnode->conn_reply = NULL;
+    }
+
+    if (rnode->latency != NULL) {
+        hist_destroy(rnode->latency);
+        rnode->latency = NULL;
+    }
 }
 
 int redis_group_init(rmtContext *ctx, redis_group *rgroup, 
@@ -521,6 +723,10 @@ int redis_group_init(rmtContext *ctx, redis_group *rgroup,
     rgroup->key_hash = NULL;
     rgroup->ncontinuum = 0;
 
+    rgroup->moved = 0;
+    rgroup->refresh = NULL;
+    pthread_mutex_init(&rgroup->nodes_mutex, NULL);
+
     rgroup->ctx = ctx;
 
     if(source) {
@@ -644,10 +850,16 @@ void redis_group_deinit(redis_group *rgroup)
         rgroup->kind = GROUP_TYPE_UNKNOW;
     }
 
+    /* the event loop was deleted before */
+    if (rgroup->refresh != NULL) {
+        redis_cluster_refresh_free(rgroup, 0);
+    }
+
     if (rgroup->nodes != NULL) {
         dictRelease(rgroup->nodes);
         rgroup->nodes = NULL;
     }
+    pthread_mutex_destroy(&rgroup->nodes_mutex);
 
     if (rgroup->route != NULL) {
         rgroup->route->nelem = 0;
@@ -689,15 +901,30 @@ int redis_rdb_init(redis_rdb *rdb, const char *addr, int type)
     rdb->data = NULL;
     rdb->fname = NULL;
     rdb->fd = -1;
+    rdb->pipefds[0] = -1;
+    rdb->pipefds[1] = -1;
 
     rdb->fp = NULL;
     rdb->cksum = 0;
     rdb->update_cksum = NULL;
 
     rdb->state = 0;
+    rdb->rnode = NULL;
+    rdb->following = 0;
+    rdb->waiting = 0;
 
     rdb->deleted = 0;
     rdb->received = 0;
+    rdb->nosplice = 0;
+    rdb->resumed = 0;
+    rdb->paused = 0;
+    rdb->obj_off = 0;
+    rdb->obj_parsed = 0;
+    rdb->obj_cksum = 0;
+    rdb->short_read = 0;
+    rdb->parsed_bytes = 0;
+    rdb->parsed_keys = 0;
+    rdb->profile = NULL;
 
     rdb->handler = NULL;
 
@@ -742,6 +969,19 @@ error:
     return RMT_ERROR;
 }
 
+static void redis_rdb_close_pipe(redis_rdb *rdb)
+{
+    if (rdb->pipefds[0] >= 0) {
+        close(rdb->pipefds[0]);
+        rdb->pipefds[0] = -1;
+    }
+
+    if (rdb->pipefds[1] >= 0) {
+        close(rdb->pipefds[1]);
+        rdb->pipefds[1] = -1;
+    }
+}
+
 void redis_rdb_deinit(redis_rdb *rdb)
 {
     struct mbuf *mbuf;
@@ -763,6 +1003,8 @@ void redis_rdb_deinit(redis_rdb *rdb)
         rdb->fd = -1;
     }
 
+    redis_rdb_close_pipe(rdb);
+
     if (rdb->fname != NULL) {
         redis_delete_rdb_file(rdb, 0);
     }
@@ -795,8 +1037,18 @@ void redis_rdb_deinit(redis_rdb *rdb)
     }
 
     rdb->state = 0;
+    rdb->rnode = NULL;
+    rdb->following = 0;
+    rdb->waiting = 0;
 
     rdb->deleted = 0;
+    rdb->parsed_bytes = 0;
+    rdb->parsed_keys = 0;
+
+    if (rdb->profile != NULL) {
+        keyprofile_destroy(rdb->profile);
+        rdb->profile = NULL;
+    }
 
     if (rdb->handler != NULL) {
         rdb->handler = NULL;
@@ -900,6 +1152,7 @@ static int redisRplicationReset(redis_node *srnode)
     rr->repl_transfer_read = 0;
     rr->repl_transfer_last_fsync_off = 0;
     rr->repl_lastio = 0;
+    rr->paused = 0;
     
     return RMT_OK;
 }
@@ -1120,6 +1373,13 @@ static int rmtTryPartialResynchronization(redis_node *srnode, int read_reply) {
             srnode->addr);
         sdsfree(reply);
         rmtRedisSlaveAgainOnline(srnode);
+        if (!srnode->rdb->received) {
+            /* Resumed from the checkpoint, there is no rdb to receive. */
+            __atomic_store_n(&srnode->rdb->resumed, 1, __ATOMIC_RELEASE);
+            __atomic_store_n(&srnode->rdb->received, 1, __ATOMIC_RELEASE);
+            thread_stat_incr(rdata, rdb_received_count, 1);
+            notice_write_thread(srnode);
+        }
         return RMT_PSYNC_CONTINUE;
     }
 
@@ -1146,110 +1406,89 @@ static int rmtTryPartialResynchronization(redis_node *srnode, int read_reply) {
     return RMT_PSYNC_NOT_SUPPORTED;
 }
 
-/* Insert master replication data into list.
- * data_type: rdb data from master or commands from master.
- * partial: when >0, mbuf is not full, also insert into the list. 
+/*
+ * Read the replication data from master with one readv into the free
+ * space of mbuf and the spare mbufs of rr after it, at most limit bytes
+ * and nmbufs mbufs. The spare mbufs that got data are taken out of rr
+ * and returned in next[] in order, so that no byte is copied again; the
+ * others stay for the next read.
  */
-static int rmtRedisReplDataInsert(redis_node *srnode, 
-    char *buf, ssize_t len, int data_type, int partial)
-{
-    mbuf_base *mb;
-    struct mbuf *m1;
-    uint32_t m1_s;
-    uint32_t len_copy, len_left;
-    mttlist *mbufs;
-    redis_group *srgroup = srnode->owner;
-    redis_rdb *rdb = srnode->rdb;
-    
-    if(srnode == NULL)
-    {
-        return RMT_ERROR;
-    }
-
-    if(data_type == RMT_REDIS_REPL_DATA_TYPE_RDB)
-    {
-        mbufs = rdb->data;
-    }
-    else if(data_type == RMT_REDIS_REPL_DATA_TYPE_CMD)
-    {
-        mbufs = srnode->cmd_data;
-    }
-    else
-    {
-        return RMT_ERROR;
-    }
-
-    mb = srgroup->mb;
-    if(mb == NULL)
-    {
-        return RMT_ERROR;
-    }
-
-    m1 = srnode->mbuf_in;
-    if(m1 == NULL)
-    {
-        if(len == 0)
-        {
-            return RMT_OK;
+static ssize_t rmtRedisReplReadv(redis_node *srnode, int fd, struct mbuf *mbuf,
+    size_t limit, int nmbufs, struct mbuf **next, int *nnext)
+{
+    redis_repl *rr = srnode->rr;
+    struct iovec iov[REDIS_REPL_READV_MBUFS];
+    struct mbuf *m;
+    size_t size, total;
+    ssize_t nread, left;
+    int niov, i;
+
+    ASSERT(nmbufs > 0 && nmbufs <= REDIS_REPL_READV_MBUFS);
+
+    *nnext = 0;
+    niov = 0;
+    total = 0;
+    m = mbuf;
+    for (;;) {
+        size = MIN(mbuf_size(m), limit - total);
+        iov[niov].iov_base = m->last;
+        iov[niov].iov_len = size;
+        niov ++;
+        total += size;
+
+        if (niov >= nmbufs || total >= limit) {
+            break;
         }
-    
-        srnode->mbuf_in = mbuf_get(mb);
-        m1 = srnode->mbuf_in;
 
-        if(m1 != NULL)
-        {
-            ASSERT(mbuf_size(m1) > 0);
+        m = rr->mbuf_spare[niov - 1];
+        if (m != NULL && m->mb != mbuf->mb) {
+            /* left by the read of the other data type */
+            mbuf_put(m);
+            m = rr->mbuf_spare[niov - 1] = NULL;
+        }
+        if (m == NULL) {
+            m = mbuf_get(mbuf->mb);
+            if (m == NULL) {
+                break;
+            }
+            rr->mbuf_spare[niov - 1] = m;
         }
     }
 
-    if(m1 == NULL)
-    {
-        log_error("ERROR: get mbuf failed");
-        return RMT_ERROR;
-    }
-
-    m1_s = mbuf_size(m1);
-    if(m1_s == 0)
-    {
-        //mbufs->lock_push(mbufs->l, m1);
-        mttlist_push(mbufs, m1);
-        notice_write_thread(srnode);
-        log_debug(LOG_VVERB, "mbuf(used:%d) inputed", mbuf_storage_length(m1));
-        srnode->mbuf_in = NULL;
-        return rmtRedisReplDataInsert(srnode, buf, len, data_type, partial);
+    nread = rmt_readv(fd, iov, niov);
+    if (nread <= 0) {
+        return nread;
     }
 
-    len_copy = (m1_s < (uint32_t)len)?m1_s:(uint32_t)len;
-    len_left = (uint32_t)len - len_copy;
-    mbuf_copy(m1, (uint8_t*) buf, len_copy);
+    left = nread;
+    for (i = 0; i < niov && left > 0; i ++) {
+        size = MIN((size_t)left, iov[i].iov_len);
+        left -= (ssize_t)size;
 
-    if(len_left > 0)
-    {
-        buf += len_copy;
-        return rmtRedisReplDataInsert(srnode, buf, len_left, data_type, partial);
-    }
+        if (i == 0) {
+            mbuf->last += size;
+            continue;
+        }
 
-    if(partial && mbuf_storage_length(srnode->mbuf_in))
-    {
-        //mbufs->lock_push(mbufs->l, m1);
-        mttlist_push(mbufs, m1);
-        notice_write_thread(srnode);
-        log_debug(LOG_VVERB, "mbuf(used:%d) inputed", mbuf_storage_length(m1));
-        srnode->mbuf_in = NULL;
+        m = rr->mbuf_spare[i - 1];
+        m->last += size;
+        next[(*nnext) ++] = m;
+        rr->mbuf_spare[i - 1] = NULL;
     }
 
-    return RMT_OK;
+    return nread;
 }
 
 static void rmtRedisSlaveReadQueryFromMaster(aeEventLoop *el, int fd, void *privdata, int mask) 
 {
-    int ret;
     ssize_t nread;
     redis_node *srnode = privdata;
     redis_group *srgroup = srnode->owner;
     thread_data *rdata = srnode->read_data;
     redis_repl *rr = srnode->rr;
     tcp_context *tc = srnode->tc;
+    struct mbuf *next[REDIS_REPL_READV_MBUFS];
+    int i, nnext;
     
     RMT_NOTUSED(el);
     RMT_NOTUSED(fd);
@@ -1260,16 +1499,6 @@ static void rmtRedisSlaveReadQueryFromMaster(aeEventLoop *el, int fd, void *priv
     ASSERT(fd == tc->sd);
 
     if(srnode->mbuf_in == NULL){
-        srnode->mbuf_in = mbuf_get(srgroup->mb);
-        if(srnode->mbuf_in == NULL){
-            log_error("ERROR: Mbuf get failed: Out of memory");
-            return;
-        }
-    }else if(mbuf_size(srnode->mbuf_in) == 0){
-        mttlist_push(srnode->cmd_data, srnode->mbuf_in);
-        srnode->mbuf_in = NULL;
-        notice_write_thread(srnode);
-
         srnode->mbuf_in = mbuf_get(srgroup->mb);
         if(srnode->mbuf_in == NULL){
             log_error("ERROR: Mbuf get failed: Out of memory");
@@ -1277,8 +1506,8 @@ static void rmtRedisSlaveReadQueryFromMaster(aeEventLoop *el, int fd, void *priv
         }
     }
     
-    nread = rmt_read(fd,srnode->mbuf_in->last,
-        mbuf_size(srnode->mbuf_in));
+    nread = rmtRedisReplReadv(srnode, fd, srnode->mbuf_in, SSIZE_MAX,
+        REDIS_REPL_READV_MBUFS, next, &nnext);
     if (nread < 0) {
         if (errno == EAGAIN) {
             log_warn("Warn: I/O error read query from MASTER[%s]: %s", 
@@ -1294,11 +1523,13 @@ static void rmtRedisSlaveReadQueryFromMaster(aeEventLoop *el, int fd, void *priv
             srnode->addr);
         goto error;
     } else {
-        rdata->stat_total_net_input_bytes += (uint64_t)nread;
+        thread_stat_incr(rdata, total_net_input_bytes, (uint64_t)nread);
         rr->reploff += nread;
-        srnode->mbuf_in->last += nread;
         mttlist_push(srnode->cmd_data, srnode->mbuf_in);
         srnode->mbuf_in = NULL;
+        for (i = 0; i < nnext; i ++) {
+            mttlist_push(srnode->cmd_data, next[i]);
+        }
         notice_write_thread(srnode);
         rr->repl_lastio = rdata->unixtime;
     }
@@ -1310,6 +1541,24 @@ error:
     rmtRedisSlaveOffline(srnode);
 }
 
+/* Notice the write thread that more of the rdb file was written, so the
+ * parser can follow the rdb file while it is still being received. It is
+ * only needed before the parser starts, or when it waits for the data. */
+static void rmtReceiveRdbNotice(redis_node *srnode)
+{
+    redis_rdb *rdb = srnode->rdb;
+
+    /* parse_prepare lets the next node begin replication for the rdb
+     * file target, so only notice it at the end of the transfer. */
+    if (srnode->ctx->target_type == GROUP_TYPE_RDBFILE) {
+        return;
+    }
+
+    if (!rdb->following || rdb->waiting) {
+        notice_write_thread(srnode);
+    }
+}
+
 static void rmtRedisRdbDataPost(redis_node *srnode)
 {
     redis_rdb *rdb = srnode->rdb;
@@ -1340,6 +1589,7 @@ static void rmtRedisRdbDataPost(redis_node *srnode)
         }
 
         mbuf->pos = mbuf->last = mbuf->start;
+        rmtReceiveRdbNotice(srnode);
     } else if(rdb->type == REDIS_RDB_TYPE_MEM) {
         ASSERT(rdb->mb != NULL);
         ASSERT(rdb->data != NULL);
@@ -1393,6 +1643,7 @@ void rmtRedisSlaveOffline(redis_node *srnode)
     aeDeleteFileEvent(rdata->loop,tc->sd,AE_READABLE|AE_WRITABLE);
     rmt_tcp_context_close_sd(tc);
     rr->repl_state = REDIS_REPL_CONNECT;
+    rr->paused = 0;
 }
 
 static int rmtRedisSlaveAgainOnline(redis_node *srnode)
@@ -1437,9 +1688,160 @@ void rmtReceiveRdbAbort(redis_node *srnode)
     
     aeDeleteFileEvent(rdata->loop, tc->sd, AE_READABLE);
     rmt_tcp_context_close_sd(tc);
-    redis_delete_rdb_file(rdb, 1);
-    redisRplicationReset(srnode);
+    redis_rdb_close_pipe(rdb);
     rr->repl_state = REDIS_REPL_CONNECT;
+    rr->paused = 0;
+    __sync_synchronize();
+
+    /* The rdb file may be followed by the parser in the write thread, 
+     * which owns rdb->fp and lets the rdb file go itself. */
+    if (rdb->fd > 0) {
+        close(rdb->fd);
+        rdb->fd = -1;
+    }
+    if (rdb->fname != NULL) {
+        unlink(rdb->fname);
+        if (rdb->following) {
+            notice_write_thread(srnode);
+        } else {
+            sdsfree(rdb->fname);
+            rdb->fname = NULL;
+        }
+    }
+    redisRplicationReset(srnode);
+}
+
+/* Update the last bytes array with the data just read, to check if it
+ * matches the EOF mark. */
+static void rmtRedisReplLastbytes(redis_repl *rr, uint8_t *data, size_t n)
+{
+    char *lastbytes = rr->lastbytes;
+    size_t rem;
+
+    if (n >= REDIS_RUN_ID_SIZE) {
+        rmt_memcpy(lastbytes,data+n-REDIS_RUN_ID_SIZE,REDIS_RUN_ID_SIZE);
+    } else {
+        rem = REDIS_RUN_ID_SIZE-n;
+        rmt_memmove(lastbytes,lastbytes+n,rem);
+        rmt_memcpy(lastbytes+rem,data,n);
+    }
+}
+
+/* Check if the rdb file can be received with splice, and create the
+ * pipe for it if not yet. */
+static int rmtReceiveRdbCanSplice(redis_node *srnode)
+{
+#ifdef HAVE_SPLICE
+    redis_rdb *rdb = srnode->rdb;
+
+    if (rdb->type != REDIS_RDB_TYPE_FILE || rdb->nosplice) {
+        return 0;
+    }
+
+    if (rdb->pipefds[0] >= 0) {
+        return 1;
+    }
+
+    if (pipe(rdb->pipefds) == -1) {
+        log_warn("Create pipe to receive the rdb of node[%s] failed: %s", 
+            srnode->addr, strerror(errno));
+        rdb->nosplice = 1;
+        return 0;
+    }
+
+    /* Not fatal, the pipe just moves less per splice */
+    fcntl(rdb->pipefds[1], F_SETPIPE_SZ, REDIS_RDB_SPLICE_SIZE);
+
+    return 1;
+#else
+    RMT_NOTUSED(srnode);
+    return 0;
+#endif
+}
+
+/*
+ * Move at most len rdb bytes from the socket into the rdb file through
+ * the pipe, without copying them to the user space. Return the bytes
+ * moved, 0 if the connection is lost, RMT_EAGAIN if nothing to read or
+ * -1 on error.
+ */
+static ssize_t rmtReceiveRdbSplice(redis_node *srnode, int fd, size_t len)
+{
+#ifdef HAVE_SPLICE
+    redis_rdb *rdb = srnode->rdb;
+    char buf[4096];
+    ssize_t nread, n;
+    size_t left;
+
+    nread = splice(fd, NULL, rdb->pipefds[1], NULL, len, 
+        SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (nread < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return RMT_EAGAIN;
+    }
+    if (nread <= 0) {
+        return nread;
+    }
+
+    left = (size_t)nread;
+    while (left > 0) {
+        n = splice(rdb->pipefds[0], NULL, rdb->fd, NULL, left, SPLICE_F_MOVE);
+        if (n > 0) {
+            left -= (size_t)n;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0 && errno == EINVAL) {
+            /* The file system does not support splice, copy the rest */
+            log_warn("Splice into rdb file %s is not supported, use write", 
+                rdb->fname);
+            rdb->nosplice = 1;
+            while (left > 0) {
+                n = rmt_read(rdb->pipefds[0], buf, MIN(left, sizeof(buf)));
+                if (n <= 0 || rmt_write(rdb->fd, buf, n) != n) {
+                    return -1;
+                }
+                left -= (size_t)n;
+            }
+            break;
+        }
+
+        log_error("ERROR: splice the rdb into file %s failed: %s", 
+            rdb->fname, n < 0 ? strerror(errno) : "pipe is empty");
+        return -1;
+    }
+
+    return nread;
+#else
+    RMT_NOTUSED(srnode);
+    RMT_NOTUSED(fd);
+    RMT_NOTUSED(len);
+    return -1;
+#endif
+}
+
+/* Peek the last bytes of the rdb file written by splice, which ends at
+ * offset off, into the last bytes array. */
+static int rmtReceiveRdbPeek(redis_node *srnode, off_t off)
+{
+    redis_repl *rr = srnode->rr;
+    redis_rdb *rdb = srnode->rdb;
+
+    if (off < REDIS_RUN_ID_SIZE) {
+        return RMT_OK;
+    }
+
+    if (pread(rdb->fd, rr->lastbytes, REDIS_RUN_ID_SIZE, 
+        off - REDIS_RUN_ID_SIZE) != REDIS_RUN_ID_SIZE) {
+        log_error("ERROR: read the last bytes of rdb file %s failed: %s", 
+            rdb->fname, strerror(errno));
+        return RMT_ERROR;
+    }
+
+    return RMT_OK;
 }
 
 static void rmtReceiveRdb(aeEventLoop *el, int fd, void *privdata, int mask) 
@@ -1456,7 +1858,9 @@ static void rmtReceiveRdb(aeEventLoop *el, int fd, void *privdata, int mask)
     char *lastbytes = rr->lastbytes;
     int usemark = rr->usemark;
     struct mbuf *mbuf;
-    uint32_t mbuf_s;
+    struct mbuf *next[REDIS_REPL_READV_MBUFS];
+    int i, nnext;
+    size_t len;
     
     RMT_NOTUSED(el);
     RMT_NOTUSED(fd);
@@ -1516,71 +1920,106 @@ static void rmtReceiveRdb(aeEventLoop *el, int fd, void *privdata, int mask)
             log_notice("MASTER <-> SLAVE sync: receiving %lld bytes from master[%s]",
                 (long long) rr->repl_transfer_size, srnode->addr);
         }
+        rr->usemark = usemark;
         return;
     }
 
-    mbuf = rdb->mbuf;
-    if (mbuf == NULL) {
-        rdb->mbuf = mbuf_get(rdb->mb);
-        mbuf = rdb->mbuf;
-        if (mbuf == NULL) {
-            log_error("ERROR: mbuf_get NULL: out of memory");
-            return;
-        }
-    } else if(mbuf_size(mbuf) == 0) {
-        rmtRedisRdbDataPost(srnode);
-    }
-
-    mbuf_s = mbuf_size(mbuf);
-    ASSERT(mbuf_s > 0);
-
      /* Read bulk data */
     if (usemark) {
-        readlen = mbuf_s;
+        readlen = SSIZE_MAX;
     } else {
         left = rr->repl_transfer_size - rr->repl_transfer_read;
-        readlen = (left < (signed)mbuf_s) ? left : (signed)mbuf_s;
-    }
-    
-    nread = rmt_read(fd,mbuf->last,readlen);
-    if (nread <= 0) {
-        log_error("Error: I/O error trying to sync with MASTER[%s]: %s",
-            srnode->addr, (nread == -1) ? strerror(errno) : "connection lost");
-        rmtReceiveRdbAbort(srnode);
-        return;
+        readlen = (ssize_t)left;
     }
 
-    ASSERT((ssize_t)mbuf_size >= nread);
+    nnext = 0;
+    mbuf = NULL;
+    if (rmtReceiveRdbCanSplice(srnode)) {
+        nread = rmtReceiveRdbSplice(srnode, fd, 
+            MIN((size_t)readlen, REDIS_RDB_SPLICE_SIZE));
+        if (nread == RMT_EAGAIN) {
+            return;
+        }
+    } else {
+        if (rdb->mbuf != NULL && mbuf_size(rdb->mbuf) == 0) {
+            rmtRedisRdbDataPost(srnode);
+        }
 
-    rdata->stat_total_net_input_bytes += (uint64_t)nread;
-    mbuf->last += nread;
-    if (mbuf_size(mbuf) == 0) {
-        rmtRedisRdbDataPost(srnode);
+        mbuf = rdb->mbuf;
+        if (mbuf == NULL) {
+            rdb->mbuf = mbuf_get(rdb->mb);
+            mbuf = rdb->mbuf;
+            if (mbuf == NULL) {
+                log_error("ERROR: mbuf_get NULL: out of memory");
+                return;
+            }
+        }
+
+        ASSERT(mbuf_size(mbuf) > 0);
+
+        /* The rdb file is written one mbuf at a time, while the rdb in memory
+         * takes every mbuf filled by the readv. */
+        nread = rmtRedisReplReadv(srnode, fd, mbuf, (size_t)readlen, 
+            rdb->type == REDIS_RDB_TYPE_MEM ? REDIS_REPL_READV_MBUFS : 1,
+            next, &nnext);
+    }
+    if (nread <= 0) {
+        log_error("Error: I/O error trying to sync with MASTER[%s]: %s",
+            srnode->addr, (nread == -1) ? strerror(errno) : "connection lost");
+        rmtReceiveRdbAbort(srnode);
+        return;
     }
 
+    thread_stat_incr(rdata, total_net_input_bytes, (uint64_t)nread);
+
     /* When a mark is used, we want to detect EOF asap in order to avoid
      * writing the EOF mark into the file... */
     int eof_reached = 0;
 
-    if (usemark) {
+    if (usemark && mbuf == NULL) {
+        /* The data is in the rdb file already, peek its last bytes. */
+        if (rmtReceiveRdbPeek(srnode, rr->repl_transfer_read + nread) != RMT_OK) {
+            goto error;
+        }
+        if (memcmp(lastbytes,eofmark,REDIS_RUN_ID_SIZE) == 0) eof_reached = 1;
+    } else if (usemark) {
         /* Update the last bytes array, and check if it matches our delimiter.*/
-        if (nread >= REDIS_RUN_ID_SIZE) {
-            rmt_memcpy(lastbytes,buf+nread-REDIS_RUN_ID_SIZE,REDIS_RUN_ID_SIZE);
-        } else {
-            int rem = REDIS_RUN_ID_SIZE-(int)nread;
-            rmt_memmove(lastbytes,lastbytes+nread,rem);
-            rmt_memcpy(lastbytes+rem,buf,nread);
+        len = (size_t)nread;
+        for (i = 0; i < nnext; i ++) {
+            len -= mbuf_length(next[i]);
+        }
+        rmtRedisReplLastbytes(rr, mbuf->last - len, len);
+        for (i = 0; i < nnext; i ++) {
+            rmtRedisReplLastbytes(rr, next[i]->pos, mbuf_length(next[i]));
         }
         if (memcmp(lastbytes,eofmark,REDIS_RUN_ID_SIZE) == 0) eof_reached = 1;
     }
 
+    for (i = 0; i < nnext; i ++) {
+        /* rdb->mbuf is full, and the data goes on in next[i] */
+        rmtRedisRdbDataPost(srnode);
+        ASSERT(rdb->mbuf == NULL);
+        rdb->mbuf = next[i];
+    }
+
+    if (mbuf != NULL && mbuf_size(rdb->mbuf) == 0) {
+        rmtRedisRdbDataPost(srnode);
+    }
+
     rr->repl_lastio = rdata->unixtime;
     
     rr->repl_transfer_read += nread;
+    if (mbuf == NULL) {
+        rmtReceiveRdbNotice(srnode);
+    }
 
     /* Delete the last 40 bytes from the file if we reached EOF. */
     if (usemark && eof_reached) {
         if (rdb->type == REDIS_RDB_TYPE_FILE) {
+            /* the mark must be in the file before it is truncated */
+            if (rdb->mbuf != NULL && mbuf_length(rdb->mbuf) > 0) {
+                rmtRedisRdbDataPost(srnode);
+            }
             if (ftruncate(rdb->fd,
                 rr->repl_transfer_read - REDIS_RUN_ID_SIZE) == -1) {
                 log_error("Error: truncating the RDB file %s failed: %s", 
@@ -1622,8 +2061,6 @@ static void rmtReceiveRdb(aeEventLoop *el, int fd, void *privdata, int mask)
         log_notice("MASTER <-> SLAVE sync: RDB data for node[%s] is received, used: %lld s", 
             srnode->addr, (now - srnode->timestamp)/1000);
 
-        rdb->received = 1;
-
         /* complete the rdb data */
         mbuf = rdb->mbuf;
         if (mbuf != NULL && mbuf_length(mbuf) > 0) {
@@ -1636,14 +2073,20 @@ static void rmtReceiveRdb(aeEventLoop *el, int fd, void *privdata, int mask)
 
             rdb->mbuf = NULL;
         }
+        /* The parser following the rdb file deletes it once received, 
+         * so the rdb file must be closed before. */
         if (rdb->type == REDIS_RDB_TYPE_FILE) {
             close(rdb->fd);
             rdb->fd = -1;
+            redis_rdb_close_pipe(rdb);
             log_notice("rdb file %s write complete", 
                 rdb->fname);
+        }
+        __atomic_store_n(&rdb->received, 1, __ATOMIC_RELEASE);
+        if (rdb->type == REDIS_RDB_TYPE_FILE) {
             notice_write_thread(srnode);
         }
-        rdata->stat_rdb_received_count ++;
+        thread_stat_incr(rdata, rdb_received_count, 1);
         
         if (srnode->ctx->target_type == GROUP_TYPE_RDBFILE) {
             rmtRedisSlaveOffline(srnode);
@@ -1910,7 +2353,7 @@ static void rmtSyncRedisMaster(aeEventLoop *el, int fd, void *privdata, int mask
             (long int)getpid());
         log_debug(LOG_DEBUG, "rdb->fname: %s", rdb->fname);
         
-        rdb->fd = open(rdb->fname,O_CREAT|O_WRONLY|O_EXCL,0644);
+        rdb->fd = open(rdb->fname,O_CREAT|O_RDWR|O_EXCL,0644);
         if(rdb->fd == -1){
             log_error("ERROR: open rdb file %s failed: %s", 
                 rdb->fname, strerror(errno));
@@ -2008,8 +2451,8 @@ void redisSlaveReplCorn(redis_node *srnode)
         rmtRedisSlaveOffline(srnode);
     }
 
-    /* Bulk transfer I/O timeout? */
-    if (rr->repl_state == REDIS_REPL_TRANSFER &&
+    /* Bulk transfer I/O timeout? Nothing is read while paused. */
+    if (rr->repl_state == REDIS_REPL_TRANSFER && !rr->paused &&
         (rmt_msec_now() - rr->repl_lastio) > srgroup->timeout) {
         log_error("ERROR: Timeout receiving bulk data from MASTER[%s]."
             "If the problem persists try to set the 'timeout' parameter(now is %d)"
@@ -2019,7 +2462,7 @@ void redisSlaveReplCorn(redis_node *srnode)
     }
 
     /* Timed out master when we are an already connected slave? */
-    if (rr->repl_state == REDIS_REPL_CONNECTED &&
+    if (rr->repl_state == REDIS_REPL_CONNECTED && !rr->paused &&
         (rmt_msec_now() - rr->repl_lastio) > srgroup->timeout) {
         log_error("ERROR: MASTER[%s] timeout, no data nor PING received.", 
             srnode->addr);
@@ -2040,6 +2483,11 @@ void redisSlaveReplCorn(redis_node *srnode)
             return;
         }
 
+        /* the write thread still parses the aborted rdb file */
+        if (srnode->rdb->following) {
+            return;
+        }
+
         log_notice("Reconnect to node[%s] for replication", 
             srnode->addr);
         
@@ -2075,354 +2523,964 @@ void redisSlaveReplCorn(redis_node *srnode)
     }
 }
 
-
-/* ========================== Redis Protocol ============================ */
-
 /*
- * Return 1, if the redis command take no key, otherwise
- * return 0
+ * Stop or start reading the replication stream or the rdb from the master 
+ * for MIGRATE PAUSE|RESUME. The connection is kept and the REPLCONF ACKs 
+ * are still sent, so the master keeps the replication while the data 
+ * waits in the socket buffers and the replication buffer of the master.
  */
-static int
-redis_argz(struct msg *r)
+void redis_repl_pause(redis_node *srnode, int pause)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_PING:
-    case MSG_REQ_REDIS_QUIT:
-    case MSG_REQ_REDIS_FLUSHALL:
-    case MSG_REQ_REDIS_FLUSHDB:
+    thread_data *rdata = srnode->read_data;
+    tcp_context *tc = srnode->tc;
+    redis_repl *rr = srnode->rr;
+    aeFileProc *proc;
 
-    case MSG_REQ_REDIS_MULTI:
-    case MSG_REQ_REDIS_EXEC:
-        return 1;
+    if (rr == NULL || rr->paused == pause) {
+        return;
+    }
 
-    default:
-        break;
+    if (rr->repl_state == REDIS_REPL_CONNECTED) {
+        proc = rmtRedisSlaveReadQueryFromMaster;
+    } else if (rr->repl_state == REDIS_REPL_TRANSFER) {
+        proc = rmtReceiveRdb;
+    } else {
+        /* paused once the handshake is done */
+        return;
     }
 
-    return 0;
+    if (pause) {
+        aeDeleteFileEvent(rdata->loop, tc->sd, AE_READABLE);
+        rr->paused = 1;
+        log_notice("Paused reading from node[%s]", srnode->addr);
+        return;
+    }
+
+    rr->paused = 0;
+    rr->repl_lastio = rdata->unixtime;
+    if (aeCreateFileEvent(rdata->loop, tc->sd, AE_READABLE, 
+        proc, srnode) == AE_ERR) {
+        log_error("ERROR: can't create readable event for node[%s] after resume.", 
+            srnode->addr);
+        rmtRedisSlaveOffline(srnode);
+        return;
+    }
+    log_notice("Resumed reading from node[%s]", srnode->addr);
 }
 
-/*
- * Return true, if the redis command accepts no arguments, otherwise
- * return false
- */
-static int
-redis_arg0(struct msg *r)
+/* ==================== Redis replication checkpoint ==================== */
+
+static redis_repl_ack *redis_repl_ack_create(redis_repl_ckpt *ckpt, long long reploff)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_EXISTS:
-    case MSG_REQ_REDIS_PERSIST:
-    case MSG_REQ_REDIS_PTTL:
-    case MSG_REQ_REDIS_SORT:
-    case MSG_REQ_REDIS_TTL:
-    case MSG_REQ_REDIS_TYPE:
-    case MSG_REQ_REDIS_DUMP:
-
-    case MSG_REQ_REDIS_DECR:
-    case MSG_REQ_REDIS_GET:
-    case MSG_REQ_REDIS_INCR:
-    case MSG_REQ_REDIS_STRLEN:
-
-    case MSG_REQ_REDIS_HGETALL:
-    case MSG_REQ_REDIS_HKEYS:
-    case MSG_REQ_REDIS_HLEN:
-    case MSG_REQ_REDIS_HVALS:
-
-    case MSG_REQ_REDIS_LLEN:
-    case MSG_REQ_REDIS_LPOP:
-    case MSG_REQ_REDIS_RPOP:
-
-    case MSG_REQ_REDIS_SCARD:
-    case MSG_REQ_REDIS_SMEMBERS:
-    case MSG_REQ_REDIS_SPOP:
-
-    case MSG_REQ_REDIS_ZCARD:
-    case MSG_REQ_REDIS_PFCOUNT:
-    case MSG_REQ_REDIS_AUTH:
-        return 1;
+    redis_repl_ack *ack;
 
-    default:
-        break;
+    ack = rmt_alloc(sizeof(*ack));
+    if (ack == NULL) {
+        return NULL;
     }
 
-    return 0;
+    ack->ckpt = ckpt;
+    ack->reploff = reploff;
+    ack->pending = 0;
+    ack->open = 1;
+    ack->lost = 0;
+
+    if (listAddNodeTail(ckpt->acks, ack) == NULL) {
+        rmt_free(ack);
+        return NULL;
+    }
+
+    return ack;
 }
 
-/*
- * Return true, if the redis command accepts exactly 1 argument, otherwise
- * return false
- */
-static int
-redis_arg1(struct msg *r)
+/* Move the acknowledged offset over the leading batches which have no
+ * msgs pending anymore. */
+static void redis_repl_ack_advance(redis_repl_ckpt *ckpt)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_EXPIRE:
-    case MSG_REQ_REDIS_EXPIREAT:
-    case MSG_REQ_REDIS_PEXPIRE:
-    case MSG_REQ_REDIS_PEXPIREAT:
+    redis_repl_ack *ack;
 
-    case MSG_REQ_REDIS_APPEND:
-    case MSG_REQ_REDIS_DECRBY:
-    case MSG_REQ_REDIS_GETBIT:
-    case MSG_REQ_REDIS_GETSET:
-    case MSG_REQ_REDIS_INCRBY:
-    case MSG_REQ_REDIS_INCRBYFLOAT:
-    case MSG_REQ_REDIS_SETNX:
+    while ((ack = listFirstValue(ckpt->acks)) != NULL && ack->pending == 0) {
+        if (ack->lost && !ckpt->lost) {
+            log_warn("Msgs were lost before acknowledged, stop saving "
+                "the checkpoint %s until the next full sync", ckpt->fname);
+            ckpt->lost = 1;
+        }
+
+        ckpt->ack_off = ack->reploff;
+        if (ack->open) {
+            break;
+        }
 
-    case MSG_REQ_REDIS_HEXISTS:
-    case MSG_REQ_REDIS_HGET:
+        listPop(ckpt->acks);
+        rmt_free(ack);
+    }
+}
 
-    case MSG_REQ_REDIS_LINDEX:
-    case MSG_REQ_REDIS_LPUSHX:
-    case MSG_REQ_REDIS_RPUSHX:
+/* Called by the write thread when the rdb parse starts or ends. */
+void redis_repl_ack_rdb(redis_node *srnode, int end)
+{
+    redis_repl_ckpt *ckpt = srnode->ckpt;
+    redis_repl *rr = srnode->rr;
+    redis_repl_ack *ack;
+    listNode *ln;
 
-    case MSG_REQ_REDIS_SISMEMBER:
+    if (ckpt == NULL) {
+        return;
+    }
 
-    case MSG_REQ_REDIS_ZRANK:
-    case MSG_REQ_REDIS_ZREVRANK:
-    case MSG_REQ_REDIS_ZSCORE:
+    pthread_mutex_lock(&ckpt->mutex);
 
-    case MSG_REQ_REDIS_PUBLISH:
+    ack = listLastValue(ckpt->acks);
+    if (ack != NULL) {
+        ack->open = 0;
+    }
 
-    case MSG_REQ_REDIS_MOVE:
-        return 1;
+    if (end) {
+        ckpt->parse_off = ckpt->rdb_off;
+        redis_repl_ack_advance(ckpt);
+        pthread_mutex_unlock(&ckpt->mutex);
+        return;
+    }
 
-    default:
-        break;
+    /* The target group is being overwritten by a new rdb, so the saved 
+     * checkpoint and the msgs still pending can't be resumed from. */
+    if (ckpt->saved_off >= 0) {
+        unlink(ckpt->fname);
+        ckpt->saved_off = -1;
     }
 
-    return 0;
-}
+    for (ln = listFirst(ckpt->acks); ln != NULL; ln = listNextNode(ln)) {
+        ack = listNodeValue(ln);
+        ack->reploff = -1;
+        ack->lost = 0;
+    }
 
-/*
- * Return true, if the redis command accepts exactly 2 arguments, otherwise
- * return false
- */
-static int
-redis_arg2(struct msg *r)
-{
-    switch (r->type) {
-    case MSG_REQ_REDIS_GETRANGE:
-    case MSG_REQ_REDIS_PSETEX:
-    case MSG_REQ_REDIS_SETBIT:
-    case MSG_REQ_REDIS_SETEX:
-    case MSG_REQ_REDIS_SETRANGE:
-
-    case MSG_REQ_REDIS_HINCRBY:
-    case MSG_REQ_REDIS_HINCRBYFLOAT:
-    case MSG_REQ_REDIS_HSET:
-    case MSG_REQ_REDIS_HSETNX:
-
-    case MSG_REQ_REDIS_LRANGE:
-    case MSG_REQ_REDIS_LREM:
-    case MSG_REQ_REDIS_LSET:
-    case MSG_REQ_REDIS_LTRIM:
-
-    case MSG_REQ_REDIS_SMOVE:
-
-    case MSG_REQ_REDIS_ZCOUNT:
-    case MSG_REQ_REDIS_ZLEXCOUNT:
-    case MSG_REQ_REDIS_ZINCRBY:
-    case MSG_REQ_REDIS_ZREMRANGEBYLEX:
-    case MSG_REQ_REDIS_ZREMRANGEBYRANK:
-    case MSG_REQ_REDIS_ZREMRANGEBYSCORE:
-
-    case MSG_REQ_REDIS_RESTORE:
-    case MSG_REQ_REDIS_RESTOREASKING:
-
-    case MSG_REQ_REDIS_BRPOPLPUSH:
-        return 1;
+    rmt_memcpy(ckpt->runid, rr->repl_master_runid, REDIS_RUN_ID_SIZE+1);
+    ckpt->rdb_off = rr->repl_master_initial_offset;
+    ckpt->parse_off = -1;
+    ckpt->ack_off = -1;
+    ckpt->lost = 0;
 
-    default:
-        break;
+    if (redis_repl_ack_create(ckpt, -1) == NULL) {
+        log_error("ERROR: Create replication ack failed: out of memory");
+        ckpt->lost = 1;
     }
 
-    return 0;
+    pthread_mutex_unlock(&ckpt->mutex);
 }
 
-/*
- * Return true, if the redis command accepts exactly 3 arguments, otherwise
- * return false
- */
-static int
-redis_arg3(struct msg *r)
+/* Called by the write thread for every command of len bytes parsed from
+ * the replication stream, before its msgs are sent. An invalid command
+ * makes the offset unknown until the next full sync. */
+void redis_repl_ack_parsed(redis_node *srnode, uint32_t len, int valid)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_LINSERT:
-        return 1;
+    redis_repl_ckpt *ckpt = srnode->ckpt;
+    redis_repl_ack *ack;
 
-    default:
-        break;
+    if (ckpt == NULL) {
+        return;
     }
 
-    return 0;
+    pthread_mutex_lock(&ckpt->mutex);
+
+    /* the commands parsed before may have no msgs to wait for */
+    redis_repl_ack_advance(ckpt);
+
+    if (!valid) {
+        ckpt->parse_off = -1;
+    } else if (ckpt->parse_off >= 0) {
+        ckpt->parse_off += len;
+    }
+
+    ack = listLastValue(ckpt->acks);
+    if (ack != NULL && ack->open) {
+        ack->reploff = ckpt->parse_off;
+        pthread_mutex_unlock(&ckpt->mutex);
+        return;
+    }
+
+    if (redis_repl_ack_create(ckpt, ckpt->parse_off) == NULL) {
+        log_error("ERROR: Create replication ack failed: out of memory");
+        ckpt->lost = 1;
+    }
+
+    pthread_mutex_unlock(&ckpt->mutex);
 }
 
-/*
- * Return true, if the redis command accepts 0 or more arguments, otherwise
- * return false
- */
-static int
-redis_argn(struct msg *r)
+/* Called by the write thread when a new batch of commands is parsed, the
+ * commands parsed after it are acknowledged apart. */
+void redis_repl_ack_batch(redis_node *srnode)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_BITCOUNT:
-    case MSG_REQ_REDIS_BITFIELD:
-
-    case MSG_REQ_REDIS_SET:
-    case MSG_REQ_REDIS_HDEL:
-    case MSG_REQ_REDIS_HMGET:
-    case MSG_REQ_REDIS_HMSET:
-    case MSG_REQ_REDIS_HSCAN:
-
-    case MSG_REQ_REDIS_LPUSH:
-    case MSG_REQ_REDIS_RPUSH:
-
-    case MSG_REQ_REDIS_SADD:
-    case MSG_REQ_REDIS_SDIFF:
-    case MSG_REQ_REDIS_SDIFFSTORE:
-    case MSG_REQ_REDIS_SINTER:
-    case MSG_REQ_REDIS_SINTERSTORE:
-    case MSG_REQ_REDIS_SREM:
-    case MSG_REQ_REDIS_SUNION:
-    case MSG_REQ_REDIS_SUNIONSTORE:
-    case MSG_REQ_REDIS_SRANDMEMBER:
-    case MSG_REQ_REDIS_SSCAN:
-
-    case MSG_REQ_REDIS_PFADD:
-    case MSG_REQ_REDIS_PFMERGE:
-
-    case MSG_REQ_REDIS_ZADD:
-    case MSG_REQ_REDIS_ZINTERSTORE:
-    case MSG_REQ_REDIS_ZRANGE:
-    case MSG_REQ_REDIS_ZRANGEBYSCORE:
-    case MSG_REQ_REDIS_ZREM:
-    case MSG_REQ_REDIS_ZREVRANGE:
-    case MSG_REQ_REDIS_ZRANGEBYLEX:
-    case MSG_REQ_REDIS_ZREVRANGEBYSCORE:
-    case MSG_REQ_REDIS_ZUNIONSTORE:
-    case MSG_REQ_REDIS_ZSCAN:
-
-    case MSG_REQ_REDIS_SELECT:
-    case MSG_REQ_REDIS_GEOADD:
-    case MSG_REQ_REDIS_GEORADIUS:
-    case MSG_REQ_REDIS_GEORADIUSBYMEMBER:
-    case MSG_REQ_REDIS_SCRIPT:
-        return 1;
+    redis_repl_ckpt *ckpt = srnode->ckpt;
+    redis_repl_ack *ack;
 
-    default:
-        break;
+    if (ckpt == NULL) {
+        return;
     }
 
-    return 0;
+    pthread_mutex_lock(&ckpt->mutex);
+    ack = listLastValue(ckpt->acks);
+    if (ack != NULL) {
+        ack->open = 0;
+    }
+    pthread_mutex_unlock(&ckpt->mutex);
 }
 
-/*
- * Return true, if the redis command is a vector command accepting one or
- * more keys, otherwise return false
- */
-static int
-redis_argx(struct msg *r)
+/* Called by the write thread when msg is queued to the target group. */
+void redis_repl_ack_msg(redis_node *srnode, struct msg *msg)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_MGET:
-    case MSG_REQ_REDIS_DEL:
+    redis_repl_ckpt *ckpt = srnode->ckpt;
+    redis_repl_ack *ack;
 
-    case MSG_REQ_REDIS_RENAME:
-    case MSG_REQ_REDIS_RENAMENX:
-    case MSG_REQ_REDIS_RPOPLPUSH:
+    if (ckpt == NULL) {
+        return;
+    }
 
-    case MSG_REQ_REDIS_BITOP:
-        return 1;
+    pthread_mutex_lock(&ckpt->mutex);
 
-    default:
-        break;
+    ack = listLastValue(ckpt->acks);
+    if (ack == NULL || !ack->open) {
+        ckpt->lost = 1;
+        pthread_mutex_unlock(&ckpt->mutex);
+        return;
     }
 
-    return 0;
+    ack->pending ++;
+    msg->ack = ack;
+
+    pthread_mutex_unlock(&ckpt->mutex);
 }
 
-/*
- * Return true, if the redis command is a vector command accepting one or
- * more key-value pairs, otherwise return false
- */
-static int
-redis_argkvx(struct msg *r)
+/* Called when the msg is freed, after the target group acknowledged it,
+ * or it was sent with noreply, or it was dropped. It may be called by 
+ * the apply threads. */
+void redis_repl_ack_put(struct msg *msg)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_MSET:
-    case MSG_REQ_REDIS_MSETNX:
-        return 1;
+    redis_repl_ack *ack = msg->ack;
+    redis_repl_ckpt *ckpt;
 
-    default:
-        break;
+    ASSERT(ack != NULL);
+    ckpt = ack->ckpt;
+
+    pthread_mutex_lock(&ckpt->mutex);
+
+    ASSERT(ack->pending > 0);
+
+    msg->ack = NULL;
+    ack->pending --;
+    if (msg->ack_lost) {
+        ack->lost = 1;
     }
 
-    return 0;
+    if (ack->pending == 0) {
+        redis_repl_ack_advance(ckpt);
+    }
+
+    pthread_mutex_unlock(&ckpt->mutex);
 }
 
-/*
- * Return true, if the redis command is either EVAL or EVALSHA. These commands
- * have a special format with exactly 2 arguments, followed by one or more keys,
- * followed by zero or more arguments (the documentation online seems to suggest
- * that at least one argument is required, but that shouldn't be the case).
- */
-static int
-redis_argeval(struct msg *r)
+/* Save the acknowledged offset of the source node to the checkpoint
+ * file, with a rename so the file is always complete. */
+int redis_repl_checkpoint_save(redis_node *srnode)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_EVAL:
-    case MSG_REQ_REDIS_EVALSHA:
-        return 1;
+    redis_repl_ckpt *ckpt = srnode->ckpt;
+    long long ack_off;
+    sds tmpname;
+    FILE *fp;
 
-    default:
-        break;
+    if (ckpt == NULL || !ckpt->save) {
+        return RMT_OK;
     }
 
-    return 0;
-}
+    pthread_mutex_lock(&ckpt->mutex);
+    ack_off = ckpt->lost ? -1 : ckpt->ack_off;
+    pthread_mutex_unlock(&ckpt->mutex);
 
-/*
- * Return true, if the redis command accepts 0 or more keys,
- * otherwise return false
- */
-static int
-redis_argzormore(struct msg *r)
-{
-    switch (r->type) {
-    case MSG_REQ_REDIS_INFO:
-    case MSG_REQ_REDIS_SHUTDOWN:
+    if (ack_off < 0 || ack_off == ckpt->saved_off) {
+        return RMT_OK;
+    }
 
-    case MSG_REQ_REDIS_COMMAND:
-        return 1;
+    tmpname = sdscatfmt(sdsempty(), "%s.tmp", ckpt->fname);
+    if (tmpname == NULL) {
+        log_error("ERROR: Out of memory");
+        return RMT_ERROR;
+    }
 
-    default:
-        break;
+    fp = fopen(tmpname, "w");
+    if (fp == NULL) {
+        log_error("ERROR: Open checkpoint file %s failed: %s", 
+            tmpname, strerror(errno));
+        sdsfree(tmpname);
+        return RMT_ERROR;
     }
 
-    return 0;
+    if (fprintf(fp, "%s %lld\n", ckpt->runid, ack_off) < 0 || 
+        fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        log_error("ERROR: Write checkpoint file %s failed: %s", 
+            tmpname, strerror(errno));
+        fclose(fp);
+        unlink(tmpname);
+        sdsfree(tmpname);
+        return RMT_ERROR;
+    }
+    fclose(fp);
+
+    if (rename(tmpname, ckpt->fname) == -1) {
+        log_error("ERROR: Rename checkpoint file %s to %s failed: %s", 
+            tmpname, ckpt->fname, strerror(errno));
+        unlink(tmpname);
+        sdsfree(tmpname);
+        return RMT_ERROR;
+    }
+    sdsfree(tmpname);
+
+    ckpt->saved_off = ack_off;
+
+    log_debug(LOG_VERB, "checkpoint of node[%s] saved: %s %lld", 
+        srnode->addr, ckpt->runid, ckpt->saved_off);
+
+    return RMT_OK;
 }
 
-/*
- * Return true, if the redis command accepts one subcommand, then one key, 
- * and 0 or more arguments, otherwise return false
- */
-static int
-redis_subcmd_onekey_argzormore(struct msg *r)
+/* Load the checkpoint of the source node saved by the last run, so the
+ * replication tries a partial resynchronization from it. */
+static int redis_repl_checkpoint_load(redis_node *srnode)
 {
-    switch (r->type) {
-    case MSG_REQ_REDIS_PFDEBUG:
-        return 1;
+    redis_repl_ckpt *ckpt = srnode->ckpt;
+    redis_repl *rr = srnode->rr;
+    char runid[REDIS_RUN_ID_SIZE+1];
+    long long offset;
+    FILE *fp;
+    int n;
 
-    default:
-        break;
+    fp = fopen(ckpt->fname, "r");
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            log_warn("Open checkpoint file %s failed: %s", 
+                ckpt->fname, strerror(errno));
+        }
+        return RMT_OK;
     }
 
-    return 0;
-}
+    n = fscanf(fp, "%40s %lld", runid, &offset);
+    fclose(fp);
+    if (n != 2 || rmt_strlen(runid) != REDIS_RUN_ID_SIZE || offset <= 0) {
+        log_warn("Checkpoint file %s is invalid, ignore it", ckpt->fname);
+        return RMT_OK;
+    }
 
+    rmt_memcpy(rr->replrunid, runid, REDIS_RUN_ID_SIZE+1);
+    rr->reploff = offset;
 
-/*
+    rmt_memcpy(ckpt->runid, runid, REDIS_RUN_ID_SIZE+1);
+    ckpt->parse_off = offset;
+    ckpt->ack_off = offset;
+    ckpt->saved_off = offset;
+
+    log_notice("Checkpoint for node[%s] loaded: %s %lld", 
+        srnode->addr, runid, offset);
+
+    return RMT_OK;
+}
+
+static redis_repl_ckpt *redis_repl_checkpoint_create(redis_node *srnode)
+{
+    rmtContext *ctx = srnode->ctx;
+    redis_repl_ckpt *ckpt;
+
+    ckpt = rmt_alloc(sizeof(*ckpt));
+    if (ckpt == NULL) {
+        return NULL;
+    }
+
+    ckpt->fname = NULL;
+    ckpt->runid[0] = '\0';
+    ckpt->rdb_off = -1;
+    ckpt->parse_off = -1;
+    ckpt->ack_off = -1;
+    ckpt->saved_off = -1;
+    ckpt->lost = 0;
+    ckpt->save = 0;
+    pthread_mutex_init(&ckpt->mutex, NULL);
+
+    ckpt->acks = listCreate();
+    if (ckpt->acks == NULL) {
+        goto error;
+    }
+
+    ckpt->fname = sdsempty();
+    if (ckpt->fname == NULL) {
+        goto error;
+    }
+    if (ctx->dir != NULL) {
+        ckpt->fname = sdscatsds(ckpt->fname, ctx->dir);
+        ckpt->fname = sdscat(ckpt->fname, "/");
+    }
+    ckpt->fname = sdscatfmt(ckpt->fname, "node%s.checkpoint", srnode->addr);
+
+    return ckpt;
+
+error:
+
+    redis_repl_checkpoint_destroy(ckpt);
+    return NULL;
+}
+
+/* Weight of the last second in the moving averages of the rdb parse */
+#define REDIS_REPL_RATE_WEIGHT      0.3
+
+/*
+ * Sample the replication offset received at now, drop the samples the 
+ * target group acknowledged, and update the lag. The lag in seconds is 
+ * the age of the oldest sample not acknowledged, without a bound: when 
+ * the samples are too many they are merged two by two, and the time
+ * between two samples doubles. The lag is over by that time at most, 
+ * about 1/32 of the highest lag of the samples left.
+ */
+void redis_repl_lag_update(redis_repl_progress *progress, long long reploff,
+    long long ack_off, long long now)
+{
+    redis_repl_sample *samples = progress->samples;
+    uint32_t i, n;
+
+    n = progress->nsamples;
+    if (n > 0 && reploff < samples[n - 1].off) {
+        /* a new replication */
+        n = 0;
+        progress->lag_step = 0;
+    }
+
+    if (n > 0 && reploff > samples[n - 1].off &&
+        now - samples[n - 1].time < progress->lag_step) {
+        samples[n - 1].off = reploff;
+    } else if (n == 0 || reploff > samples[n - 1].off) {
+        if (n == REDIS_REPL_LAG_SAMPLES) {
+            for (i = 0; i < n/2; i ++) {
+                samples[i].off = samples[2*i + 1].off;
+                samples[i].time = samples[2*i].time;
+            }
+            n /= 2;
+            progress->lag_step = MAX(progress->lag_step*2, 
+                samples[1].time - samples[0].time);
+        }
+        samples[n].off = reploff;
+        samples[n].time = now;
+        n ++;
+    }
+
+    for (i = 0; i < n && ack_off >= 0 && samples[i].off <= ack_off; i ++);
+    if (i > 0) {
+        rmt_memmove(samples, samples + i, (n - i)*sizeof(*samples));
+        n -= i;
+    }
+    if (n == 0) {
+        /* caught up, sample every update again */
+        progress->lag_step = 0;
+    }
+    progress->nsamples = n;
+
+    progress->reploff = reploff;
+    progress->ack_off = ack_off;
+    if (ack_off < 0) {
+        progress->lag_bytes = -1;
+        progress->lag_msec = -1;
+    } else if (ack_off >= reploff) {
+        progress->lag_bytes = 0;
+        progress->lag_msec = 0;
+    } else {
+        progress->lag_bytes = reploff - ack_off;
+        progress->lag_msec = now - samples[0].time;
+    }
+}
+
+/* Called every second by the write thread of the source node. */
+void redis_repl_progress_update(redis_node *srnode, long long now)
+{
+    redis_repl *rr = srnode->rr;
+    redis_rdb *rdb = srnode->rdb;
+    redis_repl_ckpt *ckpt = srnode->ckpt;
+    redis_repl_progress *progress;
+    long long ack_off = -1, total, left;
+    double seconds, rate;
+
+    if (rr == NULL) {
+        return;
+    }
+    progress = &rr->progress;
+
+    if (ckpt != NULL) {
+        pthread_mutex_lock(&ckpt->mutex);
+        ack_off = ckpt->ack_off;
+        pthread_mutex_unlock(&ckpt->mutex);
+    }
+
+    redis_repl_lag_update(progress, rr->reploff, ack_off, now);
+
+    if (progress->time > 0 && now > progress->time) {
+        seconds = (double)(now - progress->time)/1000;
+
+        if (rdb->parsed_bytes < progress->rdb_parsed) {
+            /* a new rdb */
+            progress->rdb_parsed = 0;
+            progress->rdb_keys = 0;
+            progress->rdb_bytes_per_sec = 0;
+            progress->rdb_keys_per_sec = 0;
+        }
+
+        rate = (double)(rdb->parsed_bytes - progress->rdb_parsed)/seconds;
+        progress->rdb_bytes_per_sec += 
+            (rate - progress->rdb_bytes_per_sec)*REDIS_REPL_RATE_WEIGHT;
+        rate = (double)(rdb->parsed_keys - progress->rdb_keys)/seconds;
+        progress->rdb_keys_per_sec += 
+            (rate - progress->rdb_keys_per_sec)*REDIS_REPL_RATE_WEIGHT;
+    }
+    progress->rdb_parsed = rdb->parsed_bytes;
+    progress->rdb_keys = rdb->parsed_keys;
+    progress->time = now;
+
+    total = __atomic_load_n(&rdb->received, __ATOMIC_ACQUIRE) ? 
+        (long long)rr->repl_transfer_read : 
+        (long long)rr->repl_transfer_size;
+    left = total - progress->rdb_parsed;
+    if (total <= 0 || __atomic_load_n(&rdb->resumed, __ATOMIC_ACQUIRE)) {
+        progress->rdb_eta_msec = -1;
+    } else if (left <= 0) {
+        progress->rdb_eta_msec = 0;
+    } else if (progress->rdb_bytes_per_sec >= 1) {
+        progress->rdb_eta_msec = 
+            (long long)((double)left*1000/progress->rdb_bytes_per_sec);
+    } else {
+        progress->rdb_eta_msec = -1;
+    }
+}
+
+static void redis_repl_checkpoint_destroy(redis_repl_ckpt *ckpt)
+{
+    redis_repl_ack *ack;
+
+    if (ckpt->acks != NULL) {
+        /* msgs still holding the batches were freed before */
+        while ((ack = listPop(ckpt->acks)) != NULL) {
+            rmt_free(ack);
+        }
+        listRelease(ckpt->acks);
+    }
+
+    if (ckpt->fname != NULL) {
+        sdsfree(ckpt->fname);
+    }
+
+    pthread_mutex_destroy(&ckpt->mutex);
+    rmt_free(ckpt);
+}
+
+/* ========================== Redis Protocol ============================ */
+
+/* Key position class of a redis command, used by the request parser to
+ * know where the keys are. Every parsed command has exactly one class. */
+#define REDIS_ARGZ              1   /* takes no key */
+#define REDIS_ARG0              2   /* one key and no argument */
+#define REDIS_ARG1              3   /* one key and exactly 1 argument */
+#define REDIS_ARG2              4   /* one key and exactly 2 arguments */
+#define REDIS_ARG3              5   /* one key and exactly 3 arguments */
+#define REDIS_ARGN              6   /* one key and 0 or more arguments */
+#define REDIS_ARGX              7   /* one or more keys */
+#define REDIS_ARGKVX            8   /* one or more key-value pairs */
+#define REDIS_ARGEVAL           9   /* eval and evalsha */
+#define REDIS_ARGZORMORE        10  /* 0 or more keys */
+#define REDIS_SUBCMD_ONEKEY     11  /* one subcommand, one key, 0 or more arguments */
+
+#define REDIS_CMD_NOFORWARD     (1<<0)  /* never sent to the target group */
+#define REDIS_CMD_NOT_SUPPORT   (1<<1)  /* parsed but not supported */
+
+struct redis_command {
+    const char *name;   /* command name in lower case */
+    uint32_t   len;     /* command name length */
+    int        args;    /* key position class */
+    int        flags;
+};
+
+#define REDIS_COMMAND(_type, _name, _args, _flags)                              \
+    [MSG_REQ_REDIS_##_type] = { _name, sizeof(_name) - 1, _args, _flags }
+
+/*
+ * All the commands that redis_parse_req can parse, indexed by msg type.
+ * After adding a command here, regenerate rmt_redis_cmdhash.h with
+ * scripts/rmt_cmdhash.py.
+ */
+static const struct redis_command redis_command_table[] = {
+    REDIS_COMMAND( SELECT,              "select",            REDIS_ARGN,              REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( DEL,                 "del",               REDIS_ARGX,              0 ),
+    REDIS_COMMAND( EXISTS,              "exists",            REDIS_ARG0,              0 ),
+    REDIS_COMMAND( EXPIRE,              "expire",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( EXPIREAT,            "expireat",          REDIS_ARG1,              0 ),
+    REDIS_COMMAND( PEXPIRE,             "pexpire",           REDIS_ARG1,              0 ),
+    REDIS_COMMAND( PEXPIREAT,           "pexpireat",         REDIS_ARG1,              0 ),
+    REDIS_COMMAND( PERSIST,             "persist",           REDIS_ARG0,              0 ),
+    REDIS_COMMAND( PTTL,                "pttl",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( SORT,                "sort",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( TTL,                 "ttl",               REDIS_ARG0,              0 ),
+    REDIS_COMMAND( TYPE,                "type",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( APPEND,              "append",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( BITCOUNT,            "bitcount",          REDIS_ARGN,              0 ),
+    REDIS_COMMAND( DECR,                "decr",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( DECRBY,              "decrby",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( DUMP,                "dump",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( GET,                 "get",               REDIS_ARG0,              0 ),
+    REDIS_COMMAND( GETBIT,              "getbit",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( GETRANGE,            "getrange",          REDIS_ARG2,              0 ),
+    REDIS_COMMAND( GETSET,              "getset",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( INCR,                "incr",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( INCRBY,              "incrby",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( INCRBYFLOAT,         "incrbyfloat",       REDIS_ARG1,              0 ),
+    REDIS_COMMAND( MGET,                "mget",              REDIS_ARGX,              0 ),
+    REDIS_COMMAND( MSET,                "mset",              REDIS_ARGKVX,            0 ),
+    REDIS_COMMAND( PSETEX,              "psetex",            REDIS_ARG2,              0 ),
+    REDIS_COMMAND( RESTORE,             "restore",           REDIS_ARG2,              0 ),
+    REDIS_COMMAND( RESTOREASKING,       "restore-asking",    REDIS_ARG2,              0 ),
+    REDIS_COMMAND( SET,                 "set",               REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SETBIT,              "setbit",            REDIS_ARG2,              0 ),
+    REDIS_COMMAND( SETEX,               "setex",             REDIS_ARG2,              0 ),
+    REDIS_COMMAND( SETNX,               "setnx",             REDIS_ARG1,              0 ),
+    REDIS_COMMAND( SETRANGE,            "setrange",          REDIS_ARG2,              0 ),
+    REDIS_COMMAND( STRLEN,              "strlen",            REDIS_ARG0,              0 ),
+    REDIS_COMMAND( HDEL,                "hdel",              REDIS_ARGN,              0 ),
+    REDIS_COMMAND( HEXISTS,             "hexists",           REDIS_ARG1,              0 ),
+    REDIS_COMMAND( HGET,                "hget",              REDIS_ARG1,              0 ),
+    REDIS_COMMAND( HGETALL,             "hgetall",           REDIS_ARG0,              0 ),
+    REDIS_COMMAND( HINCRBY,             "hincrby",           REDIS_ARG2,              0 ),
+    REDIS_COMMAND( HINCRBYFLOAT,        "hincrbyfloat",      REDIS_ARG2,              0 ),
+    REDIS_COMMAND( HKEYS,               "hkeys",             REDIS_ARG0,              0 ),
+    REDIS_COMMAND( HLEN,                "hlen",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( HMGET,               "hmget",             REDIS_ARGN,              0 ),
+    REDIS_COMMAND( HMSET,               "hmset",             REDIS_ARGN,              0 ),
+    REDIS_COMMAND( HSET,                "hset",              REDIS_ARG2,              0 ),
+    REDIS_COMMAND( HSETNX,              "hsetnx",            REDIS_ARG2,              0 ),
+    REDIS_COMMAND( HSCAN,               "hscan",             REDIS_ARGN,              0 ),
+    REDIS_COMMAND( HVALS,               "hvals",             REDIS_ARG0,              0 ),
+    REDIS_COMMAND( LINDEX,              "lindex",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( LINSERT,             "linsert",           REDIS_ARG3,              0 ),
+    REDIS_COMMAND( LLEN,                "llen",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( LPOP,                "lpop",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( LPUSH,               "lpush",             REDIS_ARGN,              0 ),
+    REDIS_COMMAND( LPUSHX,              "lpushx",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( LRANGE,              "lrange",            REDIS_ARG2,              0 ),
+    REDIS_COMMAND( LREM,                "lrem",              REDIS_ARG2,              0 ),
+    REDIS_COMMAND( LSET,                "lset",              REDIS_ARG2,              0 ),
+    REDIS_COMMAND( LTRIM,               "ltrim",             REDIS_ARG2,              0 ),
+    REDIS_COMMAND( PFADD,               "pfadd",             REDIS_ARGN,              0 ),
+    REDIS_COMMAND( PFCOUNT,             "pfcount",           REDIS_ARG0,              0 ),
+    REDIS_COMMAND( PFMERGE,             "pfmerge",           REDIS_ARGN,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( PFDEBUG,             "pfdebug",           REDIS_SUBCMD_ONEKEY,     0 ),
+    REDIS_COMMAND( RPOP,                "rpop",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( RPOPLPUSH,           "rpoplpush",         REDIS_ARGX,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( RPUSH,               "rpush",             REDIS_ARGN,              0 ),
+    REDIS_COMMAND( RPUSHX,              "rpushx",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( SADD,                "sadd",              REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SCARD,               "scard",             REDIS_ARG0,              0 ),
+    REDIS_COMMAND( SDIFF,               "sdiff",             REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SDIFFSTORE,          "sdiffstore",        REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SINTER,              "sinter",            REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SINTERSTORE,         "sinterstore",       REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SISMEMBER,           "sismember",         REDIS_ARG1,              0 ),
+    REDIS_COMMAND( SMEMBERS,            "smembers",          REDIS_ARG0,              0 ),
+    REDIS_COMMAND( SMOVE,               "smove",             REDIS_ARG2,              0 ),
+    REDIS_COMMAND( SPOP,                "spop",              REDIS_ARG0,              0 ),
+    REDIS_COMMAND( SRANDMEMBER,         "srandmember",       REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SREM,                "srem",              REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SUNION,              "sunion",            REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SUNIONSTORE,         "sunionstore",       REDIS_ARGN,              0 ),
+    REDIS_COMMAND( SSCAN,               "sscan",             REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZADD,                "zadd",              REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZCARD,               "zcard",             REDIS_ARG0,              0 ),
+    REDIS_COMMAND( ZCOUNT,              "zcount",            REDIS_ARG2,              0 ),
+    REDIS_COMMAND( ZINCRBY,             "zincrby",           REDIS_ARG2,              0 ),
+    REDIS_COMMAND( ZINTERSTORE,         "zinterstore",       REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZLEXCOUNT,           "zlexcount",         REDIS_ARG2,              0 ),
+    REDIS_COMMAND( ZRANGE,              "zrange",            REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZRANGEBYLEX,         "zrangebylex",       REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZRANGEBYSCORE,       "zrangebyscore",     REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZRANK,               "zrank",             REDIS_ARG1,              0 ),
+    REDIS_COMMAND( ZREM,                "zrem",              REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZREMRANGEBYRANK,     "zremrangebyrank",   REDIS_ARG2,              0 ),
+    REDIS_COMMAND( ZREMRANGEBYLEX,      "zremrangebylex",    REDIS_ARG2,              0 ),
+    REDIS_COMMAND( ZREMRANGEBYSCORE,    "zremrangebyscore",  REDIS_ARG2,              0 ),
+    REDIS_COMMAND( ZREVRANGE,           "zrevrange",         REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZREVRANGEBYSCORE,    "zrevrangebyscore",  REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZREVRANK,            "zrevrank",          REDIS_ARG1,              0 ),
+    REDIS_COMMAND( ZSCORE,              "zscore",            REDIS_ARG1,              0 ),
+    REDIS_COMMAND( ZUNIONSTORE,         "zunionstore",       REDIS_ARGN,              0 ),
+    REDIS_COMMAND( ZSCAN,               "zscan",             REDIS_ARGN,              0 ),
+    REDIS_COMMAND( EVAL,                "eval",              REDIS_ARGEVAL,           REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( EVALSHA,             "evalsha",           REDIS_ARGEVAL,           REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( SCRIPT,              "script",            REDIS_ARGN,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( PING,                "ping",              REDIS_ARGZ,              REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( INFO,                "info",              REDIS_ARGZORMORE,        REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( QUIT,                "quit",              REDIS_ARGZ,              0 ),
+    REDIS_COMMAND( AUTH,                "auth",              REDIS_ARG0,              REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( ASKING,              "asking",            REDIS_ARGZ,              REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( SHUTDOWN,            "shutdown",          REDIS_ARGZORMORE,        REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( COMMAND,             "command",           REDIS_ARGZORMORE,        0 ),
+    REDIS_COMMAND( RENAME,              "rename",            REDIS_ARGX,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( RENAMENX,            "renamenx",          REDIS_ARGX,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( BRPOPLPUSH,          "brpoplpush",        REDIS_ARG2,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( FLUSHALL,            "flushall",          REDIS_ARGZ,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( FLUSHDB,             "flushdb",           REDIS_ARGZ,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( PUBLISH,             "publish",           REDIS_ARG1,              REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( BITFIELD,            "bitfield",          REDIS_ARGN,              0 ),
+    REDIS_COMMAND( BITOP,               "bitop",             REDIS_ARGX,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( MSETNX,              "msetnx",            REDIS_ARGKVX,            0 ),
+    REDIS_COMMAND( MOVE,                "move",              REDIS_ARG1,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( GEOADD,              "geoadd",            REDIS_ARGN,              0 ),
+    REDIS_COMMAND( GEORADIUS,           "georadius",         REDIS_ARGN,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( GEORADIUSBYMEMBER,   "georadiusbymember", REDIS_ARGN,              REDIS_CMD_NOFORWARD|REDIS_CMD_NOT_SUPPORT ),
+    REDIS_COMMAND( MULTI,               "multi",             REDIS_ARGZ,              REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( EXEC,                "exec",              REDIS_ARGZ,              REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( CONFIG,              "config",            REDIS_ARGZORMORE,        REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( MIGRATE,             "migrate",           REDIS_ARGZORMORE,        REDIS_CMD_NOFORWARD ),
+    REDIS_COMMAND( SLOWLOG,             "slowlog",           REDIS_ARGZORMORE,        REDIS_CMD_NOFORWARD ),
+    [MSG_SENTINEL] = { NULL, 0, 0, 0 }
+};
+
+#include <rmt_redis_cmdhash.h>
+
+/*
+ * Return the command named by the 'len' bytes at 'name', or NULL if
+ * it is not a command that we can parse. The name is case insensitive.
+ */
+static const struct redis_command *
+redis_command_lookup(const uint8_t *name, uint32_t len, msg_type_t *type)
+{
+    const struct redis_command *cmd;
+    uint32_t hash, i, slot;
+    msg_type_t t;
+
+    hash = 2166136261UL;
+    for (i = 0; i < len; i++) {
+        hash ^= (uint32_t)(name[i] | 0x20);
+        hash *= 16777619;
+    }
+
+    slot = ((hash >> 16) ^ redis_cmdhash_disp[hash % REDIS_CMDHASH_BUCKETS]) %
+        REDIS_CMDHASH_SLOTS;
+    t = (msg_type_t)redis_cmdhash_slot[slot];
+    cmd = &redis_command_table[t];
+    if (t == MSG_UNKNOWN || cmd->len != len ||
+        strncasecmp((const char *)name, cmd->name, len) != 0) {
+        return NULL;
+    }
+
+    *type = t;
+    return cmd;
+}
+
+/*
+ * Return the lower case name of the command for msg type, or NULL if
+ * the type is not a request.
+ */
+const char *
+redis_command_name(msg_type_t type)
+{
+    if (type <= MSG_UNKNOWN || type >= MSG_SENTINEL) {
+        return NULL;
+    }
+
+    return redis_command_table[type].name;
+}
+
+/* Parse the bulk length at p, return the start of the bulk or NULL. */
+static uint8_t *
+redis_bulk_head(uint8_t *p, uint8_t *end, size_t *len)
+{
+    if (p >= end || *p != '$') {
+        return NULL;
+    }
+
+    *len = 0;
+    for (p++; p < end && isdigit(*p); p++) {
+        *len = *len*10 + (size_t)(*p - '0');
+    }
+
+    if ((size_t)(end - p) < CRLF_LEN || *p != CR) {
+        return NULL;
+    }
+
+    return p + CRLF_LEN;
+}
+
+/*
+ * Copy at most size bytes of the first key of the sent request r into buf
+ * and return its whole length, 0 if it has no key. The msgs generated from
+ * the rdb have no keys parsed, their key is the second bulk in the mbufs.
+ */
+size_t
+redis_msg_first_key(struct msg *r, uint8_t *buf, size_t size)
+{
+    struct keypos *kp;
+    struct mbuf *mbuf;
+    listNode *lnode;
+    uint8_t head[512], *p, *end;
+    size_t n = 0, len, keylen;
+
+    if (r->keys != NULL && array_n(r->keys) > 0) {
+        kp = array_get(r->keys, 0);
+        keylen = (size_t)(kp->end - kp->start);
+        rmt_memcpy(buf, kp->start, MIN(keylen, size));
+        return keylen;
+    }
+
+    for (lnode = listFirst(r->data); lnode != NULL && n < sizeof(head);
+        lnode = listNextNode(lnode)) {
+        mbuf = listNodeValue(lnode);
+        p = lnode == listFirst(r->data) && r->spos != NULL ? 
+            r->spos : mbuf->start;
+        len = MIN((size_t)(mbuf->last - p), sizeof(head) - n);
+        rmt_memcpy(head + n, p, len);
+        n += len;
+    }
+
+    /* *<argc>\r\n$<len>\r\n<command>\r\n$<len>\r\n<key>\r\n */
+    end = head + n;
+    if (n == 0 || head[0] != '*' || (p = memchr(head, LF, n)) == NULL) {
+        return 0;
+    }
+
+    p = redis_bulk_head(p + 1, end, &len);
+    if (p == NULL || (size_t)(end - p) < len + CRLF_LEN) {
+        return 0;
+    }
+
+    p = redis_bulk_head(p + len + CRLF_LEN, end, &keylen);
+    if (p == NULL || (size_t)(end - p) < MIN(keylen, size)) {
+        return 0;
+    }
+
+    rmt_memcpy(buf, p, MIN(keylen, size));
+
+    return keylen;
+}
+
+static inline int
+redis_command_args(struct msg *r)
+{
+    ASSERT(r->type < MSG_SENTINEL);
+    return redis_command_table[r->type].args;
+}
+
+/*
+ * Return 1, if the redis command take no key, otherwise
+ * return 0
+ */
+static int
+redis_argz(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARGZ;
+}
+
+/*
+ * Return true, if the redis command accepts no arguments, otherwise
+ * return false
+ */
+static int
+redis_arg0(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARG0;
+}
+
+/*
+ * Return true, if the redis command accepts exactly 1 argument, otherwise
+ * return false
+ */
+static int
+redis_arg1(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARG1;
+}
+
+/*
+ * Return true, if the redis command accepts exactly 2 arguments, otherwise
+ * return false
+ */
+static int
+redis_arg2(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARG2;
+}
+
+/*
+ * Return true, if the redis command accepts exactly 3 arguments, otherwise
+ * return false
+ */
+static int
+redis_arg3(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARG3;
+}
+
+/*
+ * Return true, if the redis command accepts 0 or more arguments, otherwise
+ * return false
+ */
+static int
+redis_argn(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARGN;
+}
+
+/*
+ * Return true, if the redis command is a vector command accepting one or
+ * more keys, otherwise return false
+ */
+static int
+redis_argx(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARGX;
+}
+
+/*
+ * Return true, if the redis command is a vector command accepting one or
+ * more key-value pairs, otherwise return false
+ */
+static int
+redis_argkvx(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARGKVX;
+}
+
+/*
+ * Return true, if the redis command is either EVAL or EVALSHA. These commands
+ * have a special format with exactly 2 arguments, followed by one or more keys,
+ * followed by zero or more arguments (the documentation online seems to suggest
+ * that at least one argument is required, but that shouldn't be the case).
+ */
+static int
+redis_argeval(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARGEVAL;
+}
+
+/*
+ * Return true, if the redis command accepts 0 or more keys,
+ * otherwise return false
+ */
+static int
+redis_argzormore(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_ARGZORMORE;
+}
+
+/*
+ * Return true, if the redis command accepts one subcommand, then one key, 
+ * and 0 or more arguments, otherwise return false
+ */
+static int
+redis_subcmd_onekey_argzormore(struct msg *r)
+{
+    return redis_command_args(r) == REDIS_SUBCMD_ONEKEY;
+}
+
+
+/*
  * Reference: http://redis.io/topics/protocol
  *
  * Redis >= 1.2 uses the unified protocol to send requests to the Redis
@@ -2452,6 +3510,7 @@ redis_parse_req(struct msg *r)
     struct mbuf *b;
     uint8_t *p, *m;
     uint8_t ch;
+    const struct redis_command *cmd;
     enum {
         SW_START,
         SW_NARG,
@@ -2599,751 +3658,558 @@ redis_parse_req(struct msg *r)
             r->token = NULL;
             r->type = MSG_UNKNOWN;
 
-            switch (p - m) {
+            cmd = redis_command_lookup(m, (uint32_t)(p - m), &r->type);
+            if (cmd == NULL) {
+                log_error("ERROR: parsed unsupported command '%.*s'", p - m, m);
+                goto error;
+            }
+
+            if (cmd->flags & REDIS_CMD_NOFORWARD) {
+                r->noforward = 1;
+            }
 
-            case 3:
-                if (str3icmp(m, 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_GET;
-                    break;
-                }
+            if (cmd->flags & REDIS_CMD_NOT_SUPPORT) {
+                r->not_support = 1;
+            }
 
-                if (str3icmp(m, 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_SET;
-                    break;
-                }
+            log_debug(LOG_VERB, "parsed command '%.*s'", p - m, m);
 
-                if (str3icmp(m, 't', 't', 'l')) {
-                    r->type = MSG_REQ_REDIS_TTL;
-                    break;
-                }
+            state = SW_REQ_TYPE_LF;
+            break;
 
-                if (str3icmp(m, 'd', 'e', 'l')) {
-                    r->type = MSG_REQ_REDIS_DEL;
-                    break;
+        case SW_REQ_TYPE_LF:
+            switch (ch) {
+            case LF:
+                if (redis_argz(r)) {
+                    goto done;
+                } else if (redis_argeval(r)) {
+                    state = SW_ARG1_LEN;
+                } else if (redis_subcmd_onekey_argzormore(r)) {
+                    state = SW_SUBCMD_LEN;
+                } else if (redis_argzormore(r)) {
+                    if (r->narg == 1) {
+                        goto done;
+                    }
+                    state = SW_KEY_LEN;
+                } else {
+                    state = SW_KEY_LEN;
                 }
-
                 break;
 
-            case 4:
-                if (str4icmp(m, 'p', 't', 't', 'l')) {
-                    r->type = MSG_REQ_REDIS_PTTL;
-                    break;
-                }
-
-                if (str4icmp(m, 'd', 'e', 'c', 'r')) {
-                    r->type = MSG_REQ_REDIS_DECR;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str4icmp(m, 'd', 'u', 'm', 'p')) {
-                    r->type = MSG_REQ_REDIS_DUMP;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'h', 'd', 'e', 'l')) {
-                    r->type = MSG_REQ_REDIS_HDEL;
-                    break;
+        case SW_SUBCMD_LEN:
+            if (r->token == NULL) {
+                if (ch != '$') {
+                    goto error;
                 }
-
-                if (str4icmp(m, 'h', 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HGET;
-                    break;
+                r->rlen = 0;
+                r->token = p;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if ((p - r->token) <= 1 || r->rnarg == 0) {
+                    goto error;
                 }
+                r->rnarg--;
+                r->token = NULL;
+                state = SW_SUBCMD_LEN_LF;
+            } else {
+                goto error;
+            }
+            break;
+            
+        case SW_SUBCMD_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_SUBCMD;
+                break;
 
-                if (str4icmp(m, 'h', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_HLEN;
-                    break;
-                }
+            default:
+                goto error;
+            }
+            break;
 
-                if (str4icmp(m, 'h', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HSET;
-                    break;
-                }
+        case SW_SUBCMD:
+            m = p + r->rlen;
+            if (m >= b->last) {
+                r->rlen -= (uint32_t)(b->last - p);
+                m = b->last - 1;
+                p = m;
+                break;
+            }
 
-                if (str4icmp(m, 'i', 'n', 'c', 'r')) {
-                    r->type = MSG_REQ_REDIS_INCR;
-                    break;
-                }
+            if (*m != CR) {
+                goto error;
+            }
 
-                if (str4icmp(m, 'l', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_LLEN;
-                    break;
-                }
+            p = m; /* move forward by rlen bytes */
+            r->rlen = 0;
 
-                if (str4icmp(m, 'l', 'p', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_LPOP;
-                    break;
-                }
+            state = SW_SUBCMD_LF;
+            break;
 
-                if (str4icmp(m, 'l', 'r', 'e', 'm')) {
-                    r->type = MSG_REQ_REDIS_LREM;
-                    break;
+        case SW_SUBCMD_LF:
+            switch (ch) {
+            case LF:
+                if (redis_subcmd_onekey_argzormore(r)) {
+                    if (r->rnarg == 0) {
+                        goto error;
+                    }
+                    state = SW_KEY_LEN;
+                } else {
+                    goto error;
                 }
 
-                if (str4icmp(m, 'l', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_LSET;
-                    break;
-                }
+                break;
 
-                if (str4icmp(m, 'r', 'p', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_RPOP;
-                    break;
-                }
+            default:
+                goto error;
+            }
+            break;
 
-                if (str4icmp(m, 's', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_SADD;
-                    break;
+        case SW_KEY_LEN:
+            if (r->token == NULL) {
+                if (ch != '$') {
+                    goto error;
                 }
-
-                if (str4icmp(m, 's', 'p', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_SPOP;
-                    break;
+                r->token = p;
+                r->rlen = 0;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if (r->rlen >= mbuf_data_size(r->mb)) {
+                    log_error("ERROR: parsed bad req %"PRIu64" of type %d with key "
+                              "length %d that greater than or equal to maximum"
+                              " redis key length of %d", r->id, r->type,
+                              r->rlen, mbuf_data_size(r->mb));
+                    goto error;
                 }
-
-                if (str4icmp(m, 's', 'r', 'e', 'm')) {
-                    r->type = MSG_REQ_REDIS_SREM;
-                    break;
+                if (r->rnarg == 0) {
+                    goto error;
                 }
+                r->rnarg--;
+                r->token = NULL;
+                state = SW_KEY_LEN_LF;
+            } else {
+                goto error;
+            }
 
-                if (str4icmp(m, 't', 'y', 'p', 'e')) {
-                    r->type = MSG_REQ_REDIS_TYPE;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'm', 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_MGET;
-                    break;
-                }
-                if (str4icmp(m, 'm', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_MSET;
-                    break;
-                }
+        case SW_KEY_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_KEY;
+                break;
 
-                if (str4icmp(m, 'z', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_ZADD;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str4icmp(m, 'z', 'r', 'e', 'm')) {
-                    r->type = MSG_REQ_REDIS_ZREM;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'e', 'v', 'a', 'l')) {
-                    r->type = MSG_REQ_REDIS_EVAL;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
+        case SW_KEY:
+            if (r->token == NULL) {
+                r->token = p;
+            }
 
-                if (str4icmp(m, 's', 'o', 'r', 't')) {
-                    r->type = MSG_REQ_REDIS_SORT;
-                    break;
-                }
+            m = r->token + r->rlen;
+            if (m >= b->last) {
+                m = b->last - 1;
+                p = m;
+                break;
+            }
 
-                if (str4icmp(m, 'p', 'i', 'n', 'g')) {
-                    r->type = MSG_REQ_REDIS_PING;
-                    r->noforward = 1;
-                    break;
-                }
+            if (*m != CR) {
+                goto error;
+            } else {        /* got a key */
+                struct keypos *kpos;
 
-                if (str4icmp(m, 'i', 'n', 'f', 'o')) {
-                    r->type = MSG_REQ_REDIS_INFO;
-                    r->noforward = 1;
-                    break;
-                }
+                p = m;      /* move forward by rlen bytes */
+                r->rlen = 0;
+                m = r->token;
+                r->token = NULL;
 
-                if (str4icmp(m, 'q', 'u', 'i', 't')) {
-                    r->type = MSG_REQ_REDIS_QUIT;
-                    r->quit = 1;
-                    break;
+                kpos = array_push(r->keys);
+                if (kpos == NULL) {
+                    goto enomem;
                 }
+                kpos->start = m;
+                kpos->end = p;
 
-                if (str4icmp(m, 'a', 'u', 't', 'h')) {
-                    r->type = MSG_REQ_REDIS_AUTH;
-                    r->noforward = 1;
-                    break;
-                }
+                state = SW_KEY_LF;
+            }
 
-                if (str4icmp(m, 'm', 'o', 'v', 'e')) {
-                    r->type = MSG_REQ_REDIS_MOVE;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
+            break;
 
-                if (str4icmp(m, 'e', 'x', 'e', 'c')) {
-                    r->type = MSG_REQ_REDIS_EXEC;
-                    r->noforward = 1;
-                    break;
+        case SW_KEY_LF:
+            switch (ch) {
+            case LF:
+                if (redis_arg0(r)) {
+                    if (r->rnarg != 0) {
+                        goto error;
+                    }
+                    goto done;
+                } else if (redis_arg1(r)) {
+                    if (r->rnarg != 1) {
+                        goto error;
+                    }
+                    state = SW_ARG1_LEN;
+                } else if (redis_arg2(r)) {
+                    if (r->rnarg != 2) {
+                        goto error;
+                    }
+                    state = SW_ARG1_LEN;
+                } else if (redis_arg3(r)) {
+                    if (r->rnarg != 3) {
+                        goto error;
+                    }
+                    state = SW_ARG1_LEN;
+                } else if (redis_argn(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_ARG1_LEN;
+                } else if (redis_argx(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_KEY_LEN;
+                } else if (redis_argzormore(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_KEY_LEN;
+                } else if (redis_argkvx(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    if (r->narg % 2 == 0) {
+                        goto error;
+                    }
+                    state = SW_ARG1_LEN;
+                } else if (redis_argeval(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_ARGN_LEN;
+                } else if (redis_subcmd_onekey_argzormore(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_ARGN_LEN;
+                } else {
+                    goto error;
                 }
 
                 break;
 
-            case 5:
-                if (str5icmp(m, 'h', 'k', 'e', 'y', 's')) {
-                    r->type = MSG_REQ_REDIS_HKEYS;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str5icmp(m, 'h', 'm', 'g', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HMGET;
-                    break;
-                }
+            break;
 
-                if (str5icmp(m, 'h', 'm', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_HMSET;
-                    break;
+        case SW_ARG1_LEN:
+            if (r->token == NULL) {
+                if (ch != '$') {
+                    goto error;
                 }
-
-                if (str5icmp(m, 'h', 'v', 'a', 'l', 's')) {
-                    r->type = MSG_REQ_REDIS_HVALS;
-                    break;
-                }
-
-                if (str5icmp(m, 'h', 's', 'c', 'a', 'n')) {
-                    r->type = MSG_REQ_REDIS_HSCAN;
-                    break;
+                r->rlen = 0;
+                r->token = p;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if ((p - r->token) <= 1 || r->rnarg == 0) {
+                    goto error;
                 }
+                r->rnarg--;
+                r->token = NULL;
+                state = SW_ARG1_LEN_LF;
+            } else {
+                goto error;
+            }
 
-                if (str5icmp(m, 'l', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_LPUSH;
-                    break;
-                }
+            break;
 
-                if (str5icmp(m, 'l', 't', 'r', 'i', 'm')) {
-                    r->type = MSG_REQ_REDIS_LTRIM;
-                    break;
-                }
+        case SW_ARG1_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_ARG1;
+                break;
 
-                if (str5icmp(m, 'r', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_RPUSH;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str5icmp(m, 's', 'c', 'a', 'r', 'd')) {
-                    r->type = MSG_REQ_REDIS_SCARD;
-                    break;
-                }
+            break;
 
-                if (str5icmp(m, 's', 'd', 'i', 'f', 'f')) {
-                    r->type = MSG_REQ_REDIS_SDIFF;
-                    break;
-                }
+        case SW_ARG1:
+            m = p + r->rlen;
+            if (m >= b->last) {
+                r->rlen -= (uint32_t)(b->last - p);
+                m = b->last - 1;
+                p = m;
+                break;
+            }
 
-                if (str5icmp(m, 's', 'e', 't', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_SETEX;
-                    break;
-                }
+            if (*m != CR) {
+                goto error;
+            }
 
-                if (str5icmp(m, 's', 'e', 't', 'n', 'x')) {
-                    r->type = MSG_REQ_REDIS_SETNX;
-                    break;
-                }
+            p = m; /* move forward by rlen bytes */
+            r->rlen = 0;
 
-                if (str5icmp(m, 's', 'm', 'o', 'v', 'e')) {
-                    r->type = MSG_REQ_REDIS_SMOVE;
-                    break;
-                }
+            state = SW_ARG1_LF;
 
-                if (str5icmp(m, 's', 's', 'c', 'a', 'n')) {
-                    r->type = MSG_REQ_REDIS_SSCAN;
-                    break;
-                }
+            break;
 
-                if (str5icmp(m, 'z', 'c', 'a', 'r', 'd')) {
-                    r->type = MSG_REQ_REDIS_ZCARD;
-                    break;
+        case SW_ARG1_LF:
+            switch (ch) {
+            case LF:
+                if (redis_arg1(r)) {
+                    if (r->rnarg != 0) {
+                        goto error;
+                    }
+                    goto done;
+                } else if (redis_arg2(r)) {
+                    if (r->rnarg != 1) {
+                        goto error;
+                    }
+                    state = SW_ARG2_LEN;
+                } else if (redis_arg3(r)) {
+                    if (r->rnarg != 2) {
+                        goto error;
+                    }
+                    state = SW_ARG2_LEN;
+                } else if (redis_argn(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_ARGN_LEN;
+                } else if (redis_argeval(r)) {
+                    if (r->rnarg < 2) {
+                        goto error;
+                    }
+                    state = SW_ARG2_LEN;
+                } else if (redis_argkvx(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_KEY_LEN;
+                } else {
+                    goto error;
                 }
 
-                if (str5icmp(m, 'z', 'r', 'a', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_ZRANK;
-                    break;
-                }
+                break;
 
-                if (str5icmp(m, 'z', 's', 'c', 'a', 'n')) {
-                    r->type = MSG_REQ_REDIS_ZSCAN;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str5icmp(m, 'p', 'f', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_PFADD;
-                    break;
-                }
+            break;
 
-                if (str5icmp(m, 'b', 'i', 't', 'o', 'p')) {
-                    r->type = MSG_REQ_REDIS_BITOP;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
+        case SW_ARG2_LEN:
+            if (r->token == NULL) {
+                if (ch != '$') {
+                    goto error;
                 }
-
-                if (str5icmp(m, 'm', 'u', 'l', 't', 'i')) {
-                    r->type = MSG_REQ_REDIS_MULTI;
-                    r->noforward = 1;
-                    break;
+                r->rlen = 0;
+                r->token = p;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if ((p - r->token) <= 1 || r->rnarg == 0) {
+                    goto error;
                 }
+                r->rnarg--;
+                r->token = NULL;
+                state = SW_ARG2_LEN_LF;
+            } else {
+                goto error;
+            }
+
+            break;
 
+        case SW_ARG2_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_ARG2;
                 break;
 
-            case 6:                
-                if (str6icmp(m, 'a', 'p', 'p', 'e', 'n', 'd')) {
-                    r->type = MSG_REQ_REDIS_APPEND;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str6icmp(m, 'd', 'e', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_DECRBY;
-                    break;
-                }
+            break;
 
-                if (str6icmp(m, 'e', 'x', 'i', 's', 't', 's')) {
-                    r->type = MSG_REQ_REDIS_EXISTS;
-                    break;
-                }
+        case SW_ARG2:
+            if (r->token == NULL && redis_argeval(r)) {
+                /*
+                 * For EVAL/EVALSHA, ARG2 represents the # key/arg pairs which must
+                 * be tokenized and stored in contiguous memory.
+                 */
+                r->token = p;
+            }
 
-                if (str6icmp(m, 'e', 'x', 'p', 'i', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_EXPIRE;
-                    break;
-                }
+            m = p + r->rlen;
+            if (m >= b->last) {
+                r->rlen -= (uint32_t)(b->last - p);
+                m = b->last - 1;
+                p = m;
+                break;
+            }
 
-                if (str6icmp(m, 'g', 'e', 't', 'b', 'i', 't')) {
-                    r->type = MSG_REQ_REDIS_GETBIT;
-                    break;
-                }
+            if (*m != CR) {
+                goto error;
+            }
 
-                if (str6icmp(m, 'g', 'e', 't', 's', 'e', 't')) {
-                    r->type = MSG_REQ_REDIS_GETSET;
-                    break;
-                }
+            p = m; /* move forward by rlen bytes */
+            r->rlen = 0;
 
-                if (str6icmp(m, 'p', 's', 'e', 't', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_PSETEX;
-                    break;
-                }
+            if (redis_argeval(r)) {
+                uint32_t nkey;
+                uint8_t *chp;
 
-                if (str6icmp(m, 'h', 's', 'e', 't', 'n', 'x')) {
-                    r->type = MSG_REQ_REDIS_HSETNX;
-                    break;
+                /*
+                 * For EVAL/EVALSHA, we need to find the integer value of this
+                 * argument. It tells us the number of keys in the script, and
+                 * we need to error out if number of keys is 0. At this point,
+                 * both p and m point to the end of the argument and r->token
+                 * points to the start.
+                 */
+                if (p - r->token < 1) {
+                    goto error;
                 }
 
-                if (str6icmp(m, 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_INCRBY;
-                    break;
+                for (nkey = 0, chp = r->token; chp < p; chp++) {
+                    if (isdigit(*chp)) {
+                        nkey = nkey * 10 + (uint32_t)(*chp - '0');
+                    } else {
+                        goto error;
+                    }
                 }
-
-                if (str6icmp(m, 'l', 'i', 'n', 'd', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_LINDEX;
-                    break;
+                if (nkey == 0) {
+                    goto error;
                 }
 
-                if (str6icmp(m, 'l', 'p', 'u', 's', 'h', 'x')) {
-                    r->type = MSG_REQ_REDIS_LPUSHX;
-                    break;
-                }
+                r->token = NULL;
+            }
 
-                if (str6icmp(m, 'l', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_LRANGE;
-                    break;
-                }
+            state = SW_ARG2_LF;
 
-                if (str6icmp(m, 'r', 'p', 'u', 's', 'h', 'x')) {
-                    r->type = MSG_REQ_REDIS_RPUSHX;
-                    break;
-                }
+            break;
 
-                if (str6icmp(m, 's', 'e', 't', 'b', 'i', 't')) {
-                    r->type = MSG_REQ_REDIS_SETBIT;
-                    break;
+        case SW_ARG2_LF:
+            switch (ch) {
+            case LF:
+                if (redis_arg2(r)) {
+                    if (r->rnarg != 0) {
+                        goto error;
+                    }
+                    goto done;
+                } else if (redis_arg3(r)) {
+                    if (r->rnarg != 1) {
+                        goto error;
+                    }
+                    state = SW_ARG3_LEN;
+                } else if (redis_argn(r)) {
+                    if (r->rnarg == 0) {
+                        goto done;
+                    }
+                    state = SW_ARGN_LEN;
+                } else if (redis_argeval(r)) {
+                    if (r->rnarg < 1) {
+                        goto error;
+                    }
+                    state = SW_KEY_LEN;
+                } else {
+                    goto error;
                 }
 
-                if (str6icmp(m, 's', 'i', 'n', 't', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SINTER;
-                    break;
-                }
+                break;
 
-                if (str6icmp(m, 's', 't', 'r', 'l', 'e', 'n')) {
-                    r->type = MSG_REQ_REDIS_STRLEN;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                if (str6icmp(m, 's', 'u', 'n', 'i', 'o', 'n')) {
-                    r->type = MSG_REQ_REDIS_SUNION;
-                    break;
-                }
+            break;
 
-                if (str6icmp(m, 'z', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_ZCOUNT;
-                    break;
+        case SW_ARG3_LEN:
+            if (r->token == NULL) {
+                if (ch != '$') {
+                    goto error;
                 }
-
-                if (str6icmp(m, 'z', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZRANGE;
-                    break;
+                r->rlen = 0;
+                r->token = p;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if ((p - r->token) <= 1 || r->rnarg == 0) {
+                    goto error;
                 }
+                r->rnarg--;
+                r->token = NULL;
+                state = SW_ARG3_LEN_LF;
+            } else {
+                goto error;
+            }
 
-                if (str6icmp(m, 'z', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZSCORE;
-                    break;
-                }
-                
-                if (str6icmp(m, 's', 'e', 'l', 'e', 'c', 't')) {
-                    r->type = MSG_REQ_REDIS_SELECT;
-                    r->noforward = 1;
-                    break;
-                }
-
-                if (str6icmp(m, 'r', 'e', 'n', 'a', 'm', 'e')) {
-                    r->type = MSG_REQ_REDIS_RENAME;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-
-                if (str6icmp(m, 'm', 's', 'e', 't', 'n', 'x')) {
-                    r->type = MSG_REQ_REDIS_MSETNX;
-                    break;
-                }
-
-                if (str6icmp(m, 'g', 'e', 'o', 'a', 'd', 'd')) {
-                    r->type = MSG_REQ_REDIS_GEOADD;
-                    break;
-                }
-
-                if (str6icmp(m, 's', 'c', 'r', 'i', 'p', 't')) {
-                    r->type = MSG_REQ_REDIS_SCRIPT;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-                
-                break;
-
-            case 7:
-                if (str7icmp(m, 'p', 'e', 'r', 's', 'i', 's', 't')) {
-                    r->type = MSG_REQ_REDIS_PERSIST;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_PEXPIRE;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'e', 'x', 'i', 's', 't', 's')) {
-                    r->type = MSG_REQ_REDIS_HEXISTS;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'g', 'e', 't', 'a', 'l', 'l')) {
-                    r->type = MSG_REQ_REDIS_HGETALL;
-                    break;
-                }
-
-                if (str7icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_HINCRBY;
-                    break;
-                }
-
-                if (str7icmp(m, 'l', 'i', 'n', 's', 'e', 'r', 't')) {
-                    r->type = MSG_REQ_REDIS_LINSERT;
-                    break;
-                }
-
-                if (str7icmp(m, 'z', 'i', 'n', 'c', 'r', 'b', 'y')) {
-                    r->type = MSG_REQ_REDIS_ZINCRBY;
-                    break;
-                }
-
-                if (str7icmp(m, 'e', 'v', 'a', 'l', 's', 'h', 'a')) {
-                    r->type = MSG_REQ_REDIS_EVALSHA;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-
-                if (str7icmp(m, 'r', 'e', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_RESTORE;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'f', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_PFCOUNT;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'f', 'm', 'e', 'r', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_PFMERGE;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-
-                if (str7icmp(m, 'c', 'o', 'm', 'm', 'a', 'n', 'd')) {
-                    r->type = MSG_REQ_REDIS_COMMAND;
-                    break;
-                }
-
-                if (str7icmp(m, 'f', 'l', 'u', 's', 'h', 'd', 'b')) {
-                    r->type = MSG_REQ_REDIS_FLUSHDB;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'u', 'b', 'l', 'i', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_PUBLISH;
-                    /* PUBLISH command will not sent to the target group. */
-                    r->noforward = 1;
-                    break;
-                }
-
-                if (str7icmp(m, 'p', 'f', 'd', 'e', 'b', 'u', 'g')) {
-                    r->type = MSG_REQ_REDIS_PFDEBUG;
-                    break;
-                }
-
-                break;
-
-            case 8:
-                if (str8icmp(m, 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_EXPIREAT;
-                    break;
-                }
-
-                if (str8icmp(m, 'b', 'i', 't', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_BITCOUNT;
-                    break;
-                }
-
-                if (str8icmp(m, 'g', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_GETRANGE;
-                    break;
-                }
-
-                if (str8icmp(m, 's', 'e', 't', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_SETRANGE;
-                    break;
-                }
-
-                if (str8icmp(m, 's', 'm', 'e', 'm', 'b', 'e', 'r', 's')) {
-                    r->type = MSG_REQ_REDIS_SMEMBERS;
-                    break;
-                }
-
-                if (str8icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANK;
-                    break;
-                }
-
-                if (str8icmp(m, 's', 'h', 'u', 't', 'd', 'o', 'w', 'n')) {
-                    r->type = MSG_REQ_REDIS_SHUTDOWN;
-                    r->noforward = 1;
-                    break;
-                }
-
-                if (str8icmp(m, 'f', 'l', 'u', 's', 'h', 'a', 'l', 'l')) {
-                    r->type = MSG_REQ_REDIS_FLUSHALL;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-
-                if (str8icmp(m, 'r', 'e', 'n', 'a', 'm', 'e', 'n', 'x')) {
-                    r->type = MSG_REQ_REDIS_RENAMENX;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-
-                if (str8icmp(m, 'b', 'i', 't', 'f', 'i', 'e', 'l', 'd')) {
-                    r->type = MSG_REQ_REDIS_BITFIELD;
-                    break;
-                }
-
-                break;
-
-            case 9:
-                if (str9icmp(m, 'p', 'e', 'x', 'p', 'i', 'r', 'e', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_PEXPIREAT;
-                    break;
-                }
-
-                if (str9icmp(m, 'r', 'p', 'o', 'p', 'l', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_RPOPLPUSH;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-
-                if (str9icmp(m, 's', 'i', 's', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SISMEMBER;
-                    break;
-                }
-
-                if (str9icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANGE;
-                    break;
-                }
-
-                if (str9icmp(m, 'z', 'l', 'e', 'x', 'c', 'o', 'u', 'n', 't')) {
-                    r->type = MSG_REQ_REDIS_ZLEXCOUNT;
-                    break;
-                }
-
-                if (str9icmp(m, 'g', 'e', 'o', 'r', 'a', 'd', 'i', 'u', 's')) {
-                    r->type = MSG_REQ_REDIS_GEORADIUS;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-
-                break;
-
-            case 10:
-                if (str10icmp(m, 's', 'd', 'i', 'f', 'f', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_SDIFFSTORE;
-                    break;
-                }
-
-                if (str10icmp(m, 'b', 'r', 'p', 'o', 'p', 'l', 'p', 'u', 's', 'h')) {
-                    r->type = MSG_REQ_REDIS_BRPOPLPUSH;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
-
-                break;
-            case 11:
-                if (str11icmp(m, 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_INCRBYFLOAT;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_SINTERSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'r', 'a', 'n', 'd', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_SRANDMEMBER;
-                    break;
-                }
-
-                if (str11icmp(m, 's', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_SUNIONSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'i', 'n', 't', 'e', 'r', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZINTERSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'u', 'n', 'i', 'o', 'n', 's', 't', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZUNIONSTORE;
-                    break;
-                }
-
-                if (str11icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_ZRANGEBYLEX;
-                    break;
-                }
-
-                break;
-
-            case 12:
-                if (str12icmp(m, 'h', 'i', 'n', 'c', 'r', 'b', 'y', 'f', 'l', 'o', 'a', 't')) {
-                    r->type = MSG_REQ_REDIS_HINCRBYFLOAT;
-                    break;
-                }
-
-
-                break;
-
-            case 13:
-                if (str13icmp(m, 'z', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZRANGEBYSCORE;
-                    break;
-                }
-
-                break;
-
-            case 14:
-                if (str14icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'l', 'e', 'x')) {
-                    r->type = MSG_REQ_REDIS_ZREMRANGEBYLEX;
-                    break;
-                }
-
-                if (str14icmp(m, 'r', 'e', 's', 't', 'o', 'r', 'e', '-', 'a', 's', 'k', 'i', 'n', 'g')) {
-                    r->type = MSG_REQ_REDIS_RESTOREASKING;
-                    break;
-                }
-
-                break;
-
-            case 15:
-                if (str15icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 'r', 'a', 'n', 'k')) {
-                    r->type = MSG_REQ_REDIS_ZREMRANGEBYRANK;
-                    break;
-                }
-
-                break;
-
-            case 16:
-                if (str16icmp(m, 'z', 'r', 'e', 'm', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZREMRANGEBYSCORE;
-                    break;
-                }
-
-                if (str16icmp(m, 'z', 'r', 'e', 'v', 'r', 'a', 'n', 'g', 'e', 'b', 'y', 's', 'c', 'o', 'r', 'e')) {
-                    r->type = MSG_REQ_REDIS_ZREVRANGEBYSCORE;
-                    break;
-                }
+            break;
 
+        case SW_ARG3_LEN_LF:
+            switch (ch) {
+            case LF:
+                state = SW_ARG3;
                 break;
 
-            case 17:
-                if (str17icmp(m, 'g', 'e', 'o', 'r', 'a', 'd', 'i', 'u', 's', 'b', 'y', 'm', 'e', 'm', 'b', 'e', 'r')) {
-                    r->type = MSG_REQ_REDIS_GEORADIUSBYMEMBER;
-                    r->noforward = 1;
-                    r->not_support = 1;
-                    break;
-                }
+            default:
+                goto error;
+            }
 
-                break;
+            break;
 
-            default:
+        case SW_ARG3:
+            m = p + r->rlen;
+            if (m >= b->last) {
+                r->rlen -= (uint32_t)(b->last - p);
+                m = b->last - 1;
+                p = m;
                 break;
             }
 
-            if (r->type == MSG_UNKNOWN) {
-                log_error("ERROR: parsed unsupported command '%.*s'", p - m, m);
+            if (*m != CR) {
                 goto error;
             }
 
-            log_debug(LOG_VERB, "parsed command '%.*s'", p - m, m);
+            p = m; /* move forward by rlen bytes */
+            r->rlen = 0;
+            state = SW_ARG3_LF;
 
-            state = SW_REQ_TYPE_LF;
             break;
 
-        case SW_REQ_TYPE_LF:
+        case SW_ARG3_LF:
             switch (ch) {
             case LF:
-                if (redis_argz(r)) {
+                if (redis_arg3(r)) {
+                    if (r->rnarg != 0) {
+                        goto error;
+                    }
                     goto done;
-                } else if (redis_argeval(r)) {
-                    state = SW_ARG1_LEN;
-                } else if (redis_subcmd_onekey_argzormore(r)) {
-                    state = SW_SUBCMD_LEN;
-                } else if (redis_argzormore(r)) {
-                    if (r->narg == 1) {
+                } else if (redis_argn(r)) {
+                    if (r->rnarg == 0) {
                         goto done;
                     }
-                    state = SW_KEY_LEN;
+                    state = SW_ARGN_LEN;
                 } else {
-                    state = SW_KEY_LEN;
+                    goto error;
                 }
+
                 break;
 
             default:
@@ -3352,7 +4218,7 @@ redis_parse_req(struct msg *r)
 
             break;
 
-        case SW_SUBCMD_LEN:
+        case SW_ARGN_LEN:
             if (r->token == NULL) {
                 if (ch != '$') {
                     goto error;
@@ -3367,24 +4233,26 @@ redis_parse_req(struct msg *r)
                 }
                 r->rnarg--;
                 r->token = NULL;
-                state = SW_SUBCMD_LEN_LF;
+                state = SW_ARGN_LEN_LF;
             } else {
                 goto error;
             }
+
             break;
-            
-        case SW_SUBCMD_LEN_LF:
+
+        case SW_ARGN_LEN_LF:
             switch (ch) {
             case LF:
-                state = SW_SUBCMD;
+                state = SW_ARGN;
                 break;
 
             default:
                 goto error;
             }
+
             break;
 
-        case SW_SUBCMD:
+        case SW_ARGN:
             m = p + r->rlen;
             if (m >= b->last) {
                 r->rlen -= (uint32_t)(b->last - p);
@@ -3399,18 +4267,18 @@ redis_parse_req(struct msg *r)
 
             p = m; /* move forward by rlen bytes */
             r->rlen = 0;
+            state = SW_ARGN_LF;
 
-            state = SW_SUBCMD_LF;
             break;
 
-        case SW_SUBCMD_LF:
+        case SW_ARGN_LF:
             switch (ch) {
             case LF:
-                if (redis_subcmd_onekey_argzormore(r)) {
+                if (redis_argn(r) || redis_argeval(r) || redis_subcmd_onekey_argzormore(r)) {
                     if (r->rnarg == 0) {
-                        goto error;
+                        goto done;
                     }
-                    state = SW_KEY_LEN;
+                    state = SW_ARGN_LEN;
                 } else {
                     goto error;
                 }
@@ -3420,41 +4288,259 @@ redis_parse_req(struct msg *r)
             default:
                 goto error;
             }
+
             break;
 
-        case SW_KEY_LEN:
-            if (r->token == NULL) {
-                if (ch != '$') {
-                    goto error;
-                }
-                r->token = p;
-                r->rlen = 0;
-            } else if (isdigit(ch)) {
-                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if (r->rlen >= mbuf_data_size(r->mb)) {
-                    log_error("ERROR: parsed bad req %"PRIu64" of type %d with key "
-                              "length %d that greater than or equal to maximum"
-                              " redis key length of %d", r->id, r->type,
-                              r->rlen, mbuf_data_size(r->mb));
+        case SW_SENTINEL:
+        default:
+            NOT_REACHED();
+            break;
+        }
+    }
+
+    ASSERT(p == b->last);
+    r->pos = p;
+    r->state = state;
+
+    //if (b->last == b->end && r->token != NULL) {
+    if (r->token != NULL) {
+        r->pos = r->token;
+        r->token = NULL;
+        r->result = MSG_PARSE_REPAIR;
+    } else {
+        r->result = MSG_PARSE_AGAIN;
+    }
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, r->pos - b->pos, b->last - b->pos);
+    return;
+
+done:
+    ASSERT(r->type > MSG_UNKNOWN && r->type < MSG_SENTINEL);
+    r->pos = p + 1;
+    ASSERT(r->pos <= b->last);
+    r->state = SW_START;
+    r->token = NULL;
+    r->result = MSG_PARSE_OK;
+
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
+                r->state, r->pos - b->pos, b->last - b->pos);
+    return;
+
+enomem:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "out of memory on parse req %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type, r->state);
+
+    return;
+
+error:
+    r->result = MSG_PARSE_ERROR;
+    r->state = state;
+    errno = EINVAL;
+
+    log_hexdump(LOG_NOTICE, b->pos, mbuf_length(b), "parsed bad req %"PRIu64" "
+                "res %d type %d state %d", r->id, r->result, r->type,
+                r->state);
+}
+
+/*
+ * Reference: http://redis.io/topics/protocol
+ *
+ * Redis will reply to commands with different kinds of replies. It is
+ * possible to check the kind of reply from the first byte sent by the
+ * server:
+ *  - with a single line reply the first byte of the reply will be "+"
+ *  - with an error message the first byte of the reply will be "-"
+ *  - with an integer number the first byte of the reply will be ":"
+ *  - with bulk reply the first byte of the reply will be "$"
+ *  - with multi-bulk reply the first byte of the reply will be "*"
+ *
+ * 1). Status reply (or single line reply) is in the form of a single line
+ *     string starting with "+" terminated by "\r\n".
+ * 2). Error reply are similar to status replies. The only difference is
+ *     that the first byte is "-" instead of "+".
+ * 3). Integer reply is just a CRLF terminated string representing an
+ *     integer, and prefixed by a ":" byte.
+ * 4). Bulk reply is used by server to return a single binary safe string.
+ *     The first reply line is a "$" byte followed by the number of bytes
+ *     of the actual reply, followed by CRLF, then the actual data bytes,
+ *     followed by additional two bytes for the final CRLF. If the requested
+ *     value does not exist the bulk reply will use the special value '-1'
+ *     as the data length.
+ * 5). Multi-bulk reply is used by the server to return many binary safe
+ *     strings (bulks) with the initial line indicating how many bulks that
+ *     will follow. The first byte of a multi bulk reply is always *.
+ */
+void
+redis_parse_rsp(struct msg *r)
+{
+    struct mbuf *b;
+    uint8_t *p, *m;
+    uint8_t ch;
+
+    enum {
+        SW_START,
+        SW_STATUS,
+        SW_ERROR,
+        SW_INTEGER,
+        SW_INTEGER_START,
+        SW_BULK,
+        SW_BULK_LF,
+        SW_BULK_ARG,
+        SW_BULK_ARG_LF,
+        SW_MULTIBULK,
+        SW_MULTIBULK_NARG_LF,
+        SW_MULTIBULK_ARGN_LEN,
+        SW_MULTIBULK_ARGN_LEN_LF,
+        SW_MULTIBULK_ARGN,
+        SW_MULTIBULK_ARGN_LF,
+        SW_RUNTO_CRLF,
+        SW_ALMOST_DONE,
+        SW_SENTINEL
+    } state;
+
+    state = r->state;
+    b = listLastValue(r->data);
+
+    ASSERT(!r->request);
+    ASSERT(state < SW_SENTINEL);
+    ASSERT(b != NULL);
+    ASSERT(b->pos <= b->last);
+
+    /* validate the parsing marker */
+    ASSERT(r->pos != NULL);
+    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+
+    for (p = r->pos; p < b->last; p++) {
+        ch = *p;
+
+        switch (state) {
+        case SW_START:
+            r->type = MSG_UNKNOWN;
+            switch (ch) {
+            case '+':
+                p = p - 1; /* go back by 1 byte */
+                r->type = MSG_RSP_REDIS_STATUS;
+                state = SW_STATUS;
+                break;
+
+            case '-':
+                r->type = MSG_RSP_REDIS_ERROR;
+                p = p - 1; /* go back by 1 byte */
+                state = SW_ERROR;
+                break;
+
+            case ':':
+                r->type = MSG_RSP_REDIS_INTEGER;
+                p = p - 1; /* go back by 1 byte */
+                state = SW_INTEGER;
+                break;
+
+            case '$':
+                r->type = MSG_RSP_REDIS_BULK;
+                p = p - 1; /* go back by 1 byte */
+                state = SW_BULK;
+                break;
+
+            case '*':
+                r->type = MSG_RSP_REDIS_MULTIBULK;
+                p = p - 1; /* go back by 1 byte */
+                state = SW_MULTIBULK;
+                break;
+
+            default:
+                goto error;
+            }
+
+            break;
+
+        case SW_STATUS:
+            /* rsp_start <- p */
+            state = SW_RUNTO_CRLF;
+            break;
+
+        case SW_ERROR:
+            /* rsp_start <- p */
+            state = SW_RUNTO_CRLF;
+            break;
+
+        case SW_INTEGER:
+            /* rsp_start <- p */
+            state = SW_INTEGER_START;
+            r->integer = 0;
+            break;
+
+        case SW_INTEGER_START:
+            if (ch == CR) {
+                state = SW_ALMOST_DONE;
+            } else if (ch == '-') {
+                ;
+            } else if (isdigit(ch)) {
+                r->integer = r->integer * 10 + (uint32_t)(ch - '0');
+            } else {
+                goto error;
+            }
+            break;
+
+        case SW_RUNTO_CRLF:
+            switch (ch) {
+            case CR:
+                state = SW_ALMOST_DONE;
+                break;
+
+            default:
+                break;
+            }
+
+            break;
+
+        case SW_ALMOST_DONE:
+            switch (ch) {
+            case LF:
+                /* rsp_end <- p */
+                goto done;
+
+            default:
+                goto error;
+            }
+
+            break;
+
+        case SW_BULK:
+            if (r->token == NULL) {
+                if (ch != '$') {
                     goto error;
                 }
-                if (r->rnarg == 0) {
+                /* rsp_start <- p */
+                r->token = p;
+                r->rlen = 0;
+            } else if (ch == '-') {
+                /* handles null bulk reply = '$-1' */
+                state = SW_RUNTO_CRLF;
+            } else if (isdigit(ch)) {
+                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == CR) {
+                if ((p - r->token) <= 1) {
                     goto error;
                 }
-                r->rnarg--;
+                r->bulk_len = r->rlen;
                 r->token = NULL;
-                state = SW_KEY_LEN_LF;
+                state = SW_BULK_LF;
             } else {
                 goto error;
             }
 
             break;
 
-        case SW_KEY_LEN_LF:
+        case SW_BULK_LF:
             switch (ch) {
             case LF:
-                state = SW_KEY;
+                state = SW_BULK_ARG;
                 break;
 
             default:
@@ -3463,13 +4549,14 @@ redis_parse_req(struct msg *r)
 
             break;
 
-        case SW_KEY:
-            if (r->token == NULL) {
-                r->token = p;
+        case SW_BULK_ARG:
+            if (r->bulk_start == NULL) {
+                r->bulk_start = p;
             }
-
-            m = r->token + r->rlen;
+            
+            m = p + r->rlen;
             if (m >= b->last) {
+                r->rlen -= (uint32_t)(b->last - p);
                 m = b->last - 1;
                 p = m;
                 break;
@@ -3477,87 +4564,19 @@ redis_parse_req(struct msg *r)
 
             if (*m != CR) {
                 goto error;
-            } else {        /* got a key */
-                struct keypos *kpos;
-
-                p = m;      /* move forward by rlen bytes */
-                r->rlen = 0;
-                m = r->token;
-                r->token = NULL;
+            }
 
-                kpos = array_push(r->keys);
-                if (kpos == NULL) {
-                    goto enomem;
-                }
-                kpos->start = m;
-                kpos->end = p;
+            p = m; /* move forward by rlen bytes */
+            r->rlen = 0;
 
-                state = SW_KEY_LF;
-            }
+            state = SW_BULK_ARG_LF;
 
             break;
 
-        case SW_KEY_LF:
+        case SW_BULK_ARG_LF:
             switch (ch) {
             case LF:
-                if (redis_arg0(r)) {
-                    if (r->rnarg != 0) {
-                        goto error;
-                    }
-                    goto done;
-                } else if (redis_arg1(r)) {
-                    if (r->rnarg != 1) {
-                        goto error;
-                    }
-                    state = SW_ARG1_LEN;
-                } else if (redis_arg2(r)) {
-                    if (r->rnarg != 2) {
-                        goto error;
-                    }
-                    state = SW_ARG1_LEN;
-                } else if (redis_arg3(r)) {
-                    if (r->rnarg != 3) {
-                        goto error;
-                    }
-                    state = SW_ARG1_LEN;
-                } else if (redis_argn(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_ARG1_LEN;
-                } else if (redis_argx(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_KEY_LEN;
-                } else if (redis_argzormore(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_KEY_LEN;
-                } else if (redis_argkvx(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    if (r->narg % 2 == 0) {
-                        goto error;
-                    }
-                    state = SW_ARG1_LEN;
-                } else if (redis_argeval(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_ARGN_LEN;
-                } else if (redis_subcmd_onekey_argzormore(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_ARGN_LEN;
-                } else {
-                    goto error;
-                }
-
-                break;
+                goto done;
 
             default:
                 goto error;
@@ -3565,97 +4584,42 @@ redis_parse_req(struct msg *r)
 
             break;
 
-        case SW_ARG1_LEN:
+        case SW_MULTIBULK:
             if (r->token == NULL) {
-                if (ch != '$') {
+                if (ch != '*') {
                     goto error;
                 }
-                r->rlen = 0;
                 r->token = p;
+                /* rsp_start <- p */
+                r->narg_start = p;
+                r->rnarg = 0;
+            } else if (ch == '-') {
+                state = SW_RUNTO_CRLF;
             } else if (isdigit(ch)) {
-                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+                r->rnarg = r->rnarg * 10 + (uint32_t)(ch - '0');
             } else if (ch == CR) {
-                if ((p - r->token) <= 1 || r->rnarg == 0) {
+                if ((p - r->token) <= 1) {
                     goto error;
                 }
-                r->rnarg--;
+
+                r->narg = r->rnarg;
+                r->narg_end = p;
                 r->token = NULL;
-                state = SW_ARG1_LEN_LF;
+                state = SW_MULTIBULK_NARG_LF;
             } else {
                 goto error;
             }
 
             break;
 
-        case SW_ARG1_LEN_LF:
-            switch (ch) {
-            case LF:
-                state = SW_ARG1;
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_ARG1:
-            m = p + r->rlen;
-            if (m >= b->last) {
-                r->rlen -= (uint32_t)(b->last - p);
-                m = b->last - 1;
-                p = m;
-                break;
-            }
-
-            if (*m != CR) {
-                goto error;
-            }
-
-            p = m; /* move forward by rlen bytes */
-            r->rlen = 0;
-
-            state = SW_ARG1_LF;
-
-            break;
-
-        case SW_ARG1_LF:
+        case SW_MULTIBULK_NARG_LF:
             switch (ch) {
             case LF:
-                if (redis_arg1(r)) {
-                    if (r->rnarg != 0) {
-                        goto error;
-                    }
+                if (r->rnarg == 0) {
+                    /* response is '*0\r\n' */
                     goto done;
-                } else if (redis_arg2(r)) {
-                    if (r->rnarg != 1) {
-                        goto error;
-                    }
-                    state = SW_ARG2_LEN;
-                } else if (redis_arg3(r)) {
-                    if (r->rnarg != 2) {
-                        goto error;
-                    }
-                    state = SW_ARG2_LEN;
-                } else if (redis_argn(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_ARGN_LEN;
-                } else if (redis_argeval(r)) {
-                    if (r->rnarg < 2) {
-                        goto error;
-                    }
-                    state = SW_ARG2_LEN;
-                } else if (redis_argkvx(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_KEY_LEN;
-                } else {
-                    goto error;
                 }
-
+                state = SW_MULTIBULK_ARGN_LEN;
                 break;
 
             default:
@@ -3664,32 +4628,71 @@ redis_parse_req(struct msg *r)
 
             break;
 
-        case SW_ARG2_LEN:
+        case SW_MULTIBULK_ARGN_LEN:
             if (r->token == NULL) {
-                if (ch != '$') {
+                /*
+                 * From: http://redis.io/topics/protocol, a multi bulk reply
+                 * is used to return an array of other replies. Every element
+                 * of a multi bulk reply can be of any kind, including a
+                 * nested multi bulk reply.
+                 *
+                 * Here, we only handle a multi bulk reply element that
+                 * are either integer reply or bulk reply.
+                 *
+                 * there is a special case for sscan/hscan/zscan, these command
+                 * replay a nested multi-bulk with a number and a multi bulk like this:
+                 *
+                 * - mulit-bulk
+                 *    - cursor
+                 *    - mulit-bulk
+                 *       - val1
+                 *       - val2
+                 *       - val3
+                 *
+                 * in this case, there is only one sub-multi-bulk,
+                 * and it's the last element of parent,
+                 * we can handle it like tail-recursive.
+                 *
+                 */
+                if (ch == '*') {    /* for sscan/hscan/zscan only */
+                    p = p - 1;      /* go back by 1 byte */
+                    state = SW_MULTIBULK;
+                    break;
+                }
+
+                if (ch != '$' && ch != ':') {
                     goto error;
                 }
-                r->rlen = 0;
                 r->token = p;
+                r->rlen = 0;
             } else if (isdigit(ch)) {
                 r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
+            } else if (ch == '-') {
+                ;
             } else if (ch == CR) {
                 if ((p - r->token) <= 1 || r->rnarg == 0) {
                     goto error;
                 }
+
+                if ((r->rlen == 1 && (p - r->token) == 3) || *r->token == ':') {
+                    /* handles not-found reply = '$-1' or integer reply = ':<num>' */
+                    r->rlen = 0;
+                    state = SW_MULTIBULK_ARGN_LF;
+                } else {
+                    state = SW_MULTIBULK_ARGN_LEN_LF;
+                }
                 r->rnarg--;
                 r->token = NULL;
-                state = SW_ARG2_LEN_LF;
             } else {
                 goto error;
             }
 
             break;
 
-        case SW_ARG2_LEN_LF:
+        case SW_MULTIBULK_ARGN_LEN_LF:
             switch (ch) {
             case LF:
-                state = SW_ARG2;
+                state = SW_MULTIBULK_ARGN;
                 break;
 
             default:
@@ -3698,15 +4701,7 @@ redis_parse_req(struct msg *r)
 
             break;
 
-        case SW_ARG2:
-            if (r->token == NULL && redis_argeval(r)) {
-                /*
-                 * For EVAL/EVALSHA, ARG2 represents the # key/arg pairs which must
-                 * be tokenized and stored in contiguous memory.
-                 */
-                r->token = p;
-            }
-
+        case SW_MULTIBULK_ARGN:
             m = p + r->rlen;
             if (m >= b->last) {
                 r->rlen -= (uint32_t)(b->last - p);
@@ -3719,220 +4714,21 @@ redis_parse_req(struct msg *r)
                 goto error;
             }
 
-            p = m; /* move forward by rlen bytes */
+            p += r->rlen; /* move forward by rlen bytes */
             r->rlen = 0;
 
-            if (redis_argeval(r)) {
-                uint32_t nkey;
-                uint8_t *chp;
+            state = SW_MULTIBULK_ARGN_LF;
 
-                /*
-                 * For EVAL/EVALSHA, we need to find the integer value of this
-                 * argument. It tells us the number of keys in the script, and
-                 * we need to error out if number of keys is 0. At this point,
-                 * both p and m point to the end of the argument and r->token
-                 * points to the start.
-                 */
-                if (p - r->token < 1) {
-                    goto error;
-                }
-
-                for (nkey = 0, chp = r->token; chp < p; chp++) {
-                    if (isdigit(*chp)) {
-                        nkey = nkey * 10 + (uint32_t)(*chp - '0');
-                    } else {
-                        goto error;
-                    }
-                }
-                if (nkey == 0) {
-                    goto error;
-                }
-
-                r->token = NULL;
-            }
-
-            state = SW_ARG2_LF;
-
-            break;
-
-        case SW_ARG2_LF:
-            switch (ch) {
-            case LF:
-                if (redis_arg2(r)) {
-                    if (r->rnarg != 0) {
-                        goto error;
-                    }
-                    goto done;
-                } else if (redis_arg3(r)) {
-                    if (r->rnarg != 1) {
-                        goto error;
-                    }
-                    state = SW_ARG3_LEN;
-                } else if (redis_argn(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_ARGN_LEN;
-                } else if (redis_argeval(r)) {
-                    if (r->rnarg < 1) {
-                        goto error;
-                    }
-                    state = SW_KEY_LEN;
-                } else {
-                    goto error;
-                }
-
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_ARG3_LEN:
-            if (r->token == NULL) {
-                if (ch != '$') {
-                    goto error;
-                }
-                r->rlen = 0;
-                r->token = p;
-            } else if (isdigit(ch)) {
-                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if ((p - r->token) <= 1 || r->rnarg == 0) {
-                    goto error;
-                }
-                r->rnarg--;
-                r->token = NULL;
-                state = SW_ARG3_LEN_LF;
-            } else {
-                goto error;
-            }
-
-            break;
-
-        case SW_ARG3_LEN_LF:
-            switch (ch) {
-            case LF:
-                state = SW_ARG3;
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_ARG3:
-            m = p + r->rlen;
-            if (m >= b->last) {
-                r->rlen -= (uint32_t)(b->last - p);
-                m = b->last - 1;
-                p = m;
-                break;
-            }
-
-            if (*m != CR) {
-                goto error;
-            }
-
-            p = m; /* move forward by rlen bytes */
-            r->rlen = 0;
-            state = SW_ARG3_LF;
-
-            break;
-
-        case SW_ARG3_LF:
-            switch (ch) {
-            case LF:
-                if (redis_arg3(r)) {
-                    if (r->rnarg != 0) {
-                        goto error;
-                    }
-                    goto done;
-                } else if (redis_argn(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_ARGN_LEN;
-                } else {
-                    goto error;
-                }
-
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_ARGN_LEN:
-            if (r->token == NULL) {
-                if (ch != '$') {
-                    goto error;
-                }
-                r->rlen = 0;
-                r->token = p;
-            } else if (isdigit(ch)) {
-                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if ((p - r->token) <= 1 || r->rnarg == 0) {
-                    goto error;
-                }
-                r->rnarg--;
-                r->token = NULL;
-                state = SW_ARGN_LEN_LF;
-            } else {
-                goto error;
-            }
-
-            break;
-
-        case SW_ARGN_LEN_LF:
-            switch (ch) {
-            case LF:
-                state = SW_ARGN;
-                break;
-
-            default:
-                goto error;
-            }
-
-            break;
-
-        case SW_ARGN:
-            m = p + r->rlen;
-            if (m >= b->last) {
-                r->rlen -= (uint32_t)(b->last - p);
-                m = b->last - 1;
-                p = m;
-                break;
-            }
-
-            if (*m != CR) {
-                goto error;
-            }
-
-            p = m; /* move forward by rlen bytes */
-            r->rlen = 0;
-            state = SW_ARGN_LF;
-
-            break;
-
-        case SW_ARGN_LF:
-            switch (ch) {
-            case LF:
-                if (redis_argn(r) || redis_argeval(r) || redis_subcmd_onekey_argzormore(r)) {
-                    if (r->rnarg == 0) {
-                        goto done;
-                    }
-                    state = SW_ARGN_LEN;
-                } else {
-                    goto error;
+            break;
+
+        case SW_MULTIBULK_ARGN_LF:
+            switch (ch) {
+            case LF:
+                if (r->rnarg == 0) {
+                    goto done;
                 }
 
+                state = SW_MULTIBULK_ARGN_LEN;
                 break;
 
             default:
@@ -3952,8 +4748,7 @@ redis_parse_req(struct msg *r)
     r->pos = p;
     r->state = state;
 
-    //if (b->last == b->end && r->token != NULL) {
-    if (r->token != NULL) {
+    if (b->last == b->end && r->token != NULL) {
         r->pos = r->token;
         r->token = NULL;
         r->result = MSG_PARSE_REPAIR;
@@ -3961,7 +4756,7 @@ redis_parse_req(struct msg *r)
         r->result = MSG_PARSE_AGAIN;
     }
 
-    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
                 "type %d state %d rpos %d of %d", r->id, r->result, r->type,
                 r->state, r->pos - b->pos, b->last - b->pos);
     return;
@@ -3974,682 +4769,384 @@ done:
     r->token = NULL;
     r->result = MSG_PARSE_OK;
 
-    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed req %"PRIu64" res %d "
+    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
                 "type %d state %d rpos %d of %d", r->id, r->result, r->type,
                 r->state, r->pos - b->pos, b->last - b->pos);
     return;
 
-enomem:
-    r->result = MSG_PARSE_ERROR;
-    r->state = state;
-
-    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "out of memory on parse req %"PRIu64" "
-                "res %d type %d state %d", r->id, r->result, r->type, r->state);
-
-    return;
-
 error:
     r->result = MSG_PARSE_ERROR;
     r->state = state;
     errno = EINVAL;
 
-    log_hexdump(LOG_NOTICE, b->pos, mbuf_length(b), "parsed bad req %"PRIu64" "
+    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad rsp %"PRIu64" "
                 "res %d type %d state %d", r->id, r->result, r->type,
                 r->state);
 }
 
-/*
- * Reference: http://redis.io/topics/protocol
- *
- * Redis will reply to commands with different kinds of replies. It is
- * possible to check the kind of reply from the first byte sent by the
- * server:
- *  - with a single line reply the first byte of the reply will be "+"
- *  - with an error message the first byte of the reply will be "-"
- *  - with an integer number the first byte of the reply will be ":"
- *  - with bulk reply the first byte of the reply will be "$"
- *  - with multi-bulk reply the first byte of the reply will be "*"
- *
- * 1). Status reply (or single line reply) is in the form of a single line
- *     string starting with "+" terminated by "\r\n".
- * 2). Error reply are similar to status replies. The only difference is
- *     that the first byte is "-" instead of "+".
- * 3). Integer reply is just a CRLF terminated string representing an
- *     integer, and prefixed by a ":" byte.
- * 4). Bulk reply is used by server to return a single binary safe string.
- *     The first reply line is a "$" byte followed by the number of bytes
- *     of the actual reply, followed by CRLF, then the actual data bytes,
- *     followed by additional two bytes for the final CRLF. If the requested
- *     value does not exist the bulk reply will use the special value '-1'
- *     as the data length.
- * 5). Multi-bulk reply is used by the server to return many binary safe
- *     strings (bulks) with the initial line indicating how many bulks that
- *     will follow. The first byte of a multi bulk reply is always *.
- */
-void
-redis_parse_rsp(struct msg *r)
+/* Copy the first line of the response into buf without the CRLF. */
+static void redis_response_line(struct msg *resp, char *buf, size_t size)
 {
-    struct mbuf *b;
-    uint8_t *p, *m;
-    uint8_t ch;
+    listNode *ln;
+    struct mbuf *mbuf;
+    size_t len = 0, n;
+    char *p;
 
-    enum {
-        SW_START,
-        SW_STATUS,
-        SW_ERROR,
-        SW_INTEGER,
-        SW_INTEGER_START,
-        SW_BULK,
-        SW_BULK_LF,
-        SW_BULK_ARG,
-        SW_BULK_ARG_LF,
-        SW_MULTIBULK,
-        SW_MULTIBULK_NARG_LF,
-        SW_MULTIBULK_ARGN_LEN,
-        SW_MULTIBULK_ARGN_LEN_LF,
-        SW_MULTIBULK_ARGN,
-        SW_MULTIBULK_ARGN_LF,
-        SW_RUNTO_CRLF,
-        SW_ALMOST_DONE,
-        SW_SENTINEL
-    } state;
+    for (ln = listFirst(resp->data); ln != NULL && len < size - 1; 
+        ln = listNextNode(ln)) {
+        mbuf = listNodeValue(ln);
+        n = MIN(mbuf_length(mbuf), size - 1 - len);
+        memcpy(buf + len, mbuf->pos, n);
+        len += n;
+    }
+    buf[len] = '\0';
 
-    state = r->state;
-    b = listLastValue(r->data);
+    p = strchr(buf, CR);
+    if (p != NULL) {
+        *p = '\0';
+    }
+}
 
-    ASSERT(!r->request);
-    ASSERT(state < SW_SENTINEL);
-    ASSERT(b != NULL);
-    ASSERT(b->pos <= b->last);
+/* Errors of the target redis that go away, the request is sent again. */
+static const char *redis_retry_errors[] = {
+    "-LOADING ",
+    "-BUSY ",
+    "-TRYAGAIN ",
+    "-OOM ",
+    "-MASTERDOWN ",
+    "-CLUSTERDOWN ",
+    NULL
+};
 
-    /* validate the parsing marker */
-    ASSERT(r->pos != NULL);
-    ASSERT(r->pos >= b->pos && r->pos <= b->last);
+static int redis_response_retriable(struct msg *resp)
+{
+    char buf[64];
+    int i;
 
-    for (p = r->pos; p < b->last; p++) {
-        ch = *p;
+    redis_response_line(resp, buf, sizeof(buf));
 
-        switch (state) {
-        case SW_START:
-            r->type = MSG_UNKNOWN;
-            switch (ch) {
-            case '+':
-                p = p - 1; /* go back by 1 byte */
-                r->type = MSG_RSP_REDIS_STATUS;
-                state = SW_STATUS;
-                break;
+    for (i = 0; redis_retry_errors[i] != NULL; i ++) {
+        if (!strncmp(buf, redis_retry_errors[i], 
+            rmt_strlen(redis_retry_errors[i]))) {
+            return 1;
+        }
+    }
 
-            case '-':
-                r->type = MSG_RSP_REDIS_ERROR;
-                p = p - 1; /* go back by 1 byte */
-                state = SW_ERROR;
-                break;
+    return 0;
+}
 
-            case ':':
-                r->type = MSG_RSP_REDIS_INTEGER;
-                p = p - 1; /* go back by 1 byte */
-                state = SW_INTEGER;
-                break;
+static void redis_response_finished(thread_data *tdata, int correct)
+{
+    if (tdata->keys_count > 0) {
+        if (correct) {
+            tdata->correct_keys_count ++;
+        }
+        tdata->finished_keys_count ++;
+        if (tdata->finished_keys_count >= tdata->keys_count) {
+            aeStop(tdata->loop);
+        }
+    }
+}
 
-            case '$':
-                r->type = MSG_RSP_REDIS_BULK;
-                p = p - 1; /* go back by 1 byte */
-                state = SW_BULK;
-                break;
+int redis_response_check(redis_node *rnode, struct msg *r)
+{
+    struct msg *resp;
+    uint32_t key_num;
+    struct keypos *kp;
+    thread_data *tdata = rnode->write_data;
 
-            case '*':
-                r->type = MSG_RSP_REDIS_MULTIBULK;
-                p = p - 1; /* go back by 1 byte */
-                state = SW_MULTIBULK;
-                break;
+    if (r == NULL) {
+        return RMT_ERROR;
+    }
 
-            default:
-                goto error;
-            }
+    resp = r->peer;
 
-            break;
+    ASSERT(r->request && r->sent);
+    ASSERT(resp != NULL && resp->request == 0);
 
-        case SW_STATUS:
-            /* rsp_start <- p */
-            state = SW_RUNTO_CRLF;
-            break;
+    if (resp->type == MSG_RSP_REDIS_ERROR) {
+        if (redis_cluster_redirect(rnode, r, resp) == RMT_OK) {
+            msg_put(resp);
+            msg_free(resp);
+            return RMT_OK;
+        }
 
-        case SW_ERROR:
-            /* rsp_start <- p */
-            state = SW_RUNTO_CRLF;
-            break;
+        if (redis_response_retriable(resp)) {
+            if (target_node_retry(rnode, r) == RMT_OK) {
+                r->retry_alone = 1;
+                command_stat_retried(tdata, r);
+                thread_stat_decr(tdata, total_msgs_sent, 1);
+                thread_stat_incr(tdata, msgs_outqueue, 1);
+                msg_put(resp);
+                msg_free(resp);
+                return RMT_OK;
+            }
 
-        case SW_INTEGER:
-            /* rsp_start <- p */
-            state = SW_INTEGER_START;
-            r->integer = 0;
-            break;
+            log_warn("Request %s to node[%s] is dropped after %d retries",
+                msg_type_string(r->type), rnode->addr, r->retries);
+        }
 
-        case SW_INTEGER_START:
-            if (ch == CR) {
-                state = SW_ALMOST_DONE;
-            } else if (ch == '-') {
-                ;
-            } else if (isdigit(ch)) {
-                r->integer = r->integer * 10 + (uint32_t)(ch - '0');
-            } else {
-                goto error;
-            }
-            break;
+        log_warn("Response from node[%s] for %s is error.",
+            rnode->addr, msg_type_string(r->type));
+        MSG_DUMP_ALL(resp, LOG_WARN, 0);
+        goto error;
+    }
 
-        case SW_RUNTO_CRLF:
-            switch (ch) {
-            case CR:
-                state = SW_ALMOST_DONE;
-                break;
+    switch(r->type){
+    case MSG_REQ_REDIS_SET:
+        if (resp->type != MSG_RSP_REDIS_STATUS) {
+            goto error;
+        }
 
-            default:
-                break;
-            }
+        if (msg_cmp_str(resp, (const uint8_t*)REDIS_REPLY_STATUS_OK, 
+            rmt_strlen(REDIS_REPLY_STATUS_OK)) != 0) {
+            goto error;
+        }
+        
+        break;
+    case MSG_REQ_REDIS_APPEND:
+    case MSG_REQ_REDIS_DEL:
+        if (resp->type != MSG_RSP_REDIS_INTEGER) {
+            goto error;
+        }
+        
+        break;
+    case MSG_REQ_REDIS_MSETNX:
+        if (resp->type != MSG_RSP_REDIS_INTEGER || resp->integer != 1) {
+            goto error;
+        }
+        break;
+    default:
 
-            break;
+        break;
+    }
+    
+    MSG_DUMP(resp, LOG_VVERB, 0);
+    
+    msg_put(r);
+    msg_free(r);
+    msg_put(resp);
+    msg_free(resp);
 
-        case SW_ALMOST_DONE:
-            switch (ch) {
-            case LF:
-                /* rsp_end <- p */
-                goto done;
+    redis_response_finished(tdata, 1);
+    
+    return RMT_OK;
 
-            default:
-                goto error;
-            }
+error:
 
-            break;
+    key_num = array_n(r->keys);
+    if (key_num == 0) {
+        kp = NULL;
+    } else {
+        kp = array_get(r->keys, 0);
+    }
+    
+    log_warn("response %s from node[%s] for request %s is error", 
+        msg_type_string(resp->type), rnode->addr, msg_type_string(r->type));
+    MSG_DUMP(r, LOG_WARN, 1);
 
-        case SW_BULK:
-            if (r->token == NULL) {
-                if (ch != '$') {
-                    goto error;
-                }
-                /* rsp_start <- p */
-                r->token = p;
-                r->rlen = 0;
-            } else if (ch == '-') {
-                /* handles null bulk reply = '$-1' */
-                state = SW_RUNTO_CRLF;
-            } else if (isdigit(ch)) {
-                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if ((p - r->token) <= 1) {
-                    goto error;
-                }
-                r->bulk_len = r->rlen;
-                r->token = NULL;
-                state = SW_BULK_LF;
-            } else {
-                goto error;
-            }
+    msg_put(r);
+    msg_free(r);
+    msg_put(resp);
+    msg_free(resp);
 
-            break;
+    redis_response_finished(tdata, 0);
 
-        case SW_BULK_LF:
-            switch (ch) {
-            case LF:
-                state = SW_BULK_ARG;
-                break;
+    return RMT_ERROR;
+}
 
-            default:
-                goto error;
-            }
+/*
+ * Check the single line response (status or integer, without the CRLF)
+ * for the request r straight from the receive buffer, as a fast path of
+ * redis_response_check. If the response is the expected one, RMT_OK is
+ * returned and the caller releases r with redis_response_line_done. 
+ * Otherwise RMT_AGAIN is returned, so the response is parsed into a msg
+ * and goes through r->resp_check.
+ */
+int redis_response_check_line(redis_node *rnode, struct msg *r, 
+    uint8_t *line, uint32_t len)
+{
+    ASSERT(r->request && r->sent);
+    ASSERT(len > 0);
 
-            break;
+    if (r->resp_check != redis_response_check) {
+        return RMT_AGAIN;
+    }
 
-        case SW_BULK_ARG:
-            if (r->bulk_start == NULL) {
-                r->bulk_start = p;
-            }
-            
-            m = p + r->rlen;
-            if (m >= b->last) {
-                r->rlen -= (uint32_t)(b->last - p);
-                m = b->last - 1;
-                p = m;
-                break;
+    switch (line[0]) {
+    case '+':
+        switch (r->type) {
+        case MSG_REQ_REDIS_SET:
+            if (len != 3 || line[1] != 'O' || line[2] != 'K') {
+                return RMT_AGAIN;
             }
-
-            if (*m != CR) {
-                goto error;
+            break;
+        case MSG_REQ_REDIS_APPEND:
+        case MSG_REQ_REDIS_DEL:
+        case MSG_REQ_REDIS_MSETNX:
+            return RMT_AGAIN;
+        default:
+            break;
+        }
+        break;
+    case ':':
+        switch (r->type) {
+        case MSG_REQ_REDIS_SET:
+            return RMT_AGAIN;
+        case MSG_REQ_REDIS_MSETNX:
+            if (len != 2 || line[1] != '1') {
+                return RMT_AGAIN;
             }
+            break;
+        default:
+            break;
+        }
+        break;
+    default:
+        return RMT_AGAIN;
+    }
 
-            p = m; /* move forward by rlen bytes */
-            r->rlen = 0;
+    log_debug(LOG_VVERB, "response '%.*s' from node[%s] for %s", 
+        len, line, rnode->addr, msg_type_string(r->type));
 
-            state = SW_BULK_ARG_LF;
-
-            break;
-
-        case SW_BULK_ARG_LF:
-            switch (ch) {
-            case LF:
-                goto done;
-
-            default:
-                goto error;
-            }
-
-            break;
+    return RMT_OK;
+}
 
-        case SW_MULTIBULK:
-            if (r->token == NULL) {
-                if (ch != '*') {
-                    goto error;
-                }
-                r->token = p;
-                /* rsp_start <- p */
-                r->narg_start = p;
-                r->rnarg = 0;
-            } else if (ch == '-') {
-                state = SW_RUNTO_CRLF;
-            } else if (isdigit(ch)) {
-                r->rnarg = r->rnarg * 10 + (uint32_t)(ch - '0');
-            } else if (ch == CR) {
-                if ((p - r->token) <= 1) {
-                    goto error;
-                }
+/* Release the request r whose response passed redis_response_check_line. */
+void redis_response_line_done(redis_node *rnode, struct msg *r)
+{
+    msg_put(r);
+    msg_free(r);
 
-                r->narg = r->rnarg;
-                r->narg_end = p;
-                r->token = NULL;
-                state = SW_MULTIBULK_NARG_LF;
-            } else {
-                goto error;
-            }
+    redis_response_finished(rnode->write_data, 1);
+}
 
+/*
+ * copy one bulk from src to dst
+ *
+ * if dst == NULL, we just eat the bulk
+ *
+ * */
+static int redis_copy_bulk(struct msg *dst, struct msg *src)
+{
+    int ret;
+    struct mbuf *mbuf;
+    listNode *node, *nnode;
+    uint8_t *p;
+    uint32_t len = 0;
+    uint32_t bytes = 0;
+    uint32_t mlen;
+    
+    for (node = listFirst(src->data); 
+        node != NULL;
+        node = listFirst(src->data)) {
+        mbuf = listNodeValue(node);
+        if (mbuf == NULL || !mbuf_empty(mbuf)) {
             break;
+        }
 
-        case SW_MULTIBULK_NARG_LF:
-            switch (ch) {
-            case LF:
-                if (r->rnarg == 0) {
-                    /* response is '*0\r\n' */
-                    goto done;
-                }
-                state = SW_MULTIBULK_ARGN_LEN;
-                break;
+        listDelNode(src->data, node);
+        mbuf_put(mbuf);
+    }
 
-            default:
-                goto error;
-            }
+    node = listFirst(src->data);
+    if (node == NULL) {
+        return RMT_ERROR;
+    }
+    
+    mbuf = listNodeValue(node);
+    if (mbuf == NULL) {
+        return RMT_ERROR;
+    }
 
-            break;
+    log_debug(LOG_DEBUG, "mbuf: %.*s",
+        mbuf_length(mbuf), mbuf->pos);
 
-        case SW_MULTIBULK_ARGN_LEN:
-            if (r->token == NULL) {
-                /*
-                 * From: http://redis.io/topics/protocol, a multi bulk reply
-                 * is used to return an array of other replies. Every element
-                 * of a multi bulk reply can be of any kind, including a
-                 * nested multi bulk reply.
-                 *
-                 * Here, we only handle a multi bulk reply element that
-                 * are either integer reply or bulk reply.
-                 *
-                 * there is a special case for sscan/hscan/zscan, these command
-                 * replay a nested multi-bulk with a number and a multi bulk like this:
-                 *
-                 * - mulit-bulk
-                 *    - cursor
-                 *    - mulit-bulk
-                 *       - val1
-                 *       - val2
-                 *       - val3
-                 *
-                 * in this case, there is only one sub-multi-bulk,
-                 * and it's the last element of parent,
-                 * we can handle it like tail-recursive.
-                 *
-                 */
-                if (ch == '*') {    /* for sscan/hscan/zscan only */
-                    p = p - 1;      /* go back by 1 byte */
-                    state = SW_MULTIBULK;
-                    break;
-                }
+    p = mbuf->pos;
+    if (*p != '$') {
+        MSG_DUMP_ALL(src,LOG_ERR,0);
+        ASSERT(*p == '$');
+    }
+    p++;
 
-                if (ch != '$' && ch != ':') {
-                    goto error;
-                }
-                r->token = p;
-                r->rlen = 0;
-            } else if (isdigit(ch)) {
-                r->rlen = r->rlen * 10 + (uint32_t)(ch - '0');
-            } else if (ch == '-') {
-                ;
-            } else if (ch == CR) {
-                if ((p - r->token) <= 1 || r->rnarg == 0) {
-                    goto error;
-                }
+    if (p[0] == '-' && p[1] == '1') {
+        len = 1 + 2 + CRLF_LEN;             /* $-1\r\n */
+        p = mbuf->pos + len;
+    } else {
+        len = 0;
+        for (; p < mbuf->last && isdigit(*p); p++) {
+            len = len * 10 + (uint32_t)(*p - '0');
+        }
+        len += (uint32_t)(CRLF_LEN * 2);
+        len += (uint32_t)(p - mbuf->pos);
+    }
+    bytes = len;
 
-                if ((r->rlen == 1 && (p - r->token) == 3) || *r->token == ':') {
-                    /* handles not-found reply = '$-1' or integer reply = ':<num>' */
-                    r->rlen = 0;
-                    state = SW_MULTIBULK_ARGN_LF;
-                } else {
-                    state = SW_MULTIBULK_ARGN_LEN_LF;
+    /* copy len bytes to dst */
+    for (; mbuf && len > 0;) {
+        if (mbuf_length(mbuf) <= len) {     /* steal this buf from src to dst */
+            nnode = listNextNode(node);
+            
+            listDelNode(src->data, node);
+            len -= mbuf_length(mbuf);
+            if (dst != NULL) {
+                /* msg_rewind sends the mbufs after the first from start */
+                if (mbuf->pos > mbuf->start) {
+                    mlen = mbuf_length(mbuf);
+                    memmove(mbuf->start, mbuf->pos, mlen);
+                    mbuf->pos = mbuf->start;
+                    mbuf->last = mbuf->start + mlen;
                 }
-                r->rnarg--;
-                r->token = NULL;
+                listAddNodeTail(dst->data, mbuf);
+                dst->mlen += mbuf_length(mbuf);
             } else {
-                goto error;
-            }
-
-            break;
-
-        case SW_MULTIBULK_ARGN_LEN_LF:
-            switch (ch) {
-            case LF:
-                state = SW_MULTIBULK_ARGN;
-                break;
-
-            default:
-                goto error;
+                mbuf_put(mbuf);
             }
 
-            break;
-
-        case SW_MULTIBULK_ARGN:
-            m = p + r->rlen;
-            if (m >= b->last) {
-                r->rlen -= (uint32_t)(b->last - p);
-                m = b->last - 1;
-                p = m;
+            if (nnode == NULL) {
                 break;
             }
 
-            if (*m != CR) {
-                goto error;
+            mbuf = listNodeValue(nnode);
+            node = nnode;
+        } else {                             /* split it */
+            if (dst != NULL) {
+                ret = msg_append(dst, mbuf->pos, len);
+                if (ret != RMT_OK) {
+                    return ret;
+                }
             }
-
-            p += r->rlen; /* move forward by rlen bytes */
-            r->rlen = 0;
-
-            state = SW_MULTIBULK_ARGN_LF;
-
+            mbuf->pos += len;
+            len = 0;
             break;
+        }
+    }
 
-        case SW_MULTIBULK_ARGN_LF:
-            switch (ch) {
-            case LF:
-                if (r->rnarg == 0) {
-                    goto done;
-                }
+    ASSERT(len == 0);
 
-                state = SW_MULTIBULK_ARGN_LEN;
-                break;
+    src->mlen -= bytes;
+    log_debug(LOG_VVERB, "redis_copy_bulk copy bytes: %d", bytes);
+    return RMT_OK;
+}
 
-            default:
-                goto error;
-            }
+/*
+ * Pre-coalesce handler is invoked when the message is a response to
+ * the fragmented multi vector request - 'mget' or 'del' and all the
+ * responses to the fragmented request vector hasn't been received
+ */
+void redis_pre_coalesce(struct msg *r)
+{
+    struct msg *pr = r->peer; /* peer request */
+    struct mbuf *mbuf;
 
-            break;
+    ASSERT(!r->request);
+    ASSERT(pr->request);
 
-        case SW_SENTINEL:
-        default:
-            NOT_REACHED();
-            break;
-        }
+    if (pr->frag_id == 0) {
+        /* do nothing, if not a response to a fragmented request */
+        return;
     }
-
-    ASSERT(p == b->last);
-    r->pos = p;
-    r->state = state;
-
-    if (b->last == b->end && r->token != NULL) {
-        r->pos = r->token;
-        r->token = NULL;
-        r->result = MSG_PARSE_REPAIR;
-    } else {
-        r->result = MSG_PARSE_AGAIN;
-    }
-
-    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
-                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
-                r->state, r->pos - b->pos, b->last - b->pos);
-    return;
-
-done:
-    ASSERT(r->type > MSG_UNKNOWN && r->type < MSG_SENTINEL);
-    r->pos = p + 1;
-    ASSERT(r->pos <= b->last);
-    r->state = SW_START;
-    r->token = NULL;
-    r->result = MSG_PARSE_OK;
-
-    log_hexdump(LOG_VERB, b->pos, mbuf_length(b), "parsed rsp %"PRIu64" res %d "
-                "type %d state %d rpos %d of %d", r->id, r->result, r->type,
-                r->state, r->pos - b->pos, b->last - b->pos);
-    return;
-
-error:
-    r->result = MSG_PARSE_ERROR;
-    r->state = state;
-    errno = EINVAL;
-
-    log_hexdump(LOG_INFO, b->pos, mbuf_length(b), "parsed bad rsp %"PRIu64" "
-                "res %d type %d state %d", r->id, r->result, r->type,
-                r->state);
-}
-
-int redis_response_check(redis_node *rnode, struct msg *r)
-{
-    struct msg *resp;
-    uint32_t key_num;
-    struct keypos *kp;
-    thread_data *tdata = rnode->write_data;
-
-    if (r == NULL) {
-        return RMT_ERROR;
-    }
-
-    resp = r->peer;
-
-    ASSERT(r->request && r->sent);
-    ASSERT(resp != NULL && resp->request == 0);
-
-    if (resp->type == MSG_RSP_REDIS_ERROR) {
-        log_warn("Response from node[%s] for %s is error.",
-            rnode->addr, msg_type_string(r->type));
-        MSG_DUMP_ALL(resp, LOG_WARN, 0);
-        goto error;
-    }
-
-    switch(r->type){
-    case MSG_REQ_REDIS_SET:
-        if (resp->type != MSG_RSP_REDIS_STATUS) {
-            goto error;
-        }
-
-        if (msg_cmp_str(resp, (const uint8_t*)REDIS_REPLY_STATUS_OK, 
-            rmt_strlen(REDIS_REPLY_STATUS_OK)) != 0) {
-            goto error;
-        }
-        
-        break;
-    case MSG_REQ_REDIS_APPEND:
-    case MSG_REQ_REDIS_DEL:
-        if (resp->type != MSG_RSP_REDIS_INTEGER) {
-            goto error;
-        }
-        
-        break;
-    case MSG_REQ_REDIS_MSETNX:
-        if (resp->type != MSG_RSP_REDIS_INTEGER || resp->integer != 1) {
-            goto error;
-        }
-        break;
-    default:
-
-        break;
-    }
-    
-    MSG_DUMP(resp, LOG_VVERB, 0);
-    
-    msg_put(r);
-    msg_free(r);
-    msg_put(resp);
-    msg_free(resp);
-
-    if (tdata->keys_count > 0) {
-        tdata->correct_keys_count ++;
-        tdata->finished_keys_count ++;
-        if (tdata->finished_keys_count >= tdata->keys_count) {
-            aeStop(tdata->loop);
-        }
-    }
-    
-    return RMT_OK;
-
-error:
-
-    key_num = array_n(r->keys);
-    if (key_num == 0) {
-        kp = NULL;
-    } else {
-        kp = array_get(r->keys, 0);
-    }
-    
-    log_warn("response %s from node[%s] for request %s is error", 
-        msg_type_string(resp->type), rnode->addr, msg_type_string(r->type));
-    MSG_DUMP(r, LOG_WARN, 1);
-
-    msg_put(r);
-    msg_free(r);
-    msg_put(resp);
-    msg_free(resp);
-
-    
-    if (tdata->keys_count > 0) {
-        tdata->finished_keys_count ++;
-        if (tdata->finished_keys_count >= tdata->keys_count) {
-            aeStop(tdata->loop);
-        }
-    }
-
-    return RMT_ERROR;
-}
-
-/*
- * copy one bulk from src to dst
- *
- * if dst == NULL, we just eat the bulk
- *
- * */
-static int redis_copy_bulk(struct msg *dst, struct msg *src)
-{
-    int ret;
-    struct mbuf *mbuf;
-    listNode *node, *nnode;
-    uint8_t *p;
-    uint32_t len = 0;
-    uint32_t bytes = 0;
-    
-    for (node = listFirst(src->data); 
-        node != NULL;
-        node = listFirst(src->data)) {
-        mbuf = listNodeValue(node);
-        if (mbuf == NULL || !mbuf_empty(mbuf)) {
-            break;
-        }
-
-        listDelNode(src->data, node);
-        mbuf_put(mbuf);
-    }
-
-    node = listFirst(src->data);
-    if (node == NULL) {
-        return RMT_ERROR;
-    }
-    
-    mbuf = listNodeValue(node);
-    if (mbuf == NULL) {
-        return RMT_ERROR;
-    }
-
-    log_debug(LOG_DEBUG, "mbuf: %.*s",
-        mbuf_length(mbuf), mbuf->pos);
-
-    p = mbuf->pos;
-    if (*p != '$') {
-        MSG_DUMP_ALL(src,LOG_ERR,0);
-        ASSERT(*p == '$');
-    }
-    p++;
-
-    if (p[0] == '-' && p[1] == '1') {
-        len = 1 + 2 + CRLF_LEN;             /* $-1\r\n */
-        p = mbuf->pos + len;
-    } else {
-        len = 0;
-        for (; p < mbuf->last && isdigit(*p); p++) {
-            len = len * 10 + (uint32_t)(*p - '0');
-        }
-        len += (uint32_t)(CRLF_LEN * 2);
-        len += (uint32_t)(p - mbuf->pos);
-    }
-    bytes = len;
-
-    /* copy len bytes to dst */
-    for (; mbuf && len > 0;) {
-        if (mbuf_length(mbuf) <= len) {     /* steal this buf from src to dst */
-            nnode = listNextNode(node);
-            
-            listDelNode(src->data, node);
-            len -= mbuf_length(mbuf);
-            if (dst != NULL) {
-                listAddNodeTail(dst->data, mbuf);
-                dst->mlen += mbuf_length(mbuf);
-            } else {
-                mbuf_put(mbuf);
-            }
-
-            if (nnode == NULL) {
-                break;
-            }
-
-            mbuf = listNodeValue(nnode);
-            node = nnode;
-        } else {                             /* split it */
-            if (dst != NULL) {
-                ret = msg_append(dst, mbuf->pos, len);
-                if (ret != RMT_OK) {
-                    return ret;
-                }
-            }
-            mbuf->pos += len;
-            len = 0;
-            break;
-        }
-    }
-
-    ASSERT(len == 0);
-
-    src->mlen -= bytes;
-    log_debug(LOG_VVERB, "redis_copy_bulk copy bytes: %d", bytes);
-    return RMT_OK;
-}
-
-/*
- * Pre-coalesce handler is invoked when the message is a response to
- * the fragmented multi vector request - 'mget' or 'del' and all the
- * responses to the fragmented request vector hasn't been received
- */
-void redis_pre_coalesce(struct msg *r)
-{
-    struct msg *pr = r->peer; /* peer request */
-    struct mbuf *mbuf;
-
-    ASSERT(!r->request);
-    ASSERT(pr->request);
-
-    if (pr->frag_id == 0) {
-        /* do nothing, if not a response to a fragmented request */
-        return;
-    }
-    pr->frag_owner->nfrag_done++;
+    pr->frag_owner->nfrag_done++;
 
     switch (r->type) {
     case MSG_RSP_REDIS_INTEGER:
@@ -5324,14 +5821,10 @@ int redis_msg_append_multi_bulk_len_full(struct msg *msg, uint32_t integer)
     return RMT_OK;
 }
 
-int redis_msg_append_bulk_full(struct msg *msg, const char *str, uint32_t len)
+static int redis_msg_append_bulk_len_full(struct msg *msg, uint32_t len)
 {
     int ret;
     sds len_str;
-    
-    if (msg == NULL || str == NULL) {
-        return RMT_ERROR;
-    }
 
     ret = msg_append_full(msg, (const uint8_t*)"$", 1);
     if (ret != RMT_OK) {
@@ -5356,6 +5849,22 @@ int redis_msg_append_bulk_full(struct msg *msg, const char *str, uint32_t len)
        return RMT_ENOMEM;
     }
 
+    return RMT_OK;
+}
+
+int redis_msg_append_bulk_full(struct msg *msg, const char *str, uint32_t len)
+{
+    int ret;
+    
+    if (msg == NULL || str == NULL) {
+        return RMT_ERROR;
+    }
+
+    ret = redis_msg_append_bulk_len_full(msg, len);
+    if (ret != RMT_OK) {
+        return ret;
+    }
+
     ret = msg_append_full(msg, (const uint8_t*)str, len);
     if (ret != RMT_OK) {
         return RMT_ENOMEM;
@@ -5369,6 +5878,59 @@ int redis_msg_append_bulk_full(struct msg *msg, const char *str, uint32_t len)
     return RMT_OK;
 }
 
+static void redis_sds_free(void *ptr)
+{
+    sdsfree(ptr);
+}
+
+/*
+ * Append the sds *str into msg as a bulk. A value that does not fit in
+ * one mbuf is referenced by the msg instead of copied: the msg takes the
+ * ownership of the sds and *str is set to NULL.
+ */
+int redis_msg_append_bulk_sds(struct msg *msg, sds *str)
+{
+    int ret;
+    struct mbuf_seg *seg;
+    uint32_t len;
+
+    if (msg == NULL || str == NULL || *str == NULL) {
+        return RMT_ERROR;
+    }
+
+    len = (uint32_t)sdslen(*str);
+    if (len < mbuf_data_size(msg->mb)) {
+        return redis_msg_append_bulk_full(msg, *str, len);
+    }
+
+    ret = redis_msg_append_bulk_len_full(msg, len);
+    if (ret != RMT_OK) {
+        return ret;
+    }
+
+    seg = mbuf_seg_create(*str, redis_sds_free);
+    if (seg == NULL) {
+        return RMT_ENOMEM;
+    }
+
+    ret = msg_append_seg(msg, seg, (uint8_t *)*str, len);
+    if (ret != RMT_OK) {
+        seg->free = NULL;
+        mbuf_seg_put(seg);
+        return ret;
+    }
+
+    *str = NULL;
+    mbuf_seg_put(seg);
+
+    ret = msg_append_full(msg, (const uint8_t*)CRLF, CRLF_LEN);
+    if (ret != RMT_OK) {
+       return RMT_ENOMEM;
+    }
+
+    return RMT_OK;
+}
+
 int redis_msg_append_command_full(struct msg * msg, ...)
 {
     int ret;
@@ -5563,7 +6125,7 @@ next:
     for(i = start; i < end; i ++){
         elem = array_get(value, i);
 
-        ret = redis_msg_append_bulk_full(msg, *elem, (uint32_t)sdslen(*elem));
+        ret = redis_msg_append_bulk_sds(msg, elem);
         if(ret != RMT_OK){
             log_error("ERROR: Redis msg append bulk the %d value error(key is %.*s).", 
                 i, (uint32_t)sdslen(key), key);
@@ -5674,1711 +6236,2814 @@ struct msg *redis_generate_msg_with_key_expire(rmtContext *ctx, mbuf_base *mb,
     if(ctx->noreply){
         msg->noreply = 1;
     }
-    
-    return msg;
+    
+    return msg;
+
+enomem:
+    log_error("ERROR: Out of memory");
+    
+error: 
+
+    if(msg != NULL)
+    {
+        msg_put(msg);
+        msg_free(msg);
+    }
+
+    return NULL;
+
+}
+
+struct array *redis_value_create(uint32_t nelem)
+{
+    struct array *value;
+
+    value = array_create(nelem, sizeof(sds));
+    if(value == NULL)
+    {
+        return NULL;
+    }
+    
+    return value;
+}
+
+void redis_value_destroy(struct array *value)
+{
+    sds *str;
+    
+    if(value == NULL)
+    {
+        return;
+    }
+
+    while(array_n(value) > 0)
+    {
+        str = array_pop(value);
+        if(*str == NULL) continue;
+        sdsfree(*str);
+    }
+
+    array_destroy(value);
+}
+
+void
+redis_rdb_update_checksum(redis_rdb *rdb, 
+    const void *buf, size_t len)
+{
+    rdb->cksum = hash_crc64(rdb->cksum,buf,len);
+}
+
+/* Check the transfer of the rdb file followed by the parser.
+ * return:
+ * RMT_OK the rdb file is received, and stops to be followed
+ * RMT_AGAIN the rdb file is still being received
+ * RMT_ERROR the transfer was aborted */
+static int redis_rdb_file_transfer(redis_rdb *rdb)
+{
+    redis_repl *rr = rdb->rnode->rr;
+
+    if (!__atomic_load_n(&rdb->received, __ATOMIC_ACQUIRE)) {
+        if (rr->repl_state == REDIS_REPL_TRANSFER) {
+            return RMT_AGAIN;
+        }
+
+        /* it may be received just after the first check */
+        if (!__atomic_load_n(&rdb->received, __ATOMIC_ACQUIRE)) {
+            return RMT_ERROR;
+        }
+    }
+
+    rdb->following = 0;
+    return RMT_OK;
+}
+
+/* Bytes of the rdb file written after the read position. */
+static long long redis_rdb_file_available(redis_rdb *rdb)
+{
+    struct stat st;
+    long pos;
+
+    pos = ftell(rdb->fp);
+    if (pos < 0 || fstat(fileno(rdb->fp), &st) < 0) {
+        return 0;
+    }
+
+    return (long long)st.st_size - pos;
+}
+
+/* Check if len bytes of the followed rdb file can be read.
+ * return:
+ * RMT_OK the bytes can be read
+ * RMT_EAGAIN wait the read thread to write more of the rdb file
+ * RMT_ERROR the transfer was aborted */
+static int redis_rdb_file_follow_len(redis_rdb *rdb, long long len)
+{
+    int ret;
+
+    if (redis_rdb_file_available(rdb) >= len) {
+        return RMT_OK;
+    }
+
+    ret = redis_rdb_file_transfer(rdb);
+    if (ret != RMT_AGAIN) {
+        return ret;
+    }
+
+    /* check again, the data may be written before the waiting is seen */
+    __atomic_store_n(&rdb->waiting, 1, __ATOMIC_SEQ_CST);
+    if (redis_rdb_file_available(rdb) >= len) {
+        rdb->waiting = 0;
+        return RMT_OK;
+    }
+
+    /* or the transfer may end before */
+    ret = redis_rdb_file_transfer(rdb);
+    if (ret != RMT_AGAIN) {
+        rdb->waiting = 0;
+        return ret;
+    }
+
+    return RMT_EAGAIN;
+}
+
+/* Check if the next object of the followed rdb file can be parsed,
+ * and remember where it starts to parse it again if it is not all
+ * written yet. */
+static int redis_rdb_file_follow(redis_rdb *rdb)
+{
+    int ret;
+
+    ret = redis_rdb_file_follow_len(rdb, 1);
+    if (ret != RMT_OK) {
+        return ret;
+    }
+
+    rdb->obj_off = ftell(rdb->fp);
+    rdb->obj_parsed = rdb->parsed_bytes;
+    rdb->obj_cksum = rdb->cksum;
+    rdb->short_read = 0;
+
+    return RMT_OK;
+}
+
+/* The followed rdb file ends in the middle of an object, go back to
+ * the start of the object to parse it again when more is written.
+ * return like redis_rdb_file_follow_len() */
+static int redis_rdb_file_rewind(redis_rdb *rdb)
+{
+    long long len;
+
+    if (fseek(rdb->fp, rdb->obj_off, SEEK_SET) < 0) {
+        log_error("ERROR: Seek rdb file %s failed: %s", 
+            rdb->fname, strerror(errno));
+        return RMT_ERROR;
+    }
+
+    rdb->parsed_bytes = rdb->obj_parsed;
+    rdb->cksum = rdb->obj_cksum;
+    rdb->short_read = 0;
+
+    /* the object needs more than the bytes written */
+    len = redis_rdb_file_available(rdb) + 1;
+    
+    return redis_rdb_file_follow_len(rdb, len);
+}
+
+/* A short read of the followed rdb file is not an error, the parser
+ * goes back with redis_rdb_file_rewind() and waits for more. */
+#define log_rdb_error(_rdb, ...) do {               \
+    if (!(_rdb)->short_read) {                      \
+        log_error(__VA_ARGS__);                     \
+    }                                               \
+} while (0)
+
+static int redis_rdb_file_read(redis_rdb *rdb, void *buf, size_t len)
+{
+    size_t n;
+
+    n = rmt_fread(rdb->fp, buf, len);
+    if (n < len) {
+        if (rdb->following) {
+            rdb->short_read = 1;
+        }
+        return RMT_ERROR;
+    }
+    rdb->parsed_bytes += (long long)len;
+
+    if(rdb->update_cksum)
+    {
+        rdb->update_cksum(rdb, buf, len);
+    }
+
+    return RMT_OK;
+}
+
+static uint32_t redis_rdb_file_load_len(redis_rdb *rdb, int *isencoded)
+{
+    unsigned char buf[2];
+    uint32_t len;
+    int type;
+    
+    if(rdb->fp == NULL)
+    {
+        return REDIS_RDB_LENERR;
+    }
+
+    if (isencoded){
+        *isencoded = 0;
+    }
+    
+    if(redis_rdb_file_read(rdb, buf, 1) != RMT_OK){
+        return REDIS_RDB_LENERR;
+    }
+    
+    type = (buf[0]&0xC0)>>6;
+    if (type == REDIS_RDB_ENCVAL) {
+        /* Read a 6 bit encoding type. */
+        if (isencoded) *isencoded = 1;
+        return buf[0]&0x3F;
+    } else if (type == REDIS_RDB_6BITLEN) {
+        /* Read a 6 bit len. */
+        return buf[0]&0x3F;
+    } else if (type == REDIS_RDB_14BITLEN) {
+        /* Read a 14 bit len. */
+        if (redis_rdb_file_read(rdb, buf+1, 1) != RMT_OK){
+            return REDIS_RDB_LENERR;
+        }
+
+        return (uint32_t)(((buf[0]&0x3F)<<8)|buf[1]);
+    } else {
+        /* Read a 32 bit len. */
+        if (redis_rdb_file_read(rdb, &len, 4) != RMT_OK){
+            return REDIS_RDB_LENERR;
+        }
+
+        return ntohl(len);
+    }
+}
+
+/* Loads an integer-encoded object with the specified encoding type "enctype".
+ * If the "encode" argument is set the function may return an integer-encoded
+ * string object, otherwise it always returns a raw string object. */
+static long long redis_rdb_file_load_int(redis_rdb *rdb, int enctype) {
+    unsigned char enc[4];
+    long long val;
+
+    if (enctype == REDIS_RDB_ENC_INT8) {
+        if (redis_rdb_file_read(rdb,enc,1) != RMT_OK) return 0;
+        val = (signed char)enc[0];
+    } else if (enctype == REDIS_RDB_ENC_INT16) {
+        uint16_t v;
+        if (redis_rdb_file_read(rdb,enc,2) != RMT_OK) return 0;
+        v = (uint32_t)(enc[0]|(enc[1]<<8));
+        val = (int16_t)v;
+    } else if (enctype == REDIS_RDB_ENC_INT32) {
+        uint32_t v;
+        if (redis_rdb_file_read(rdb,enc,4) != RMT_OK) return 0;
+        v = (uint32_t)(enc[0]|(enc[1]<<8)|(enc[2]<<16)|(enc[3]<<24));
+        val = (int32_t)v;
+    } else {
+        val = 0; /* anti-warning */
+        log_error("ERROR: Unknown RDB integer encoding type");
+    }
+
+    return val;
+}
+
+static sds redis_rdb_file_load_double_str(redis_rdb *rdb) {
+    char buf[256];
+    unsigned char len;
+
+    if (redis_rdb_file_read(rdb,&len,1) != RMT_OK) return NULL;
+    switch(len) {
+    case 255: return NULL;  //need to handle later
+    case 254: return NULL;  //need to handle later
+    case 253: return sdsnew("0");
+    default:
+        if (redis_rdb_file_read(rdb,buf,len) != RMT_OK) return NULL;
+        return sdsnewlen(buf, len);
+    }
+}
+
+static sds redis_rdb_file_load_lzf_str(redis_rdb *rdb) {
+    unsigned int len, clen;
+    unsigned char *c = NULL;
+    sds val = NULL;
+
+    if ((clen = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
+    if ((len = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
+    if ((c = rmt_alloc(clen)) == NULL) goto err;
+    if ((val = sdsnewlen(NULL,len)) == NULL) goto err;
+    if (redis_rdb_file_read(rdb,c,clen) != RMT_OK) goto err;
+    if (lzf_decompress(c,clen,val,len) == 0) goto err;
+    rmt_free(c);
+    return val;
+err:
+    rmt_free(c);
+    sdsfree(val);
+    return NULL;
+}
+
+static sds redis_rdb_file_load_str(redis_rdb *rdb)
+{
+    int isencoded;
+    uint32_t len;
+    sds str;
+
+    if((len = redis_rdb_file_load_len(rdb, &isencoded)) 
+        == REDIS_RDB_LENERR)
+    {
+        log_rdb_error(rdb, "ERROR: Short read or OOM loading DB. Unrecoverable error, aborting now.");
+        return NULL;
+    }
+
+    if (isencoded) {
+        switch(len) {
+        case REDIS_RDB_ENC_INT8:
+        case REDIS_RDB_ENC_INT16:
+        case REDIS_RDB_ENC_INT32:
+            return sdsfromlonglong(redis_rdb_file_load_int(rdb, (int)len));
+            break;
+        case REDIS_RDB_ENC_LZF:
+            return redis_rdb_file_load_lzf_str(rdb);
+            break;
+        default:
+            log_error("ERROR: Unknown RDB encoding type %"PRIu32"", len);
+            return NULL;
+            break;
+        }
+    }
+
+    str = sdsnewlen(NULL, len);
+    if(str == NULL)
+    {
+        log_error("ERROR: Out of memory");
+        return NULL;
+    }
+
+    if(redis_rdb_file_read(rdb, str, len) != RMT_OK){
+        log_rdb_error(rdb, "ERROR: Short read or OOM loading DB. Unrecoverable error, aborting now.");
+        return NULL;
+    }
+
+    return str;
+}
+
+static struct array *redis_rdb_file_load_value(redis_rdb *rdb, int rdbtype)
+{
+    struct array *value;
+    sds *str;
+    sds elem1, elem2, elems;
+    size_t len;
+    uint32_t i;
+
+    str = NULL;
+    value = NULL;
+    elems = NULL;
+
+    log_debug(LOG_DEBUG, "rdbtype: %d", rdbtype);
+
+    if (rdbtype == REDIS_RDB_TYPE_STRING) {
+        value = redis_value_create(1);
+        if(value == NULL)
+        {
+            log_error("ERROR: Out of memory");
+            goto error;
+        }
+
+        str = array_push(value);
+        if((*str = redis_rdb_file_load_str(rdb)) == NULL){
+            goto error;
+        }
+
+    }else if (rdbtype == REDIS_RDB_TYPE_LIST || 
+        rdbtype == REDIS_RDB_TYPE_SET) {
+        if ((len = redis_rdb_file_load_len(rdb,NULL)) 
+            == REDIS_RDB_LENERR) goto error;
+
+        value = redis_value_create((uint32_t)len);
+        if(value == NULL)
+        {
+            log_error("ERROR: Out of memory");
+            goto error;
+        }
+        
+        while(len--) {
+            str = array_push(value);
+            if ((*str = redis_rdb_file_load_str(rdb)) == NULL) goto error;
+        }
+    }else if (rdbtype == REDIS_RDB_TYPE_ZSET) {
+        if ((len = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) goto error;
+
+        value = redis_value_create((uint32_t)(2*len));
+        if (value == NULL) {
+            log_error("ERROR: Out of memory");
+            goto error;
+        }
+        
+        while(len--) {
+            if ((elem1 = redis_rdb_file_load_str(rdb)) == NULL) goto error;
+            if ((elem2 = redis_rdb_file_load_double_str(rdb)) == NULL) {
+                sdsfree(elem1);
+                goto error;
+            }
+
+            str = array_push(value);
+            *str = elem2;
+            ASSERT(sdsIsNum(*str) == 1);
+            str = array_push(value);
+            *str = elem1;
+        }
+    }else if (rdbtype == REDIS_RDB_TYPE_HASH) {
+        if ((len = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) goto error;
+
+        value = redis_value_create((uint32_t)(2*len));
+        if(value == NULL)
+        {
+            log_error("ERROR: Out of memory");
+            goto error;
+        }
+
+        while(len--) {
+            str = array_push(value);
+            if ((*str = redis_rdb_file_load_str(rdb)) == NULL) goto error;
+            str = array_push(value);
+            if ((*str = redis_rdb_file_load_str(rdb)) == NULL) goto error;
+        }
+    } else if (rdbtype == REDIS_RDB_TYPE_LIST_QUICKLIST) {
+        if ((len = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) goto error;
+
+        value = redis_value_create((uint32_t)(len));
+        if (value == NULL) {
+            log_error("ERROR: Out of memory");
+            goto error;
+        }
+
+        while (len--) {
+            unsigned char *zl;
+            unsigned int count;
+            unsigned char *eptr, *sptr;
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vlong;
+
+            zl = redis_rdb_file_load_str(rdb);
+            
+            count = ziplistLen(zl);
+            eptr = ziplistIndex(zl,0);
+            while (eptr != NULL) {
+                ziplistGet(eptr,&vstr,&vlen,&vlong);
+
+                str = array_push(value);
+
+                if (vstr == NULL) {
+                    *str = sdsfromlonglong(vlong);
+                } else {
+                    *str = sdsnewlen(vstr, vlen);
+                }
+                
+                eptr = ziplistNext(zl,eptr);
+            }
+        }
+    } else if (rdbtype == REDIS_RDB_TYPE_HASH_ZIPMAP  ||
+               rdbtype == REDIS_RDB_TYPE_LIST_ZIPLIST ||
+               rdbtype == REDIS_RDB_TYPE_SET_INTSET   ||
+               rdbtype == REDIS_RDB_TYPE_ZSET_ZIPLIST ||
+               rdbtype == REDIS_RDB_TYPE_HASH_ZIPLIST) {
+        if ((elems = redis_rdb_file_load_str(rdb)) == NULL) goto error;
+
+        switch(rdbtype) {
+        case REDIS_RDB_TYPE_HASH_ZIPMAP:
+        {
+            unsigned char * zm = (unsigned char *)elems;
+            unsigned char *zi = zipmapRewind(zm);
+            unsigned char *fstr, *vstr;
+            unsigned int flen, vlen;
+            
+            len = zipmapLen(zm);
+            
+            value = redis_value_create((uint32_t)(2*len));
+            if (value == NULL) {
+                log_error("ERROR: Out of memory");
+                goto error;
+            }
+
+            while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
+                str = array_push(value);
+                *str = sdsnewlen(fstr, flen);
+
+                str = array_push(value);
+                *str = sdsnewlen(vstr, vlen);
+            }
+            
+            break;
+        }
+        case REDIS_RDB_TYPE_LIST_ZIPLIST:
+        case REDIS_RDB_TYPE_HASH_ZIPLIST:
+        {
+            unsigned char *zl = (unsigned char *)elems;
+            unsigned char *eptr, *sptr;
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vlong;
+            
+            len = ziplistLen(zl);
+            if (rdbtype == REDIS_RDB_TYPE_HASH_ZIPLIST && len%2 != 0) {
+                log_error("ERROR: hash value length from rdb must be an even number");
+                goto error;
+            }
+
+            value = redis_value_create((uint32_t)len);
+            if (value == NULL) {
+                log_error("ERROR: Out of memory");
+                goto error;
+            }
+
+            eptr = ziplistIndex(zl,0);
+            
+            while (eptr != NULL) {
+                ziplistGet(eptr,&vstr,&vlen,&vlong);
+
+                str = array_push(value);
+
+                if (vstr == NULL) {
+                    *str = sdsfromlonglong(vlong);
+                } else {
+                    *str = sdsnewlen(vstr, vlen);
+                }
+                
+                eptr = ziplistNext(zl,eptr);
+            }
+            
+            break;
+        }
+        case REDIS_RDB_TYPE_ZSET_ZIPLIST:
+        {
+            unsigned char *zl = (unsigned char *)elems;
+            unsigned char *eptr, *sptr;
+            unsigned char *vstr;
+            unsigned int vlen;
+            long long vlong;
+            uint32_t k = 0;
+            sds *score, *data;
+            sds field;
+            
+            len = ziplistLen(zl);
+            if (len%2 != 0) {
+                log_error("ERROR: zset value length from rdb must be an even number");
+                goto error;
+            }
+
+            value = redis_value_create((uint32_t)len);
+            if (value == NULL) {
+                log_error("ERROR: Out of memory");
+                goto error;
+            }
+
+            eptr = ziplistIndex(zl,0);
+            
+            while (eptr != NULL) {
+                ziplistGet(eptr,&vstr,&vlen,&vlong);
+
+                if (vstr == NULL) {
+                    field = sdsfromlonglong(vlong);
+                } else {
+                    field = sdsnewlen(vstr, vlen);
+                }
+
+                if (k%2 == 0) {
+                    score = array_push(value);
+                    data = array_push(value);
+
+                    *data = field;
+                } else {
+                    *score = field;
+                }
+                
+                eptr = ziplistNext(zl,eptr);
+                k ++;
+            }
+            break;
+        }
+        case REDIS_RDB_TYPE_SET_INTSET:
+        {
+            intset *is = (intset *)elems;
+            int64_t integer;
+            
+            len = intsetLen(is);
+
+            value = redis_value_create((uint32_t)len);
+            if (value == NULL) {
+                log_error("ERROR: Out of memory");
+                goto error;
+            }
+
+            for (i = 0; i < len; i ++) {
+                if (intsetGet(is, i, &integer) == 0) {
+                    log_error("ERROR: intset get failed");
+                    goto error;
+                }
+
+                elem1 = sdsfromlonglong(integer);
+
+                str = array_push(value);
+                *str = elem1;
+            }
+            
+            break;
+        }
+        default:
+            NOT_REACHED();
+            break;
+        }
+
+        sdsfree(elems);
+    }else {
+        
+        log_error("ERROR: Unknown object type");
+        goto error;
+    }
 
-enomem:
-    log_error("ERROR: Out of memory");
-    
-error: 
+    return value;
 
-    if(msg != NULL)
+error:
+
+    if(value != NULL)
     {
-        msg_put(msg);
-        msg_free(msg);
+        redis_value_destroy(value);
     }
 
-    return NULL;
+    if(elems != NULL)
+    {
+        sdsfree(elems);
+    }
 
+    return NULL;
 }
 
-struct array *redis_value_create(uint32_t nelem)
+static int redis_object_type_get_by_rdbtype(int dbtype)
 {
-    struct array *value;
-
-    value = array_create(nelem, sizeof(sds));
-    if(value == NULL)
+    switch(dbtype)
     {
-        return NULL;
+    case REDIS_RDB_TYPE_STRING:
+
+        return REDIS_STRING;
+        break;
+    case REDIS_RDB_TYPE_LIST:
+    case REDIS_RDB_TYPE_LIST_ZIPLIST:
+    case REDIS_RDB_TYPE_LIST_QUICKLIST:
+
+        return REDIS_LIST;
+        break;
+    case REDIS_RDB_TYPE_SET:
+    case REDIS_RDB_TYPE_SET_INTSET:
+
+        return REDIS_SET;
+        break;
+    case REDIS_RDB_TYPE_ZSET:
+    case REDIS_RDB_TYPE_ZSET_ZIPLIST:
+        
+        return REDIS_ZSET;
+        break;
+    case REDIS_RDB_TYPE_HASH:
+    case REDIS_RDB_TYPE_HASH_ZIPMAP:
+    case REDIS_RDB_TYPE_HASH_ZIPLIST:
+        
+        return REDIS_HASH;
+        break;
+    default:
+        
+        return -1;
+        break;
     }
-    
-    return value;
+
+    return -1;
 }
 
-void redis_value_destroy(struct array *value)
+void redis_delete_rdb_file(redis_rdb *rdb, int always)
 {
-    sds *str;
-    
-    if(value == NULL)
-    {
+    if (rdb == NULL) {
         return;
     }
 
-    while(array_n(value) > 0)
-    {
-        str = array_pop(value);
-        if(*str == NULL) continue;
-        sdsfree(*str);
+    if (always) {
+        goto del;
     }
 
-    array_destroy(value);
-}
+    if (rdb->deleted) {
+        goto del;
+    }
 
-void
-redis_rdb_update_checksum(redis_rdb *rdb, 
-    const void *buf, size_t len)
-{
-    rdb->cksum = hash_crc64(rdb->cksum,buf,len);
-}
+    return;
 
-static int redis_rdb_file_read(redis_rdb *rdb, void *buf, size_t len)
-{
-    if (rmt_fread(rdb->fp, buf, len) != len){
-        return RMT_ERROR;
+del:
+    if (rdb->fd > 0) {
+        close(rdb->fd);
+        rdb->fd = -1;
     }
 
-    if(rdb->update_cksum)
-    {
-        rdb->update_cksum(rdb, buf, len);
+    if (rdb->fp != NULL) {
+        fclose(rdb->fp);
+        rdb->fp = NULL;
     }
 
-    return RMT_OK;
+    if (rdb->fname != NULL) {
+        unlink(rdb->fname);
+        sdsfree(rdb->fname);
+        rdb->fname = NULL;
+    }
 }
 
-static uint32_t redis_rdb_file_load_len(redis_rdb *rdb, int *isencoded)
+/*
+  * return: 
+  * -1 error
+  * 0 no msg sent
+  * >0 mbuf count sent 
+  */
+int redis_key_value_send(redis_node *srnode, sds key, 
+    int data_type, struct array *value, 
+    int expiretime_type, long long expiretime, 
+    void *data)
 {
-    unsigned char buf[2];
-    uint32_t len;
-    int type;
-    
-    if(rdb->fp == NULL)
-    {
-        return REDIS_RDB_LENERR;
-    }
+    int ret;
+    rmtContext *ctx = srnode->ctx;
+    redis_group *srgroup = srnode->owner;
+    mbuf_base *mb = srgroup->mb;
+    redis_group *trgroup = data;
+    long long now = rmt_msec_now();
+    redis_node *trnode;
+    sds expiretime_str = NULL;
+    struct msg *msg = NULL;
+    uint32_t i;
+    int mbuf_count = 0;
 
-    if (isencoded){
-        *isencoded = 0;
-    }
-    
-    if(redis_rdb_file_read(rdb, buf, 1) != RMT_OK){
-        return REDIS_RDB_LENERR;
-    }
-    
-    type = (buf[0]&0xC0)>>6;
-    if (type == REDIS_RDB_ENCVAL) {
-        /* Read a 6 bit encoding type. */
-        if (isencoded) *isencoded = 1;
-        return buf[0]&0x3F;
-    } else if (type == REDIS_RDB_6BITLEN) {
-        /* Read a 6 bit len. */
-        return buf[0]&0x3F;
-    } else if (type == REDIS_RDB_14BITLEN) {
-        /* Read a 14 bit len. */
-        if (redis_rdb_file_read(rdb, buf+1, 1) != RMT_OK){
-            return REDIS_RDB_LENERR;
+    if (expiretime_type == RMT_TIME_SECOND) {
+        if(expiretime * 1000 < now){
+            return 0;
         }
 
-        return (uint32_t)(((buf[0]&0x3F)<<8)|buf[1]);
-    } else {
-        /* Read a 32 bit len. */
-        if (redis_rdb_file_read(rdb, &len, 4) != RMT_OK){
-            return REDIS_RDB_LENERR;
+        expiretime_str = sdsfromlonglong(expiretime);
+    } else if(expiretime_type == RMT_TIME_MILLISECOND) {
+        if (expiretime < now) {
+            return 0;
         }
 
-        return ntohl(len);
+        expiretime_str = sdsfromlonglong(expiretime);
     }
-}
-
-/* Loads an integer-encoded object with the specified encoding type "enctype".
- * If the "encode" argument is set the function may return an integer-encoded
- * string object, otherwise it always returns a raw string object. */
-static long long redis_rdb_file_load_int(redis_rdb *rdb, int enctype) {
-    unsigned char enc[4];
-    long long val;
 
-    if (enctype == REDIS_RDB_ENC_INT8) {
-        if (redis_rdb_file_read(rdb,enc,1) != RMT_OK) return 0;
-        val = (signed char)enc[0];
-    } else if (enctype == REDIS_RDB_ENC_INT16) {
-        uint16_t v;
-        if (redis_rdb_file_read(rdb,enc,2) != RMT_OK) return 0;
-        v = (uint32_t)(enc[0]|(enc[1]<<8));
-        val = (int16_t)v;
-    } else if (enctype == REDIS_RDB_ENC_INT32) {
-        uint32_t v;
-        if (redis_rdb_file_read(rdb,enc,4) != RMT_OK) return 0;
-        v = (uint32_t)(enc[0]|(enc[1]<<8)|(enc[2]<<16)|(enc[3]<<24));
-        val = (int32_t)v;
-    } else {
-        val = 0; /* anti-warning */
-        log_error("ERROR: Unknown RDB integer encoding type");
+    trnode = trgroup->get_backend_node(trgroup, (uint8_t *)key, (uint32_t)sdslen(key));
+    if (trnode == NULL) {
+        log_error("ERROR: Get key %s backend node is NULL", key);
+        goto error;
     }
 
-    return val;
-}
-
-static sds redis_rdb_file_load_double_str(redis_rdb *rdb) {
-    char buf[256];
-    unsigned char len;
-
-    if (redis_rdb_file_read(rdb,&len,1) != RMT_OK) return NULL;
-    switch(len) {
-    case 255: return NULL;  //need to handle later
-    case 254: return NULL;  //need to handle later
-    case 253: return sdsnew("0");
-    default:
-        if (redis_rdb_file_read(rdb,buf,len) != RMT_OK) return NULL;
-        return sdsnewlen(buf, len);
+    msg = redis_generate_msg_with_key_value(ctx, mb, data_type, 
+        key, value, expiretime_type, expiretime_str);
+    if (msg == NULL) {
+        log_error("ERROR: generate msg with key value failed");
+        goto error;
     }
-}
-
-static sds redis_rdb_file_load_lzf_str(redis_rdb *rdb) {
-    unsigned int len, clen;
-    unsigned char *c = NULL;
-    sds val = NULL;
-
-    if ((clen = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
-    if ((len = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) return NULL;
-    if ((c = rmt_alloc(clen)) == NULL) goto err;
-    if ((val = sdsnewlen(NULL,len)) == NULL) goto err;
-    if (redis_rdb_file_read(rdb,c,clen) != RMT_OK) goto err;
-    if (lzf_decompress(c,clen,val,len) == 0) goto err;
-    rmt_free(c);
-    return val;
-err:
-    rmt_free(c);
-    sdsfree(val);
-    return NULL;
-}
 
-static sds redis_rdb_file_load_str(redis_rdb *rdb)
-{
-    int isencoded;
-    uint32_t len;
-    sds str;
-
-    if((len = redis_rdb_file_load_len(rdb, &isencoded)) 
-        == REDIS_RDB_LENERR)
-    {
-        log_error("ERROR: Short read or OOM loading DB. Unrecoverable error, aborting now.");
-        return NULL;
+    if (msg->frag_seq == NULL) {
+        mbuf_count += listLength(msg->data);
+        ret = apply_send_msg(srnode, msg, trnode, 
+            (uint8_t *)key, (uint32_t)sdslen(key));
+        if (ret != RMT_OK) {
+            log_error("ERROR: prepare send msg to node[%s] failed.", 
+                trnode->addr);
+            goto error;
+        }
+        msg = NULL;
+    } else {
+        for (i = 0; i < msg->nfrag; i ++) {
+            mbuf_count += listLength(msg->frag_seq[i]->data);
+            ret = apply_send_msg(srnode, msg->frag_seq[i], trnode, 
+                (uint8_t *)key, (uint32_t)sdslen(key));
+            if (ret != RMT_OK) {
+                log_error("ERROR: prepare send msg to node[%s] failed.", 
+                    trnode->addr);
+                goto error;
+            }
+            msg->frag_seq[i] = NULL;
+        }
+        
+        msg_put(msg);
+        msg_free(msg);
+        msg = NULL;
     }
 
-    if (isencoded) {
-        switch(len) {
-        case REDIS_RDB_ENC_INT8:
-        case REDIS_RDB_ENC_INT16:
-        case REDIS_RDB_ENC_INT32:
-            return sdsfromlonglong(redis_rdb_file_load_int(rdb, (int)len));
-            break;
-        case REDIS_RDB_ENC_LZF:
-            return redis_rdb_file_load_lzf_str(rdb);
-            break;
-        default:
-            log_error("ERROR: Unknown RDB encoding type %"PRIu32"", len);
-            return NULL;
-            break;
+    if (expiretime_type != RMT_TIME_NONE) {
+        msg = redis_generate_msg_with_key_expire(ctx, mb, key, 
+            expiretime_type, expiretime_str);
+        if (msg == NULL) {
+            log_error("ERROR: generate msg with key value failed");
+            goto error;
         }
-    }
 
-    str = sdsnewlen(NULL, len);
-    if(str == NULL)
-    {
-        log_error("ERROR: Out of memory");
-        return NULL;
+        mbuf_count += listLength(msg->data);
+        ret = apply_send_msg(srnode, msg, trnode, 
+            (uint8_t *)key, (uint32_t)sdslen(key));
+        if (ret != RMT_OK) {
+            log_error("ERROR: prepare send msg to node[%s] failed.", 
+                trnode->addr);
+            goto error;
+        }
+
+        msg = NULL;
     }
 
-    if(redis_rdb_file_read(rdb, str, len) != RMT_OK){
-        log_error("ERROR: Short read or OOM loading DB. Unrecoverable error, aborting now.");
-        return NULL;
+    return mbuf_count;
+        
+error:
+
+    if (expiretime_str != NULL) {
+        sdsfree(expiretime_str);
+        expiretime_str = NULL;
     }
 
-    return str;
+    if (msg != NULL) {
+        if (msg->frag_seq!= NULL) {
+            for (i = 0; i < msg->nfrag; i ++) {
+                if (msg->frag_seq[i] != NULL) {
+                    msg_put(msg->frag_seq[i]);
+                    msg_free(msg->frag_seq[i]);
+                    msg->frag_seq[i] = NULL;
+                }
+            }
+        }
+        msg_put(msg);
+        msg_free(msg);
+    }
+    
+    return -1;
 }
 
-static struct array *redis_rdb_file_load_value(redis_rdb *rdb, int rdbtype)
+int redis_parse_rdb_file(redis_node *srnode, int mbuf_count_one_time)
 {
-    struct array *value;
-    sds *str;
-    sds elem1, elem2, elems;
-    size_t len;
+    int ret;
     uint32_t i;
+    rmtContext *ctx = srnode->ctx;
+    redis_rdb *rdb = srnode->rdb;
+    redis_repl *rr = srnode->rr;
+    thread_data *wdata = srnode->write_data;
+    redis_group *srgroup = srnode->owner;
+    redis_group *trgroup = wdata->trgroup;
+    char buf[20];
+    size_t len;
+    uint32_t dbid;
+    unsigned char type;
+    int32_t t32;
+    int64_t t64;
+    long long expiretime = -1, now, key_start;
+    int expiretime_type;
+    sds key;
+    struct array *value;
+    int data_type;
+    int mbuf_count, mbuf_count_max;
 
-    str = NULL;
+    ASSERT(rdb->type == REDIS_RDB_TYPE_FILE);
+
+    key = NULL;
     value = NULL;
-    elems = NULL;
+    mbuf_count = 0;
+    mbuf_count_max = mbuf_count_one_time;
 
-    log_debug(LOG_DEBUG, "rdbtype: %d", rdbtype);
+    enum {
+        RDB_FILE_PARSE_START,
+        RDB_FILE_PARSE_AGAIN,
+        RDB_FILE_PARSE_END,
+        SW_SENTINEL
+    } state;
 
-    if (rdbtype == REDIS_RDB_TYPE_STRING) {
-        value = redis_value_create(1);
-        if(value == NULL)
-        {
-            log_error("ERROR: Out of memory");
-            goto error;
+    state = rdb->state;
+
+    if (state == RDB_FILE_PARSE_START) {
+        /* Follow the rdb file while it is still being received. */
+        if (!__atomic_load_n(&rdb->received, __ATOMIC_ACQUIRE)) {
+            rdb->following = 1;
+            __sync_synchronize();
+            ret = redis_rdb_file_transfer(rdb);
+            if (ret == RMT_ERROR || 
+                (ret == RMT_AGAIN && rr->repl_transfer_read == 0)) {
+                rdb->following = 0;
+                return RMT_EAGAIN;
+            }
         }
 
-        str = array_push(value);
-        if((*str = redis_rdb_file_load_str(rdb)) == NULL){
+        if ((rdb->fp = fopen(rdb->fname,"r")) == NULL){
+            log_error("ERROR: Open rdb file %s failed: %s", 
+                rdb->fname, strerror(errno));
             goto error;
         }
 
-    }else if (rdbtype == REDIS_RDB_TYPE_LIST || 
-        rdbtype == REDIS_RDB_TYPE_SET) {
-        if ((len = redis_rdb_file_load_len(rdb,NULL)) 
-            == REDIS_RDB_LENERR) goto error;
+        /* the magic string and the version */
+        if (rdb->following && redis_rdb_file_follow_len(rdb, 9) != RMT_OK) {
+            fclose(rdb->fp);
+            rdb->fp = NULL;
+            rdb->following = 0;
+            return RMT_EAGAIN;
+        }
 
-        value = redis_value_create((uint32_t)len);
-        if(value == NULL)
-        {
-            log_error("ERROR: Out of memory");
-            goto error;
+        rdb->cksum = 0;
+        rdb->parsed_bytes = 0;
+        rdb->parsed_keys = 0;
+        rdb->short_read = 0;
+        if (rdb->profile != NULL) {
+            keyprofile_reset(rdb->profile);
+        }
+        redis_repl_ack_rdb(srnode, 0);
+
+        if (redis_rdb_file_read(rdb, buf, 9) != RMT_OK) {
+            log_rdb_error(rdb, "ERROR: redis rdb file %s read first 9 char error", 
+                rdb->fname);
+            goto eoferr;
         }
         
-        while(len--) {
-            str = array_push(value);
-            if ((*str = redis_rdb_file_load_str(rdb)) == NULL) goto error;
+        len = rmt_strlen(REDIS_RDB_MAGIC_STR);
+        if (memcmp(buf, REDIS_RDB_MAGIC_STR, len) != 0) {
+            log_error("ERROR: Redis rdb file %s magic string is error: %.*s",
+                rdb->fname, len, buf);
+            goto error;
         }
-    }else if (rdbtype == REDIS_RDB_TYPE_ZSET) {
-        if ((len = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) goto error;
 
-        value = redis_value_create((uint32_t)(2*len));
-        if (value == NULL) {
-            log_error("ERROR: Out of memory");
+        rdb->rdbver = rmt_atoi(buf+len, 4);
+        if (rdb->rdbver < 1 || rdb->rdbver > REDIS_RDB_VERSION) {
+            log_error("ERROR: Can't handle RDB format version %d",
+                rdb->fname, rdb->rdbver);
             goto error;
         }
+
+        rdb->state = RDB_FILE_PARSE_AGAIN;
+    }
+
+    while(1) {
+        if (rdb->following) {
+            ret = redis_rdb_file_follow(rdb);
+            if (ret == RMT_EAGAIN) {
+                goto wait;
+            } else if (ret != RMT_OK) {
+                goto abort;
+            }
+        }
+
+        expiretime_type = RMT_TIME_NONE;
+        data_type = -1;
         
-        while(len--) {
-            if ((elem1 = redis_rdb_file_load_str(rdb)) == NULL) goto error;
-            if ((elem2 = redis_rdb_file_load_double_str(rdb)) == NULL) {
-                sdsfree(elem1);
-                goto error;
+        if (redis_rdb_file_read(rdb, &type, 1) != RMT_OK) {
+            log_rdb_error(rdb, "ERROR: redis rdb file %s read type error", 
+                rdb->fname);
+            goto eoferr;
+        }
+
+        if (type == REDIS_RDB_OPCODE_EXPIRETIME) {
+            if (redis_rdb_file_read(rdb, (&t32), 4) != RMT_OK) {
+                log_rdb_error(rdb, "ERROR: redis rdb file %s read 4 expiretime error", 
+                    rdb->fname);
+                goto eoferr;
             }
 
-            str = array_push(value);
-            *str = elem2;
-            ASSERT(sdsIsNum(*str) == 1);
-            str = array_push(value);
-            *str = elem1;
+            expiretime = (time_t)t32;
+            
+            if (redis_rdb_file_read(rdb, (unsigned char*)(&type), 1) != RMT_OK) {
+                log_rdb_error(rdb, "ERROR: redis rdb file %s read type error", 
+                    rdb->fname);
+                goto eoferr;
+            }
+
+            expiretime_type = RMT_TIME_SECOND;
+        } else if (type == REDIS_RDB_OPCODE_EXPIRETIME_MS) {
+            if (redis_rdb_file_read(rdb, (&t64), 8) != RMT_OK) {
+                log_rdb_error(rdb, "ERROR: redis rdb file %s read 8 expiretime error", 
+                    rdb->fname);
+                goto eoferr;
+            }
+
+            expiretime = (long long)t64;
+            
+            if (redis_rdb_file_read(rdb, (unsigned char*)(&type), 1) != RMT_OK) {
+                log_rdb_error(rdb, "ERROR: redis rdb file %s read type error", 
+                    rdb->fname);
+                goto eoferr;
+            }
+
+            expiretime_type = RMT_TIME_MILLISECOND;
+        } else if (type == REDIS_RDB_OPCODE_EOF) {
+            break;
+        } else if (type == REDIS_RDB_OPCODE_SELECTDB) {
+            if ((dbid = redis_rdb_file_load_len(rdb, NULL)) 
+                == REDIS_RDB_LENERR) {
+                log_rdb_error(rdb, "ERROR: redis rdb file %s read db num error", 
+                    rdb->fname);
+                goto eoferr;
+            }
+
+            log_debug(LOG_INFO, "dbid: %d", dbid);
+            continue;
+        } else if (type == REDIS_RDB_OPCODE_RESIZEDB) {
+            uint32_t db_size, expires_size;
+            if ((db_size = redis_rdb_file_load_len(rdb, NULL)) 
+                == REDIS_RDB_LENERR) {
+                log_rdb_error(rdb, "ERROR: redis rdb file %s read db num error", 
+                    rdb->fname);
+                goto eoferr;
+            }
+            if ((expires_size = redis_rdb_file_load_len(rdb, NULL)) 
+                == REDIS_RDB_LENERR) {
+                log_rdb_error(rdb, "ERROR: redis rdb file %s read db num error", 
+                    rdb->fname);
+                goto eoferr;
+            }
+            continue;
+        } else if (type == REDIS_RDB_OPCODE_AUX) {
+            sds auxkey, auxval;
+            if ((auxkey = redis_rdb_file_load_str(rdb)) == NULL) goto eoferr;
+            if ((auxval = redis_rdb_file_load_str(rdb)) == NULL) {
+                sdsfree(auxkey);
+                goto eoferr;
+            }
+            sdsfree(auxkey);
+            sdsfree(auxval);
+            continue;
         }
-    }else if (rdbtype == REDIS_RDB_TYPE_HASH) {
-        if ((len = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) goto error;
 
-        value = redis_value_create((uint32_t)(2*len));
-        if(value == NULL)
-        {
-            log_error("ERROR: Out of memory");
-            goto error;
+        key_start = rdb->parsed_bytes;
+        if ((key = redis_rdb_file_load_str(rdb)) == NULL) {
+            log_rdb_error(rdb, "ERROR: redis rdb file %s read key error", 
+                rdb->fname);
+            goto eoferr;
         }
 
-        while(len--) {
-            str = array_push(value);
-            if ((*str = redis_rdb_file_load_str(rdb)) == NULL) goto error;
-            str = array_push(value);
-            if ((*str = redis_rdb_file_load_str(rdb)) == NULL) goto error;
+        if ((value = redis_rdb_file_load_value(rdb, type)) == NULL) {
+            log_rdb_error(rdb, "ERROR: redis rdb file %s read value error", 
+                rdb->fname);
+            goto eoferr;
         }
-    } else if (rdbtype == REDIS_RDB_TYPE_LIST_QUICKLIST) {
-        if ((len = redis_rdb_file_load_len(rdb,NULL)) == REDIS_RDB_LENERR) goto error;
 
-        value = redis_value_create((uint32_t)(len));
-        if (value == NULL) {
-            log_error("ERROR: Out of memory");
-            goto error;
+        /* some short reads of the followed rdb file are not seen by the loaders */
+        if (rdb->short_read) {
+            goto eoferr;
         }
 
-        while (len--) {
-            unsigned char *zl;
-            unsigned int count;
-            unsigned char *eptr, *sptr;
-            unsigned char *vstr;
-            unsigned int vlen;
-            long long vlong;
+        rdb->parsed_keys ++;
 
-            zl = redis_rdb_file_load_str(rdb);
-            
-            count = ziplistLen(zl);
-            eptr = ziplistIndex(zl,0);
-            while (eptr != NULL) {
-                ziplistGet(eptr,&vstr,&vlen,&vlong);
+        data_type = redis_object_type_get_by_rdbtype(type);
+        if (data_type < 0) {
+            log_error("ERROR: get redis object type by rdbtype failed");
+            goto error;
+        }
 
-                str = array_push(value);
+        log_debug(LOG_DEBUG, "key: %s, value array length: %u", 
+            key, array_n(value));
 
-                if (vstr == NULL) {
-                    *str = sdsfromlonglong(vlong);
-                } else {
-                    *str = sdsnewlen(vstr, vlen);
-                }
-                
-                eptr = ziplistNext(zl,eptr);
-            }
+        if (rdb->profile != NULL) {
+            /* the zset and hash values are member and score, field and value pairs */
+            keyprofile_add(rdb->profile, key, data_type, 
+                (uint64_t)(rdb->parsed_bytes - key_start), 
+                data_type == REDIS_ZSET || data_type == REDIS_HASH ? 
+                array_n(value)/2 : array_n(value),
+                expiretime_type == RMT_TIME_NONE ? -1 : 
+                (expiretime_type == RMT_TIME_SECOND ? expiretime*1000 : expiretime));
         }
-    } else if (rdbtype == REDIS_RDB_TYPE_HASH_ZIPMAP  ||
-               rdbtype == REDIS_RDB_TYPE_LIST_ZIPLIST ||
-               rdbtype == REDIS_RDB_TYPE_SET_INTSET   ||
-               rdbtype == REDIS_RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == REDIS_RDB_TYPE_HASH_ZIPLIST) {
-        if ((elems = redis_rdb_file_load_str(rdb)) == NULL) goto error;
 
-        switch(rdbtype) {
-        case REDIS_RDB_TYPE_HASH_ZIPMAP:
-        {
-            unsigned char * zm = (unsigned char *)elems;
-            unsigned char *zi = zipmapRewind(zm);
-            unsigned char *fstr, *vstr;
-            unsigned int flen, vlen;
-            
-            len = zipmapLen(zm);
-            
-            value = redis_value_create((uint32_t)(2*len));
-            if (value == NULL) {
-                log_error("ERROR: Out of memory");
+        if (rdb->handler != NULL && 
+            (srgroup->kind == GROUP_TYPE_SINGLE || srgroup->get_backend_node == NULL || 
+            srgroup->get_backend_node(srgroup, key, sdslen(key)) == srnode) && 
+            (ctx->filter == NULL || 
+            stringmatchlen(ctx->filter, sdslen(ctx->filter), key, sdslen(key), 0))) {
+            ret = rdb->handler(srnode, key, data_type, value, 
+                expiretime_type, expiretime, trgroup);
+            if (ret < 0) {
                 goto error;
             }
 
-            while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
-                str = array_push(value);
-                *str = sdsnewlen(fstr, flen);
+            mbuf_count += ret;
+        }
+        
+        sdsfree(key);
+        key = NULL;
+        redis_value_destroy(value);
+        value = NULL;
 
-                str = array_push(value);
-                *str = sdsnewlen(vstr, vlen);
-            }
-            
-            break;
+        if (mbuf_count_max > 0 && mbuf_count >= mbuf_count_max) {
+            goto again;
         }
-        case REDIS_RDB_TYPE_LIST_ZIPLIST:
-        case REDIS_RDB_TYPE_HASH_ZIPLIST:
-        {
-            unsigned char *zl = (unsigned char *)elems;
-            unsigned char *eptr, *sptr;
-            unsigned char *vstr;
-            unsigned int vlen;
-            long long vlong;
-            
-            len = ziplistLen(zl);
-            if (rdbtype == REDIS_RDB_TYPE_HASH_ZIPLIST && len%2 != 0) {
-                log_error("ERROR: hash value length from rdb must be an even number");
-                goto error;
-            }
+    }
 
-            value = redis_value_create((uint32_t)len);
-            if (value == NULL) {
-                log_error("ERROR: Out of memory");
-                goto error;
-            }
+    if (rdb->rdbver >= 5 && rdb->update_cksum) {
+        uint64_t cksum, expected = rdb->cksum;
+        if (redis_rdb_file_read(rdb,&cksum,8) != RMT_OK) goto eoferr;
 
-            eptr = ziplistIndex(zl,0);
-            
-            while (eptr != NULL) {
-                ziplistGet(eptr,&vstr,&vlen,&vlong);
+        memrev64ifbe(&cksum);
+        if (cksum == 0) {
+            log_warn("RDB file was saved with checksum disabled: no check performed.");
+        } else if (cksum != expected) {
+            log_warn("Wrong RDB checksum. Aborting now.");
+            exit(1);
+        }
+    }
 
-                str = array_push(value);
+    /* The rdb file is deleted after parsed, wait the end of the transfer
+     * and parse the end of the rdb file again then. */
+    if (rdb->following && redis_rdb_file_transfer(rdb) != RMT_OK) {
+        goto rewind;
+    }
 
-                if (vstr == NULL) {
-                    *str = sdsfromlonglong(vlong);
-                } else {
-                    *str = sdsnewlen(vstr, vlen);
-                }
-                
-                eptr = ziplistNext(zl,eptr);
-            }
-            
-            break;
-        }
-        case REDIS_RDB_TYPE_ZSET_ZIPLIST:
-        {
-            unsigned char *zl = (unsigned char *)elems;
-            unsigned char *eptr, *sptr;
-            unsigned char *vstr;
-            unsigned int vlen;
-            long long vlong;
-            uint32_t k = 0;
-            sds *score, *data;
-            sds field;
-            
-            len = ziplistLen(zl);
-            if (len%2 != 0) {
-                log_error("ERROR: zset value length from rdb must be an even number");
-                goto error;
-            }
+    rdb->state = RDB_FILE_PARSE_END;
+    redis_repl_ack_rdb(srnode, 1);
 
-            value = redis_value_create((uint32_t)len);
-            if (value == NULL) {
-                log_error("ERROR: Out of memory");
-                goto error;
-            }
+    if (rdb->fp != NULL) {
+        fclose(rdb->fp);
+        rdb->fp = NULL;
+    }
 
-            eptr = ziplistIndex(zl,0);
-            
-            while (eptr != NULL) {
-                ziplistGet(eptr,&vstr,&vlen,&vlong);
+    now = rmt_msec_now();
+    log_notice("Rdb file for node[%s] parsed finished, use: %lld s.",
+        srnode->addr, (now - srnode->timestamp)/1000);
+    srnode->timestamp = now;
 
-                if (vstr == NULL) {
-                    field = sdsfromlonglong(vlong);
-                } else {
-                    field = sdsnewlen(vstr, vlen);
-                }
+    if (rdb->profile != NULL && 
+        keyprofile_report(rdb->profile, srnode->addr, rdb->rdbver) == RMT_OK) {
+        log_notice("Key profile of the rdb for node[%s] is written to %s", 
+            srnode->addr, rdb->profile->fname);
+    }
 
-                if (k%2 == 0) {
-                    score = array_push(value);
-                    data = array_push(value);
+    redis_delete_rdb_file(rdb, 0);
 
-                    *data = field;
-                } else {
-                    *score = field;
-                }
-                
-                eptr = ziplistNext(zl,eptr);
-                k ++;
-            }
-            break;
-        }
-        case REDIS_RDB_TYPE_SET_INTSET:
-        {
-            intset *is = (intset *)elems;
-            int64_t integer;
-            
-            len = intsetLen(is);
+    thread_stat_incr(wdata, rdb_parsed_count, 1);
 
-            value = redis_value_create((uint32_t)len);
-            if (value == NULL) {
-                log_error("ERROR: Out of memory");
-                goto error;
-            }
+    return RMT_OK;
 
-            for (i = 0; i < len; i ++) {
-                if (intsetGet(is, i, &integer) == 0) {
-                    log_error("ERROR: intset get failed");
-                    goto error;
-                }
+again:
 
-                elem1 = sdsfromlonglong(integer);
+    return RMT_AGAIN;
 
-                str = array_push(value);
-                *str = elem1;
-            }
-            
-            break;
-        }
-        default:
-            NOT_REACHED();
-            break;
-        }
+wait:
+
+    return RMT_EAGAIN;
+
+eoferr: /* unexpected end of file is handled here with a fatal exit */
+
+    if (rdb->following) {
+        goto rewind;
+    }
+    
+    log_error("ERROR: Short read or OOM loading DB. Unrecoverable error, aborting now.");
+
+error:
+
+    if (rdb->fp != NULL) {
+        fclose(rdb->fp);
+        rdb->fp = NULL;
+    }
+
+    if (key != NULL) {
+        sdsfree(key);
+    }
+
+    if (value != NULL) {
+        redis_value_destroy(value);
+    }
+
+    if (rdb->following) {
+        /* the read thread still writes the rdb file */
+        rdb->following = 0;
+    } else {
+        redis_delete_rdb_file(rdb, 0);
+    }
+    
+    return RMT_ERROR;
+
+abort: /* the transfer was aborted, parse the rdb file again after the next sync */
+
+    log_warn("Rdb transfer for node[%s] aborted while parsing, "
+        "parse it again after the next sync", srnode->addr);
+
+    if (rdb->fp != NULL) {
+        fclose(rdb->fp);
+        rdb->fp = NULL;
+    }
+
+    if (key != NULL) {
+        sdsfree(key);
+    }
 
-        sdsfree(elems);
-    }else {
-        
-        log_error("ERROR: Unknown object type");
-        goto error;
+    if (value != NULL) {
+        redis_value_destroy(value);
     }
 
-    return value;
+    rdb->state = RDB_FILE_PARSE_START;
+    rdb->following = 0;
 
-error:
+    return RMT_EAGAIN;
 
-    if(value != NULL)
-    {
+rewind: /* the followed rdb file ends in the middle of an object */
+
+    if (key != NULL) {
+        sdsfree(key);
+        key = NULL;
+    }
+
+    if (value != NULL) {
         redis_value_destroy(value);
+        value = NULL;
     }
 
-    if(elems != NULL)
-    {
-        sdsfree(elems);
+    ret = redis_rdb_file_rewind(rdb);
+    if (ret == RMT_ERROR) {
+        goto abort;
+    } else if (ret == RMT_EAGAIN) {
+        goto wait;
     }
 
-    return NULL;
+    goto again;
 }
 
-static int redis_object_type_get_by_rdbtype(int dbtype)
+int redis_parse_rdb_time(aeEventLoop *el, long long id, void *privdata)
 {
-    switch(dbtype)
-    {
-    case REDIS_RDB_TYPE_STRING:
-
-        return REDIS_STRING;
-        break;
-    case REDIS_RDB_TYPE_LIST:
-    case REDIS_RDB_TYPE_LIST_ZIPLIST:
-    case REDIS_RDB_TYPE_LIST_QUICKLIST:
+    int ret;
+    redis_node *srnode = privdata;
+    thread_data *wdata = srnode->write_data;
+    redis_rdb *rdb = srnode->rdb;
 
-        return REDIS_LIST;
-        break;
-    case REDIS_RDB_TYPE_SET:
-    case REDIS_RDB_TYPE_SET_INTSET:
+    ret = redis_parse_rdb_file(srnode, 10);
+    if(ret == RMT_AGAIN || ret == RMT_EAGAIN){
+        return 1;
+    }else if(ret == RMT_OK){
+        ret = aeCreateFileEvent(wdata->loop, srnode->sockpairfds[1], 
+            AE_READABLE, parse_request, srnode);
+        if(ret != AE_OK){
+            log_error("ERROR: Create ae read event for node %s parse_request failed", 
+                srnode->addr);
+            return AE_NOMORE;
+        }
 
-        return REDIS_SET;
-        break;
-    case REDIS_RDB_TYPE_ZSET:
-    case REDIS_RDB_TYPE_ZSET_ZIPLIST:
-        
-        return REDIS_ZSET;
-        break;
-    case REDIS_RDB_TYPE_HASH:
-    case REDIS_RDB_TYPE_HASH_ZIPMAP:
-    case REDIS_RDB_TYPE_HASH_ZIPLIST:
-        
-        return REDIS_HASH;
-        break;
-    default:
-        
-        return -1;
-        break;
+        notice_write_thread(srnode);
+    }else{
+        log_error("ERROR: Rdb file for node[%s] parsed failed", srnode->addr);
     }
 
-    return -1;
+    return AE_NOMORE;
 }
 
-void redis_delete_rdb_file(redis_rdb *rdb, int always)
+/* The read thread wrote more of the followed rdb file, go on parsing it. */
+static void redis_parse_rdb_follow(aeEventLoop *el, int fd, void *privdata, int mask)
 {
-    if (rdb == NULL) {
-        return;
-    }
-
-    if (always) {
-        goto del;
-    }
-
-    if (rdb->deleted) {
-        goto del;
-    }
+    int ret;
+    redis_node *srnode = privdata;
+    char buf[64];
 
-    return;
+    RMT_NOTUSED(mask);
 
-del:
-    if (rdb->fd > 0) {
-        close(rdb->fd);
-        rdb->fd = -1;
-    }
+    ASSERT(fd == srnode->sockpairfds[1]);
 
-    if (rdb->fp != NULL) {
-        fclose(rdb->fp);
-        rdb->fp = NULL;
-    }
+    while (read(fd, buf, sizeof(buf)) > 0);
+    srnode->rdb->waiting = 0;
 
-    if (rdb->fname != NULL) {
-        unlink(rdb->fname);
-        sdsfree(rdb->fname);
-        rdb->fname = NULL;
+    aeDeleteFileEvent(el, fd, AE_READABLE);
+    ret = aeCreateFileEvent(el, srnode->sk_event, 
+        AE_WRITABLE, redis_parse_rdb, srnode);
+    if (ret != AE_OK) {
+        log_error("ERROR: Create ae write event for node %s parse rdb file failed", 
+            srnode->addr);
     }
 }
 
-/*
-  * return: 
-  * -1 error
-  * 0 no msg sent
-  * >0 mbuf count sent 
-  */
-int redis_key_value_send(redis_node *srnode, sds key, 
-    int data_type, struct array *value, 
-    int expiretime_type, long long expiretime, 
-    void *data)
+void redis_parse_rdb(aeEventLoop *el, int fd, void *privdata, int mask)
 {
     int ret;
-    rmtContext *ctx = srnode->ctx;
-    redis_group *srgroup = srnode->owner;
-    mbuf_base *mb = srgroup->mb;
-    redis_group *trgroup = data;
-    long long now = rmt_msec_now();
-    redis_node *trnode;
-    sds expiretime_str = NULL;
-    struct msg *msg = NULL;
-    uint32_t i;
-    int mbuf_count = 0;
+    redis_node *srnode = privdata;
+    thread_data *wdata = srnode->write_data;
+    redis_rdb *rdb = srnode->rdb;
 
-    if (expiretime_type == RMT_TIME_SECOND) {
-        if(expiretime * 1000 < now){
-            return 0;
+    RMT_NOTUSED(el);
+    RMT_NOTUSED(fd);
+    RMT_NOTUSED(privdata);
+    RMT_NOTUSED(mask);
+
+    ASSERT(fd == srnode->sk_event);
+    ASSERT(el == wdata->loop);
+
+    if (wdata->tunables.paused || source_node_held(srnode)) {
+        /* redis_parse_rdb_resume parses it again */
+        aeDeleteFileEvent(wdata->loop, srnode->sk_event, AE_WRITABLE);
+        rdb->paused = 1;
+        return;
+    }
+
+    ret = redis_parse_rdb_file(srnode, wdata->tunables.step);
+    if(ret == RMT_AGAIN){
+        return;
+    } else if(ret == RMT_EAGAIN) {
+        /* Wait the read thread to write more of the rdb file. */
+        aeDeleteFileEvent(wdata->loop, 
+            srnode->sk_event, AE_WRITABLE);
+        ret = aeCreateFileEvent(wdata->loop, srnode->sockpairfds[1], 
+            AE_READABLE, redis_parse_rdb_follow, srnode);
+        if(ret != AE_OK){
+            log_error("ERROR: Create ae read event for node %s follow rdb file failed", 
+                srnode->addr);
         }
+        return;
+    } else if(ret == RMT_OK) {
+        redis_group *srgroup = srnode->owner;
+        
+        aeDeleteFileEvent(wdata->loop, 
+            srnode->sk_event, AE_WRITABLE);
 
-        expiretime_str = sdsfromlonglong(expiretime);
-    } else if(expiretime_type == RMT_TIME_MILLISECOND) {
-        if (expiretime < now) {
-            return 0;
+        if (srgroup->kind == GROUP_TYPE_RDBFILE) {
+            return;
         }
 
-        expiretime_str = sdsfromlonglong(expiretime);
+        ret = aeCreateFileEvent(wdata->loop, srnode->sockpairfds[1], 
+            AE_READABLE, parse_request, srnode);
+        if(ret != AE_OK){
+            log_error("ERROR: Create ae read event for node %s parse_request failed", 
+                srnode->addr);
+            return;
+        }
+
+        notice_write_thread(srnode);
+
+        //notice the read thread to begin replication for the next redis_node
+        if (srnode->next != NULL) {
+            rmt_write(srnode->next->sockpairfds[1], " ", 1);
+        } else if (thread_stat(wdata, rdb_parsed_count) == wdata->nodes_count) {
+            log_notice("All nodes' rdb file parsed finished for this write thread(%d).",
+                wdata->id);
+        }
+    }else{
+        aeDeleteFileEvent(wdata->loop, 
+            srnode->sk_event, AE_WRITABLE);
+        log_error("ERROR: Rdb file for node[%s] parsed failed", srnode->addr);
     }
 
-    trnode = trgroup->get_backend_node(trgroup, (uint8_t *)key, (uint32_t)sdslen(key));
-    if (trnode == NULL) {
-        log_error("ERROR: Get key %s backend node is NULL", key);
-        goto error;
+    close(srnode->sk_event);
+    srnode->sk_event = -1;
+}
+
+/* Parse the rdb stopped by MIGRATE PAUSE or source_node_held() again. */
+void redis_parse_rdb_resume(redis_node *srnode)
+{
+    thread_data *wdata = srnode->write_data;
+    redis_rdb *rdb = srnode->rdb;
+
+    if (rdb == NULL || !rdb->paused) {
+        return;
     }
 
-    msg = redis_generate_msg_with_key_value(ctx, mb, data_type, 
-        key, value, expiretime_type, expiretime_str);
-    if (msg == NULL) {
-        log_error("ERROR: generate msg with key value failed");
-        goto error;
+    rdb->paused = 0;
+    if (aeCreateFileEvent(wdata->loop, srnode->sk_event, 
+        AE_WRITABLE, redis_parse_rdb, srnode) != AE_OK) {
+        log_error("ERROR: Create ae write event for node %s parse rdb file failed", 
+            srnode->addr);
     }
+}
+/* ======================== Redis RDB END ========================== */
 
-    if (msg->frag_seq == NULL) {
-        mbuf_count += listLength(msg->data);
-        ret = prepare_send_msg(srnode, msg, trnode);
-        if (ret != RMT_OK) {
-            log_error("ERROR: prepare send msg to node[%s] failed.", 
-                trnode->addr);
-            goto error;
-        }
-        msg = NULL;
-    } else {
-        for (i = 0; i < msg->nfrag; i ++) {
-            mbuf_count += listLength(msg->frag_seq[i]->data);
-            ret = prepare_send_msg(srnode, msg->frag_seq[i], trnode);
-            if (ret != RMT_OK) {
-                log_error("ERROR: prepare send msg to node[%s] failed.", 
-                    trnode->addr);
-                goto error;
+/* ======================== Redis AOF ========================== */
+
+int redis_load_aof_file(redis_node *srnode, char *aof_file)
+{
+    int ret;
+    rmtContext *ctx = srnode->ctx;
+    redis_group *srgroup = srnode->owner;
+    thread_data *rdata = srnode->read_data;
+    int fd = -1;
+    size_t len;
+    ssize_t nread;
+
+    fd = open(aof_file, O_RDONLY);
+    if (fd < 0) {
+        log_error("ERROR: open %s failed: %s", 
+            aof_file, strerror(errno));
+        return RMT_ERROR;
+    }    
+    
+    while (1) {
+        if (srnode->mbuf_in == NULL) {
+            srnode->mbuf_in = mbuf_get(srgroup->mb);
+            if (srnode->mbuf_in == NULL) {
+                log_error("ERROR: Mbuf get failed: Out of memory");
+                return RMT_ERROR;
+            }
+        } else if(mbuf_size(srnode->mbuf_in) == 0) {
+            mttlist_push(srnode->cmd_data, srnode->mbuf_in);
+            srnode->mbuf_in = NULL;
+            notice_write_thread(srnode);
+
+            srnode->mbuf_in = mbuf_get(srgroup->mb);
+            if (srnode->mbuf_in == NULL) {
+                log_error("ERROR: Mbuf get failed: Out of memory");
+                return RMT_ERROR;
             }
-            msg->frag_seq[i] = NULL;
         }
         
-        msg_put(msg);
-        msg_free(msg);
-        msg = NULL;
-    }
+        len = mbuf_size(srnode->mbuf_in);
+        nread = read(fd, srnode->mbuf_in->last, len);
+        if (nread > 0) {
+            srnode->mbuf_in->last += nread;
+        }
+        
+        if (nread == 0 || nread < len) {
+            thread_stat_incr(rdata, aof_loaded_count, 1);
+            
+            if (mbuf_length(srnode->mbuf_in) > 0) {
+                mttlist_push(srnode->cmd_data, srnode->mbuf_in);
+                srnode->mbuf_in = NULL;
+                notice_write_thread(srnode);
+            }
 
-    if (expiretime_type != RMT_TIME_NONE) {
-        msg = redis_generate_msg_with_key_expire(ctx, mb, key, 
-            expiretime_type, expiretime_str);
-        if (msg == NULL) {
-            log_error("ERROR: generate msg with key value failed");
-            goto error;
+            log_notice("Aof file %s load finished", aof_file);
+            break;
         }
 
-        ret = prepare_send_msg(srnode, msg, trnode);
-        if (ret != RMT_OK) {
-            log_error("ERROR: prepare send msg to node[%s] failed.", 
-                trnode->addr);
-            goto error;
+        if (nread < 0) {
+            log_error("ERROR: read data from %s failed: %s", 
+                aof_file, strerror(errno));
+            close(fd);
+            return RMT_ERROR;
         }
 
-        mbuf_count += listLength(msg->data);
-        msg = NULL;
+        usleep(100/ctx->step);
     }
 
-    return mbuf_count;
-        
-error:
+    close(fd);
+    return RMT_OK;
+}
 
-    if (expiretime_str != NULL) {
-        sdsfree(expiretime_str);
-        expiretime_str = NULL;
-    }
+/* ======================== Redis AOF END ========================== */
 
-    if (msg != NULL) {
-        if (msg->frag_seq!= NULL) {
-            for (i = 0; i < msg->nfrag; i ++) {
-                if (msg->frag_seq[i] != NULL) {
-                    msg_put(msg->frag_seq[i]);
-                    msg_free(msg->frag_seq[i]);
-                    msg->frag_seq[i] = NULL;
-                }
-            }
-        }
-        msg_put(msg);
-        msg_free(msg);
-    }
-    
-    return -1;
-}
+/* ========================== Redis Cluster ============================ */
 
-int redis_parse_rdb_file(redis_node *srnode, int mbuf_count_one_time)
-{
-    int ret;
-    uint32_t i;
-    rmtContext *ctx = srnode->ctx;
-    redis_rdb *rdb = srnode->rdb;
-    thread_data *wdata = srnode->write_data;
-    redis_group *srgroup = srnode->owner;
-    redis_group *trgroup = wdata->trgroup;
-    char buf[20];
-    size_t len;
-    uint32_t dbid;
-    unsigned char type;
-    int32_t t32;
-    int64_t t64;
-    long long expiretime = -1, now;
-    int expiretime_type;
-    sds key;
-    struct array *value;
-    int data_type;
-    int mbuf_count, mbuf_count_max;
+/* We have 16384 hash slots. The hash slot of a given key is obtained
+ * as the least significant 14 bits of the crc16 of the key.
+ *
+ * However if the key contains the {...} pattern, only the part between
+ * { and } is hashed. This may be useful in the future to force certain
+ * keys to be in the same node (assuming no resharding is in progress). */
+static unsigned int clusterKeyHashSlot(char *key, int keylen) {
+    int s, e; /* start-end indexes of { and } */
 
-    ASSERT(rdb->type == REDIS_RDB_TYPE_FILE);
+    for (s = 0; s < keylen; s++)
+        if (key[s] == '{') break;
 
-    key = NULL;
-    value = NULL;
-    mbuf_count = 0;
-    mbuf_count_max = mbuf_count_one_time;
+    /* No '{' ? Hash the whole key. This is the base case. */
+    if (s == keylen) return hash_crc16(key,(size_t)keylen) & 0x3FFF;
 
-    enum {
-        RDB_FILE_PARSE_START,
-        RDB_FILE_PARSE_AGAIN,
-        RDB_FILE_PARSE_END,
-        SW_SENTINEL
-    } state;
+    /* '{' found? Check if we have the corresponding '}'. */
+    for (e = s+1; e < keylen; e++)
+        if (key[e] == '}') break;
 
-    state = rdb->state;
+    /* No '}' or nothing betweeen {} ? Hash the whole key. */
+    if (e == keylen || e == s+1) return hash_crc16(key,(size_t)keylen) & 0x3FFF;
 
-    if (state == RDB_FILE_PARSE_START) {
-        if ((rdb->fp = fopen(rdb->fname,"r")) == NULL){
-            log_error("ERROR: Open rdb file %s failed: %s", 
-                rdb->fname, strerror(errno));
-            goto error;
-        }
+    /* If we are here there is both a { and a } on its right. Hash
+     * what is in the middle between { and }. */
+    return hash_crc16(key+s+1,(size_t)(e-s-1)) & 0x3FFF;
+}
 
-        if (redis_rdb_file_read(rdb, buf, 9) != RMT_OK) {
-            log_error("ERROR: redis rdb file %s read first 9 char error", 
-                rdb->fname);
-            goto eoferr;
+static void cluster_nodes_swap_tc(dict *nodes_f, dict *nodes_t)
+{
+    dictIterator *di;
+    dictEntry *de_f, *de_t;
+    redis_node *node_f, *node_t;
+    tcp_context *tc;
+
+    if(nodes_f == NULL || nodes_t == NULL)
+    {
+        return;
+    }
+
+    di = dictGetIterator(nodes_t);
+    while((de_t = dictNext(di)) != NULL)
+    {
+        node_t = dictGetVal(de_t);
+        if(node_t == NULL)
+        {
+            continue;
         }
         
-        len = rmt_strlen(REDIS_RDB_MAGIC_STR);
-        if (memcmp(buf, REDIS_RDB_MAGIC_STR, len) != 0) {
-            log_error("ERROR: Redis rdb file %s magic string is error: %.*s",
-                rdb->fname, len, buf);
-            goto error;
+        de_f = dictFind(nodes_f, node_t->addr);
+        if(de_f == NULL)
+        {
+            continue;
         }
 
-        rdb->rdbver = rmt_atoi(buf+len, 4);
-        if (rdb->rdbver < 1 || rdb->rdbver > REDIS_RDB_VERSION) {
-            log_error("ERROR: Can't handle RDB format version %d",
-                rdb->fname, rdb->rdbver);
-            goto error;
+        node_f = dictGetVal(de_f);
+        if(node_f->tc != NULL)
+        {
+            tc = node_f->tc;
+            node_f->tc = node_t->tc;
+            node_t->tc = tc;
         }
 
-        rdb->state = RDB_FILE_PARSE_AGAIN;
     }
 
-    while(1) {
-        expiretime_type = RMT_TIME_NONE;
-        data_type = -1;
-        
-        if (redis_rdb_file_read(rdb, &type, 1) != RMT_OK) {
-            log_error("ERROR: redis rdb file %s read type error", 
-                rdb->fname);
-            goto eoferr;
-        }
-
-        if (type == REDIS_RDB_OPCODE_EXPIRETIME) {
-            if (redis_rdb_file_read(rdb, (&t32), 4) != RMT_OK) {
-                log_error("ERROR: redis rdb file %s read 4 expiretime error", 
-                    rdb->fname);
-                goto eoferr;
-            }
-
-            expiretime = (time_t)t32;
-            
-            if (redis_rdb_file_read(rdb, (unsigned char*)(&type), 1) != RMT_OK) {
-                log_error("ERROR: redis rdb file %s read type error", 
-                    rdb->fname);
-                goto eoferr;
-            }
+    dictReleaseIterator(di);
+    
+}
 
-            expiretime_type = RMT_TIME_SECOND;
-        } else if (type == REDIS_RDB_OPCODE_EXPIRETIME_MS) {
-            if (redis_rdb_file_read(rdb, (&t64), 8) != RMT_OK) {
-                log_error("ERROR: redis rdb file %s read 8 expiretime error", 
-                    rdb->fname);
-                goto eoferr;
-            }
+static ssize_t rmt_redis_sync_read_string(int fd, char *ptr, size_t len, long long timeout) {
+    ssize_t size = 0;
+    char c;
 
-            expiretime = (long long)t64;
-            
-            if (redis_rdb_file_read(rdb, (unsigned char*)(&type), 1) != RMT_OK) {
-                log_error("ERROR: redis rdb file %s read type error", 
-                    rdb->fname);
-                goto eoferr;
-            }
+    if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
+    
+    if (c != '$') {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
 
-            expiretime_type = RMT_TIME_MILLISECOND;
-        } else if (type == REDIS_RDB_OPCODE_EOF) {
-            break;
-        } else if (type == REDIS_RDB_OPCODE_SELECTDB) {
-            if ((dbid = redis_rdb_file_load_len(rdb, NULL)) 
-                == REDIS_RDB_LENERR) {
-                log_error("ERROR: redis rdb file %s read db num error", 
-                    rdb->fname);
-                goto eoferr;
-            }
+    do {
+        if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
 
-            log_debug(LOG_INFO, "dbid: %d", dbid);
-            continue;
-        } else if (type == REDIS_RDB_OPCODE_RESIZEDB) {
-            uint32_t db_size, expires_size;
-            if ((db_size = redis_rdb_file_load_len(rdb, NULL)) 
-                == REDIS_RDB_LENERR) {
-                log_error("ERROR: redis rdb file %s read db num error", 
-                    rdb->fname);
-                goto eoferr;
-            }
-            if ((expires_size = redis_rdb_file_load_len(rdb, NULL)) 
-                == REDIS_RDB_LENERR) {
-                log_error("ERROR: redis rdb file %s read db num error", 
-                    rdb->fname);
-                goto eoferr;
-            }
-            continue;
-        } else if (type == REDIS_RDB_OPCODE_AUX) {
-            sds auxkey, auxval;
-            if ((auxkey = redis_rdb_file_load_str(rdb)) == NULL) goto eoferr;
-            if ((auxval = redis_rdb_file_load_str(rdb)) == NULL) {
-                sdsfree(auxkey);
-                goto eoferr;
-            }
-            sdsfree(auxkey);
-            sdsfree(auxval);
-            continue;
-        }
+        if (isdigit(c)) {
+            size = size * 10 + (ssize_t)(c - '0');
+        } else if(c != CR) {
+            errno = ENOPROTOOPT;
+            return -1;
+        }           
+    } while(isdigit(c));
 
-        if ((key = redis_rdb_file_load_str(rdb)) == NULL) {
-            log_error("ERROR: redis rdb file %s read key error", 
-                rdb->fname);
-            goto eoferr;
-        }
+    if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
+    if (c != LF) {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
 
-        if ((value = redis_rdb_file_load_value(rdb, type)) == NULL) {
-            log_error("ERROR: redis rdb file %s read value error", 
-                rdb->fname);
-            goto eoferr;
-        }
+    if ((size_t)size > len) {
+        errno = ENOBUFS;
+        return -1;
+    }
 
-        data_type = redis_object_type_get_by_rdbtype(type);
-        if (data_type < 0) {
-            log_error("ERROR: get redis object type by rdbtype failed");
-            goto error;
-        }
+    if (rmt_sync_read(fd,ptr,size,timeout) == -1) return -1;
 
-        log_debug(LOG_DEBUG, "key: %s, value array length: %u", 
-            key, array_n(value));
+    if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
+    if (c != CR) {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
 
-        if (rdb->handler != NULL && 
-            (srgroup->kind == GROUP_TYPE_SINGLE || srgroup->get_backend_node == NULL || 
-            srgroup->get_backend_node(srgroup, key, sdslen(key)) == srnode) && 
-            (ctx->filter == NULL || 
-            stringmatchlen(ctx->filter, sdslen(ctx->filter), key, sdslen(key), 0))) {
-            ret = rdb->handler(srnode, key, data_type, value, 
-                expiretime_type, expiretime, trgroup);
-            if (ret < 0) {
-                goto error;
-            }
+    if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
+    if (c != LF) {
+        errno = ENOPROTOOPT;
+        return -1;
+    }
 
-            mbuf_count += ret;
-        }
-        
-        sdsfree(key);
-        key = NULL;
-        redis_value_destroy(value);
-        value = NULL;
+    return size;
+}
 
-        if (mbuf_count_max > 0 && mbuf_count >= mbuf_count_max) {
-            goto again;
-        }
+
+/* Send an INFO command to the source redis and read the reply
+ * into buf as a null terminated string. */
+static int redis_node_info_read(tcp_context *tc, const char *cmd, 
+    char *buf, size_t len)
+{
+    ssize_t n;
+
+    if (rmt_sync_write(tc->sd,cmd,(ssize_t)rmt_strlen(cmd),1000) == -1) {
+        return RMT_ERROR;
     }
 
-    if (rdb->rdbver >= 5 && rdb->update_cksum) {
-        uint64_t cksum, expected = rdb->cksum;
-        if (redis_rdb_file_read(rdb,&cksum,8) != RMT_OK) goto eoferr;
+    n = rmt_redis_sync_read_string(tc->sd,buf,len-1,1000);
+    if (n == -1) {
+        return RMT_ERROR;
+    }
 
-        memrev64ifbe(&cksum);
-        if (cksum == 0) {
-            log_warn("RDB file was saved with checksum disabled: no check performed.");
-        } else if (cksum != expected) {
-            log_warn("Wrong RDB checksum. Aborting now.");
-            exit(1);
-        }
+    buf[n] = '\0';
+    return RMT_OK;
+}
+
+/* Get the used_memory and the keys count of the source redis
+ * with INFO memory and INFO keyspace. They are used by the 
+ * replication scheduler to estimate the cost of the rdb. 
+ * rnode->used_memory and rnode->keys stay -1 if failed. */
+int redis_node_info_cost(redis_node *rnode)
+{
+    int ret;
+    redis_group *rgroup = rnode->owner;
+    tcp_context *tc = NULL;
+    struct timeval timeout = {1, 0};
+    char *buf = NULL, *p;
+    long long keys;
+
+    rnode->used_memory = -1;
+    rnode->keys = -1;
+
+    tc = rmt_tcp_context_create();
+    if (tc == NULL) {
+        log_error("ERROR: create tcp_context failed: out of memory");
+        goto error;
     }
 
-    rdb->state = RDB_FILE_PARSE_END;
+    tc->flags |= RMT_BLOCK;
+    ret = rmt_tcp_context_connect_addr(tc, rnode->addr, 
+        (int)rmt_strlen(rnode->addr), &timeout, NULL);
+    if (ret != RMT_OK) {
+        log_error("ERROR: connect to %s failed", rnode->addr);
+        goto error;
+    }
 
-    if (rdb->fp != NULL) {
-        fclose(rdb->fp);
-        rdb->fp = NULL;
+    buf = rmt_alloc(REDIS_INFO_BUF_SIZE);
+    if (buf == NULL) {
+        log_error("ERROR: out of memory");
+        goto error;
     }
 
-    now = rmt_msec_now();
-    log_notice("Rdb file for node[%s] parsed finished, use: %lld s.",
-        srnode->addr, (now - srnode->timestamp)/1000);
-    srnode->timestamp = now;
+    if (rgroup->password) {
+        sds reply;
+        reply = rmt_send_sync_cmd_read_line(tc->sd, "auth", rgroup->password, NULL);
+        if (sdslen(reply) == 0 || reply[0] == '-') {
+            log_error("ERROR: password to %s is wrong", rnode->addr);
+            sdsfree(reply);
+            goto error;
+        }
+        sdsfree(reply);
+    }
 
-    redis_delete_rdb_file(rdb, 0);
+    if (redis_node_info_read(tc, REDIS_COMMAND_INFO_MEMORY, 
+        buf, REDIS_INFO_BUF_SIZE) != RMT_OK) {
+        log_error("ERROR: read from %s for command '%s' failed: %s", 
+            rnode->addr, "INFO memory", strerror(errno));
+        goto error;
+    }
 
-    wdata->stat_rdb_parsed_count ++;
+    p = strstr(buf, "used_memory:");
+    if (p == NULL) {
+        log_error("ERROR: no used_memory in the INFO reply from %s", 
+            rnode->addr);
+        goto error;
+    }
+    rnode->used_memory = strtoll(p + rmt_strlen("used_memory:"), NULL, 10);
 
-    return RMT_OK;
+    if (redis_node_info_read(tc, REDIS_COMMAND_INFO_KEYSPACE, 
+        buf, REDIS_INFO_BUF_SIZE) != RMT_OK) {
+        log_error("ERROR: read from %s for command '%s' failed: %s", 
+            rnode->addr, "INFO keyspace", strerror(errno));
+        goto error;
+    }
 
-again:
+    /* db0:keys=1,expires=0,avg_ttl=0 */
+    keys = 0;
+    p = buf;
+    while ((p = strstr(p, "keys=")) != NULL) {
+        p += rmt_strlen("keys=");
+        keys += strtoll(p, &p, 10);
+    }
+    rnode->keys = keys;
 
-    return RMT_AGAIN;
+    rmt_tcp_context_destroy(tc);
+    rmt_free(buf);
 
-eoferr: /* unexpected end of file is handled here with a fatal exit */
-    
-    log_error("ERROR: Short read or OOM loading DB. Unrecoverable error, aborting now.");
+    return RMT_OK;
 
 error:
 
-    if (rdb->fp != NULL) {
-        fclose(rdb->fp);
-        rdb->fp = NULL;
-    }
-
-    if (key != NULL) {
-        sdsfree(key);
+    if (tc != NULL) {
+        rmt_tcp_context_destroy(tc);
     }
 
-    if (value != NULL) {
-        redis_value_destroy(value);
+    if (buf != NULL) {
+        rmt_free(buf);
     }
 
-    redis_delete_rdb_file(rdb, 0);
-    
     return RMT_ERROR;
 }
 
-int redis_parse_rdb_time(aeEventLoop *el, long long id, void *privdata)
+/**
+  * Update route with the "cluster nodes" command reply.
+  */
+static int cluster_update_route_with_nodes(
+    redis_group *rgroup, redis_node *node)
 {
     int ret;
-    redis_node *srnode = privdata;
-    thread_data *wdata = srnode->write_data;
-    redis_rdb *rdb = srnode->rdb;
+    tcp_context *tc = NULL;
+    char *buf = NULL;
+    int buf_len = 0;
+    struct array *table = NULL;
+    redis_node *master, **trnode;
+    dict *nodes = NULL;
+    char *pos, *start, *end, *line_start, *line_end;
+    char *role;
+    int role_len;
+    uint8_t myself = 0;
+    int slot_start, slot_end;
+    sds *part = NULL, *slot_start_end = NULL;
+    int count_part = 0, count_slot_start_end = 0;
+    int j, k;
+    int len;
 
-    ret = redis_parse_rdb_file(srnode, 10);
-    if(ret == RMT_AGAIN){
-        return 1;
-    }else if(ret == RMT_OK){
-        ret = aeCreateFileEvent(wdata->loop, srnode->sockpairfds[1], 
-            AE_READABLE, parse_request, srnode);
-        if(ret != AE_OK){
-            log_error("ERROR: Create ae read event for node %s parse_request failed", 
-                srnode->addr);
-            return AE_NOMORE;
+    if(rgroup == NULL){
+        return RMT_ERROR;
+    }
+
+    tc = rmt_tcp_context_create();
+    if(tc == NULL){
+        log_error("ERROR: create tcp_context failed: out of memory");
+        goto error;
+    }
+
+    tc->flags |= RMT_BLOCK;    
+    ret = rmt_tcp_context_connect_addr(tc, node->addr, 
+        (int)rmt_strlen(node->addr), NULL, NULL);
+    if(ret != RMT_OK){
+        log_error("ERROR: connect to %s failed", node->addr);
+        goto error;
+    }
+
+    buf = rmt_alloc(102400*sizeof(*buf));
+    if(buf == NULL){
+        log_error("ERROR: out of memory");
+        goto error;
+    }
+
+    if (rgroup->password) {
+        sds reply;
+        reply = rmt_send_sync_cmd_read_line(tc->sd, "auth", rgroup->password, NULL);
+        if (sdslen(reply) == 0 || reply[0] == '-') {
+            log_error("ERROR: password to %s is wrong", node->addr);
+            sdsfree(reply);
+            goto error;
         }
+        sdsfree(reply);
+    }
 
-        notice_write_thread(srnode);
-    }else{
-        log_error("ERROR: Rdb file for node[%s] parsed failed", srnode->addr);
+    if (rmt_sync_write(tc->sd,REDIS_COMMAND_CLUSTER_NODES,
+        rmt_strlen(REDIS_COMMAND_CLUSTER_NODES),1000) == -1){
+        log_error("ERROR: send to %s for command '%s' failed", 
+            node->addr, "CLUSTER NODES");
+        goto error;
+    }
+
+    /* Read the reply from the server. */
+    if ((buf_len = (int)rmt_redis_sync_read_string(tc->sd,buf,102400,1000)) == -1){
+        log_error("ERROR: read from %s for command '%s' failed: %s", 
+            node->addr, "CLUSTER NODES", strerror(errno));
+        goto error;
+    }
+
+    log_debug(LOG_DEBUG, "nodes info %d : %.*s", buf_len, buf_len, buf);
+
+    nodes = dictCreate(&groupNodesDictType, NULL);
+    if(nodes == NULL){
+        log_error("ERROR: create nodes dict failed: out of memory");
+        goto error;
+    }
+
+    table = array_create(REDIS_CLUSTER_SLOTS, sizeof(redis_node *));
+    if(table == NULL){
+        log_error("ERROR: create cluster route table array failed: out of memory");
+        goto error;
+    }
+
+    for(j = 0; j < REDIS_CLUSTER_SLOTS; j ++){
+        trnode = array_push(table);
+        *trnode = NULL;
     }
 
-    return AE_NOMORE;
-}
+    start = buf;
+    end = start + buf_len;
+    
+    line_start = start;
+
+    for(pos = start; pos < end; pos ++){
+        if(*pos == '\n'){
+            line_end = pos - 1;
+            len = (int)(line_end - line_start);
+            
+            part = sdssplitlen(line_start, len + 1, " ", 1, &count_part);
+
+            if(part == NULL || count_part < 8){
+                log_error("ERROR: split cluster nodes error");
+                goto error;
+            }
+
+            //the address string is ":0", skip this node.
+            if(sdslen(part[1]) == 2 && strcmp(part[1], ":0") == 0){
+                sdsfreesplitres(part, count_part);
+                count_part = 0;
+                part = NULL;
+                
+                start = pos + 1;
+                line_start = start;
+                pos = start;
+                
+                continue;
+            }
+
+            if(sdslen(part[2]) >= 7 && memcmp(part[2], "myself,", 7) == 0){
+                role_len = (int)sdslen(part[2]) - 7;
+                role = part[2] + 7;
+                myself = 1;
+            }else{
+                role_len = (int)sdslen(part[2]);
+                role = part[2];
+            }
 
-void redis_parse_rdb(aeEventLoop *el, int fd, void *privdata, int mask)
-{
-    int ret;
-    redis_node *srnode = privdata;
-    thread_data *wdata = srnode->write_data;
-    redis_rdb *rdb = srnode->rdb;
-    rmtContext *ctx = srnode->ctx;
+            //add master node
+            if(role_len >= 6 && memcmp(role, "master", 6) == 0){
+                if(count_part < 8){
+                    log_error("ERROR: master node part number error");
+                    goto error;
+                }
+                
+                master = rmt_alloc(sizeof(*master));
+                if(master == NULL){
+                    log_error("ERROR: out of memory");
+                    goto error;
+                }
 
-    RMT_NOTUSED(el);
-    RMT_NOTUSED(fd);
-    RMT_NOTUSED(privdata);
-    RMT_NOTUSED(mask);
+                ret = redis_node_init(master, part[1], rgroup);
+                if(ret != RMT_OK){
+                    log_error("ERROR: target redis node init failed");
+                    goto error;
+                }
 
-    ASSERT(fd == srnode->sk_event);
-    ASSERT(el == wdata->loop);
+                ret = dictAdd(nodes, sdsnewlen(master->addr, 
+                    sdslen(master->addr)), master);
+                if(ret != DICT_OK){
+                    log_error("ERROR: the address already exists in the nodes");
+                    redis_node_deinit(master);
+                    rmt_free(master);
+                    goto error;
+                }
+                
+                for(k = 8; k < count_part; k ++){
+                    slot_start_end = sdssplitlen(part[k], 
+                        (int)sdslen(part[k]), "-", 1, &count_slot_start_end);
+                    
+                    if(slot_start_end == NULL){
+                        log_error("ERROR: split slot start end error(NULL)");
+                        goto error;
+                    }else if(count_slot_start_end == 1){
+                        slot_start = 
+                            rmt_atoi(slot_start_end[0], sdslen(slot_start_end[0]));
+                        slot_end = slot_start;
+                    }else if(count_slot_start_end == 2){
+                        slot_start = 
+                            rmt_atoi(slot_start_end[0], sdslen(slot_start_end[0]));;
+                        slot_end = 
+                            rmt_atoi(slot_start_end[1], sdslen(slot_start_end[1]));;
+                    }else{
+                        slot_start = -1;
+                        slot_end = -1;
+                    }
+                    
+                    sdsfreesplitres(slot_start_end, count_slot_start_end);
+                    count_slot_start_end = 0;
+                    slot_start_end = NULL;
 
-    ret = redis_parse_rdb_file(srnode, ctx->step);
-    if(ret == RMT_AGAIN){
-        return;
-    } else if(ret == RMT_OK) {
-        redis_group *srgroup = srnode->owner;
-        
-        aeDeleteFileEvent(wdata->loop, 
-            srnode->sk_event, AE_WRITABLE);
+                    if(slot_start < 0 || slot_end < 0 || 
+                        slot_start > slot_end || slot_end >= REDIS_CLUSTER_SLOTS){
+                        continue;
+                    }
 
-        if (srgroup->kind == GROUP_TYPE_RDBFILE) {
-            return;
-        }
+                    for(j = slot_start; j <= slot_end; j ++){
+                        trnode = array_get(table, (uint32_t)j);
+                        if(*trnode != NULL){
+                            log_error("ERROR: nodes %s and %s hold a same slot %d",
+                                (*trnode)->addr, master->addr, j);
+                            goto error;
+                        }
+                        
+                        *trnode = master;
+                    }
+                    
+                }
 
-        ret = aeCreateFileEvent(wdata->loop, srnode->sockpairfds[1], 
-            AE_READABLE, parse_request, srnode);
-        if(ret != AE_OK){
-            log_error("ERROR: Create ae read event for node %s parse_request failed", 
-                srnode->addr);
-            return;
-        }
+            }
 
-        notice_write_thread(srnode);
+            if(myself == 1){
+                myself = 0;
+            }
 
-        //notice the read thread to begin replication for the next redis_node
-        if (srnode->next != NULL) {
-            rmt_write(srnode->next->sockpairfds[1], " ", 1);
-        } else {
-            log_notice("All nodes' rdb file parsed finished for this write thread(%d).",
-                wdata->id);
-            ASSERT(wdata->stat_rdb_parsed_count == wdata->nodes_count);
+            sdsfreesplitres(part, count_part);
+            count_part = 0;
+            part = NULL;
+            
+            start = pos + 1;
+            line_start = start;
+            pos = start;
         }
-    }else{
-        aeDeleteFileEvent(wdata->loop, 
-            srnode->sk_event, AE_WRITABLE);
-        log_error("ERROR: Rdb file for node[%s] parsed failed", srnode->addr);
     }
 
-    close(srnode->sk_event);
-    srnode->sk_event = -1;
-}
-/* ======================== Redis RDB END ========================== */
-
-/* ======================== Redis AOF ========================== */
-
-int redis_load_aof_file(redis_node *srnode, char *aof_file)
-{
-    int ret;
-    rmtContext *ctx = srnode->ctx;
-    redis_group *srgroup = srnode->owner;
-    thread_data *rdata = srnode->read_data;
-    int fd = -1;
-    size_t len;
-    ssize_t nread;
+    cluster_nodes_swap_tc(rgroup->nodes, nodes);
 
-    fd = open(aof_file, O_RDONLY);
-    if (fd < 0) {
-        log_error("ERROR: open %s failed: %s", 
-            aof_file, strerror(errno));
-        return RMT_ERROR;
-    }    
+    if(rgroup->nodes != NULL){
+        dictRelease(rgroup->nodes);
+        rgroup->nodes = NULL;
+    }
     
-    while (1) {
-        if (srnode->mbuf_in == NULL) {
-            srnode->mbuf_in = mbuf_get(srgroup->mb);
-            if (srnode->mbuf_in == NULL) {
-                log_error("ERROR: Mbuf get failed: Out of memory");
-                return RMT_ERROR;
-            }
-        } else if(mbuf_size(srnode->mbuf_in) == 0) {
-            mttlist_push(srnode->cmd_data, srnode->mbuf_in);
-            srnode->mbuf_in = NULL;
-            notice_write_thread(srnode);
-
-            srnode->mbuf_in = mbuf_get(srgroup->mb);
-            if (srnode->mbuf_in == NULL) {
-                log_error("ERROR: Mbuf get failed: Out of memory");
-                return RMT_ERROR;
-            }
-        }
-        
-        len = mbuf_size(srnode->mbuf_in);
-        nread = read(fd, srnode->mbuf_in->last, len);
-        if (nread > 0) {
-            srnode->mbuf_in->last += nread;
-        }
-        
-        if (nread == 0 || nread < len) {
-            rdata->stat_aof_loaded_count ++;
-            
-            if (mbuf_length(srnode->mbuf_in) > 0) {
-                mttlist_push(srnode->cmd_data, srnode->mbuf_in);
-                srnode->mbuf_in = NULL;
-                notice_write_thread(srnode);
-            }
+    rgroup->nodes = nodes;
 
-            log_notice("Aof file %s load finished", aof_file);
-            break;
-        }
+    if(rgroup->route != NULL){
+        rgroup->route->nelem = 0;
+        array_destroy(rgroup->route);
+        rgroup->route = NULL;
+    }
 
-        if (nread < 0) {
-            log_error("ERROR: read data from %s failed: %s", 
-                aof_file, strerror(errno));
-            close(fd);
-            return RMT_ERROR;
-        }
+    rgroup->route = table;
 
-        usleep(100/ctx->step);
+    if(tc != NULL){
+        rmt_tcp_context_destroy(tc);
     }
 
-    close(fd);
+    if(buf != NULL){
+        rmt_free(buf);
+    }
+    
     return RMT_OK;
-}
 
-/* ======================== Redis AOF END ========================== */
-
-/* ========================== Redis Cluster ============================ */
+error:
 
-/* We have 16384 hash slots. The hash slot of a given key is obtained
- * as the least significant 14 bits of the crc16 of the key.
- *
- * However if the key contains the {...} pattern, only the part between
- * { and } is hashed. This may be useful in the future to force certain
- * keys to be in the same node (assuming no resharding is in progress). */
-static unsigned int clusterKeyHashSlot(char *key, int keylen) {
-    int s, e; /* start-end indexes of { and } */
+    if(tc != NULL){
+        rmt_tcp_context_destroy(tc);
+    }
 
-    for (s = 0; s < keylen; s++)
-        if (key[s] == '{') break;
+    if(buf != NULL){
+        rmt_free(buf);
+    }
+    
+    if(part != NULL){
+        sdsfreesplitres(part, count_part);
+        count_part = 0;
+        part = NULL;
+    }
 
-    /* No '{' ? Hash the whole key. This is the base case. */
-    if (s == keylen) return hash_crc16(key,(size_t)keylen) & 0x3FFF;
+    if(slot_start_end != NULL){
+        sdsfreesplitres(slot_start_end, count_slot_start_end);
+        count_slot_start_end = 0;
+        slot_start_end = NULL;
+    }
 
-    /* '{' found? Check if we have the corresponding '}'. */
-    for (e = s+1; e < keylen; e++)
-        if (key[e] == '}') break;
+    if(nodes != NULL){
+        if(nodes == rgroup->nodes){
+            rgroup->nodes = NULL;
+        }
 
-    /* No '}' or nothing betweeen {} ? Hash the whole key. */
-    if (e == keylen || e == s+1) return hash_crc16(key,(size_t)keylen) & 0x3FFF;
+        dictRelease(nodes);
+    }
 
-    /* If we are here there is both a { and a } on its right. Hash
-     * what is in the middle between { and }. */
-    return hash_crc16(key+s+1,(size_t)(e-s-1)) & 0x3FFF;
+    if(table != NULL){
+        if(table == rgroup->route){
+            rgroup->route = NULL;
+        }
+    
+        rgroup->route->nelem = 0;
+        array_destroy(table);
+    }
+    
+    return RMT_ERROR;
 }
 
-static void cluster_nodes_swap_tc(dict *nodes_f, dict *nodes_t)
+static int cluster_update_route(redis_group *rgroup)
 {
-    dictIterator *di;
-    dictEntry *de_f, *de_t;
-    redis_node *node_f, *node_t;
-    tcp_context *tc;
+    int ret;
+    redis_node *node;
+    dictIterator *it;
+    dictEntry *de;
+    
+    if(rgroup == NULL){
+        return RMT_ERROR;
+    }
 
-    if(nodes_f == NULL || nodes_t == NULL)
-    {
-        return;
+    if(rgroup->nodes == NULL){
+        log_error("ERROR: redis_group->nodes is NULL");
+        return RMT_ERROR;
     }
 
-    di = dictGetIterator(nodes_t);
-    while((de_t = dictNext(di)) != NULL)
-    {
-        node_t = dictGetVal(de_t);
-        if(node_t == NULL)
-        {
-            continue;
-        }
-        
-        de_f = dictFind(nodes_f, node_t->addr);
-        if(de_f == NULL)
-        {
+    it = dictGetSafeIterator(rgroup->nodes);
+    while ((de = dictNext(it)) != NULL){
+        node = dictGetVal(de);
+        if(node == NULL){
             continue;
         }
 
-        node_f = dictGetVal(de_f);
-        if(node_f->tc != NULL)
-        {
-            tc = node_f->tc;
-            node_f->tc = node_t->tc;
-            node_t->tc = tc;
+        ret = cluster_update_route_with_nodes(rgroup, node);
+        if(ret == RMT_OK){
+            dictReleaseIterator(it);
+            return RMT_OK;
         }
-
     }
+    dictReleaseIterator(it);
 
-    dictReleaseIterator(di);
-    
+    log_error("ERROR: no valid server address in the target redis cluster");
+
+    return RMT_ERROR;
 }
 
-static ssize_t rmt_redis_sync_read_string(int fd, char *ptr, long long timeout) {
-    ssize_t size = 0;
-    char c;
+redis_node * 
+redis_group_add_node(redis_group *rgroup, const char *name, const char *addr)
+{
+    int ret;
+    dictEntry *node_entry;
+    redis_node *node;
+    
+    if(rgroup == NULL){
+        return NULL;
+    }
 
-    if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
+    if(rgroup->nodes == NULL){
+        rgroup->nodes = dictCreate(&groupNodesDictType, NULL);
+        if(rgroup->nodes == NULL){
+            log_error("ERROR: Create nodes dict failed");
+            return NULL;
+        }
+    }
+
+    node_entry = dictFind(rgroup->nodes, name);
+    if(node_entry != NULL){
+        log_error("ERROR: Add node to redis group failed: node %s already exits",
+            name);
+        return NULL;
+    }
     
-    if (c != '$') {
-        errno = ENOPROTOOPT;
-        return -1;
+    node = rmt_alloc(sizeof(*node));
+    if(node == NULL){
+        log_error("ERROR: create redis_node failed: out of memory");
+        return NULL;
     }
 
-    do {
-        if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
+    ret = redis_node_init(node, addr, rgroup);
+    if(ret != RMT_OK){
+        log_error("ERROR: Redis node init failed");
+        rmt_free(node);
+        return NULL;
+    }
 
-        if (isdigit(c)) {
-            size = size * 10 + (ssize_t)(c - '0');
-        } else if(c != CR) {
-            errno = ENOPROTOOPT;
-            return -1;
-        }           
-    } while(isdigit(c));
+    dictAdd(rgroup->nodes, sdsnewlen(name, rmt_strlen(name)), node);
+    
+    return node;
+}
 
-    if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
-    if (c != LF) {
-        errno = ENOPROTOOPT;
-        return -1;
+int redis_cluster_init_from_addrs(redis_group *rgroup, const char *addrs)
+{
+    int ret;
+    int i;
+    sds *address = NULL;
+    int address_count = 0;
+    
+    if(rgroup == NULL || addrs == NULL){
+        return RMT_ERROR;
     }
 
-    if (rmt_sync_read(fd,ptr,size,timeout) == -1) return -1;
+    address = sdssplitlen(addrs, (int)rmt_strlen(addrs), ADDRESS_SEPARATOR, 
+        (int)rmt_strlen(ADDRESS_SEPARATOR), &address_count);
+    if(address == NULL || address_count <= 0){
+        log_error("ERROR: Redis cluster address is error");
+        goto error;
+    }
 
-    if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
-    if (c != CR) {
-        errno = ENOPROTOOPT;
-        return -1;
+    for(i = 0; i < address_count; i ++){
+        if(redis_group_add_node(rgroup, 
+            address[i], address[i]) == NULL){
+            log_error("ERROR: Redis group add node[%s] failed", 
+                address[i]);
+            goto error;
+        }
     }
 
-    if (rmt_sync_read(fd,&c,1,timeout) == -1) return -1;
-    if (c != LF) {
-        errno = ENOPROTOOPT;
-        return -1;
+    sdsfreesplitres(address, address_count);
+    
+    ret = cluster_update_route(rgroup);
+    if(ret != RMT_OK){
+        return ret;
     }
+    
+    return RMT_OK;
 
-    return size;
-}
+error:
 
+    if(address != NULL){
+        sdsfreesplitres(address, address_count);
+    }
 
-/**
-  * Update route with the "cluster nodes" command reply.
-  */
-static int cluster_update_route_with_nodes(
-    redis_group *rgroup, redis_node *node)
+    return RMT_ERROR;
+}
+
+int redis_cluster_init_from_conf(redis_group *rgroup, conf_pool *cp)
 {
     int ret;
-    tcp_context *tc = NULL;
-    char *buf = NULL;
-    int buf_len = 0;
-    struct array *table = NULL;
-    redis_node *master, **trnode;
-    dict *nodes = NULL;
-    char *pos, *start, *end, *line_start, *line_end;
-    char *role;
-    int role_len;
-    uint8_t myself = 0;
-    int slot_start, slot_end;
-    sds *part = NULL, *slot_start_end = NULL;
-    int count_part = 0, count_slot_start_end = 0;
-    int j, k;
-    int len;
-
-    if(rgroup == NULL){
+    uint32_t i;
+    sds *str;
+    
+    if(rgroup == NULL || cp == NULL || 
+        cp->servers == NULL){
         return RMT_ERROR;
     }
 
-    tc = rmt_tcp_context_create();
-    if(tc == NULL){
-        log_error("ERROR: create tcp_context failed: out of memory");
-        goto error;
+    for(i = 0; i < array_n(cp->servers); i ++){
+        str = array_get(cp->servers, i);
+        if(redis_group_add_node(rgroup, *str, *str) == NULL)
+        {
+            log_error("ERROR: Redis group add node[%s] failed", 
+                *str);
+            return RMT_ERROR;
+        }
     }
-
-    tc->flags |= RMT_BLOCK;    
-    ret = rmt_tcp_context_connect_addr(tc, node->addr, 
-        (int)rmt_strlen(node->addr), NULL, NULL);
+    
+    ret = cluster_update_route(rgroup);
     if(ret != RMT_OK){
-        log_error("ERROR: connect to %s failed", node->addr);
-        goto error;
+        return ret;
     }
+    
+    return RMT_OK;
+}
+
+uint32_t 
+redis_cluster_backend_idx(redis_group *rgroup, uint8_t *key, uint32_t keylen)
+{
+    uint32_t idx;
+
+    RMT_NOTUSED(rgroup);
+    RMT_NOTUSED(key);
+    RMT_NOTUSED(keylen);
+    
+    idx = clusterKeyHashSlot((char *)key, (int)keylen);
+
+    return idx;
+}
+
+redis_node *
+redis_cluster_backend_node(redis_group *rgroup, uint8_t *key, uint32_t keylen)
+{
+    uint32_t idx;
+    redis_node **node;
+    
+    RMT_NOTUSED(rgroup);
+    RMT_NOTUSED(key);
+    RMT_NOTUSED(keylen);
+
+    idx = redis_cluster_backend_idx(rgroup, key, keylen);
 
-    buf = rmt_alloc(102400*sizeof(*buf));
-    if(buf == NULL){
-        log_error("ERROR: out of memory");
-        goto error;
-    }
+    ASSERT(idx < array_n(rgroup->route));
 
-    if (rgroup->password) {
-        sds reply;
-        reply = rmt_send_sync_cmd_read_line(tc->sd, "auth", rgroup->password, NULL);
-        if (sdslen(reply) == 0 || reply[0] == '-') {
-            log_error("ERROR: password to %s is wrong", node->addr);
-            sdsfree(reply);
-            goto error;
-        }
-        sdsfree(reply);
-    }
+    node = array_get(rgroup->route, idx);
+    return *node;
+}
 
-    if (rmt_sync_write(tc->sd,REDIS_COMMAND_CLUSTER_NODES,
-        rmt_strlen(REDIS_COMMAND_CLUSTER_NODES),1000) == -1){
-        log_error("ERROR: send to %s for command '%s' failed", 
-            node->addr, "CLUSTER NODES");
-        goto error;
+/* Find the node of the target cluster by address, or add it if the 
+ * cluster has a new master. The address of the nodes from CLUSTER NODES 
+ * may end with the cluster bus port (ip:port@cport). */
+redis_node *
+redis_cluster_node_get(redis_group *rgroup, const char *addr, 
+    thread_data *tdata)
+{
+    rmtContext *ctx = rgroup->ctx;
+    dictIterator *di;
+    dictEntry *de;
+    redis_node *node;
+    size_t len = rmt_strlen(addr);
+
+    di = dictGetIterator(rgroup->nodes);
+    while ((de = dictNext(di)) != NULL) {
+        node = dictGetVal(de);
+        if (!strncmp(node->addr, addr, len) && 
+            (node->addr[len] == '\0' || node->addr[len] == '@')) {
+            dictReleaseIterator(di);
+            return node;
+        }
     }
+    dictReleaseIterator(di);
 
-    /* Read the reply from the server. */
-    if ((buf_len = (int)rmt_redis_sync_read_string(tc->sd,buf,1000)) == -1){
-        log_error("ERROR: read from %s for command '%s' failed: %s", 
-            node->addr, "CLUSTER NODES", strerror(errno));
-        goto error;
+    pthread_mutex_lock(&rgroup->nodes_mutex);
+    node = redis_group_add_node(rgroup, addr, addr);
+    pthread_mutex_unlock(&rgroup->nodes_mutex);
+    if (node == NULL) {
+        return NULL;
     }
 
-    log_debug(LOG_DEBUG, "nodes info %d : %.*s", buf_len, buf_len, buf);
+    node->write_data = tdata;
 
-    nodes = dictCreate(&groupNodesDictType, NULL);
-    if(nodes == NULL){
-        log_error("ERROR: create nodes dict failed: out of memory");
-        goto error;
+    /* the apply threads find their own node for it when it is used */
+    if (ctx->adatas != NULL && tdata->data == NULL) {
+        node->apply_nodes = rmt_zalloc(array_n(ctx->adatas)*sizeof(redis_node *));
+        if (node->apply_nodes == NULL) {
+            log_error("ERROR: Out of memory");
+            return NULL;
+        }
     }
 
-    table = array_create(REDIS_CLUSTER_SLOTS, sizeof(redis_node *));
-    if(table == NULL){
-        log_error("ERROR: create cluster route table array failed: out of memory");
-        goto error;
-    }
+    log_notice("Node %s joined the target cluster", addr);
 
-    for(j = 0; j < REDIS_CLUSTER_SLOTS; j ++){
-        trnode = array_push(table);
-        *trnode = NULL;
-    }
+    return node;
+}
 
-    start = buf;
-    end = start + buf_len;
-    
-    line_start = start;
+/*
+ * The slot of the first key of the request r to the target cluster, or
+ * -1 if r has no key, or its key is too long to be found in the head.
+ */
+static int
+redis_cluster_msg_slot(struct msg *r)
+{
+    uint8_t key[512];
+    size_t keylen;
 
-    for(pos = start; pos < end; pos ++){
-        if(*pos == '\n'){
-            line_end = pos - 1;
-            len = (int)(line_end - line_start);
-            
-            part = sdssplitlen(line_start, len + 1, " ", 1, &count_part);
+    keylen = redis_msg_first_key(r, key, sizeof(key));
+    if (keylen == 0 || keylen > sizeof(key)) {
+        return -1;
+    }
 
-            if(part == NULL || count_part < 8){
-                log_error("ERROR: split cluster nodes error");
-                goto error;
-            }
+    return (int)clusterKeyHashSlot((char *)key, (int)keylen);
+}
 
-            //the address string is ":0", skip this node.
-            if(sdslen(part[1]) == 2 && strcmp(part[1], ":0") == 0){
-                sdsfreesplitres(part, count_part);
-                count_part = 0;
-                part = NULL;
-                
-                start = pos + 1;
-                line_start = start;
-                pos = start;
-                
-                continue;
-            }
+/* The node the route of the cluster sends r to, NULL if r has no key. */
+redis_node *
+redis_cluster_msg_node(redis_group *rgroup, struct msg *r)
+{
+    redis_node **node;
+    int slot;
 
-            if(sdslen(part[2]) >= 7 && memcmp(part[2], "myself,", 7) == 0){
-                role_len = (int)sdslen(part[2]) - 7;
-                role = part[2] + 7;
-                myself = 1;
-            }else{
-                role_len = (int)sdslen(part[2]);
-                role = part[2];
-            }
+    slot = redis_cluster_msg_slot(r);
+    if (slot < 0) {
+        return NULL;
+    }
 
-            //add master node
-            if(role_len >= 6 && memcmp(role, "master", 6) == 0){
-                if(count_part < 8){
-                    log_error("ERROR: master node part number error");
-                    goto error;
-                }
-                
-                master = rmt_alloc(sizeof(*master));
-                if(master == NULL){
-                    log_error("ERROR: out of memory");
-                    goto error;
-                }
+    node = array_get(rgroup->route, (uint32_t)slot);
+    return *node;
+}
 
-                ret = redis_node_init(master, part[1], rgroup);
-                if(ret != RMT_OK){
-                    log_error("ERROR: target redis node init failed");
-                    goto error;
-                }
+/*
+ * The node that the msg queued to rnode is routed to now, if it is not 
+ * rnode and the msg is of the slot, or of any slot if slot is -1.
+ */
+static redis_node *
+redis_cluster_msg_moved(redis_node *rnode, struct msg *msg, int slot)
+{
+    redis_node *node;
+    int s;
 
-                ret = dictAdd(nodes, sdsnewlen(master->addr, 
-                    sdslen(master->addr)), master);
-                if(ret != DICT_OK){
-                    log_error("ERROR: the address already exists in the nodes");
-                    redis_node_deinit(master);
-                    rmt_free(master);
-                    goto error;
-                }
-                
-                for(k = 8; k < count_part; k ++){
-                    slot_start_end = sdssplitlen(part[k], 
-                        (int)sdslen(part[k]), "-", 1, &count_slot_start_end);
-                    
-                    if(slot_start_end == NULL){
-                        log_error("ERROR: split slot start end error(NULL)");
-                        goto error;
-                    }else if(count_slot_start_end == 1){
-                        slot_start = 
-                            rmt_atoi(slot_start_end[0], sdslen(slot_start_end[0]));
-                        slot_end = slot_start;
-                    }else if(count_slot_start_end == 2){
-                        slot_start = 
-                            rmt_atoi(slot_start_end[0], sdslen(slot_start_end[0]));;
-                        slot_end = 
-                            rmt_atoi(slot_start_end[1], sdslen(slot_start_end[1]));;
-                    }else{
-                        slot_start = -1;
-                        slot_end = -1;
-                    }
-                    
-                    sdsfreesplitres(slot_start_end, count_slot_start_end);
-                    count_slot_start_end = 0;
-                    slot_start_end = NULL;
+    if (msg->extra) {
+        return NULL;
+    }
 
-                    if(slot_start < 0 || slot_end < 0 || 
-                        slot_start > slot_end || slot_end >= REDIS_CLUSTER_SLOTS){
-                        continue;
-                    }
+    s = redis_cluster_msg_slot(msg);
+    if (s < 0 || (slot >= 0 && s != slot)) {
+        return NULL;
+    }
 
-                    for(j = slot_start; j <= slot_end; j ++){
-                        trnode = array_get(table, (uint32_t)j);
-                        if(*trnode != NULL){
-                            log_error("ERROR: nodes %s and %s hold a same slot %d",
-                                (*trnode)->addr, master->addr, j);
-                            goto error;
-                        }
-                        
-                        *trnode = master;
-                    }
-                    
-                }
+    node = *(redis_node **)array_get(rnode->owner->route, (uint32_t)s);
+    return node != rnode ? node : NULL;
+}
 
-            }
+/* Queue the msg to the node it is moved to, it was counted already. */
+static void
+redis_cluster_msg_move(redis_node *node, struct msg *msg)
+{
+    msg->sent = 0;
+    msg->peer = NULL;
+
+    if (target_node_queue(node, msg) != RMT_OK) {
+        log_error("ERROR: Move the request %s to node[%s] failed",
+            msg_type_string(msg->type), node->addr);
+        thread_stat_decr(node->write_data, msgs_outqueue, 1);
+        msg->ack_lost = 1;
+        msg_put(msg);
+        msg_free(msg);
+    }
+}
 
-            if(myself == 1){
-                myself = 0;
-            }
+/*
+ * Move the msgs of rnode that the route of the cluster sends to other 
+ * nodes now: the msgs of the slot, or of any slot if slot is -1. So the 
+ * msgs of a key keep their order, the msgs go to the tail of their new 
+ * node in the order they were sent in: the msgs waiting to retry, r 
+ * (if not NULL) to the node, the msgs waiting for the replies, then the 
+ * msgs to send. The msgs sent already, even partially, leave a stand-in
+ * behind to drop the reply or send the rest.
+ */
+static void
+redis_cluster_requeue(redis_node *rnode, int slot, 
+    struct msg *r, redis_node *node)
+{
+    listNode *ln, *next;
+    struct msg *msg, *sub;
+    redis_node *to;
+    long long moved = 0;
 
-            sdsfreesplitres(part, count_part);
-            count_part = 0;
-            part = NULL;
-            
-            start = pos + 1;
-            line_start = start;
-            pos = start;
+    for (ln = listFirst(rnode->retry_data); ln != NULL; ln = next) {
+        next = listNextNode(ln);
+        msg = listNodeValue(ln);
+        to = redis_cluster_msg_moved(rnode, msg, slot);
+        if (to != NULL) {
+            listDelNode(rnode->retry_data, ln);
+            redis_cluster_msg_move(to, msg);
+            moved ++;
         }
     }
 
-    cluster_nodes_swap_tc(rgroup->nodes, nodes);
-
-    if(rgroup->nodes != NULL){
-        dictRelease(rgroup->nodes);
-        rgroup->nodes = NULL;
+    if (r != NULL) {
+        redis_cluster_msg_move(node, r);
     }
-    
-    rgroup->nodes = nodes;
 
-    if(rgroup->route != NULL){
-        rgroup->route->nelem = 0;
-        array_destroy(rgroup->route);
-        rgroup->route = NULL;
+    for (ln = listFirst(rnode->sent_data); ln != NULL; ln = listNextNode(ln)) {
+        msg = listNodeValue(ln);
+        to = redis_cluster_msg_moved(rnode, msg, slot);
+        if (to != NULL && (sub = msg_stand_in(msg)) != NULL) {
+            ln->value = sub;
+            redis_cluster_msg_move(to, msg);
+            moved ++;
+        }
     }
 
-    rgroup->route = table;
+    for (ln = listFirst(rnode->send_data); ln != NULL; ln = next) {
+        next = listNextNode(ln);
+        msg = listNodeValue(ln);
+        to = redis_cluster_msg_moved(rnode, msg, slot);
+        if (to == NULL) {
+            continue;
+        }
 
-    if(tc != NULL){
-        rmt_tcp_context_destroy(tc);
+        if (!msg_sent_partially(msg)) {
+            listDelNode(rnode->send_data, ln);
+        } else if ((sub = msg_stand_in(msg)) != NULL) {
+            ln->value = sub;
+        } else {
+            continue;
+        }
+        redis_cluster_msg_move(to, msg);
+        moved ++;
     }
 
-    if(buf != NULL){
-        rmt_free(buf);
+    if (moved > 0) {
+        log_debug(LOG_INFO, "%lld requests queued to node[%s] are moved "
+            "to the new nodes of their slots", moved, rnode->addr);
     }
-    
-    return RMT_OK;
-
-error:
+}
 
-    if(tc != NULL){
-        rmt_tcp_context_destroy(tc);
+/*
+ * Follow the -MOVED or -ASK reply of the target cluster for the request
+ * r: r is sent again to the node in the reply, after an ASKING for -ASK. 
+ * For -MOVED, the slot is routed to that node at once, the msgs of the 
+ * slot queued to rnode are moved after r, and the routes are refreshed 
+ * with CLUSTER SLOTS. r is not counted again in the stats. Returns 
+ * RMT_ERROR if resp is not a redirection to follow, and r is left 
+ * untouched.
+ */
+int
+redis_cluster_redirect(redis_node *rnode, struct msg *r, struct msg *resp)
+{
+    rmtContext *ctx = rnode->ctx;
+    thread_data *tdata = rnode->write_data;
+    redis_group *rgroup = rnode->owner;
+    redis_node *node, **slot_node;
+    struct msg *asking;
+    char buf[REDIS_CLUSTER_REDIRECT_LEN];
+    char *p, *addr;
+    long slot;
+    int ask;
+
+    if (rgroup->kind != GROUP_TYPE_RCLUSTER) {
+        return RMT_ERROR;
     }
 
-    if(buf != NULL){
-        rmt_free(buf);
-    }
-    
-    if(part != NULL){
-        sdsfreesplitres(part, count_part);
-        count_part = 0;
-        part = NULL;
-    }
+    redis_response_line(resp, buf, sizeof(buf));
 
-    if(slot_start_end != NULL){
-        sdsfreesplitres(slot_start_end, count_slot_start_end);
-        count_slot_start_end = 0;
-        slot_start_end = NULL;
+    if (!strncmp(buf, "-MOVED ", 7)) {
+        ask = 0;
+        p = buf + 7;
+    } else if (!strncmp(buf, "-ASK ", 5)) {
+        ask = 1;
+        p = buf + 5;
+    } else {
+        return RMT_ERROR;
     }
 
-    if(nodes != NULL){
-        if(nodes == rgroup->nodes){
-            rgroup->nodes = NULL;
-        }
-
-        dictRelease(nodes);
+    slot = strtol(p, &addr, 10);
+    if (addr == p || *addr != ' ' || slot < 0 || slot >= REDIS_CLUSTER_SLOTS) {
+        log_warn("Bad redirection from node[%s]: %s", rnode->addr, buf);
+        return RMT_ERROR;
     }
+    addr ++;
 
-    if(table != NULL){
-        if(table == rgroup->route){
-            rgroup->route = NULL;
-        }
-    
-        rgroup->route->nelem = 0;
-        array_destroy(table);
+    if (r->redirects >= REDIS_CLUSTER_MAX_REDIRECTS) {
+        log_warn("Request %s is redirected too many times, the last from node[%s]: %s",
+            msg_type_string(r->type), rnode->addr, buf);
+        return RMT_ERROR;
     }
-    
-    return RMT_ERROR;
-}
 
-static int cluster_update_route(redis_group *rgroup)
-{
-    int ret;
-    redis_node *node;
-    dictIterator *it;
-    dictEntry *de;
-    
-    if(rgroup == NULL){
+    node = redis_cluster_node_get(rgroup, addr, rnode->write_data);
+    if (node == NULL) {
+        log_error("ERROR: Add the target cluster node %s failed", addr);
         return RMT_ERROR;
     }
 
-    if(rgroup->nodes == NULL){
-        log_error("ERROR: redis_group->nodes is NULL");
+    if (msg_rewind(r) != RMT_OK) {
+        log_warn("Request %s redirected by node[%s] can not be sent again",
+            msg_type_string(r->type), rnode->addr);
         return RMT_ERROR;
     }
 
-    it = dictGetSafeIterator(rgroup->nodes);
-    while ((de = dictNext(it)) != NULL){
-        node = dictGetVal(de);
-        if(node == NULL){
-            continue;
+    log_debug(LOG_INFO, "Request %s is redirected from node[%s]: %s",
+        msg_type_string(r->type), rnode->addr, buf);
+
+    r->redirects ++;
+
+    /* r waits in the queue again, not replied yet */
+    thread_stat_decr(tdata, total_msgs_sent, 1);
+    thread_stat_incr(tdata, msgs_outqueue, 1);
+    thread_stat_incr(tdata, total_msgs_redirected, 1);
+    command_stat_retried(tdata, r);
+
+    if (ask) {
+        asking = msg_get(rgroup->mb, 1, REDIS_DATA_TYPE_CMD);
+        if (asking == NULL || msg_append(asking, 
+            (uint8_t *)REDIS_COMMAND_ASKING, 
+            rmt_strlen(REDIS_COMMAND_ASKING)) != RMT_OK) {
+            log_error("ERROR: Out of memory");
+        } else {
+            asking->type = MSG_REQ_REDIS_ASKING;
+            asking->extra = 1;
+            if (target_node_queue(node, asking) == RMT_OK) {
+                thread_stat_incr(tdata, total_asking_sent, 1);
+                asking = NULL;
+            }
         }
 
-        ret = cluster_update_route_with_nodes(rgroup, node);
-        if(ret == RMT_OK){
-            dictReleaseIterator(it);
-            return RMT_OK;
+        if (asking != NULL) {
+            msg_put(asking);
+            msg_free(asking);
         }
+
+        redis_cluster_msg_move(node, r);
+    } else {
+        slot_node = array_get(rgroup->route, (uint32_t)slot);
+        *slot_node = node;
+        __sync_add_and_fetch(&ctx->cluster_moved, 1);
+
+        redis_cluster_requeue(rnode, (int)slot, r, node);
     }
-    dictReleaseIterator(it);
 
-    log_error("ERROR: no valid server address in the target redis cluster");
+    return RMT_OK;
+}
 
-    return RMT_ERROR;
+/* CLUSTER SLOTS sent to a node of the target cluster to refresh the route */
+typedef struct redis_cluster_refresh {
+    redis_group *rgroup;
+    thread_data *tdata;
+    tcp_context *tc;
+    sds addr;
+    sds reply;
+    long long start;
+} redis_cluster_refresh;
+
+static void redis_cluster_refresh_free(redis_group *rgroup, int events)
+{
+    redis_cluster_refresh *rf = rgroup->refresh;
+
+    if (rf->tc != NULL) {
+        if (events && rf->tc->sd > 0) {
+            aeDeleteFileEvent(rf->tdata->loop, rf->tc->sd, AE_READABLE|AE_WRITABLE);
+        }
+        rmt_tcp_context_destroy(rf->tc);
+    }
+
+    sdsfree(rf->addr);
+    sdsfree(rf->reply);
+    rmt_free(rf);
+
+    rgroup->refresh = NULL;
 }
 
-redis_node * 
-redis_group_add_node(redis_group *rgroup, const char *name, const char *addr)
+/* Returns the end of the RESP reply at p, or NULL if it is not complete. */
+char *
+redis_reply_skip(char *p, char *end)
 {
-    int ret;
-    dictEntry *node_entry;
-    redis_node *node;
-    
-    if(rgroup == NULL){
+    char *cr;
+    long long n, i;
+
+    if (end - p < 2) {
         return NULL;
     }
 
-    if(rgroup->nodes == NULL){
-        rgroup->nodes = dictCreate(&groupNodesDictType, NULL);
-        if(rgroup->nodes == NULL){
-            log_error("ERROR: Create nodes dict failed");
+    cr = p;
+    while (cr[0] != CR || cr[1] != LF) {
+        if (cr + 2 >= end) {
             return NULL;
         }
+        cr ++;
     }
 
-    node_entry = dictFind(rgroup->nodes, name);
-    if(node_entry != NULL){
-        log_error("ERROR: Add node to redis group failed: node %s already exits",
-            name);
+    switch (*p) {
+    case '+':
+    case '-':
+    case ':':
+        return cr + 2;
+    case '$':
+        n = strtoll(p + 1, NULL, 10);
+        if (n < 0) {
+            return cr + 2;
+        }
+        return end - (cr + 2) >= n + 2 ? cr + 2 + n + 2 : NULL;
+    case '*':
+        n = strtoll(p + 1, NULL, 10);
+        p = cr + 2;
+        for (i = 0; i < n && p != NULL; i ++) {
+            p = redis_reply_skip(p, end);
+        }
+        return p;
+    default:
         return NULL;
     }
-    
-    node = rmt_alloc(sizeof(*node));
-    if(node == NULL){
-        log_error("ERROR: create redis_node failed: out of memory");
+}
+
+/* Read the number after the type byte of a complete RESP reply. */
+static char *cluster_reply_num(char *p, char type, long long *num)
+{
+    char *cr;
+
+    if (p == NULL || *p != type) {
         return NULL;
     }
 
-    ret = redis_node_init(node, addr, rgroup);
-    if(ret != RMT_OK){
-        log_error("ERROR: Redis node init failed");
-        rmt_free(node);
+    *num = strtoll(p + 1, &cr, 10);
+    if (*cr != CR) {
         return NULL;
     }
 
-    dictAdd(rgroup->nodes, sdsnewlen(name, rmt_strlen(name)), node);
-    
-    return node;
+    return cr + 2;
 }
 
-int redis_cluster_init_from_addrs(redis_group *rgroup, const char *addrs)
+/*
+ * Push the slot ranges of the complete CLUSTER SLOTS reply at p and their
+ * masters into slots, the caller frees the addrs. An empty ip is the one
+ * of from, the node the reply came from.
+ */
+int
+redis_cluster_slots_parse(char *p, char *end, const char *from, 
+    struct array *slots)
 {
-    int ret;
-    int i;
-    sds *address = NULL;
-    int address_count = 0;
-    
-    if(rgroup == NULL || addrs == NULL){
+    redis_cluster_slots *range;
+    long long nranges = 0, nfields, nnode, start, stop, len, port;
+    long long i, j;
+    const char *ip, *colon;
+
+    p = cluster_reply_num(p, '*', &nranges);
+    for (i = 0; p != NULL && i < nranges; i ++) {
+        p = cluster_reply_num(p, '*', &nfields);
+        p = cluster_reply_num(p, ':', &start);
+        p = cluster_reply_num(p, ':', &stop);
+        p = cluster_reply_num(p, '*', &nnode);
+        p = cluster_reply_num(p, '$', &len);
+        if (p == NULL || nfields < 3 || nnode < 2 || len < 0 || 
+            end - p < len + 2) {
+            break;
+        }
+        ip = p;
+        p = cluster_reply_num(p + len + 2, ':', &port);
+        for (j = 2; j < nnode && p != NULL; j ++) {
+            p = redis_reply_skip(p, end);
+        }
+        for (j = 3; j < nfields && p != NULL; j ++) {
+            p = redis_reply_skip(p, end);
+        }
+        if (p == NULL || start < 0 || start > stop || stop >= REDIS_CLUSTER_SLOTS) {
+            break;
+        }
+
+        if (len == 0) {
+            colon = strrchr(from, ':');
+            ip = from;
+            len = colon != NULL ? colon - from : 0;
+        }
+
+        range = array_push(slots);
+        if (range == NULL) {
+            return RMT_ENOMEM;
+        }
+        range->start = (int)start;
+        range->stop = (int)stop;
+        range->addr = sdscatprintf(sdsempty(), "%.*s:%lld", (int)len, ip, port);
+        if (range->addr == NULL) {
+            array_pop(slots);
+            return RMT_ENOMEM;
+        }
+    }
+
+    if (i < nranges || p == NULL) {
         return RMT_ERROR;
     }
 
-    address = sdssplitlen(addrs, (int)rmt_strlen(addrs), ADDRESS_SEPARATOR, 
-        (int)rmt_strlen(ADDRESS_SEPARATOR), &address_count);
-    if(address == NULL || address_count <= 0){
-        log_error("ERROR: Redis cluster address is error");
-        goto error;
+    return RMT_OK;
+}
+
+/* Route the slots to the masters in the CLUSTER SLOTS reply. */
+static int cluster_slots_apply(redis_cluster_refresh *rf, char *p, char *end)
+{
+    redis_group *rgroup = rf->rgroup;
+    redis_node *node, **slot_node;
+    redis_cluster_slots *range;
+    struct array *slots;
+    long long changed = 0;
+    uint32_t i;
+    int j, ret;
+    dictIterator *di;
+    dictEntry *de;
+
+    slots = array_create(16, sizeof(redis_cluster_slots));
+    if (slots == NULL) {
+        return RMT_ENOMEM;
     }
 
-    for(i = 0; i < address_count; i ++){
-        if(redis_group_add_node(rgroup, 
-            address[i], address[i]) == NULL){
-            log_error("ERROR: Redis group add node[%s] failed", 
-                address[i]);
-            goto error;
-        }
+    ret = redis_cluster_slots_parse(p, end, rf->addr, slots);
+    if (ret != RMT_OK) {
+        log_warn("Bad CLUSTER SLOTS reply from node[%s]", rf->addr);
+        goto done;
     }
 
-    sdsfreesplitres(address, address_count);
-    
-    ret = cluster_update_route(rgroup);
-    if(ret != RMT_OK){
-        return ret;
+    for (i = 0; i < array_n(slots); i ++) {
+        range = array_get(slots, i);
+        node = redis_cluster_node_get(rgroup, range->addr, rf->tdata);
+        if (node == NULL) {
+            ret = RMT_ERROR;
+            break;
+        }
+
+        for (j = range->start; j <= range->stop; j ++) {
+            slot_node = array_get(rgroup->route, (uint32_t)j);
+            if (*slot_node != node) {
+                *slot_node = node;
+                changed ++;
+            }
+        }
     }
-    
-    return RMT_OK;
 
-error:
+    if (changed > 0) {
+        log_notice("Route of %lld slots is refreshed from node[%s]", 
+            changed, rf->addr);
 
-    if(address != NULL){
-        sdsfreesplitres(address, address_count);
+        di = dictGetIterator(rgroup->nodes);
+        while ((de = dictNext(di)) != NULL) {
+            redis_cluster_requeue(dictGetVal(de), -1, NULL, NULL);
+        }
+        dictReleaseIterator(di);
     }
 
-    return RMT_ERROR;
+done:
+    while (array_n(slots) > 0) {
+        range = array_pop(slots);
+        sdsfree(range->addr);
+    }
+    array_destroy(slots);
+
+    return ret;
 }
 
-int redis_cluster_init_from_conf(redis_group *rgroup, conf_pool *cp)
+static void cluster_refresh_read(aeEventLoop *el, int fd, void *privdata, int mask)
 {
-    int ret;
-    uint32_t i;
-    sds *str;
-    
-    if(rgroup == NULL || cp == NULL || 
-        cp->servers == NULL){
-        return RMT_ERROR;
+    redis_group *rgroup = privdata;
+    redis_cluster_refresh *rf = rgroup->refresh;
+    ssize_t n;
+    char *p, *end;
+
+    RMT_NOTUSED(el);
+    RMT_NOTUSED(mask);
+
+    rf->reply = sdsMakeRoomFor(rf->reply, 16384);
+    n = rmt_read(fd, rf->reply + sdslen(rf->reply), sdsavail(rf->reply));
+    if (n <= 0) {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        log_warn("Read CLUSTER SLOTS from node[%s] failed: %s", rf->addr, 
+            n == 0 ? "connection closed" : strerror(errno));
+        redis_cluster_refresh_free(rgroup, 1);
+        return;
     }
+    sdsIncrLen(rf->reply, (int)n);
 
-    for(i = 0; i < array_n(cp->servers); i ++){
-        str = array_get(cp->servers, i);
-        if(redis_group_add_node(rgroup, *str, *str) == NULL)
-        {
-            log_error("ERROR: Redis group add node[%s] failed", 
-                *str);
-            return RMT_ERROR;
+    p = rf->reply;
+    end = p + sdslen(rf->reply);
+
+    /* the reply of AUTH first */
+    if (rgroup->password) {
+        p = redis_reply_skip(p, end);
+        if (p == NULL) {
+            return;
+        }
+        if (rf->reply[0] == '-') {
+            log_error("ERROR: password to %s is wrong", rf->addr);
+            redis_cluster_refresh_free(rgroup, 1);
+            return;
         }
     }
-    
-    ret = cluster_update_route(rgroup);
-    if(ret != RMT_OK){
-        return ret;
+
+    if (redis_reply_skip(p, end) == NULL) {
+        return;
     }
-    
-    return RMT_OK;
+
+    cluster_slots_apply(rf, p, end);
+    redis_cluster_refresh_free(rgroup, 1);
 }
 
-uint32_t 
-redis_cluster_backend_idx(redis_group *rgroup, uint8_t *key, uint32_t keylen)
+static void cluster_refresh_write(aeEventLoop *el, int fd, void *privdata, int mask)
 {
-    uint32_t idx;
+    redis_group *rgroup = privdata;
+    redis_cluster_refresh *rf = rgroup->refresh;
+    sds cmd;
+    ssize_t n;
 
-    RMT_NOTUSED(rgroup);
-    RMT_NOTUSED(key);
-    RMT_NOTUSED(keylen);
-    
-    idx = clusterKeyHashSlot((char *)key, (int)keylen);
+    RMT_NOTUSED(mask);
 
-    return idx;
+    aeDeleteFileEvent(el, fd, AE_WRITABLE);
+
+    cmd = sdsempty();
+    if (rgroup->password) {
+        cmd = sdscatprintf(cmd, "*2\r\n$4\r\nAUTH\r\n$%zu\r\n%s\r\n", 
+            strlen(rgroup->password), rgroup->password);
+    }
+    cmd = sdscat(cmd, REDIS_COMMAND_CLUSTER_SLOTS);
+
+    n = rmt_write(fd, cmd, sdslen(cmd));
+    if (n != (ssize_t)sdslen(cmd)) {
+        log_warn("Send CLUSTER SLOTS to node[%s] failed: %s", rf->addr, 
+            n < 0 ? strerror(errno) : "partial write");
+        sdsfree(cmd);
+        redis_cluster_refresh_free(rgroup, 1);
+        return;
+    }
+    sdsfree(cmd);
+
+    if (aeCreateFileEvent(el, fd, AE_READABLE, 
+        cluster_refresh_read, rgroup) != AE_OK) {
+        log_error("ERROR: Create read event for CLUSTER SLOTS failed");
+        redis_cluster_refresh_free(rgroup, 1);
+    }
 }
 
-redis_node *
-redis_cluster_backend_node(redis_group *rgroup, uint8_t *key, uint32_t keylen)
+/*
+ * Called from the cron of the write or apply thread that owns the target 
+ * cluster group. A refresh of the route with CLUSTER SLOTS from a random node 
+ * starts when the target cluster replied -MOVED since the last one.
+ */
+void
+redis_cluster_refresh_cron(redis_group *rgroup, thread_data *tdata)
 {
-    uint32_t idx;
-    redis_node **node;
-    
-    RMT_NOTUSED(rgroup);
-    RMT_NOTUSED(key);
-    RMT_NOTUSED(keylen);
+    rmtContext *ctx = rgroup->ctx;
+    redis_cluster_refresh *rf = rgroup->refresh;
+    dictEntry *de;
+    redis_node *node;
+    long long moved;
 
-    idx = redis_cluster_backend_idx(rgroup, key, keylen);
+    if (rf != NULL) {
+        if (rmt_msec_now() - rf->start > REDIS_CLUSTER_REFRESH_TIMEOUT) {
+            log_warn("CLUSTER SLOTS from node[%s] timed out", rf->addr);
+            redis_cluster_refresh_free(rgroup, 1);
+        }
+        return;
+    }
 
-    ASSERT(idx < array_n(rgroup->route));
+    moved = ctx->cluster_moved;
+    if (moved == rgroup->moved) {
+        return;
+    }
 
-    node = array_get(rgroup->route, idx);
-    return *node;
+    /* dictGetRandomKey may rehash the dict INFO walks under the lock */
+    pthread_mutex_lock(&rgroup->nodes_mutex);
+    de = dictGetRandomKey(rgroup->nodes);
+    node = de != NULL ? dictGetVal(de) : NULL;
+    pthread_mutex_unlock(&rgroup->nodes_mutex);
+    if (node == NULL) {
+        return;
+    }
+
+    rf = rmt_zalloc(sizeof(*rf));
+    if (rf == NULL) {
+        log_error("ERROR: Out of memory");
+        return;
+    }
+    rf->rgroup = rgroup;
+    rf->tdata = tdata;
+    rf->start = rmt_msec_now();
+    rf->addr = sdsnew(node->addr);
+    rf->reply = sdsempty();
+    rf->tc = rmt_tcp_context_create();
+    rgroup->refresh = rf;
+    if (rf->addr == NULL || rf->reply == NULL || rf->tc == NULL) {
+        log_error("ERROR: Out of memory");
+        goto error;
+    }
+
+    rgroup->moved = moved;
+
+    rf->tc->flags &= ~RMT_BLOCK;
+    if (rmt_tcp_context_connect_addr(rf->tc, node->addr, 
+        (int)rmt_strlen(node->addr), NULL, NULL) != RMT_OK) {
+        log_warn("Connect to node[%s] for CLUSTER SLOTS failed", node->addr);
+        goto error;
+    }
+
+    if (aeCreateFileEvent(tdata->loop, rf->tc->sd, AE_WRITABLE, 
+        cluster_refresh_write, rgroup) != AE_OK) {
+        log_error("ERROR: Create write event for CLUSTER SLOTS failed");
+        goto error;
+    }
+
+    return;
+
+error:
+
+    redis_cluster_refresh_free(rgroup, 0);
 }
 
 /* ======================== Redis Cluster END ========================== */
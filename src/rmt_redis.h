@@ -25,6 +25,16 @@
 
 #define REDIS_RUN_ID_SIZE 40
 
+/* Max mbufs filled by one readv of the replication data */
+#define REDIS_REPL_READV_MBUFS      8
+
+/* Received replication offsets not acknowledged yet kept for the lag,
+ * they are merged two by two when there are more */
+#define REDIS_REPL_LAG_SAMPLES      64
+
+/* Max rdb bytes spliced from the socket into the file per read event */
+#define REDIS_RDB_SPLICE_SIZE       (1024*1024)
+
 #define REDIS_DATA_TYPE_UNKNOW      0
 #define REDIS_DATA_TYPE_RDB         1
 #define REDIS_DATA_TYPE_CMD         2
@@ -52,6 +62,17 @@
 #define REDIS_REPL_TRANSFER 12 /* Receiving .rdb from master */
 #define REDIS_REPL_CONNECTED 13 /* Connected to master */
 
+/* Connection state of the target node. Used in rnode->state. */
+#define REDIS_TARGET_NONE 0 /* Not connected, connect after rnode->conn_time */
+#define REDIS_TARGET_CONNECTING 1 /* Nonblocking connect in progress */
+#define REDIS_TARGET_HANDSHAKE 2 /* Wait for the AUTH reply */
+#define REDIS_TARGET_READY 3 /* Msgs can be sent */
+
+#define REDIS_TARGET_CONNECT_TIMEOUT 5000   /* ms to connect and handshake */
+#define REDIS_TARGET_RETRY_MIN 100          /* ms to reconnect after the first failure */
+#define REDIS_TARGET_RETRY_MAX 30000        /* ms to reconnect at most */
+#define REDIS_TARGET_RETRY_TIMES 12         /* times a msg is sent again for the transient errors */
+
 
 /* Slave replication state - from the point of view of the master.
  * In SEND_BULK and ONLINE state the slave receives new updates
@@ -84,19 +105,65 @@ typedef struct redis_rdb{
 
     sds fname;    		    /* rdb file name */
     int fd;         		/* rdb file descriptor */
+    int pipefds[2];         /* pipe to splice the rdb from the socket into the file */
 
     FILE *fp;       		/* rdb file to read */
     uint64_t cksum; 		/* for rdb checksum */
     void (*update_cksum)(struct redis_rdb *, const void *, size_t);
 
     int state;
-
-    uint8_t deleted:1;  		/* if the rdb file deleted after parse */
-    uint8_t received:1;         /* if the rdb file had received */
+    struct redis_node *rnode;   /* the source node of this rdb */
+    volatile int following;     /* if the rdb file is parsed while it is received */
+    volatile int waiting;       /* if the parser waits for more of the rdb file */
+
+    /* The flags below are written by the read thread and the write thread,
+     * so they are not bit fields, and the ones read by the other thread 
+     * are accessed with __atomic. */
+    int deleted;  		        /* if the rdb file deleted after parse */
+    int received;               /* if the rdb file had received */
+    int nosplice;               /* if the rdb file can not be written by splice */
+    int resumed;                /* if the replication resumed from the checkpoint without rdb */
+    int paused;                 /* if the parse was stopped by MIGRATE PAUSE or source_node_held() */
+
+    long obj_off;               /* offset in the rdb file of the object being parsed */
+    long long obj_parsed;       /* parsed_bytes at the object being parsed */
+    uint64_t obj_cksum;         /* cksum at the object being parsed */
+    int short_read;             /* if the followed rdb file ended in the object */
+
+    long long parsed_bytes;     /* bytes of the rdb file parsed */
+    long long parsed_keys;      /* keys of the rdb file parsed */
+    struct keyprofile *profile; /* profile of the keys parsed, NULL if disabled */
 
     int (*handler)(struct redis_node *, sds, int, struct array *, int, long long, void *);
 }redis_rdb;
 
+/* The replication bytes after the previous sample up to off, received 
+ * from time on. */
+typedef struct redis_repl_sample{
+    long long off;
+    long long time;             /* in milliseconds */
+}redis_repl_sample;
+
+/* Progress of the replication from a source node, updated every second 
+ * by the write thread of the node and read by INFO. */
+typedef struct redis_repl_progress{
+    redis_repl_sample samples[REDIS_REPL_LAG_SAMPLES];  /* offsets not acknowledged yet, oldest first */
+    uint32_t nsamples;
+    long long lag_step;         /* min time between two samples, doubled when they are merged */
+    long long time;                             /* last update, in milliseconds */
+
+    long long reploff;          /* replication offset received at the last update */
+    long long ack_off;          /* replication offset acknowledged by the target group, -1 if unknown */
+    long long lag_bytes;        /* replication bytes received and not acknowledged yet, -1 if unknown */
+    long long lag_msec;         /* since the oldest data not acknowledged yet was received, -1 if unknown */
+
+    long long rdb_parsed;       /* rdb bytes parsed at the last update */
+    long long rdb_keys;         /* rdb keys parsed at the last update */
+    double rdb_bytes_per_sec;   /* moving average of the rdb bytes parsed per second */
+    double rdb_keys_per_sec;    /* moving average of the rdb keys parsed per second */
+    long long rdb_eta_msec;     /* time to parse the rest of the rdb, -1 if unknown */
+}redis_repl_progress;
+
 /*redis replication*/
 typedef struct redis_repl{
     /* Static vars used to hold the EOF mark, and the last bytes received
@@ -119,8 +186,39 @@ typedef struct redis_repl{
     off_t repl_transfer_read;   /* Amount of RDB read from master during sync. */
     off_t repl_transfer_last_fsync_off; /* Offset when we fsync-ed last time. */
     long long repl_lastio;      /* Unix time of the latest read, for timeout. In milliseconds. */
+    int paused;                 /* reading from the master stopped by MIGRATE PAUSE */
+
+    struct mbuf *mbuf_spare[REDIS_REPL_READV_MBUFS-1]; /* pool mbufs readv after the current one */
+
+    redis_repl_progress progress;
 }redis_repl;
 
+/* The msgs sent to the target group for a batch of commands parsed 
+ * from the replication stream of a source node. */
+typedef struct redis_repl_ack{
+    struct redis_repl_ckpt *ckpt;
+    long long reploff;          /* replication offset after the commands, -1 for the rdb */
+    uint32_t pending;           /* msgs not acknowledged by the target group yet */
+    uint8_t open:1;             /* if the commands parsed next join this batch */
+    uint8_t lost:1;             /* if some msgs were dropped without the acknowledgement */
+}redis_repl_ack;
+
+/* The replication offset acknowledged by the target group, for the lag
+ * of the replication and, with 'checkpoint', saved as the checkpoint to 
+ * resume the replication with PSYNC after a restart. */
+typedef struct redis_repl_ckpt{
+    list *acks;                 /* type: redis_repl_ack */
+    sds fname;                  /* checkpoint file name */
+    char runid[REDIS_RUN_ID_SIZE+1];    /* master run id of the offsets */
+    long long rdb_off;          /* replication offset the rdb ends at */
+    long long parse_off;        /* replication offset parsed, -1 if unknown */
+    long long ack_off;          /* replication offset acknowledged, -1 if unknown */
+    long long saved_off;        /* replication offset saved in the checkpoint file */
+    int lost;                   /* msgs were lost, stop saving until the next full sync */
+    int save;                   /* if saved to the checkpoint file */
+    pthread_mutex_t mutex;      /* msgs are freed by the apply threads too */
+}redis_repl_ckpt;
+
 typedef struct redis_group{
     struct rmtContext *ctx;
     dict *nodes;
@@ -140,6 +238,10 @@ typedef struct redis_group{
     hash_t key_hash;
 
     uint32_t ncontinuum;	/* # continuum points */
+
+    long long moved;        /* ctx->cluster_moved that the route was refreshed for */
+    struct redis_cluster_refresh *refresh;  /* CLUSTER SLOTS in progress, or NULL */
+    pthread_mutex_t nodes_mutex;    /* held to add nodes or step their rehash after the threads started, and to read them from other threads */
 }redis_group;
 
 typedef struct redis_node{
@@ -165,7 +267,18 @@ typedef struct redis_node{
 
     list *send_data;        	/* used to cache the msg that will be sent. type: msg */
     list *sent_data;        	/* used to cache the msg that have be sent. type: msg */
+    list *retry_data;           /* used to cache the msg that will be sent again after retry_time. type: msg */
+    long long retry_time;
     struct msg *msg_rcv;    	/* used to recieve response msg from the target redis. */
+    struct mbuf *mbuf_rcv;  	/* used to scan simple responses from the target redis without a msg. */
+    struct mbuf *mbuf_spare;    /* readv from the target redis together with mbuf_rcv, holds the data not consumed yet. */
+    int iov_batch;              /* max iovecs gathered for one send to the target redis, adapted by the send results. */
+    int window_full;            /* sending stopped for max_inflight msgs waiting for the replies of the target redis. */
+    struct ratelimit *ratelimit;    /* token buckets of the target redis shared by the threads, NULL before the first send. */
+    int throttled;              /* sending stopped for the rate limits, target_node_cron sends again. */
+    int backlogged;             /* counted in ctx->targets_backlogged, see target_node_backlog(). */
+    rmt_zerocopy *zc;           /* MSG_ZEROCOPY state of the connection to the target redis. */
+    redis_repl_ckpt *ckpt;      /* replication checkpoint of the source redis, NULL if disabled. */
 
     int sockpairfds[2];         /* sorcketpair used to notice between read and write thread. 
                                                          *  sockpairfds[0]: read thread,  sockpairfds[1]: write thread
@@ -176,8 +289,33 @@ typedef struct redis_node{
     int sk_event;				/* used to run some task */
 
     struct redis_node *next;	/* next redis_node to begin replication */
+
+    long long used_memory;      /* used_memory of the source redis at startup, -1 if unknown. */
+    long long keys;             /* keys count of the source redis at startup, -1 if unknown. */
+    int lane;                   /* replication lane on its host assigned by the scheduler, -1 if not scheduled. */
+    int lane_order;             /* start order in the lane, the first node of a lane is 0. */
+
+    volatile long long msgs_inflight;   /* msgs of the source redis handed to the apply threads and not freed yet. */
+    list *apply_parked;                 /* msgs of the source redis waiting for a barrier msg, in order. */
+    int apply_barrier;                  /* a barrier msg was handed to the apply threads and is not freed yet. */
+    volatile int apply_blocked;         /* apply_barrier or apply_parked, the apply threads notice the write thread. */
+    int parse_held;                     /* parse_request stopped for source_node_held(), resumed by source_node_resume(). */
+    struct redis_node **apply_nodes;    /* the same target redis in every apply thread, NULL if no apply threads. */
+
+    int conn_retries;           /* failed connects to the target redis in a row. */
+    long long conn_time;        /* time to reconnect the target redis, or the deadline of the connect in progress. */
+    sds conn_reply;             /* handshake replies read from the target redis. */
+
+    histogram *latency;         /* send to reply latency of the msgs sent to the target redis. */
 }redis_node;
 
+/* A range of slots in the CLUSTER SLOTS reply and the addr of its master. */
+typedef struct redis_cluster_slots{
+    int start;
+    int stop;
+    sds addr;
+}redis_cluster_slots;
+
 int redis_replication_init(redis_repl *rr);
 void redis_replication_deinit(redis_repl *rr);
 int redis_node_init(redis_node *rnode, const char *addr, redis_group *rgroup);
@@ -189,6 +327,16 @@ int redis_rdb_init(redis_rdb *rdb, const char *addr, int type);
 void redis_rdb_deinit(redis_rdb *rdb);
 
 char *rmt_send_sync_cmd_read_line(int fd, ...);
+int redis_node_info_cost(redis_node *rnode);
+
+redis_node *redis_cluster_node_get(redis_group *rgroup, const char *addr, 
+    struct thread_data *tdata);
+int redis_cluster_redirect(redis_node *rnode, struct msg *r, struct msg *resp);
+redis_node *redis_cluster_msg_node(redis_group *rgroup, struct msg *r);
+void redis_cluster_refresh_cron(redis_group *rgroup, struct thread_data *tdata);
+char *redis_reply_skip(char *p, char *end);
+int redis_cluster_slots_parse(char *p, char *end, const char *from, 
+    struct array *slots);
 
 int rmtConnectRedisMaster(redis_node *srnode);
 
@@ -196,9 +344,23 @@ void rmtRedisSlaveOffline(redis_node *srnode);
 void rmtReceiveRdbAbort(redis_node *srnode);
 
 void redisSlaveReplCorn(redis_node *srnode);
+void redis_repl_pause(redis_node *srnode, int pause);
+
+void redis_repl_ack_rdb(redis_node *srnode, int end);
+void redis_repl_ack_parsed(redis_node *srnode, uint32_t len, int valid);
+void redis_repl_ack_batch(redis_node *srnode);
+void redis_repl_ack_msg(redis_node *srnode, struct msg *msg);
+void redis_repl_ack_put(struct msg *msg);
+int redis_repl_checkpoint_save(redis_node *srnode);
+void redis_repl_lag_update(redis_repl_progress *progress, long long reploff,
+    long long ack_off, long long now);
+void redis_repl_progress_update(redis_node *srnode, long long now);
 
 void redis_parse_req_rdb(struct msg *r);
 
+const char *redis_command_name(msg_type_t type);
+size_t redis_msg_first_key(struct msg *r, uint8_t *buf, size_t size);
+
 void redis_parse_req(struct msg *r);
 void redis_parse_rsp(struct msg *r);
 
@@ -210,6 +372,8 @@ int redis_fragment(struct redis_group *rgroup,
     struct msg *r, uint32_t ncontinuum, list *frag_msgl);
 
 int redis_response_check(redis_node *rnode, struct msg *r);
+int redis_response_check_line(redis_node *rnode, struct msg *r, uint8_t *line, uint32_t len);
+void redis_response_line_done(redis_node *rnode, struct msg *r);
 
 void redis_rdb_update_checksum(redis_rdb *rdb, const void *buf, size_t len);
 
@@ -218,6 +382,7 @@ void redis_delete_rdb_file(redis_rdb *rdb, int always);
 int redis_parse_rdb_file(redis_node *srnode, int mbuf_count_one_time);
 int redis_parse_rdb_time(aeEventLoop *el, long long id, void *privdata);
 void redis_parse_rdb(aeEventLoop *el, int fd, void *privdata, int mask);
+void redis_parse_rdb_resume(redis_node *srnode);
 
 int redis_load_aof_file(redis_node *srnode, char *aof_file);
 
@@ -243,6 +408,7 @@ sds redis_msg_response_get_bulk_string(struct msg *msg);
 int redis_append_bulk(struct msg *r, uint8_t *str, uint32_t str_len);
 int redis_msg_append_multi_bulk_len_full(struct msg *msg, uint32_t integer);
 int redis_msg_append_bulk_full(struct msg *msg, const char *str, uint32_t len);
+int redis_msg_append_bulk_sds(struct msg *msg, sds *str);
 int redis_msg_append_command_full(struct msg * msg, ...);
 int redis_msg_append_command_full_safe(struct msg * msg, struct array *args);
 struct msg *redis_generate_msg_with_key_value(struct rmtContext *ctx, mbuf_base *mb, int data_type, sds key, struct array *value, int expiretime_type, sds expiretime);
@@ -0,0 +1,283 @@
+/*
+ * Perfect hash over the redis command names, generated by
+ * scripts/rmt_cmdhash.py from redis_command_table in rmt_redis.c.
+ * Do not edit by hand, rerun the script after adding a command.
+ */
+
+#ifndef _RMT_REDIS_CMDHASH_H_
+#define _RMT_REDIS_CMDHASH_H_
+
+#define REDIS_CMDHASH_BUCKETS   64
+#define REDIS_CMDHASH_SLOTS     256
+
+static const uint16_t redis_cmdhash_disp[REDIS_CMDHASH_BUCKETS] = {
+      0,   0,   0,   1,   0,   0,   0,   0,
+      4,   1,   7,   5,   2,   0,   0,   0,
+      0,   3,   0,   1,   1,   0,   0,   0,
+      0,   0,   1,   1,   1,   5,   3,   1,
+      3,   0,   1,   0,   1,   0,   0,   1,
+      0,   0,   2,   0,   2,   2,   0,   2,
+      0,   1,   1,   5,   0,   1,   0,   3,
+      0,   0,   0,   0,   0,   0,   2,   2,
+};
+
+static const uint16_t redis_cmdhash_slot[REDIS_CMDHASH_SLOTS] = {
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_ZLEXCOUNT,
+    MSG_REQ_REDIS_SISMEMBER,
+    MSG_REQ_REDIS_MGET,
+    MSG_REQ_REDIS_SPOP,
+    MSG_REQ_REDIS_LINSERT,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_EXEC,
+    MSG_REQ_REDIS_LRANGE,
+    MSG_REQ_REDIS_GET,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_MSET,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_ZCARD,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_LSET,
+    MSG_REQ_REDIS_HINCRBY,
+    MSG_REQ_REDIS_ZSCORE,
+    MSG_REQ_REDIS_SUNION,
+    MSG_REQ_REDIS_ZRANGE,
+    MSG_REQ_REDIS_LPOP,
+    MSG_REQ_REDIS_HGETALL,
+    MSG_REQ_REDIS_SETBIT,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_LTRIM,
+    MSG_REQ_REDIS_SLOWLOG,
+    MSG_REQ_REDIS_BITCOUNT,
+    MSG_REQ_REDIS_SADD,
+    MSG_REQ_REDIS_SETRANGE,
+    MSG_REQ_REDIS_SHUTDOWN,
+    MSG_REQ_REDIS_SET,
+    MSG_REQ_REDIS_TYPE,
+    MSG_REQ_REDIS_SORT,
+    MSG_REQ_REDIS_ASKING,
+    MSG_REQ_REDIS_TTL,
+    MSG_REQ_REDIS_ZRANGEBYSCORE,
+    MSG_REQ_REDIS_HEXISTS,
+    MSG_REQ_REDIS_SSCAN,
+    MSG_REQ_REDIS_SINTER,
+    MSG_REQ_REDIS_RPOP,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_GETSET,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_HSETNX,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_GETBIT,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_PFDEBUG,
+    MSG_REQ_REDIS_SCRIPT,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_PTTL,
+    MSG_REQ_REDIS_AUTH,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_EXPIRE,
+    MSG_REQ_REDIS_HGET,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_LPUSH,
+    MSG_REQ_REDIS_PEXPIRE,
+    MSG_REQ_REDIS_ZINCRBY,
+    MSG_REQ_REDIS_MOVE,
+    MSG_REQ_REDIS_BRPOPLPUSH,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_HLEN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_SRANDMEMBER,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_INCRBY,
+    MSG_REQ_REDIS_DUMP,
+    MSG_REQ_REDIS_ZINTERSTORE,
+    MSG_REQ_REDIS_SETEX,
+    MSG_REQ_REDIS_GEORADIUSBYMEMBER,
+    MSG_REQ_REDIS_COMMAND,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_PING,
+    MSG_REQ_REDIS_HVALS,
+    MSG_REQ_REDIS_DEL,
+    MSG_REQ_REDIS_SCARD,
+    MSG_REQ_REDIS_ZRANK,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_PFMERGE,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_SETNX,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_ZREMRANGEBYRANK,
+    MSG_REQ_REDIS_HKEYS,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_RPUSH,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_PERSIST,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_ZCOUNT,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_ZREM,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_HINCRBYFLOAT,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_FLUSHALL,
+    MSG_REQ_REDIS_FLUSHDB,
+    MSG_REQ_REDIS_QUIT,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_SDIFF,
+    MSG_REQ_REDIS_INCRBYFLOAT,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_PEXPIREAT,
+    MSG_REQ_REDIS_GEOADD,
+    MSG_REQ_REDIS_ZREVRANGE,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_APPEND,
+    MSG_REQ_REDIS_RENAMENX,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_GETRANGE,
+    MSG_REQ_REDIS_ZREMRANGEBYSCORE,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_EXPIREAT,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_MSETNX,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_PSETEX,
+    MSG_REQ_REDIS_INFO,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_HDEL,
+    MSG_REQ_REDIS_LINDEX,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_STRLEN,
+    MSG_REQ_REDIS_RPUSHX,
+    MSG_REQ_REDIS_ZUNIONSTORE,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_EXISTS,
+    MSG_REQ_REDIS_SMOVE,
+    MSG_REQ_REDIS_SELECT,
+    MSG_REQ_REDIS_HSET,
+    MSG_REQ_REDIS_INCR,
+    MSG_REQ_REDIS_ZADD,
+    MSG_REQ_REDIS_PUBLISH,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_HSCAN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_RESTOREASKING,
+    MSG_REQ_REDIS_LPUSHX,
+    MSG_REQ_REDIS_ZREVRANGEBYSCORE,
+    MSG_REQ_REDIS_MIGRATE,
+    MSG_REQ_REDIS_RESTORE,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_EVAL,
+    MSG_REQ_REDIS_BITFIELD,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_BITOP,
+    MSG_REQ_REDIS_MULTI,
+    MSG_REQ_REDIS_GEORADIUS,
+    MSG_REQ_REDIS_ZREVRANK,
+    MSG_REQ_REDIS_PFCOUNT,
+    MSG_REQ_REDIS_SREM,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_EVALSHA,
+    MSG_REQ_REDIS_SINTERSTORE,
+    MSG_REQ_REDIS_DECR,
+    MSG_REQ_REDIS_ZREMRANGEBYLEX,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_ZSCAN,
+    MSG_REQ_REDIS_SUNIONSTORE,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_SDIFFSTORE,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_LLEN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_HMSET,
+    MSG_REQ_REDIS_ZRANGEBYLEX,
+    MSG_REQ_REDIS_PFADD,
+    MSG_REQ_REDIS_SMEMBERS,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_RENAME,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_DECRBY,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_RPOPLPUSH,
+    MSG_REQ_REDIS_LREM,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_HMGET,
+    MSG_UNKNOWN,
+    MSG_UNKNOWN,
+    MSG_REQ_REDIS_CONFIG,
+};
+
+#endif
@@ -0,0 +1,92 @@
+
+#include <rmt_core.h>
+
+static void
+slowlog_entry_free(void *value)
+{
+    slowlog_entry *se = value;
+
+    sdsfree(se->command);
+    sdsfree(se->key);
+    sdsfree(se->node);
+    rmt_free(se);
+}
+
+int
+slowlog_init(slowlog *sl)
+{
+    sl->next_id = 0;
+
+    sl->entries = listCreate();
+    if (sl->entries == NULL) {
+        return RMT_ENOMEM;
+    }
+    listSetFreeMethod(sl->entries, slowlog_entry_free);
+
+    pthread_mutex_init(&sl->lock, NULL);
+
+    return RMT_OK;
+}
+
+void
+slowlog_deinit(slowlog *sl)
+{
+    if (sl->entries == NULL) {
+        return;
+    }
+
+    listRelease(sl->entries);
+    sl->entries = NULL;
+    pthread_mutex_destroy(&sl->lock);
+}
+
+/*
+ * Add an entry at the head and drop the oldest ones beyond max_len. The key
+ * of keylen bytes is truncated to the SLOWLOG_ENTRY_MAX_STRING bytes at key
+ * like the arguments in the redis slowlog.
+ */
+void
+slowlog_push(slowlog *sl, long long max_len, const char *command,
+    uint8_t *key, size_t keylen, const char *node, long long duration)
+{
+    slowlog_entry *se;
+
+    if (max_len <= 0) {
+        return;
+    }
+
+    se = rmt_alloc(sizeof(*se));
+    if (se == NULL) {
+        return;
+    }
+
+    se->time = rmt_msec_now()/1000;
+    se->duration = duration;
+    se->command = sdsnew(command != NULL ? command : "unknown");
+    if (keylen > SLOWLOG_ENTRY_MAX_STRING) {
+        se->key = sdsnewlen(key, SLOWLOG_ENTRY_MAX_STRING);
+        se->key = sdscatprintf(se->key, "... (%zu more bytes)",
+            keylen - SLOWLOG_ENTRY_MAX_STRING);
+    } else {
+        se->key = sdsnewlen(key, keylen);
+    }
+    se->node = sdsnew(node);
+
+    pthread_mutex_lock(&sl->lock);
+    se->id = sl->next_id++;
+    listAddNodeHead(sl->entries, se);
+    while ((long long)listLength(sl->entries) > max_len) {
+        listDelNode(sl->entries, listLast(sl->entries));
+    }
+    pthread_mutex_unlock(&sl->lock);
+}
+
+void
+slowlog_reset(slowlog *sl)
+{
+    pthread_mutex_lock(&sl->lock);
+    while (listLength(sl->entries) > 0) {
+        listDelNode(sl->entries, listFirst(sl->entries));
+    }
+    pthread_mutex_unlock(&sl->lock);
+}
@@ -0,0 +1,33 @@
+#ifndef _RMT_SLOWLOG_H_
+#define _RMT_SLOWLOG_H_
+
+#define SLOWLOG_ENTRY_MAX_STRING    128     /* bytes of the key kept in an entry */
+
+/* A command whose reply took longer than slowlog_log_slower_than. */
+typedef struct slowlog_entry{
+    long long id;               /* unique and growing */
+    long long time;             /* unix time of the reply, in seconds */
+    long long duration;         /* microseconds from the send to the reply */
+    sds command;
+    sds key;                    /* the first key, or empty */
+    sds node;                   /* address of the target node */
+}slowlog_entry;
+
+/*
+ * The slowest round trips to the target group, newest first. The threads
+ * sending to the target group push the entries, the listen port reads
+ * them with SLOWLOG.
+ */
+typedef struct slowlog{
+    pthread_mutex_t lock;
+    list *entries;              /* type: slowlog_entry */
+    long long next_id;
+}slowlog;
+
+int slowlog_init(slowlog *sl);
+void slowlog_deinit(slowlog *sl);
+void slowlog_push(slowlog *sl, long long max_len, const char *command,
+    uint8_t *key, size_t keylen, const char *node, long long duration);
+void slowlog_reset(slowlog *sl);
+
+#endif
@@ -0,0 +1,462 @@
+
+#include <rmt_core.h>
+
+#include <lzf/lzf.h>
+
+/*
+ * Every spilled mbuf is a record in the segment file:
+ * a header of the data length and the compressed length
+ * (0 if it is not compressed), followed by the data.
+ */
+#define SPILLLIST_HEADER_SIZE   (2*sizeof(uint32_t))
+
+static sds spilllist_segment_name(spilllist *sl, int seg)
+{
+    return sdscatfmt(sdsempty(), "%S-%i.spill", sl->prefix, seg);
+}
+
+static int spilllist_segment_open(spilllist *sl, int seg, int flags)
+{
+    int fd;
+    sds fname;
+
+    fname = spilllist_segment_name(sl, seg);
+    if (fname == NULL) {
+        return -1;
+    }
+
+    fd = open(fname, flags, 0644);
+    if (fd < 0) {
+        log_error("ERROR: Open spill file %s failed: %s",
+            fname, strerror(errno));
+    }
+    sdsfree(fname);
+
+    return fd;
+}
+
+static void spilllist_segment_remove(spilllist *sl, int seg)
+{
+    sds fname;
+
+    fname = spilllist_segment_name(sl, seg);
+    if (fname == NULL) {
+        return;
+    }
+
+    unlink(fname);
+    sdsfree(fname);
+}
+
+spilllist *spilllist_create(struct mbuf_base *mb, const char *prefix,
+    long long limit, int compress)
+{
+    spilllist *sl;
+
+    sl = rmt_alloc(sizeof(*sl));
+    if (sl == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&sl->lmutex,NULL);
+
+    sl->l = NULL;
+    sl->tail = NULL;
+    sl->mb = mb;
+    sl->prefix = NULL;
+    sl->limit = limit;
+    sl->compress = compress;
+    sl->nspilled = 0;
+    sl->failed = 0;
+    sl->wfd = -1;
+    sl->wseg = 0;
+    sl->wsize = 0;
+    sl->wbuf = NULL;
+    sl->rfd = -1;
+    sl->rseg = 0;
+    sl->rbuf = NULL;
+    sl->rsize = MAX(SPILLLIST_READ_AHEAD,
+        mbuf_data_size(mb) + SPILLLIST_HEADER_SIZE);
+    sl->rpos = 0;
+    sl->rlast = 0;
+
+    sl->l = listCreate();
+    sl->tail = listCreate();
+    sl->prefix = sdsnew(prefix);
+    if (sl->l == NULL || sl->tail == NULL || sl->prefix == NULL) {
+        spilllist_free(sl);
+        return NULL;
+    }
+
+    if (compress) {
+        sl->wbuf = rmt_alloc(mbuf_data_size(mb));
+        if (sl->wbuf == NULL) {
+            spilllist_free(sl);
+            return NULL;
+        }
+    }
+
+    return sl;
+}
+
+static int spilllist_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return RMT_ERROR;
+        }
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov ++;
+            iovcnt --;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+
+    return RMT_OK;
+}
+
+/* Append the mbuf to the segment file, only called by the pushing thread. */
+static int spilllist_write(spilllist *sl, struct mbuf *mbuf)
+{
+    uint32_t hdr[2];
+    struct iovec iov[2];
+    uint32_t len, clen;
+
+    if (sl->wfd < 0 || sl->wsize >= SPILLLIST_SEGMENT_SIZE) {
+        if (sl->wfd >= 0) {
+            close(sl->wfd);
+            sl->wfd = -1;
+            sl->wseg ++;
+        }
+
+        sl->wfd = spilllist_segment_open(sl, sl->wseg,
+            O_WRONLY|O_CREAT|O_TRUNC|O_APPEND);
+        if (sl->wfd < 0) {
+            return RMT_ERROR;
+        }
+        sl->wsize = 0;
+    }
+
+    len = mbuf_length(mbuf);
+    hdr[0] = len;
+    hdr[1] = 0;
+    iov[1].iov_base = mbuf->pos;
+    iov[1].iov_len = len;
+
+    if (sl->compress && len > 4) {
+        clen = lzf_compress(mbuf->pos, len, sl->wbuf, len - 1);
+        if (clen > 0) {
+            hdr[1] = clen;
+            iov[1].iov_base = sl->wbuf;
+            iov[1].iov_len = clen;
+        }
+    }
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = SPILLLIST_HEADER_SIZE;
+
+    if (spilllist_writev(sl->wfd, iov, 2) != RMT_OK) {
+        log_error("ERROR: Write spill file %s-%d.spill failed: %s",
+            sl->prefix, sl->wseg, strerror(errno));
+        return RMT_ERROR;
+    }
+    sl->wsize += SPILLLIST_HEADER_SIZE + (hdr[1] > 0 ? hdr[1] : len);
+
+    return RMT_OK;
+}
+
+/* Read ahead the segment file, returns 0 at the end of the file. */
+static ssize_t spilllist_fill(spilllist *sl)
+{
+    ssize_t n;
+
+    if (sl->rpos > 0) {
+        memmove(sl->rbuf, sl->rbuf + sl->rpos, sl->rlast - sl->rpos);
+        sl->rlast -= sl->rpos;
+        sl->rpos = 0;
+    }
+
+    do {
+        n = read(sl->rfd, sl->rbuf + sl->rlast, sl->rsize - sl->rlast);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0) {
+        sl->rlast += (size_t)n;
+    }
+
+    return n;
+}
+
+static int spilllist_segment_next(spilllist *sl)
+{
+    if (sl->rfd >= 0) {
+        close(sl->rfd);
+        sl->rfd = -1;
+        spilllist_segment_remove(sl, sl->rseg);
+        sl->rseg ++;
+    }
+
+    sl->rfd = spilllist_segment_open(sl, sl->rseg, O_RDONLY);
+    if (sl->rfd < 0) {
+        return RMT_ERROR;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(sl->rfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    sl->rpos = 0;
+    sl->rlast = 0;
+
+    return RMT_OK;
+}
+
+/* Read the next spilled mbuf back, only called by the popping thread.
+ * The record is complete in the file, as it was counted in nspilled. */
+static struct mbuf *spilllist_read(spilllist *sl)
+{
+    uint32_t hdr[2];
+    size_t avail, size = 0;
+    ssize_t n;
+    uint8_t *data;
+    struct mbuf *mbuf;
+
+    if (sl->rbuf == NULL) {
+        sl->rbuf = rmt_alloc(sl->rsize);
+        if (sl->rbuf == NULL) {
+            log_error("ERROR: Out of memory");
+            return NULL;
+        }
+    }
+
+    if (sl->rfd < 0 && spilllist_segment_next(sl) != RMT_OK) {
+        return NULL;
+    }
+
+    for (;;) {
+        avail = sl->rlast - sl->rpos;
+        if (avail >= SPILLLIST_HEADER_SIZE) {
+            memcpy(hdr, sl->rbuf + sl->rpos, SPILLLIST_HEADER_SIZE);
+            size = hdr[1] > 0 ? hdr[1] : hdr[0];
+            if (hdr[0] > mbuf_data_size(sl->mb) || hdr[1] > hdr[0]) {
+                log_error("ERROR: Spill file %s-%d.spill is corrupted",
+                    sl->prefix, sl->rseg);
+                return NULL;
+            }
+
+            if (avail >= SPILLLIST_HEADER_SIZE + size) {
+                break;
+            }
+        }
+
+        n = spilllist_fill(sl);
+        if (n < 0) {
+            log_error("ERROR: Read spill file %s-%d.spill failed: %s",
+                sl->prefix, sl->rseg, strerror(errno));
+            return NULL;
+        } else if (n == 0) {
+            if (avail > 0) {
+                log_error("ERROR: Spill file %s-%d.spill is truncated",
+                    sl->prefix, sl->rseg);
+                return NULL;
+            }
+
+            /* The record is in the next segment file. */
+            if (spilllist_segment_next(sl) != RMT_OK) {
+                return NULL;
+            }
+        }
+    }
+
+    mbuf = mbuf_get(sl->mb);
+    if (mbuf == NULL) {
+        log_error("ERROR: Mbuf get failed: Out of memory");
+        return NULL;
+    }
+
+    data = sl->rbuf + sl->rpos + SPILLLIST_HEADER_SIZE;
+    if (hdr[1] > 0) {
+        if (lzf_decompress(data, hdr[1], mbuf->last, mbuf_size(mbuf)) != hdr[0]) {
+            log_error("ERROR: Decompress spill file %s-%d.spill failed",
+                sl->prefix, sl->rseg);
+            mbuf_put(mbuf);
+            return NULL;
+        }
+    } else {
+        memcpy(mbuf->last, data, hdr[0]);
+    }
+    mbuf->last += hdr[0];
+    sl->rpos += SPILLLIST_HEADER_SIZE + size;
+
+    return mbuf;
+}
+
+int spilllist_push(void *l, void *value)
+{
+    spilllist *sl = l;
+    struct mbuf *mbuf = value;
+    int ret;
+
+    if (sl == NULL || sl->l == NULL) {
+        return RMT_ERROR;
+    }
+
+    pthread_mutex_lock(&sl->lmutex);
+    if (sl->failed) {
+        listAddNodeTail(sl->tail, mbuf);
+        pthread_mutex_unlock(&sl->lmutex);
+        return RMT_OK;
+    }
+
+    /* Keep in memory until the limit, and until all the
+     * spilled mbufs were read back to keep the order. */
+    if (sl->nspilled == 0 && (long long)listLength(sl->l) < sl->limit) {
+        listAddNodeTail(sl->l, mbuf);
+        pthread_mutex_unlock(&sl->lmutex);
+        return RMT_OK;
+    }
+    pthread_mutex_unlock(&sl->lmutex);
+
+    ret = spilllist_write(sl, mbuf);
+
+    pthread_mutex_lock(&sl->lmutex);
+    if (ret == RMT_OK) {
+        sl->nspilled ++;
+    } else {
+        log_warn("WARNING: Spilling failed, keep the data in memory");
+        sl->failed = 1;
+        listAddNodeTail(sl->tail, mbuf);
+    }
+    pthread_mutex_unlock(&sl->lmutex);
+
+    if (ret == RMT_OK) {
+        mbuf_put(mbuf);
+    }
+
+    return RMT_OK;
+}
+
+void *spilllist_pop(void *l)
+{
+    spilllist *sl = l;
+    listNode *node;
+    void *value;
+
+    if (sl == NULL || sl->l == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sl->lmutex);
+
+    node = listFirst(sl->l);
+    if (node == NULL && sl->nspilled == 0) {
+        node = listFirst(sl->tail);
+        if (node != NULL) {
+            value = listNodeValue(node);
+            listDelNode(sl->tail, node);
+            pthread_mutex_unlock(&sl->lmutex);
+            return value;
+        }
+    }
+
+    if (node != NULL) {
+        value = listNodeValue(node);
+        listDelNode(sl->l, node);
+        pthread_mutex_unlock(&sl->lmutex);
+        return value;
+    }
+
+    if (sl->nspilled == 0) {
+        pthread_mutex_unlock(&sl->lmutex);
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&sl->lmutex);
+
+    value = spilllist_read(sl);
+    if (value == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sl->lmutex);
+    sl->nspilled --;
+    pthread_mutex_unlock(&sl->lmutex);
+
+    return value;
+}
+
+void spilllist_free(void *l)
+{
+    spilllist *sl = l;
+    int seg;
+
+    if (sl == NULL) {
+        return;
+    }
+
+    if (sl->l != NULL) {
+        listRelease(sl->l);
+    }
+
+    if (sl->tail != NULL) {
+        listRelease(sl->tail);
+    }
+
+    if (sl->wfd >= 0) {
+        close(sl->wfd);
+    }
+
+    if (sl->rfd >= 0) {
+        close(sl->rfd);
+    }
+
+    if (sl->prefix != NULL) {
+        if (sl->wfd >= 0) {
+            for (seg = sl->rseg; seg <= sl->wseg; seg ++) {
+                spilllist_segment_remove(sl, seg);
+            }
+        }
+        sdsfree(sl->prefix);
+    }
+
+    if (sl->wbuf != NULL) {
+        rmt_free(sl->wbuf);
+    }
+
+    if (sl->rbuf != NULL) {
+        rmt_free(sl->rbuf);
+    }
+
+    pthread_mutex_destroy(&sl->lmutex);
+
+    rmt_free(sl);
+}
+
+long long spilllist_length(void *l)
+{
+    spilllist *sl = l;
+    long long length;
+
+    if (sl == NULL || sl->l == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&sl->lmutex);
+    length = (long long)listLength(sl->l) + sl->nspilled +
+        (long long)listLength(sl->tail);
+    pthread_mutex_unlock(&sl->lmutex);
+
+    return length;
+}
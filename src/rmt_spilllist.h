@@ -0,0 +1,46 @@
+#ifndef _RMT_SPILLLIST_H_
+#define _RMT_SPILLLIST_H_
+
+#define SPILLLIST_SEGMENT_SIZE  67108864    /* roll to a new segment file after 64mb */
+#define SPILLLIST_READ_AHEAD    1048576     /* read the segment files 1mb at a time */
+
+struct mbuf_base;
+
+/*
+ * Multi-thread safe list of mbufs for one pushing thread and one
+ * popping thread. Beyond the limit of mbufs in memory, the mbufs are
+ * appended to segment files (optionally compressed with lzf), and pop
+ * reads them back in order once the mbufs in memory are used up.
+ */
+typedef struct spilllist{
+    list *l;                    /* mbufs in memory, before the spilled ones */
+    list *tail;                 /* mbufs after the spilled ones, if spilling failed */
+    pthread_mutex_t lmutex;
+
+    struct mbuf_base *mb;       /* used to get the mbufs read back */
+    sds prefix;                 /* segment file name prefix */
+    long long limit;            /* max mbufs in memory before spilling */
+    int compress;               /* compress the spilled mbufs with lzf */
+
+    long long nspilled;         /* mbufs in the segment files not read back yet */
+    int failed;                 /* spilling failed, keep the rest in memory */
+
+    int wfd;                    /* segment file written by push */
+    int wseg;
+    size_t wsize;
+    uint8_t *wbuf;              /* lzf output */
+
+    int rfd;                    /* segment file read by pop */
+    int rseg;
+    uint8_t *rbuf;              /* read ahead buffer */
+    size_t rsize, rpos, rlast;
+}spilllist;
+
+spilllist *spilllist_create(struct mbuf_base *mb, const char *prefix,
+    long long limit, int compress);
+int spilllist_push(void *l, void *value);
+void *spilllist_pop(void *l);
+void spilllist_free(void *l);
+long long spilllist_length(void *l);
+
+#endif
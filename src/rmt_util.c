@@ -486,6 +486,19 @@ rmt_msec_now(void)
     return rmt_usec_now() / 1000LL;
 }
 
+/*
+ * Return the monotonic time in nanoseconds, to measure latencies
+ */
+long long
+rmt_nsec_monotonic(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 static char *
 _safe_utoa(int _base, uint64_t val, char *buf)
 {
@@ -1142,3 +1155,35 @@ int stringmatch(const char *pattern, const char *string, int nocase) {
     return stringmatchlen(pattern,strlen(pattern),string,strlen(string),nocase);
 }
 
+
+#ifdef HAVE_SCHED_SETAFFINITY
+/* Parse a cpu list like "0-3,8,10-11", the format of the sysfs cpulist
+ * files, into set. */
+int rmt_cpu_list_parse(const char *s, cpu_set_t *set) {
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    while (*s != '\0' && *s != '\n') {
+        lo = strtol(s, &end, 10);
+        if (end == s || lo < 0 || lo >= CPU_SETSIZE) return RMT_ERROR;
+        hi = lo;
+        s = end;
+        if (*s == '-') {
+            s++;
+            hi = strtol(s, &end, 10);
+            if (end == s || hi < lo || hi >= CPU_SETSIZE) return RMT_ERROR;
+            s = end;
+        }
+        for (; lo <= hi; lo++) CPU_SET((size_t)lo, set);
+
+        if (*s == ',') {
+            s++;
+        } else if (*s != '\0' && *s != '\n') {
+            return RMT_ERROR;
+        }
+    }
+
+    return RMT_OK;
+}
+#endif
@@ -13,6 +13,14 @@
 
 #define NELEMS(a)           ((sizeof(a)) / sizeof((a)[0]))
 
+#if defined(__GNUC__)
+#define rmt_likely(x)       __builtin_expect(!!(x), 1)
+#define rmt_unlikely(x)     __builtin_expect(!!(x), 0)
+#else
+#define rmt_likely(x)       (x)
+#define rmt_unlikely(x)     (x)
+#endif
+
 #define MIN(a, b)           ((a) < (b) ? (a) : (b))
 #define MAX(a, b)           ((a) > (b) ? (a) : (b))
 
@@ -176,6 +184,7 @@ int _scnprintf(char *buf, size_t size, const char *fmt, ...);
 int _vscnprintf(char *buf, size_t size, const char *fmt, va_list args);
 long long rmt_usec_now(void);
 long long rmt_msec_now(void);
+long long rmt_nsec_monotonic(void);
 
 /*
  * Wrapper around common routines for manipulating C character
@@ -432,5 +441,10 @@ sds getAbsolutePath(char *filename);
 int stringmatchlen(const char *pattern, int patternLen, const char *string, int stringLen, int nocase);
 int stringmatch(const char *pattern, const char *string, int nocase);
 
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+int rmt_cpu_list_parse(const char *s, cpu_set_t *set);
+#endif
+
 #endif
 
@@ -0,0 +1,26 @@
+#ifndef _RMT_TEST_H_
+#define _RMT_TEST_H_
+
+#include <stdio.h>
+
+/*
+ * Checks of the unit tests run by make check. A failed check is printed
+ * and the test goes on, the test exits with 1 if any check failed.
+ */
+static int test_failed = 0;
+
+#define test_assert(_c) do {                                            \
+    if (!(_c)) {                                                        \
+        fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #_c); \
+        test_failed ++;                                                 \
+    }                                                                   \
+} while (0)
+
+#define test_done() do {                                                \
+    if (test_failed > 0) {                                              \
+        fprintf(stderr, "%d checks failed\n", test_failed);             \
+    }                                                                   \
+    return test_failed > 0 ? 1 : 0;                                     \
+} while (0)
+
+#endif
@@ -0,0 +1,110 @@
+#include <rmt_core.h>
+
+#include "rmt_test.h"
+
+#define TEST_FROM   "10.0.0.9:7000"
+
+/* Two masters, the first with a replica and the node ids of redis 4. */
+#define TEST_SLOTS                                                          \
+    "*2\r\n"                                                                \
+    "*4\r\n:0\r\n:8191\r\n"                                                 \
+        "*3\r\n$8\r\n10.0.0.1\r\n:7001\r\n$4\r\nid-1\r\n"                   \
+        "*3\r\n$8\r\n10.0.0.2\r\n:7002\r\n$4\r\nid-2\r\n"                   \
+    "*3\r\n:8192\r\n:16383\r\n"                                             \
+        "*2\r\n$0\r\n\r\n:7003\r\n"
+
+static void test_slots_free(struct array *slots)
+{
+    redis_cluster_slots *range;
+
+    while (array_n(slots) > 0) {
+        range = array_pop(slots);
+        sdsfree(range->addr);
+    }
+}
+
+static int test_parse(const char *reply, struct array *slots)
+{
+    sds s = sdsnew(reply);
+    int ret;
+
+    test_slots_free(slots);
+    ret = redis_cluster_slots_parse(s, s + sdslen(s), TEST_FROM, slots);
+    sdsfree(s);
+
+    return ret;
+}
+
+static void test_skip(void)
+{
+    sds s = sdsnew(TEST_SLOTS "+OK\r\n");
+    size_t len = strlen(TEST_SLOTS), n;
+    char buf[512];
+
+    test_assert(redis_reply_skip(s, s + sdslen(s)) == s + len);
+
+    /* never complete before the last byte */
+    for (n = 0; n < len; n ++) {
+        memcpy(buf, s, n);
+        test_assert(redis_reply_skip(buf, buf + n) == NULL);
+    }
+
+    sdsfree(s);
+
+    s = sdsnew("$-1\r\n-ERR no\r\n:1\r\n$3\r\na\r\n\r\n");
+    test_assert(redis_reply_skip(s, s + sdslen(s)) == s + 5);
+    test_assert(redis_reply_skip(s + 5, s + sdslen(s)) == s + 14);
+    test_assert(redis_reply_skip(s + 14, s + sdslen(s)) == s + 18);
+    /* the bulk holds the crlf */
+    test_assert(redis_reply_skip(s + 18, s + sdslen(s)) == s + sdslen(s));
+    sdsfree(s);
+}
+
+static void test_parse_slots(void)
+{
+    struct array *slots = array_create(4, sizeof(redis_cluster_slots));
+    redis_cluster_slots *range;
+
+    test_assert(test_parse(TEST_SLOTS, slots) == RMT_OK);
+    test_assert(array_n(slots) == 2);
+    if (array_n(slots) == 2) {
+        range = array_get(slots, 0);
+        test_assert(range->start == 0 && range->stop == 8191);
+        test_assert(strcmp(range->addr, "10.0.0.1:7001") == 0);
+
+        /* the empty ip is the one of the node asked */
+        range = array_get(slots, 1);
+        test_assert(range->start == 8192 && range->stop == 16383);
+        test_assert(strcmp(range->addr, "10.0.0.9:7003") == 0);
+    }
+
+    /* a cluster with no slots assigned */
+    test_assert(test_parse("*0\r\n", slots) == RMT_OK);
+    test_assert(array_n(slots) == 0);
+
+    /* bad replies */
+    test_assert(test_parse("-ERR This instance has cluster support disabled\r\n",
+        slots) == RMT_ERROR);
+    test_assert(test_parse("*1\r\n*3\r\n:0\r\n:16384\r\n"
+        "*2\r\n$8\r\n10.0.0.1\r\n:7001\r\n", slots) == RMT_ERROR);
+    test_assert(test_parse("*1\r\n*3\r\n:9\r\n:8\r\n"
+        "*2\r\n$8\r\n10.0.0.1\r\n:7001\r\n", slots) == RMT_ERROR);
+    test_assert(test_parse("*1\r\n*2\r\n:0\r\n:8\r\n", slots) == RMT_ERROR);
+    test_assert(test_parse("*1\r\n*3\r\n:0\r\n:8\r\n"
+        "*1\r\n$8\r\n10.0.0.1\r\n", slots) == RMT_ERROR);
+    test_assert(test_parse("*2\r\n*3\r\n:0\r\n:8\r\n"
+        "*2\r\n$8\r\n10.0.0.1\r\n:7001\r\n", slots) == RMT_ERROR);
+
+    test_slots_free(slots);
+    array_destroy(slots);
+}
+
+int main(void)
+{
+    log_init(LOG_WARN, NULL);
+
+    test_skip();
+    test_parse_slots();
+
+    test_done();
+}
@@ -0,0 +1,68 @@
+#include <rmt_core.h>
+
+#include "rmt_test.h"
+
+#ifdef HAVE_SCHED_SETAFFINITY
+/* Parse s and check the cpus in the set are the ones in cpus. */
+static int test_cpu_list_is(const char *s, const int *cpus, int ncpus)
+{
+    cpu_set_t set;
+    int i;
+
+    if (rmt_cpu_list_parse(s, &set) != RMT_OK) {
+        return 0;
+    }
+
+    if (CPU_COUNT(&set) != ncpus) {
+        return 0;
+    }
+
+    for (i = 0; i < ncpus; i ++) {
+        if (!CPU_ISSET((size_t)cpus[i], &set)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(void)
+{
+    cpu_set_t set;
+    int one[] = {5};
+    int range[] = {0, 1, 2, 3};
+    int mixed[] = {0, 1, 2, 3, 8, 10, 11};
+    int last[] = {CPU_SETSIZE - 1};
+    char buf[32];
+
+    test_assert(test_cpu_list_is("5", one, 1));
+    test_assert(test_cpu_list_is("0-3", range, 4));
+    test_assert(test_cpu_list_is("0-3,8,10-11", mixed, 7));
+    test_assert(test_cpu_list_is("10-11,8,0-3", mixed, 7));
+
+    /* the sysfs cpulist files end with a newline */
+    test_assert(test_cpu_list_is("0-3,8,10-11\n", mixed, 7));
+    test_assert(test_cpu_list_is("", NULL, 0));
+
+    snprintf(buf, sizeof(buf), "%d", CPU_SETSIZE - 1);
+    test_assert(test_cpu_list_is(buf, last, 1));
+    snprintf(buf, sizeof(buf), "%d", CPU_SETSIZE);
+    test_assert(rmt_cpu_list_parse(buf, &set) == RMT_ERROR);
+
+    test_assert(rmt_cpu_list_parse("3-1", &set) == RMT_ERROR);
+    test_assert(rmt_cpu_list_parse("-1", &set) == RMT_ERROR);
+    test_assert(rmt_cpu_list_parse("1-", &set) == RMT_ERROR);
+    test_assert(rmt_cpu_list_parse("a", &set) == RMT_ERROR);
+    test_assert(rmt_cpu_list_parse("1;2", &set) == RMT_ERROR);
+    test_assert(rmt_cpu_list_parse("1,,2", &set) == RMT_ERROR);
+    test_assert(rmt_cpu_list_parse("1 2", &set) == RMT_ERROR);
+
+    test_done();
+}
+#else
+int main(void)
+{
+    /* skipped */
+    return 77;
+}
+#endif
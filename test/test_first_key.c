@@ -0,0 +1,150 @@
+#include <rmt_core.h>
+
+#include "rmt_test.h"
+
+#define TEST_SET    "*3\r\n$3\r\nSET\r\n$5\r\nhello\r\n$5\r\nworld\r\n"
+#define TEST_PING   "*1\r\n$4\r\nPING\r\n"
+
+/* A msg of str with the mbufs cut every step bytes, as the rdb makes them. */
+static struct msg *test_msg(mbuf_base *mb, const char *str, size_t step)
+{
+    struct msg *msg;
+    struct mbuf *mbuf;
+    size_t len = strlen(str), n;
+
+    msg = msg_get(mb, 1, REDIS_DATA_TYPE_CMD);
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    while (len > 0) {
+        n = MIN(len, step);
+        mbuf = mbuf_get(mb);
+        if (mbuf == NULL) {
+            break;
+        }
+        mbuf_copy(mbuf, (uint8_t *)str, n);
+        listAddNodeTail(msg->data, mbuf);
+        msg->mlen += (uint32_t)n;
+        str += n;
+        len -= n;
+    }
+
+    return msg;
+}
+
+static void test_msg_free(struct msg *msg)
+{
+    msg_put(msg);
+    msg_free(msg);
+}
+
+/* The keys parsed from the client. */
+static void test_parsed(mbuf_base *mb)
+{
+    struct msg *msg;
+    uint8_t key[16];
+
+    msg = test_msg(mb, TEST_SET, 1024);
+    test_assert(msg != NULL);
+    if (msg == NULL) {
+        return;
+    }
+
+    msg->pos = ((struct mbuf *)listFirstValue(msg->data))->pos;
+    redis_parse_req(msg);
+    test_assert(msg->result == MSG_PARSE_OK);
+    test_assert(array_n(msg->keys) == 1);
+
+    test_assert(redis_msg_first_key(msg, key, sizeof(key)) == 5);
+    test_assert(memcmp(key, "hello", 5) == 0);
+
+    test_msg_free(msg);
+}
+
+/* The msgs of the rdb have no keys parsed, the key is read in the mbufs. */
+static void test_unparsed(mbuf_base *mb)
+{
+    struct msg *msg;
+    struct mbuf *mbuf;
+    uint8_t key[16];
+    size_t step;
+
+    for (step = 1; step <= strlen(TEST_SET); step ++) {
+        msg = test_msg(mb, TEST_SET, step);
+        test_assert(msg != NULL);
+        if (msg == NULL) {
+            return;
+        }
+
+        rmt_memset(key, 0, sizeof(key));
+        test_assert(redis_msg_first_key(msg, key, sizeof(key)) == 5);
+        test_assert(memcmp(key, "hello", 5) == 0);
+
+        /* cut to the size of buf, with the whole length returned */
+        rmt_memset(key, 0, sizeof(key));
+        test_assert(redis_msg_first_key(msg, key, 3) == 5);
+        test_assert(memcmp(key, "hel\0", 4) == 0);
+
+        test_msg_free(msg);
+    }
+
+    /* partly sent, the msg starts at spos */
+    msg = test_msg(mb, "+OK\r\n" TEST_SET, 1024);
+    test_assert(msg != NULL);
+    if (msg == NULL) {
+        return;
+    }
+    mbuf = listFirstValue(msg->data);
+    msg->spos = mbuf->start + 5;
+    mbuf->pos = mbuf->start + 20;
+    test_assert(redis_msg_first_key(msg, key, sizeof(key)) == 5);
+    test_assert(memcmp(key, "hello", 5) == 0);
+    test_msg_free(msg);
+}
+
+static void test_no_key(mbuf_base *mb)
+{
+    struct msg *msg;
+    uint8_t key[16];
+
+    msg = test_msg(mb, TEST_PING, 1024);
+    test_assert(redis_msg_first_key(msg, key, sizeof(key)) == 0);
+    test_msg_free(msg);
+
+    /* not a multibulk */
+    msg = test_msg(mb, "PING\r\n", 1024);
+    test_assert(redis_msg_first_key(msg, key, sizeof(key)) == 0);
+    test_msg_free(msg);
+
+    /* the key is cut */
+    msg = test_msg(mb, "*2\r\n$3\r\nGET\r\n$5\r\nhel", 1024);
+    test_assert(redis_msg_first_key(msg, key, sizeof(key)) == 0);
+    test_msg_free(msg);
+
+    msg = test_msg(mb, "", 1024);
+    test_assert(redis_msg_first_key(msg, key, sizeof(key)) == 0);
+    test_msg_free(msg);
+}
+
+int main(void)
+{
+    mbuf_base *mb;
+
+    log_init(LOG_WARN, NULL);
+
+    mb = mbuf_base_create(REDIS_CMD_MBUF_BASE_SIZE,
+        mttlist_init_with_unlocklist);
+    test_assert(mb != NULL);
+    if (mb == NULL) {
+        test_done();
+    }
+
+    test_parsed(mb);
+    test_unparsed(mb);
+    test_no_key(mb);
+
+    mbuf_base_destroy(mb);
+
+    test_done();
+}
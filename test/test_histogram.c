@@ -0,0 +1,106 @@
+#include <rmt_core.h>
+
+#include "rmt_test.h"
+
+/* The value of the bucket of v is at most 1/HIST_SUB_COUNT above it. */
+static void test_buckets(void)
+{
+    histogram *h = hist_create();
+    uint64_t v, b;
+
+    test_assert(h != NULL);
+    if (h == NULL) {
+        return;
+    }
+
+    for (v = 0; v < (1ULL << HIST_MAX_BITS); v = v < 64 ? v + 1 : v + v/7) {
+        hist_reset(h);
+        hist_record(h, v);
+        hist_record(h, 1ULL << HIST_MAX_BITS);
+
+        /* the lower of the two values */
+        b = hist_percentile(h, 50.0);
+        test_assert(b >= v);
+        test_assert(b <= v + v/HIST_SUB_COUNT);
+    }
+
+    hist_destroy(h);
+}
+
+static void test_percentiles(void)
+{
+    histogram *h = hist_create();
+    uint64_t v;
+
+    test_assert(h != NULL);
+    if (h == NULL) {
+        return;
+    }
+
+    test_assert(hist_percentile(h, 50.0) == 0);
+
+    /* exact below HIST_SUB_COUNT */
+    for (v = 1; v <= 4; v ++) {
+        hist_record(h, v);
+    }
+    test_assert(hist_percentile(h, 25.0) == 1);
+    test_assert(hist_percentile(h, 50.0) == 2);
+    test_assert(hist_percentile(h, 100.0) == 4);
+    test_assert(hist_percentile(h, 0.0) == 1);
+
+    hist_reset(h);
+    for (v = 1; v <= 10000; v ++) {
+        hist_record(h, v);
+    }
+    test_assert(h->count == 10000);
+    test_assert(h->max == 10000);
+    test_assert(hist_percentile(h, 50.0) >= 5000);
+    test_assert(hist_percentile(h, 50.0) <= 5000 + 5000/HIST_SUB_COUNT);
+    test_assert(hist_percentile(h, 99.0) >= 9900);
+    test_assert(hist_percentile(h, 99.0) <= 10000);
+    test_assert(hist_percentile(h, 100.0) == 10000);
+
+    /* the values too big are in the last bucket */
+    hist_reset(h);
+    hist_record(h, UINT64_MAX);
+    test_assert(h->counts[HIST_BUCKETS - 1] == 1);
+    test_assert(hist_percentile(h, 50.0) == (1ULL << HIST_MAX_BITS) - 1);
+
+    hist_destroy(h);
+}
+
+static void test_merge(void)
+{
+    histogram *a = hist_create(), *b = hist_create();
+    uint64_t v;
+
+    test_assert(a != NULL && b != NULL);
+    if (a == NULL || b == NULL) {
+        return;
+    }
+
+    for (v = 1; v <= 100; v ++) {
+        hist_record(a, v);
+        hist_record(b, v + 100);
+    }
+    hist_merge(a, b);
+
+    test_assert(a->count == 200);
+    test_assert(a->max == 200);
+    test_assert(b->count == 100);
+    test_assert(hist_percentile(a, 50.0) >= 100);
+    test_assert(hist_percentile(a, 50.0) <= 100 + 100/HIST_SUB_COUNT);
+    test_assert(hist_percentile(a, 100.0) == 200);
+
+    hist_destroy(a);
+    hist_destroy(b);
+}
+
+int main(void)
+{
+    test_buckets();
+    test_percentiles();
+    test_merge();
+
+    test_done();
+}
@@ -0,0 +1,149 @@
+#include <rmt_core.h>
+
+#include "rmt_test.h"
+
+#define TEST_KEYS   5000
+
+static void test_add(keyprofile *kp, const char *fmt, int n, int type,
+    uint64_t bytes)
+{
+    sds key = sdscatprintf(sdsempty(), fmt, n);
+
+    keyprofile_add(kp, key, type, bytes, 1, -1);
+    sdsfree(key);
+}
+
+/* The heap keeps the KEYPROFILE_TOP_KEYS biggest, whatever the order. */
+static void test_top(keyprofile *kp)
+{
+    uint32_t i, child;
+    int n;
+
+    for (n = 0; n < TEST_KEYS; n ++) {
+        /* a permutation of 0 .. TEST_KEYS-1 */
+        test_add(kp, "top:%d", n, 0, (uint64_t)((n*7919)%TEST_KEYS));
+    }
+
+    test_assert(kp->ntop == KEYPROFILE_TOP_KEYS);
+    test_assert(kp->top[0].bytes == TEST_KEYS - KEYPROFILE_TOP_KEYS);
+    for (i = 0; i < kp->ntop; i ++) {
+        test_assert(kp->top[i].bytes >= TEST_KEYS - KEYPROFILE_TOP_KEYS);
+        for (child = 2*i + 1; child <= 2*i + 2 && child < kp->ntop; child ++) {
+            test_assert(kp->top[i].bytes <= kp->top[child].bytes);
+        }
+    }
+}
+
+/*
+ * The prefixes with more than 1/KEYPROFILE_PREFIXES of the keys are kept
+ * among many rare ones, and their true count is in [keys - error, keys].
+ */
+static void test_prefixes(keyprofile *kp)
+{
+    keyprofile_prefix *pp;
+    uint64_t total = 0;
+    uint32_t i;
+    int n;
+
+    for (n = 0; n < 4*KEYPROFILE_PREFIXES; n ++) {
+        test_add(kp, "rare%d:x", n, 1, 10);
+        total ++;
+        if (n % 2 == 0) {
+            test_add(kp, "user:%d", n, 1, 10);
+            total ++;
+        }
+        if (n % 8 == 0) {
+            test_add(kp, "session:%d", n, 1, 10);
+            total ++;
+        }
+    }
+    /* no separator, the whole key is no prefix */
+    test_add(kp, "plain%d", 0, 1, 10);
+    total ++;
+
+    test_assert(kp->nprefixes == KEYPROFILE_PREFIXES);
+    for (i = 0; i < kp->nprefixes; i ++) {
+        test_assert(kp->heap[i]->pos == i);
+        if (2*i + 1 < kp->nprefixes) {
+            test_assert(kp->heap[i]->keys <= kp->heap[2*i + 1]->keys);
+        }
+        test_assert(dictFetchValue(kp->index, kp->heap[i]->prefix) ==
+            kp->heap[i]);
+    }
+
+    kp->scratch = sdscpy(kp->scratch, "user");
+    pp = dictFetchValue(kp->index, kp->scratch);
+    test_assert(pp != NULL);
+    if (pp != NULL) {
+        test_assert(pp->keys >= 2*KEYPROFILE_PREFIXES);
+        test_assert(pp->keys - pp->error <= 2*KEYPROFILE_PREFIXES);
+        test_assert(pp->error <= total/KEYPROFILE_PREFIXES);
+    }
+
+    kp->scratch = sdscpy(kp->scratch, "session");
+    pp = dictFetchValue(kp->index, kp->scratch);
+    test_assert(pp != NULL);
+    if (pp != NULL) {
+        test_assert(pp->keys >= KEYPROFILE_PREFIXES/2);
+        test_assert(pp->keys - pp->error <= KEYPROFILE_PREFIXES/2);
+    }
+
+    kp->scratch = sdscpy(kp->scratch, "");
+    pp = dictFetchValue(kp->index, kp->scratch);
+    test_assert(pp != NULL);
+}
+
+static void test_types(keyprofile *kp)
+{
+    keyprofile_type *kt = &kp->types[2];
+    sds key = sdsnew("k");
+
+    keyprofile_add(kp, key, 2, 0, 3, -1);
+    keyprofile_add(kp, key, 2, 1, 3, 1000);
+    keyprofile_add(kp, key, 2, 3, 3, -1);
+    keyprofile_add(kp, key, 2, 4, 3, -1);
+    keyprofile_add(kp, key, 2, UINT64_MAX, 3, -1);
+    keyprofile_add(kp, key, KEYPROFILE_TYPES, 100, 3, -1);
+    keyprofile_add(kp, key, -1, 100, 3, -1);
+    sdsfree(key);
+
+    test_assert(kt->keys == 5);
+    test_assert(kt->elements == 15);
+    test_assert(kt->expires == 1);
+    test_assert(kt->max_bytes == UINT64_MAX);
+    test_assert(kt->hist[0] == 2);
+    test_assert(kt->hist[1] == 1);
+    test_assert(kt->hist[2] == 1);
+    test_assert(kt->hist[KEYPROFILE_BUCKETS - 1] == 1);
+}
+
+int main(void)
+{
+    keyprofile *kp;
+
+    log_init(LOG_WARN, NULL);
+
+    kp = keyprofile_create("/dev/null");
+    test_assert(kp != NULL);
+    if (kp == NULL) {
+        test_done();
+    }
+
+    test_top(kp);
+    test_assert(kp->types[0].keys == TEST_KEYS);
+    test_assert(kp->types[0].max_bytes == TEST_KEYS - 1);
+
+    keyprofile_reset(kp);
+    test_assert(kp->ntop == 0 && kp->nprefixes == 0);
+    test_assert(kp->types[0].keys == 0);
+    test_assert(dictSize(kp->index) == 0);
+
+    test_prefixes(kp);
+    keyprofile_reset(kp);
+    test_types(kp);
+    test_assert(kp->ntop == 5);
+
+    keyprofile_destroy(kp);
+
+    test_done();
+}
@@ -0,0 +1,118 @@
+#include <rmt_core.h>
+
+#include "rmt_test.h"
+
+#define SEC 1000000000LL
+
+/* The rates of 0 are no limit and leave the window alone. */
+static void test_unlimited(void)
+{
+    ratelimit *rl = ratelimit_create();
+    size_t bytes = 12345;
+    long cmds = -1;
+
+    test_assert(ratelimit_allow(rl, 0, 0, 1000, SEC, &bytes, &cmds) == 0);
+    test_assert(bytes == 12345);
+    test_assert(cmds == -1);
+
+    ratelimit_consume(rl, bytes, 100);
+    test_assert(ratelimit_allow(rl, 0, 0, 1000, SEC, &bytes, &cmds) == 0);
+    test_assert(rl->throttled == 0);
+
+    ratelimit_destroy(rl);
+}
+
+static void test_bytes(void)
+{
+    ratelimit *rl = ratelimit_create();
+    size_t bytes;
+    long cmds = -1;
+
+    /* the first use has a full burst of 1000 bytes for 1 second */
+    bytes = 5000;
+    test_assert(ratelimit_allow(rl, 1000, 0, 1000, 10*SEC, &bytes, &cmds) == 0);
+    test_assert(bytes == 1000);
+    test_assert(cmds == -1);
+    ratelimit_consume(rl, bytes, 1);
+
+    bytes = 5000;
+    test_assert(ratelimit_allow(rl, 1000, 0, 1000, 10*SEC, &bytes, &cmds) == 1);
+    test_assert(rl->throttled == 1);
+
+    /* refilled for the time passed */
+    bytes = 5000;
+    test_assert(ratelimit_allow(rl, 1000, 0, 1000, 10*SEC + SEC/2, &bytes, &cmds) == 0);
+    test_assert(bytes == 500);
+
+    /* a send may take more than left, the debt delays the next sends */
+    ratelimit_consume(rl, 2500, 1);
+    bytes = 5000;
+    test_assert(ratelimit_allow(rl, 1000, 0, 1000, 11*SEC + SEC/2, &bytes, &cmds) == 1);
+    bytes = 5000;
+    test_assert(ratelimit_allow(rl, 1000, 0, 1000, 13*SEC, &bytes, &cmds) == 0);
+    test_assert(bytes == 500);
+    test_assert(rl->throttled == 2);
+
+    /* never more than the burst */
+    bytes = 5000;
+    test_assert(ratelimit_allow(rl, 1000, 0, 1000, 100*SEC, &bytes, &cmds) == 0);
+    test_assert(bytes == 1000);
+
+    ratelimit_destroy(rl);
+}
+
+static void test_cmds(void)
+{
+    ratelimit *rl = ratelimit_create();
+    size_t bytes = 100;
+    long cmds;
+
+    /* the burst is at least RATELIMIT_BURST_MIN milliseconds */
+    cmds = -1;
+    test_assert(ratelimit_allow(rl, 0, 1000, 1, 10*SEC, &bytes, &cmds) == 0);
+    test_assert(cmds == 1000*RATELIMIT_BURST_MIN/1000);
+    test_assert(bytes == 100);
+
+    cmds = 10;
+    test_assert(ratelimit_allow(rl, 0, 1000, 1, 10*SEC, &bytes, &cmds) == 0);
+    test_assert(cmds == 10);
+
+    ratelimit_consume(rl, bytes, 100);
+    cmds = 10;
+    test_assert(ratelimit_allow(rl, 0, 1000, 1, 10*SEC, &bytes, &cmds) == 1);
+
+    /* the bytes or the cmds out of tokens throttle both */
+    cmds = 10;
+    bytes = 100;
+    test_assert(ratelimit_allow(rl, 1000000, 1000, 1000, 10*SEC + SEC/2000,
+        &bytes, &cmds) == 1);
+    test_assert(rl->throttled == 2);
+
+    ratelimit_destroy(rl);
+}
+
+static void test_targets(void)
+{
+    ratelimits rls;
+    ratelimit *a, *b;
+
+    test_assert(ratelimits_init(&rls) == RMT_OK);
+
+    a = ratelimits_target(&rls, "127.0.0.1:6379");
+    b = ratelimits_target(&rls, "127.0.0.1:6380");
+    test_assert(a != NULL && b != NULL && a != b);
+    test_assert(ratelimits_target(&rls, "127.0.0.1:6379") == a);
+    test_assert(a != rls.global && b != rls.global);
+
+    ratelimits_deinit(&rls);
+}
+
+int main(void)
+{
+    test_unlimited();
+    test_bytes();
+    test_cmds();
+    test_targets();
+
+    test_done();
+}
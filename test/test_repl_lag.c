@@ -0,0 +1,71 @@
+#include <rmt_core.h>
+
+#include "rmt_test.h"
+
+#define SEC 1000LL
+
+/* The offset received grows every second, the target stopped at 1000. */
+static void test_behind(void)
+{
+    redis_repl_progress progress;
+    long long t;
+
+    rmt_memset(&progress, 0, sizeof(progress));
+
+    for (t = 0; t <= 600; t ++) {
+        redis_repl_lag_update(&progress, 1000 + t*100, 1000, t*SEC);
+        test_assert(progress.nsamples <= REDIS_REPL_LAG_SAMPLES);
+    }
+
+    /* ten minutes since the first byte not acknowledged, at 1 */
+    test_assert(progress.lag_bytes == 600*100);
+    test_assert(progress.lag_msec >= 599*SEC);
+    test_assert(progress.lag_msec <= 599*SEC + 600*SEC/32);
+
+    /* the target catches up half way */
+    redis_repl_lag_update(&progress, 1000 + 601*100, 1000 + 300*100, 601*SEC);
+    test_assert(progress.lag_bytes == 301*100);
+    test_assert(progress.lag_msec >= 300*SEC);
+    test_assert(progress.lag_msec <= 300*SEC + 600*SEC/32);
+
+    /* and all the way */
+    redis_repl_lag_update(&progress, 1000 + 602*100, 1000 + 602*100, 602*SEC);
+    test_assert(progress.lag_bytes == 0);
+    test_assert(progress.lag_msec == 0);
+    test_assert(progress.nsamples == 0);
+
+    /* exact to the second in the first minute */
+    for (t = 603; t <= 640; t ++) {
+        redis_repl_lag_update(&progress, 1000 + t*100, 1000 + 602*100, t*SEC);
+    }
+    test_assert(progress.lag_msec == 37*SEC);
+}
+
+static void test_unknown(void)
+{
+    redis_repl_progress progress;
+
+    rmt_memset(&progress, 0, sizeof(progress));
+
+    redis_repl_lag_update(&progress, 1000, -1, 0);
+    test_assert(progress.lag_bytes == -1 && progress.lag_msec == -1);
+
+    /* the offset did not move, the time of the first sample is kept */
+    redis_repl_lag_update(&progress, 1000, 500, 5*SEC);
+    test_assert(progress.lag_bytes == 500);
+    test_assert(progress.lag_msec == 5*SEC);
+
+    /* a new replication from a lower offset */
+    redis_repl_lag_update(&progress, 100, 50, 6*SEC);
+    test_assert(progress.nsamples == 1);
+    test_assert(progress.lag_bytes == 50);
+    test_assert(progress.lag_msec == 0);
+}
+
+int main(void)
+{
+    test_behind();
+    test_unknown();
+
+    test_done();
+}
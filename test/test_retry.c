@@ -0,0 +1,151 @@
+#include <rmt_core.h>
+
+#include "rmt_test.h"
+
+#define TEST_OOM    "-OOM command not allowed when used memory > 'maxmemory'.\r\n"
+
+static struct msg *test_req(mbuf_base *mb, const char *cmd)
+{
+    struct msg *msg;
+    struct mbuf *mbuf;
+
+    msg = msg_get(mb, 1, REDIS_DATA_TYPE_CMD);
+    if (msg == NULL) {
+        return NULL;
+    }
+    if (msg_append(msg, (uint8_t *)cmd, strlen(cmd)) != RMT_OK) {
+        msg_put(msg);
+        msg_free(msg);
+        return NULL;
+    }
+
+    mbuf = listFirstValue(msg->data);
+    msg->pos = mbuf->pos;
+    redis_parse_req(msg);
+
+    /* sent to the node as send_data_to_target does */
+    msg->spos = mbuf->pos;
+    mbuf->pos = mbuf->last;
+    msg->sent = 1;
+
+    return msg;
+}
+
+/* Give the reply to the first msg in sent_data, as response_done does. */
+static int test_reply(mbuf_base *mb, redis_node *trnode, const char *reply)
+{
+    struct msg *req, *resp;
+
+    req = listPop(trnode->sent_data);
+    resp = msg_get(mb, 0, 0);
+    if (req == NULL || resp == NULL) {
+        return RMT_ERROR;
+    }
+    msg_append(resp, (uint8_t *)reply, strlen(reply));
+    resp->pos = ((struct mbuf *)listFirstValue(resp->data))->pos;
+    redis_parse_rsp(resp);
+
+    req->peer = resp;
+    return redis_response_check(trnode, req);
+}
+
+/*
+ * The msgs pipelined behind a msg to retry are not sent again, they may
+ * have taken effect already: only the ones whose reply is a retriable 
+ * error too are retried, after it.
+ */
+static void test_pipelined(mbuf_base *mb, redis_node *trnode)
+{
+    struct msg *set, *incr, *incrby;
+    thread_data *wdata = trnode->write_data;
+
+    set = test_req(mb, "*3\r\n$3\r\nSET\r\n$1\r\na\r\n$1\r\n1\r\n");
+    incr = test_req(mb, "*2\r\n$4\r\nINCR\r\n$1\r\nb\r\n");
+    incrby = test_req(mb, "*3\r\n$6\r\nINCRBY\r\n$1\r\nc\r\n$1\r\n5\r\n");
+    test_assert(set != NULL && incr != NULL && incrby != NULL);
+    if (set == NULL || incr == NULL || incrby == NULL) {
+        return;
+    }
+    test_assert(set->type == MSG_REQ_REDIS_SET);
+    test_assert(incr->type == MSG_REQ_REDIS_INCR);
+
+    listAddNodeTail(trnode->sent_data, set);
+    listAddNodeTail(trnode->sent_data, incr);
+    listAddNodeTail(trnode->sent_data, incrby);
+
+    test_assert(test_reply(mb, trnode, TEST_OOM) == RMT_OK);
+    test_assert(listLength(trnode->retry_data) == 1);
+    test_assert(listFirstValue(trnode->retry_data) == set);
+    test_assert(set->retries == 1 && set->sent == 0 && set->retry_alone);
+    test_assert(mbuf_length(listFirstValue(set->data)) == set->mlen);
+
+    /* still waiting for their own replies */
+    test_assert(listLength(trnode->sent_data) == 2);
+    test_assert(listFirstValue(trnode->sent_data) == incr);
+    test_assert(incr->sent == 1 && incr->retries == 0);
+
+    test_assert(test_reply(mb, trnode, ":1\r\n") == RMT_OK);
+    test_assert(listLength(trnode->retry_data) == 1);
+
+    test_assert(test_reply(mb, trnode, TEST_OOM) == RMT_OK);
+    test_assert(listLength(trnode->retry_data) == 2);
+    test_assert(listLastValue(trnode->retry_data) == incrby);
+    test_assert(listLength(trnode->sent_data) == 0);
+
+    test_assert(wdata->stat.total_msgs_retried == 2);
+
+    while ((set = listPop(trnode->retry_data)) != NULL) {
+        msg_put(set);
+        msg_free(set);
+    }
+}
+
+int main(void)
+{
+    mbuf_base *mb;
+    rmtContext *ctx;
+    redis_group *rgroup;
+    thread_data *wdata;
+    redis_node *trnode;
+
+    log_init(LOG_ERR, NULL);
+
+    mb = mbuf_base_create(REDIS_CMD_MBUF_BASE_SIZE,
+        mttlist_init_with_unlocklist);
+    ctx = rmt_zalloc(sizeof(*ctx));
+    rgroup = rmt_zalloc(sizeof(*rgroup));
+    wdata = rmt_zalloc(sizeof(*wdata));
+    trnode = rmt_zalloc(sizeof(*trnode));
+    test_assert(mb != NULL && ctx != NULL && rgroup != NULL && 
+        wdata != NULL && trnode != NULL);
+    if (mb == NULL || ctx == NULL || rgroup == NULL || wdata == NULL ||
+        trnode == NULL) {
+        test_done();
+    }
+
+    rgroup->ctx = ctx;
+    rgroup->kind = GROUP_TYPE_SINGLE;
+    rgroup->mb = mb;
+
+    trnode->ctx = ctx;
+    trnode->owner = rgroup;
+    trnode->write_data = wdata;
+    trnode->addr = sdsnew("127.0.0.1:6379");
+    trnode->send_data = listCreate();
+    trnode->sent_data = listCreate();
+    trnode->retry_data = listCreate();
+
+    test_pipelined(mb, trnode);
+
+    listRelease(trnode->send_data);
+    listRelease(trnode->sent_data);
+    listRelease(trnode->retry_data);
+    sdsfree(trnode->addr);
+    rmt_free(trnode);
+    rmt_free(wdata);
+    rmt_free(rgroup);
+    rmt_free(ctx);
+    mbuf_base_destroy(mb);
+
+    test_done();
+}
@@ -0,0 +1,113 @@
+#include <rmt_core.h>
+
+#include "rmt_test.h"
+
+#define TEST_MBUFS  200
+#define TEST_LIMIT  8
+
+static struct mbuf *test_mbuf(mbuf_base *mb, int n)
+{
+    struct mbuf *mbuf;
+    char buf[128];
+    int len;
+
+    mbuf = mbuf_get(mb);
+    if (mbuf == NULL) {
+        return NULL;
+    }
+
+    /* odd ones compress, even ones are too short to */
+    if (n % 2) {
+        len = snprintf(buf, sizeof(buf), "%d:aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", n);
+    } else {
+        len = snprintf(buf, sizeof(buf), "%d", n);
+    }
+    mbuf_copy(mbuf, (uint8_t *)buf, (size_t)len);
+
+    return mbuf;
+}
+
+static int test_mbuf_is(struct mbuf *mbuf, int n)
+{
+    char buf[128];
+    int len;
+
+    if (n % 2) {
+        len = snprintf(buf, sizeof(buf), "%d:aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", n);
+    } else {
+        len = snprintf(buf, sizeof(buf), "%d", n);
+    }
+
+    return mbuf != NULL && mbuf_length(mbuf) == (uint32_t)len &&
+        memcmp(mbuf->pos, buf, (size_t)len) == 0;
+}
+
+/*
+ * Push and pop in turns so the mbufs go to memory, to the segment files
+ * and to memory again: they must come back in the order they were pushed.
+ */
+static void test_order(mbuf_base *mb, const char *prefix, int compress)
+{
+    spilllist *sl;
+    struct mbuf *mbuf;
+    int pushed = 0, popped = 0, i;
+
+    sl = spilllist_create(mb, prefix, TEST_LIMIT, compress);
+    test_assert(sl != NULL);
+    if (sl == NULL) {
+        return;
+    }
+
+    while (pushed < TEST_MBUFS) {
+        for (i = 0; i < 13 && pushed < TEST_MBUFS; i ++) {
+            test_assert(spilllist_push(sl, test_mbuf(mb, pushed)) == RMT_OK);
+            pushed ++;
+        }
+        test_assert(spilllist_length(sl) == pushed - popped);
+
+        for (i = 0; i < 5; i ++) {
+            mbuf = spilllist_pop(sl);
+            test_assert(test_mbuf_is(mbuf, popped));
+            popped ++;
+            if (mbuf != NULL) {
+                mbuf_put(mbuf);
+            }
+        }
+    }
+    test_assert(sl->failed == 0);
+
+    while ((mbuf = spilllist_pop(sl)) != NULL) {
+        test_assert(test_mbuf_is(mbuf, popped));
+        popped ++;
+        mbuf_put(mbuf);
+    }
+    test_assert(popped == TEST_MBUFS);
+    test_assert(spilllist_length(sl) == 0);
+
+    spilllist_free(sl);
+}
+
+int main(void)
+{
+    mbuf_base *mb;
+    char dir[] = "/tmp/rmt-test-spilllist-XXXXXX";
+    sds prefix;
+
+    log_init(LOG_WARN, NULL);
+
+    test_assert(mkdtemp(dir) != NULL);
+    prefix = sdscatfmt(sdsempty(), "%s/spill", dir);
+
+    mb = mbuf_base_create(REDIS_CMD_MBUF_BASE_SIZE,
+        mttlist_init_with_unlocklist);
+    test_assert(mb != NULL);
+
+    test_order(mb, prefix, 0);
+    test_order(mb, prefix, 1);
+
+    mbuf_base_destroy(mb);
+    sdsfree(prefix);
+    test_assert(rmdir(dir) == 0);
+
+    test_done();
+}